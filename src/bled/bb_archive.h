@@ -267,6 +267,34 @@ IF_DESKTOP(long long) int unpack_bz2_stream(transformer_state_t *xstate) FAST_FU
 IF_DESKTOP(long long) int unpack_lzma_stream(transformer_state_t *xstate) FAST_FUNC;
 IF_DESKTOP(long long) int unpack_xz_stream(transformer_state_t *xstate) FAST_FUNC;
 
+/* Worker pool for the multithreaded decoders (decompress_mt.c) */
+#define BLED_MT_MAX_THREADS 16
+struct bled_mt {
+	/* Set by bled_mt_init() */
+	uint32_t num_threads;
+	uint32_t num_slots;
+	uint64_t budget;
+	/* Set by the decoder. decode() processes the job placed in slot, with the worker's state */
+	void (*decode)(void *ctx, void *worker, uint32_t slot);
+	void *(*worker_init)(void *ctx);
+	void (*worker_free)(void *worker);
+	/* Wakes up workers that wait on the writer, once quit is set */
+	void (*wake)(void *ctx);
+	void *ctx;
+	volatile BOOL quit;
+	/* Private */
+	HANDLE work;
+	HANDLE thread[BLED_MT_MAX_THREADS];
+	uint32_t num_workers;
+	volatile LONG next_job;
+};
+uint64_t bled_mt_memory(void) FAST_FUNC;
+bool bled_mt_init(struct bled_mt *mt, uint64_t max_jobs, uint64_t slot_memory) FAST_FUNC;
+bool bled_mt_start(struct bled_mt *mt, void *ctx) FAST_FUNC;
+void bled_mt_post(struct bled_mt *mt) FAST_FUNC;
+void bled_mt_stop(struct bled_mt *mt) FAST_FUNC;
+void bled_mt_free(struct bled_mt *mt) FAST_FUNC;
+
 char* append_ext(char *filename, const char *expected_ext) FAST_FUNC;
 int bbunpack(char **argv,
 		IF_DESKTOP(long long) int FAST_FUNC (*unpacker)(transformer_state_t *xstate),
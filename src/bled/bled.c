@@ -309,3 +309,118 @@ void bled_exit(void)
 	}
 	bled_initialized = false;
 }
+
+#if defined(_DEBUG)
+typedef struct {
+	uint8_t* buf;
+	size_t pos;
+	uint32_t bits;
+	int nbits;
+} bit_writer_t;
+
+/* Append 'n' bits of 'val' to the stream, LSB first, as deflate expects */
+static void put_bits(bit_writer_t* bw, uint32_t val, int n)
+{
+	bw->bits |= val << bw->nbits;
+	bw->nbits += n;
+	while (bw->nbits >= 8) {
+		bw->buf[bw->pos++] = (uint8_t)bw->bits;
+		bw->bits >>= 8;
+		bw->nbits -= 8;
+	}
+}
+
+/* Huffman codes are stored starting with their MSB */
+static void put_code(bit_writer_t* bw, uint32_t code, int n)
+{
+	uint32_t rev = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		rev |= ((code >> i) & 1) << (n - 1 - i);
+	put_bits(bw, rev, n);
+}
+
+static void put_le32(uint8_t* p, uint32_t val)
+{
+	p[0] = (uint8_t)val;
+	p[1] = (uint8_t)(val >> 8);
+	p[2] = (uint8_t)(val >> 16);
+	p[3] = (uint8_t)(val >> 24);
+}
+
+/*
+ * Decompress a gzip stream of 3885 random bytes followed by 600000 zeros,
+ * encoded as a single fixed Huffman block of 258 byte matches at distance
+ * 1. This walks the inflate window position through GUNZIP_WSIZE - 258,
+ * which the fast decoding loop used to copy a full match past.
+ */
+int bled_test_gunzip(printf_t print_function)
+{
+	const size_t random_len = 3885, zero_len = 600000;
+	const size_t raw_len = random_len + zero_len;
+	uint8_t *raw = NULL, *gz = NULL, *out = NULL;
+	uint32_t seed = 0x12345678, *crc_table = NULL;
+	bit_writer_t bw = { 0 };
+	size_t i, left;
+	int64_t ret;
+	int r = -1;
+
+	if (bled_init(print_function, NULL, NULL, NULL, NULL, NULL) < 0)
+		return -1;
+	raw = calloc(1, raw_len);
+	gz = malloc(16 * 1024);
+	out = malloc(raw_len + 1);
+	crc_table = crc32_filltable(NULL, 0);
+	if ((raw == NULL) || (gz == NULL) || (out == NULL) || (crc_table == NULL))
+		goto out;
+
+	/* Header: deflate, no flags, no mtime, unknown OS */
+	memcpy(gz, "\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\xff", 10);
+	bw.buf = gz;
+	bw.pos = 10;
+
+	/* Final block, fixed Huffman codes */
+	put_bits(&bw, 1, 1);
+	put_bits(&bw, 1, 2);
+	for (i = 0; i < random_len; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		raw[i] = (uint8_t)seed;
+		if (raw[i] < 144)
+			put_code(&bw, 0x30 + raw[i], 8);
+		else
+			put_code(&bw, 0x190 + raw[i] - 144, 9);
+	}
+	/* One literal zero, then copies of it at distance 1 (code 0, 5 bits) */
+	put_code(&bw, 0x30, 8);
+	for (left = zero_len - 1; left >= 258; left -= 258) {
+		put_code(&bw, 0xc5, 8);		/* 285: length 258 */
+		put_code(&bw, 0, 5);
+	}
+	/* 281: lengths 131-162, with 5 extra bits */
+	put_code(&bw, 0xc1, 8);
+	put_bits(&bw, (uint32_t)(left - 131), 5);
+	put_code(&bw, 0, 5);
+	/* End of block */
+	put_code(&bw, 0, 7);
+	put_bits(&bw, 0, 7);
+
+	put_le32(&gz[bw.pos], ~crc32_le(~0, raw, raw_len, crc_table));
+	put_le32(&gz[bw.pos + 4], (uint32_t)raw_len);
+	bw.pos += 8;
+
+	ret = bled_uncompress_from_buffer_to_buffer((const char*)gz, bw.pos, (char*)out, raw_len + 1, BLED_COMPRESSION_GZIP);
+	r = ((ret == (int64_t)raw_len) && (memcmp(out, raw, raw_len) == 0)) ? 0 : 1;
+	bb_printf("Test gunzip window boundary: %s", (r == 0) ? "PASS" : "FAIL");
+
+out:
+	free(crc_table);
+	free(out);
+	free(gz);
+	free(raw);
+	bled_exit();
+	return r;
+}
+#endif
@@ -48,6 +48,18 @@ int64_t bled_uncompress_to_dir(const char* src, const char* dir, int type);
 /* Uncompress buffer 'src' of length 'src_len' to buffer 'dst' of size 'dst_len' */
 int64_t bled_uncompress_from_buffer_to_buffer(const char* src, const size_t src_len, char* dst, size_t dst_len, int type);
 
+/* Carry-less multiplication (PCLMULQDQ) CRC32 kernel for reflected polynomials, which
+ * can also be used outside of bled, with the folding constants for another polynomial.
+ * 'len' must be at least 64 and a multiple of 16, and 'crc' is not inverted (x86 only). */
+typedef struct {
+	uint64_t k1k2[2];
+	uint64_t k3k4[2];
+	uint64_t k5[2];
+	uint64_t poly_mu[2];
+} crc32_clmul_t;
+extern const crc32_clmul_t crc32_clmul_ieee;
+uint32_t crc32_clmul(uint32_t crc, unsigned char const *p, size_t len, const crc32_clmul_t *k);
+
 /* Initialize the library.
  * When the parameters are not NULL you can:
  * - specify the printf-like function you want to use to output message
@@ -64,3 +76,8 @@ int bled_init(printf_t print_function, read_t read_function, write_t write_funct
 
 /* This call frees any resource used by the library */
 void bled_exit(void);
+
+#if defined(_DEBUG)
+/* Self-test for the gzip decompressor. Must be called while the library is not in use */
+int bled_test_gunzip(printf_t print_function);
+#endif
@@ -8,6 +8,18 @@
  */
 
 #include "libbb.h"
+#include "bled.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define CRC32_CLMUL
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET(t) __attribute__ ((__target__(t)))
+#else
+#define TARGET(t)
+#endif
+#endif
 
 #if __GNUC__ >= 3	/* 2.x has "attribute", but only 3.0 has "pure */
 #define attribute(x) __attribute__(x)
@@ -30,6 +42,20 @@
 /* This needs to be defined somewhere */
 uint32_t *global_crc32_table;
 
+/*
+ * Folding constants for the carry-less multiplication kernel, as described in
+ * Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ":
+ * k1/k2 = x^(4*128+32)/x^(4*128-32) mod P, k3/k4 = x^(128+32)/x^(128-32) mod P,
+ * k5 = x^64 mod P, all bit-reflected and shifted left by one, then the reflected
+ * polynomial and the Barrett constant mu = x^64 / P.
+ */
+const crc32_clmul_t crc32_clmul_ieee = {
+	{ 0x0154442bd4ULL, 0x01c6e41596ULL },
+	{ 0x01751997d0ULL, 0x00ccaa009eULL },
+	{ 0x0163cd6124ULL, 0x0000000000ULL },
+	{ 0x01db710641ULL, 0x01f7011641ULL },
+};
+
 static void crc32init_le(uint32_t *crc32table_le)
 {
 	unsigned i, j;
@@ -42,7 +68,94 @@ static void crc32init_le(uint32_t *crc32table_le)
 		for (j = 0; j < 1 << CRC_LE_BITS; j += 2 * i)
 			crc32table_le[i + j] = crc ^ crc32table_le[j];
 	}
+
+	/* Slice k gives the CRC of a byte followed by k zero bytes */
+	for (i = 256; i < CRC32_LE_TABLE_SIZE; i++)
+		crc32table_le[i] = (crc32table_le[i - 256] >> 8) ^ crc32table_le[crc32table_le[i - 256] & 255];
+}
+
+#if defined(CRC32_CLMUL)
+/*
+ * crc32_clmul() - Fold a buffer into a reflected CRC32 using PCLMULQDQ
+ * @crc - current (non inverted) CRC value
+ * @p   - pointer to buffer over which CRC is run
+ * @len - length of buffer @p. Must be at least 64 and a multiple of 16
+ * @k   - folding constants for the polynomial
+ *
+ * This folds 4 x 128 bits at a time, then down to 128 bits, and finally uses
+ * a Barrett reduction to get back to 32 bits. Only call this if the CPU has
+ * PCLMULQDQ.
+ */
+TARGET("pclmul,sse2") uint32_t crc32_clmul(uint32_t crc, unsigned char const *p, size_t len, const crc32_clmul_t *k)
+{
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, mask32;
+
+	x1 = _mm_loadu_si128((const __m128i*)(p + 0x00));
+	x2 = _mm_loadu_si128((const __m128i*)(p + 0x10));
+	x3 = _mm_loadu_si128((const __m128i*)(p + 0x20));
+	x4 = _mm_loadu_si128((const __m128i*)(p + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+	x0 = _mm_loadu_si128((const __m128i*)k->k1k2);
+	p += 64;
+	len -= 64;
+
+	/* Fold 4 x 128 bits at a time */
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(p + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(p + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(p + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(p + 0x30)));
+		p += 64;
+		len -= 64;
+	}
+
+	/* Fold into 128 bits */
+	x0 = _mm_loadu_si128((const __m128i*)k->k3k4);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* Then the remaining 128 bit blocks, if any */
+	while (len >= 16) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)p));
+		p += 16;
+		len -= 16;
+	}
+
+	/* Fold 128 bits to 64 */
+	mask32 = _mm_setr_epi32(-1, 0, -1, 0);
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x0 = _mm_loadu_si128((const __m128i*)k->k5);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = _mm_loadu_si128((const __m128i*)k->poly_mu);
+	x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), x0, 0x10);
+	x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask32), x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
 }
+#endif
 
 /**
  * crc32_le() - Calculate bitwise little-endian Ethernet AUTODIN II CRC32
@@ -50,25 +163,37 @@ static void crc32init_le(uint32_t *crc32table_le)
  *        other uses, or the previous crc32 value if computing incrementally.
  * @p   - pointer to buffer over which CRC is run
  * @len - length of buffer @p
+ * @crc32table_le - CRC32_LE_TABLE_SIZE entries, from crc32_filltable(..., 0)
  * 
  */
 uint32_t attribute((pure)) crc32_le(uint32_t crc, unsigned char const *p, size_t len, uint32_t *crc32table_le)
 {
-	while (len--) {
-# if CRC_LE_BITS == 8
-		crc = (crc >> 8) ^ crc32table_le[(crc ^ *p++) & 255];
-# elif CRC_LE_BITS == 4
-		crc ^= *p++;
-		crc = (crc >> 4) ^ crc32table_le[crc & 15];
-		crc = (crc >> 4) ^ crc32table_le[crc & 15];
-# elif CRC_LE_BITS == 2
-		crc ^= *p++;
-		crc = (crc >> 2) ^ crc32table_le[crc & 3];
-		crc = (crc >> 2) ^ crc32table_le[crc & 3];
-		crc = (crc >> 2) ^ crc32table_le[crc & 3];
-		crc = (crc >> 2) ^ crc32table_le[crc & 3];
-# endif
+	const uint32_t *t = crc32table_le;
+	uint32_t q, r;
+
+#if defined(CRC32_CLMUL)
+	if (cpu_has_pclmulqdq && len >= 64) {
+		crc = crc32_clmul(crc, p, len & ~(size_t)15, &crc32_clmul_ieee);
+		p += len & ~(size_t)15;
+		len &= 15;
+	}
+#endif
+
+	/* Slicing-by-8, with the usual byte at a time walk for the unaligned head and the tail */
+	while (len && ((uintptr_t)p & 7)) {
+		crc = (crc >> 8) ^ t[(crc ^ *p++) & 255];
+		len--;
+	}
+	for (; len >= 8; len -= 8, p += 8) {
+		q = crc ^ get_le32(p);
+		r = get_le32(p + 4);
+		crc = t[7 * 256 + (q & 255)] ^ t[6 * 256 + ((q >> 8) & 255)] ^
+		      t[5 * 256 + ((q >> 16) & 255)] ^ t[4 * 256 + (q >> 24)] ^
+		      t[3 * 256 + (r & 255)] ^ t[2 * 256 + ((r >> 8) & 255)] ^
+		      t[1 * 256 + ((r >> 16) & 255)] ^ t[0 * 256 + (r >> 24)];
 	}
+	while (len--)
+		crc = (crc >> 8) ^ t[(crc ^ *p++) & 255];
 	return crc;
 }
 
@@ -119,7 +244,7 @@ uint32_t* crc32_filltable(uint32_t *crc_table, int endian)
 {
 	/* Expects the caller to do the cleanup */
 	if (!crc_table)
-		crc_table = malloc((1 << CRC_LE_BITS) * sizeof(uint32_t));
+		crc_table = malloc((endian ? (1 << CRC_BE_BITS) : CRC32_LE_TABLE_SIZE) * sizeof(uint32_t));
 	if (crc_table) {
 		if (endian)
 			crc32init_be(crc_table);
@@ -96,6 +96,9 @@ struct bunzip_data {
 	/* The CRC values stored in the block header and calculated from the data */
 	uint32_t headerCRC, totalCRC, writeCRC;
 
+	/* Stop after the first block (for multithreaded decoding) */
+	smallint singleBlock;
+
 	/* Intermediate buffer and its size (in bytes) */
 	uint32_t *dbuf;
 	unsigned dbufSize;
@@ -630,6 +633,12 @@ int FAST_FUNC read_bunzip(bunzip_data *bd, char *outbuf, int len)
 			bd->totalCRC = bd->headerCRC + 1;
 			return RETVAL_LAST_BLOCK;
 		}
+
+		/* If we only decode one block, this is the end of our data */
+		if (bd->singleBlock) {
+			bd->writeCount = RETVAL_LAST_BLOCK;
+			return len;
+		}
 	}
 
 	/* Refill the intermediate buffer by Huffman-decoding next block of input */
@@ -729,12 +738,418 @@ void FAST_FUNC dealloc_bunzip(bunzip_data *bd)
 }
 
 
+/*
+ * Multithreaded decoding, for streams with more than a few blocks, such as the ones
+ * created by 'bzip2 -9' on large images or by pbzip2. Blocks are not byte aligned, so we
+ * look for the 48-bit block and end of stream magic values at every bit position, and a
+ * pool of worker threads, that each have their own bunzip_data, decodes one block per
+ * job. The blocks are then written in order, while we combine their CRCs for the stream.
+ * A block only counts as decoded if it passes its CRC check and ends exactly where the
+ * next magic value starts, which rules out any magic value that was a false positive.
+ * Anything else (errors, end of stream, trailing data...) has us pick up with the regular
+ * decoder, from the start of the block or end of stream marker where we stopped.
+ */
+#define BZ2_MT_MIN_SIZE         (1024 * 1024)
+#define BZ2_MT_READ_SIZE        (1024 * 1024)
+/* Larger than any block can be, even with 20-bit codes for every symbol */
+#define BZ2_MT_MAX_BLOCK_SIZE   (2560 * 1024)
+/* What we copy past the end of a block, for get_next_block() to read ahead from */
+#define BZ2_MT_BLOCK_SLACK      8
+#define BZ2_MT_BLOCK_MAGIC      0x314159265359ULL
+#define BZ2_MT_EOS_MAGIC        0x177245385090ULL
+
+struct bz2_mt_slot {
+	/* The block, starting at bit skip of in[0] */
+	uint8_t *in;
+	size_t in_size;
+	int skip;
+	int64_t bits;
+	unsigned dbufSize;
+	/* Where the next block or end of stream marker starts (as a bit offset in the file) */
+	int64_t end;
+	/* If the end of stream marker at end is followed by another stream */
+	bool ends_stream;
+	uint32_t stream_crc;
+	int64_t next_pos;
+	unsigned next_dbufSize;
+	/* Decoded data */
+	char *out;
+	size_t out_size;
+	size_t out_max;
+	uint32_t blockCRC;
+	int ret;
+	HANDLE done;
+};
+
+struct bz2_mt {
+	struct bled_mt pool;
+	struct bz2_mt_slot *slot;
+	/* Input window, and where the next block starts, for the main thread */
+	uint8_t *buf;
+	int64_t buf_offset;
+	size_t buf_len;
+	size_t buf_max;
+	bool eof;
+	bool stopped;
+	int64_t pos;
+	unsigned dbufSize;
+	/* Which bytes can follow the first byte of a magic value, at any bit offset */
+	uint8_t candidate[256];
+};
+
+/* Where the regular decoder picks up, after multithreaded decoding stopped */
+struct bz2_mt_resume {
+	bool active;
+	int skip_bits;
+	uint32_t totalCRC;
+	IF_DESKTOP(long long) int total;
+};
+
+static uint64_t bz2_mt_get_be48(const uint8_t *p, int skip)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < 7; i++)
+		v = (v << 8) | p[i];
+	return (v >> (8 - skip)) & 0xffffffffffffULL;
+}
+
+static void *bz2_mt_worker_init(void *ctx)
+{
+	bunzip_data *bd = calloc(1, sizeof(bunzip_data));
+
+	if (bd != NULL) {
+		crc32_filltable(bd->crc32Table, 1);
+		bd->in_fd = -1;
+		bd->singleBlock = 1;
+		bd->dbuf = malloc(900000 * sizeof(bd->dbuf[0]));
+	}
+	return bd;
+}
+
+static void bz2_mt_worker_free(void *worker)
+{
+	bunzip_data *bd = (bunzip_data *)worker;
+
+	if (bd != NULL)
+		free(bd->dbuf);
+	free(bd);
+}
+
+static void bz2_mt_decode(void *ctx, void *worker, uint32_t index)
+{
+	struct bz2_mt_slot *slot = &((struct bz2_mt *)ctx)->slot[index];
+	bunzip_data *bd = (bunzip_data *)worker;
+	int i;
+
+	slot->out_size = 0;
+	if ((bd == NULL) || (bd->dbuf == NULL)) {
+		slot->ret = RETVAL_OUT_OF_MEMORY;
+		SetEvent(slot->done);
+		return;
+	}
+	bd->inbuf = slot->in;
+	bd->inbufCount = (int)slot->in_size;
+	bd->inbufPos = 0;
+	bd->inbufBitCount = 0;
+	bd->inbufBits = 0;
+	bd->writeCopies = 0;
+	bd->writeCount = 0;
+	bd->dbufSize = slot->dbufSize;
+	i = setjmp(bd->jmpbuf);
+	if (i == 0) {
+		get_bits(bd, slot->skip);
+		do {
+			if (slot->out_max - slot->out_size < IOBUF_SIZE) {
+				slot->out_max += 4 * IOBUF_SIZE;
+				slot->out = xrealloc(slot->out, slot->out_max);
+				if (slot->out == NULL) {
+					slot->out_max = 0;
+					i = RETVAL_OUT_OF_MEMORY;
+					break;
+				}
+			}
+			i = read_bunzip(bd, &slot->out[slot->out_size], IOBUF_SIZE);
+			if (i >= 0)
+				slot->out_size += IOBUF_SIZE - i;
+		} while (i >= 0);
+	}
+	/* The block must check out, and end right where the next magic starts */
+	if ((i == RETVAL_LAST_BLOCK) && (bd->writeCRC == bd->headerCRC) &&
+		((int64_t)bd->inbufPos * 8 - bd->inbufBitCount == slot->skip + slot->bits)) {
+		slot->blockCRC = bd->writeCRC;
+		slot->ret = RETVAL_OK;
+	} else {
+		slot->ret = (i < 0) ? i : RETVAL_DATA_ERROR;
+	}
+	SetEvent(slot->done);
+}
+
+/* Read more data into the input window, which we first move to start with the current block */
+static bool bz2_mt_fill(struct bz2_mt *mt, int fd)
+{
+	size_t keep = (size_t)((mt->pos >> 3) - mt->buf_offset);
+	int rb;
+
+	if (mt->eof)
+		return false;
+	memmove(mt->buf, &mt->buf[keep], mt->buf_len - keep);
+	mt->buf_offset += keep;
+	mt->buf_len -= keep;
+	rb = full_read(fd, &mt->buf[mt->buf_len], (unsigned)MIN(mt->buf_max - mt->buf_len, BZ2_MT_READ_SIZE));
+	if (rb <= 0) {
+		mt->eof = true;
+		return false;
+	}
+	mt->buf_len += rb;
+	return true;
+}
+
+/*
+ * Look for the next block or end of stream magic, from bit offset *from in the file. Returns
+ * its bit offset, or -1 with *from updated if it isn't in the window (yet).
+ */
+static int64_t bz2_mt_find_magic(struct bz2_mt *mt, int64_t *from, bool *eos)
+{
+	const uint8_t *buf = mt->buf;
+	uint64_t v;
+	size_t p;
+	int s;
+
+	for (p = (size_t)((*from >> 3) - mt->buf_offset); p + 7 <= mt->buf_len; p++) {
+		if (!mt->candidate[buf[p + 1]])
+			continue;
+		for (s = 0; s < 8; s++) {
+			if ((int64_t)(mt->buf_offset + p) * 8 + s < *from)
+				continue;
+			v = bz2_mt_get_be48(&buf[p], s);
+			if ((v == BZ2_MT_BLOCK_MAGIC) || (v == BZ2_MT_EOS_MAGIC)) {
+				*eos = (v == BZ2_MT_EOS_MAGIC);
+				return (int64_t)(mt->buf_offset + p) * 8 + s;
+			}
+		}
+	}
+	*from = MAX(*from, (int64_t)(mt->buf_offset + p) * 8);
+	return -1;
+}
+
+/* Set up slot with the next block, or return false if we should stop splitting the input */
+static bool bz2_mt_next_block(struct bz2_mt *mt, int fd, struct bz2_mt_slot *slot)
+{
+	int64_t from = mt->pos + 48, end, next;
+	size_t start, size;
+	const uint8_t *p;
+	bool eos;
+
+	if (mt->stopped)
+		return false;
+	mt->stopped = true;
+	while ((end = bz2_mt_find_magic(mt, &from, &eos)) < 0) {
+		if ((from >> 3) - (mt->pos >> 3) > BZ2_MT_MAX_BLOCK_SIZE)
+			return false;
+		if (!bz2_mt_fill(mt, fd))
+			return false;
+	}
+	slot->ends_stream = false;
+	next = end;
+	if (eos) {
+		/* Only carry on if another stream, that starts with a block, follows the stream CRC */
+		next = (end + 80 + 7) >> 3;
+		while (next + 11 > mt->buf_offset + (int64_t)mt->buf_len) {
+			if (!bz2_mt_fill(mt, fd))
+				break;
+		}
+		p = &mt->buf[next - mt->buf_offset];
+		if ((next + 11 <= mt->buf_offset + (int64_t)mt->buf_len) && (p[0] == 'B') && (p[1] == 'Z') &&
+			(p[2] == 'h') && (p[3] >= '1') && (p[3] <= '9') && (bz2_mt_get_be48(&p[4], 0) == BZ2_MT_BLOCK_MAGIC)) {
+			slot->ends_stream = true;
+			slot->stream_crc = (uint32_t)(bz2_mt_get_be48(&mt->buf[((end + 48) >> 3) - mt->buf_offset], (end + 48) & 7) >> 16);
+			slot->next_pos = (next + 4) * 8;
+			slot->next_dbufSize = 100000 * (p[3] - '0');
+		}
+	}
+
+	/* Copy the block, with the bytes that follow, as get_next_block() reads ahead */
+	start = (size_t)((mt->pos >> 3) - mt->buf_offset);
+	size = (size_t)((end >> 3) - (mt->pos >> 3)) + BZ2_MT_BLOCK_SLACK;
+	size = MIN(size, mt->buf_len - start);
+	if (slot->in_size < size || slot->in == NULL) {
+		slot->in = xrealloc(slot->in, size);
+		if (slot->in == NULL)
+			return false;
+	}
+	memcpy(slot->in, &mt->buf[start], size);
+	slot->in_size = size;
+	slot->skip = mt->pos & 7;
+	slot->bits = end - mt->pos;
+	slot->dbufSize = mt->dbufSize;
+	slot->end = end;
+	if (slot->ends_stream) {
+		mt->pos = slot->next_pos;
+		mt->dbufSize = slot->next_dbufSize;
+	} else {
+		mt->pos = end;
+	}
+	mt->stopped = eos && !slot->ends_stream;
+	return true;
+}
+
+/*
+ * Returns false if the regular decoder should process the stream, from the point set in
+ * resume (with outbuf and len set for start_bunzip()), or true and the result in *n.
+ */
+static bool unpack_bz2_stream_mt(transformer_state_t *xstate, char *outbuf, unsigned *len,
+	struct bz2_mt_resume *resume, IF_DESKTOP(long long) int *n)
+{
+	bool r = false;
+	struct bz2_mt mt = { 0 };
+	struct bz2_mt_slot *slot;
+	int64_t start, end, pos;
+	uint64_t total_rb = bb_total_rb;
+	uint32_t i, next_read, next_write, totalCRC = 0;
+	unsigned dbufSize;
+	ssize_t nwrote;
+	int s;
+
+	/* We need to seek the source, and only bother with output to a file */
+	if ((xstate->src_fd == bb_virtual_fd) || (bled_read != NULL) || (xstate->mem_output_size_max != 0))
+		return false;
+	/* The magic was already read */
+	start = _lseeki64(xstate->src_fd, 0, SEEK_CUR) - 2;
+	end = _lseeki64(xstate->src_fd, 0, SEEK_END);
+	if ((start < 0) || (end < start + BZ2_MT_MIN_SIZE))
+		goto fallback;
+	/* A slot holds a block, and its worker has a dbuf of up to 900000 entries */
+	if (!bled_mt_init(&mt.pool, UINT32_MAX, BZ2_MT_MAX_BLOCK_SIZE + 900000 * sizeof(uint32_t)))
+		goto fallback;
+	mt.pool.decode = bz2_mt_decode;
+	mt.pool.worker_init = bz2_mt_worker_init;
+	mt.pool.worker_free = bz2_mt_worker_free;
+
+	/* The stream must start with a block */
+	mt.buf_max = BZ2_MT_MAX_BLOCK_SIZE + 2 * BZ2_MT_READ_SIZE;
+	mt.buf = malloc(mt.buf_max);
+	if ((mt.buf == NULL) || (_lseeki64(xstate->src_fd, start, SEEK_SET) != start))
+		goto fallback;
+	mt.buf_offset = start;
+	mt.pos = start * 8;
+	if (!bz2_mt_fill(&mt, xstate->src_fd) || (mt.buf_len < 10) || (mt.buf[2] != 'h') ||
+		(mt.buf[3] < '1') || (mt.buf[3] > '9') || (bz2_mt_get_be48(&mt.buf[4], 0) != BZ2_MT_BLOCK_MAGIC))
+		goto fallback;
+	bb_total_rb -= 2;
+	mt.pos = (start + 4) * 8;
+	mt.dbufSize = 100000 * (mt.buf[3] - '0');
+	for (s = 0; s < 8; s++) {
+		mt.candidate[(BZ2_MT_BLOCK_MAGIC >> (32 + s)) & 0xff] = 1;
+		mt.candidate[(BZ2_MT_EOS_MAGIC >> (32 + s)) & 0xff] = 1;
+	}
+
+	mt.slot = calloc(mt.pool.num_slots, sizeof(struct bz2_mt_slot));
+	if (mt.slot == NULL)
+		goto fallback;
+	for (i = 0; i < mt.pool.num_slots; i++) {
+		mt.slot[i].done = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (mt.slot[i].done == NULL)
+			goto fallback;
+	}
+	/* From this stage on, we are committed to multithreaded decoding */
+	r = true;
+	if (!bled_mt_start(&mt.pool, &mt))
+		bb_error_msg_and_err("could not create decoder thread");
+	bb_printf("Decoding bzip2 blocks using %d threads", mt.pool.num_threads);
+
+	*n = 0;
+	pos = mt.pos;
+	dbufSize = mt.dbufSize;
+	for (next_read = 0, next_write = 0; ; next_write++) {
+		/* Queue as many blocks as we have free slots */
+		for (; next_read - next_write < mt.pool.num_slots; next_read++) {
+			if (!bz2_mt_next_block(&mt, xstate->src_fd, &mt.slot[next_read % mt.pool.num_slots]))
+				break;
+			bled_mt_post(&mt.pool);
+		}
+		if (next_write == next_read)
+			break;
+		/* Then write the next block in order, once it has been decoded */
+		slot = &mt.slot[next_write % mt.pool.num_slots];
+		WaitForSingleObject(slot->done, INFINITE);
+		if (slot->ret != RETVAL_OK)
+			break;
+		nwrote = transformer_write(xstate, slot->out, slot->out_size);
+		if (nwrote != (ssize_t)slot->out_size) {
+			*n = RETVAL_SHORT_WRITE;
+			goto out;
+		}
+		*n += nwrote;
+		totalCRC = ((totalCRC << 1) | (totalCRC >> 31)) ^ slot->blockCRC;
+		pos = slot->end;
+		if (slot->ends_stream) {
+			/* Let the regular decoder report a stream CRC error */
+			if (totalCRC != slot->stream_crc)
+				break;
+			totalCRC = 0;
+			pos = slot->next_pos;
+			dbufSize = slot->next_dbufSize;
+		}
+	}
+
+	/* Stop the workers before we hand the source over */
+	bled_mt_stop(&mt.pool);
+
+	/* Resume with the header of the stream we're in, and the byte that holds the start of the block */
+	start = _lseeki64(xstate->src_fd, 0, SEEK_CUR);
+	if ((start < 0) || (_lseeki64(xstate->src_fd, pos >> 3, SEEK_SET) != (pos >> 3)))
+		bb_error_msg_and_err("seek error (errno: %d)", errno);
+	bb_total_rb -= start - (pos >> 3);
+	if (full_read(xstate->src_fd, &outbuf[4], 1) != 1)
+		bb_error_msg_and_err("read error (errno: %d)", errno);
+	outbuf[2] = 'h';
+	outbuf[3] = '0' + dbufSize / 100000;
+	*len = 3;
+	resume->active = true;
+	resume->skip_bits = pos & 7;
+	resume->totalCRC = totalCRC;
+	resume->total = *n;
+	r = false;
+	goto out;
+
+err:
+	*n = RETVAL_DATA_ERROR;
+	goto out;
+
+fallback:
+	/* Rewind, so that the regular decoder can process the stream */
+	if (start >= 0) {
+		if (_lseeki64(xstate->src_fd, start + 2, SEEK_SET) != start + 2) {
+			*n = RETVAL_DATA_ERROR;
+			r = true;
+		}
+		bb_total_rb = total_rb;
+	}
+
+out:
+	bled_mt_free(&mt.pool);
+	if (mt.slot != NULL) {
+		for (i = 0; i < mt.pool.num_slots; i++) {
+			free(mt.slot[i].in);
+			free(mt.slot[i].out);
+			if (mt.slot[i].done != NULL)
+				CloseHandle(mt.slot[i].done);
+		}
+		free(mt.slot);
+	}
+	free(mt.buf);
+	return r;
+}
+
 /* Decompress src_fd to dst_fd.  Stops at end of bzip data, not end of file. */
 IF_DESKTOP(long long) int FAST_FUNC
 unpack_bz2_stream(transformer_state_t *xstate)
 {
 	IF_DESKTOP(long long total_written = 0;)
 	bunzip_data *bd;
+	struct bz2_mt_resume resume = { 0 };
 	char *outbuf;
 	int i, nwrote;
 	unsigned len;
@@ -744,10 +1159,22 @@ unpack_bz2_stream(transformer_state_t *xstate)
 
 	outbuf = xmalloc(IOBUF_SIZE);
 	len = 0;
+	if (unpack_bz2_stream_mt(xstate, outbuf, &len, &resume, &resume.total)) {
+		free(outbuf);
+		return resume.total;
+	}
+	IF_DESKTOP(total_written = resume.total;)
 	while (1) { /* "Process one BZ... stream" loop */
 
 		i = start_bunzip(&bd, xstate->src_fd, outbuf + 2, len);
 
+		if ((i == 0) && resume.active) {
+			/* Pick up where multithreaded decoding stopped, in the middle of the stream */
+			get_bits(bd, resume.skip_bits);
+			bd->totalCRC = resume.totalCRC;
+			resume.active = false;
+		}
+
 		if (i == 0) {
 			while (1) { /* "Produce some output bytes" loop */
 				i = read_bunzip(bd, outbuf, IOBUF_SIZE);
@@ -778,6 +1205,8 @@ unpack_bz2_stream(transformer_state_t *xstate)
 		}
 		if (bd->headerCRC != bd->totalCRC) {
 			bb_error_msg("CRC error");
+			/* Don't report success for a stream that ended right after its header */
+			i = RETVAL_LAST_BLOCK;
 			break;
 		}
 
@@ -37,24 +37,46 @@
 #include "libbb.h"
 #include "bb_archive.h"
 
-typedef struct huft_t {
-	unsigned char e;	/* number of extra bits or operation */
-	unsigned char b;	/* number of bits in this code or subcode */
-	union {
-		unsigned short n;	/* literal, length base, or distance base */
-		struct huft_t *t;	/* pointer to next level of table */
-	} v;
-} huft_t;
+/* Huffman decoding table entry. The layout follows zlib's inflate:
+ * op == 0:          literal, val is the byte
+ * op & 16:          length or distance base in val, op & 15 extra bits
+ * op & 64 == 0:     link to a second level table of op bits at offset val
+ * op & 32:          end of block
+ * op & 64:          invalid code
+ * bits is the number of bits this entry consumes.
+ */
+typedef struct code_t {
+	unsigned char op;
+	unsigned char bits;
+	unsigned short val;
+} code_t;
 
 enum {
 	/* gunzip_window size--must be a power of two, and
 	 * at least 32K for zip's deflate method */
 	GUNZIP_WSIZE = BB_BUFSIZE,
-	/* If BMAX needs to be larger than 16, then h and x[] should be ulg. */
-	BMAX = 16,	/* maximum bit length of any code (16 for explode) */
-	N_MAX = 288,	/* maximum number of codes in any set */
+	/* Matches are copied 8 bytes at a time and may write up to 7 bytes
+	 * past their end, so the window has some slack */
+	GUNZIP_WSLACK = 8,
+	/* Bytes kept free at the front of bytebuffer so that any lookahead
+	 * left in the 64-bit bit buffer can be unwound there */
+	BYTEBUFFER_UNWIND = 8,
+	MAXBITS = 15,	/* maximum bit length of any code */
+	MAX_MATCH = 258,	/* longest match deflate can emit */
+	/* Root lookup bits and worst case table sizes (see zlib's enough.c) */
+	LBITS = 9,
+	DBITS = 6,
+	ENOUGH_LENS = 852,
+	ENOUGH_DISTS = 592,
+	ENOUGH = ENOUGH_LENS + ENOUGH_DISTS,
 };
 
+typedef enum {
+	CODES,
+	LENS,
+	DISTS
+} codetype_t;
+
 
 /* This is somewhat complex-looking arrangement, but it allows
  * to place decompressor state either in bss or in
@@ -67,6 +89,8 @@ enum {
 #define STATE_IN_BSS 0
 #define STATE_IN_MALLOC 1
 
+struct gz_mt;
+struct gz_mt_slot;
 
 typedef struct state_t {
 	off_t gunzip_bytes_out; /* number of output bytes */
@@ -80,8 +104,8 @@ typedef struct state_t {
 	uint32_t *gunzip_crc_table;
 
 	/* bitbuffer */
-	unsigned gunzip_bb; /* bit buffer */
-	unsigned char gunzip_bk; /* bits in bit buffer */
+	uint64_t gunzip_bb; /* bit buffer */
+	unsigned gunzip_bk; /* bits in bit buffer */
 
 	/* input (compressed) data */
 	unsigned char *bytebuffer;      /* buffer itself */
@@ -91,19 +115,15 @@ typedef struct state_t {
 	unsigned bytebuffer_size;       /* how much data is there (size <= max) */
 
 	/* private data of inflate_codes() */
-	unsigned inflate_codes_ml; /* masks for bl and bd bits */
-	unsigned inflate_codes_md; /* masks for bl and bd bits */
-	unsigned inflate_codes_bb; /* bit buffer */
-	unsigned inflate_codes_k; /* number of bits in bit buffer */
-	unsigned inflate_codes_w; /* current gunzip_window position */
-	huft_t *inflate_codes_tl;
-	huft_t *inflate_codes_td;
-	unsigned inflate_codes_bl;
-	unsigned inflate_codes_bd;
+	const code_t *inflate_codes_lcode;
+	const code_t *inflate_codes_dcode;
+	unsigned inflate_codes_lbits;
+	unsigned inflate_codes_dbits;
 	unsigned inflate_codes_nn; /* length and index for copy */
 	unsigned inflate_codes_dd;
 
 	smallint resume_copy;
+	smallint window_wrapped; /* the whole window holds history */
 
 	/* private data of inflate_get_next_window() */
 	smallint method; /* method == -1 for stored, -2 for codes */
@@ -112,9 +132,22 @@ typedef struct state_t {
 
 	/* private data of inflate_stored() */
 	unsigned inflate_stored_n;
-	unsigned inflate_stored_b;
-	unsigned inflate_stored_k;
-	unsigned inflate_stored_w;
+
+	/* private data of inflate_unzip_internal() */
+	const unsigned char *preset_dict; /* history to start with */
+	unsigned preset_dict_size;
+	uint64_t skip_out; /* output bytes to drop, since they were already written */
+	smallint input_ended; /* in-memory input ended in between two blocks */
+
+	/* multithreaded decoding, where output goes to a worker slot */
+	struct gz_mt *mt_ctx;
+	struct gz_mt_slot *mt_slot;
+	smallint mt_head; /* output belongs to a member that started before the slot */
+
+	/* private data of inflate_block() */
+	smallint fixed_built;
+	code_t fixed_codes[512 + 32];
+	code_t codes[ENOUGH];
 
 	const char *error_msg;
 	jmp_buf error_jmp;
@@ -132,25 +165,28 @@ typedef struct state_t {
 #define bytebuffer          (S()bytebuffer         )
 #define bytebuffer_offset   (S()bytebuffer_offset  )
 #define bytebuffer_size     (S()bytebuffer_size    )
-#define inflate_codes_ml    (S()inflate_codes_ml   )
-#define inflate_codes_md    (S()inflate_codes_md   )
-#define inflate_codes_bb    (S()inflate_codes_bb   )
-#define inflate_codes_k     (S()inflate_codes_k    )
-#define inflate_codes_w     (S()inflate_codes_w    )
-#define inflate_codes_tl    (S()inflate_codes_tl   )
-#define inflate_codes_td    (S()inflate_codes_td   )
-#define inflate_codes_bl    (S()inflate_codes_bl   )
-#define inflate_codes_bd    (S()inflate_codes_bd   )
+#define inflate_codes_lcode (S()inflate_codes_lcode)
+#define inflate_codes_dcode (S()inflate_codes_dcode)
+#define inflate_codes_lbits (S()inflate_codes_lbits)
+#define inflate_codes_dbits (S()inflate_codes_dbits)
 #define inflate_codes_nn    (S()inflate_codes_nn   )
 #define inflate_codes_dd    (S()inflate_codes_dd   )
 #define resume_copy         (S()resume_copy        )
+#define window_wrapped      (S()window_wrapped     )
 #define method              (S()method             )
 #define need_another_block  (S()need_another_block )
 #define end_reached         (S()end_reached        )
 #define inflate_stored_n    (S()inflate_stored_n   )
-#define inflate_stored_b    (S()inflate_stored_b   )
-#define inflate_stored_k    (S()inflate_stored_k   )
-#define inflate_stored_w    (S()inflate_stored_w   )
+#define preset_dict         (S()preset_dict        )
+#define preset_dict_size    (S()preset_dict_size   )
+#define skip_out            (S()skip_out           )
+#define input_ended         (S()input_ended        )
+#define mt_ctx              (S()mt_ctx             )
+#define mt_slot             (S()mt_slot            )
+#define mt_head             (S()mt_head            )
+#define fixed_built         (S()fixed_built        )
+#define fixed_codes         (S()fixed_codes        )
+#define codes               (S()codes              )
 #define error_msg           (S()error_msg          )
 #define error_jmp           (S()error_jmp          )
 
@@ -179,11 +215,6 @@ static state_t state;
 #endif
 
 
-static const uint16_t mask_bits[] ALIGN2 = {
-	0x0000, 0x0001, 0x0003, 0x0007, 0x000f, 0x001f, 0x003f, 0x007f, 0x00ff,
-	0x01ff, 0x03ff, 0x07ff, 0x0fff, 0x1fff, 0x3fff, 0x7fff, 0xffff
-};
-
 /* Copy lengths for literal codes 257..285 */
 static const uint16_t cplens[] ALIGN2 = {
 	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
@@ -216,703 +247,711 @@ static const uint8_t border[] ALIGN1 = {
 };
 
 
-/*
- * Free the malloc'ed tables built by huft_build(), which makes a linked
- * list of the tables it made, with the links in a dummy first entry of
- * each table.
- * t: table to free
- */
-static void huft_free(huft_t *p)
-{
-	huft_t *q;
-
-	/* Go through linked list, freeing from the malloced (t[-1]) address. */
-	while (p) {
-		q = (--p)->v.t;
-		free(p);
-		p = q;
-	}
-}
-
-static void huft_free_all(STATE_PARAM_ONLY)
-{
-	huft_free(inflate_codes_tl);
-	huft_free(inflate_codes_td);
-	inflate_codes_tl = NULL;
-	inflate_codes_td = NULL;
-}
-
 static void abort_unzip(STATE_PARAM_ONLY) NORETURN;
 static void abort_unzip(STATE_PARAM_ONLY)
 {
-	huft_free_all(PASS_STATE_ONLY);
 	longjmp(error_jmp, 1);
 }
 
-static unsigned fill_bitbuffer(STATE_PARAM unsigned bitbuffer, unsigned *current, const unsigned required)
+/* Read the next chunk of compressed data into bytebuffer */
+static void refill_bytebuffer(STATE_PARAM_ONLY)
 {
-	while (*current < required) {
-		if (bytebuffer_offset >= bytebuffer_size) {
-			unsigned sz = bytebuffer_max - 4;
-			if (to_read >= 0 && to_read < sz) /* unzip only */
-				sz = (unsigned)to_read;
-			/* Leave the first 4 bytes empty so we can always unwind the bitbuffer
-			 * to the front of the bytebuffer */
-			bytebuffer_size = safe_read(gunzip_src_fd, &bytebuffer[4], sz);
-			if ((int)bytebuffer_size < 1) {
-				error_msg = "unexpected end of file";
-				abort_unzip(PASS_STATE_ONLY);
-			}
-			if (to_read >= 0) /* unzip only */
-				to_read -= bytebuffer_size;
-			bytebuffer_size += 4;
-			bytebuffer_offset = 4;
-		}
-		bitbuffer |= ((unsigned) bytebuffer[bytebuffer_offset]) << *current;
-		bytebuffer_offset++;
-		*current += 8;
+	unsigned sz = bytebuffer_max - BYTEBUFFER_UNWIND;
+	if (to_read >= 0 && to_read < sz) /* unzip only */
+		sz = (unsigned)to_read;
+	/* Leave the first bytes empty so we can always unwind the bitbuffer
+	 * to the front of the bytebuffer */
+	bytebuffer_size = safe_read(gunzip_src_fd, &bytebuffer[BYTEBUFFER_UNWIND], sz);
+	if ((int)bytebuffer_size < 1) {
+		error_msg = "unexpected end of file";
+		abort_unzip(PASS_STATE_ONLY);
 	}
-	return bitbuffer;
+	if (to_read >= 0) /* unzip only */
+		to_read -= bytebuffer_size;
+	bytebuffer_size += BYTEBUFFER_UNWIND;
+	bytebuffer_offset = BYTEBUFFER_UNWIND;
 }
 
-
-/* Given a list of code lengths and a maximum table size, make a set of
- * tables to decode that set of codes.  Return zero on success, one if
- * the given code set is incomplete (the tables are still built in this
- * case), two if the input is invalid (all zero length codes or an
- * oversubscribed set of lengths) - in this case stores NULL in *t.
+/*
+ * Bit buffer helpers. They work on local copies (bb, bk) of the bit buffer.
+ * PULLBYTE() and NEEDBITS() read one byte at a time, and are safe to use
+ * right up to the end of the compressed data. REFILL() loads 8 bytes at
+ * once and may only be used when that many remain in bytebuffer. It leaves
+ * the bits above bk set to the next input bits rather than zero, which is
+ * harmless as long as PULLBYTE() keeps reading from the same place.
+ */
+#define BITS(n)     ((unsigned)bb & ((1U << (n)) - 1))
+#define DROPBITS(n) do { bb >>= (n); bk -= (n); } while (0)
+#define PULLBYTE() do { \
+	if (bytebuffer_offset >= bytebuffer_size) \
+		refill_bytebuffer(PASS_STATE_ONLY); \
+	bb |= (uint64_t)bytebuffer[bytebuffer_offset++] << bk; \
+	bk += 8; \
+} while (0)
+#define NEEDBITS(n) do { while (bk < (unsigned)(n)) PULLBYTE(); } while (0)
+#define REFILL() do { \
+	bb |= SWAP_LE64(get_le64(&bytebuffer[bytebuffer_offset])) << bk; \
+	bytebuffer_offset += (63 - bk) >> 3; \
+	bk |= 56; \
+} while (0)
+
+
+/* Given a list of code lengths, build the decoding table for that set of
+ * codes into *table and advance *table past it. On entry *bits is the
+ * requested root table size, on return the actual one. Codes longer than
+ * that go into second level tables linked from the root table. Returns
+ * zero on success, or nonzero for an oversubscribed code set, or for an
+ * incomplete one (which is only allowed for a single code of length 1).
+ * An all zero length set yields a table of invalid codes.
+ * This is the table builder from zlib's inftrees.c, by Mark Adler.
  *
- * b:	code lengths in bits (all assumed <= BMAX)
- * n:	number of codes (assumed <= N_MAX)
- * s:	number of simple-valued codes (0..s-1)
- * d:	list of base values for non-simple codes
- * e:	list of extra bits for non-simple codes
- * t:	result: starting table
- * m:	maximum lookup bits, returns actual
+ * type:	CODES, LENS or DISTS
+ * lens:	code lengths in bits (all assumed <= MAXBITS)
+ * ncodes:	number of codes
+ * table:	where to put the table, updated on return
+ * bits:	root lookup bits, returns actual
  */
-static int huft_build(const unsigned *b, const unsigned n,
-			const unsigned s, const unsigned short *d,
-			const unsigned char *e, huft_t **t, unsigned *m)
+static int inflate_table(codetype_t type, const unsigned short *lens, unsigned ncodes,
+			code_t **table, unsigned *bits)
 {
-	unsigned a;             /* counter for codes of length k */
-	unsigned c[BMAX + 1];   /* bit length count table */
-	unsigned eob_len;       /* length of end-of-block code (value 256) */
-	unsigned f;             /* i repeats in table every f entries */
-	int g;                  /* maximum code length */
-	int htl;                /* table level */
-	unsigned i;             /* counter, current code */
-	unsigned j;             /* counter */
-	int k;                  /* number of bits in current code */
-	unsigned *p;            /* pointer into c[], b[], or v[] */
-	huft_t *q;              /* points to current table */
-	huft_t r;               /* table entry for structure assignment */
-	huft_t *u[BMAX];        /* table stack */
-	unsigned v[N_MAX];      /* values in order of bit length */
-	int ws[BMAX + 1];       /* bits decoded stack */
-	int w;                  /* bits decoded */
-	unsigned x[BMAX + 1];   /* bit offsets, then code stack */
-	unsigned *xp;           /* pointer into x */
-	int y;                  /* number of dummy codes added */
-	unsigned z;             /* number of entries in current table */
-
-	/* Length of EOB code, if any */
-	eob_len = n > 256 ? b[256] : BMAX;
-
-	*t = NULL;
-
-	/* Generate counts for each bit length */
-	memset(c, 0, sizeof(c));
-	p = (unsigned *) b; /* cast allows us to reuse p for pointing to b */
-	i = n;
-	do {
-		c[*p]++; /* assume all entries <= BMAX */
-		p++;     /* can't combine with above line (Solaris bug) */
-	} while (--i);
-	if (c[0] == n) {  /* null input - all zero length codes */
-		*m = 0;
-		return 2;
+	unsigned len;               /* a code's length in bits */
+	unsigned sym;               /* index of code symbols */
+	unsigned min, max;          /* minimum and maximum code lengths */
+	unsigned root;              /* number of index bits for root table */
+	unsigned curr;              /* number of index bits for current table */
+	unsigned drop;              /* code bits to drop for sub-table */
+	int left;                   /* number of prefix codes available */
+	unsigned used;              /* code entries in table used */
+	unsigned huff;              /* Huffman code */
+	unsigned incr;              /* for incrementing code, index */
+	unsigned fill;              /* index for replicating entries */
+	unsigned low;               /* low bits for current root entry */
+	unsigned mask;              /* mask for low root bits */
+	unsigned idx;
+	code_t here;                /* table entry for duplication */
+	code_t *next;               /* next available space in table */
+	const unsigned short *base; /* base value table to use */
+	const unsigned char *extra; /* extra bits table to use */
+	unsigned nbase;             /* number of entries in base and extra */
+	unsigned match;             /* use base and extra for symbol >= match */
+	unsigned short count[MAXBITS + 1]; /* number of codes of each length */
+	unsigned short offs[MAXBITS + 1];  /* offsets in table for each length */
+	unsigned short work[288];   /* symbols sorted by code length */
+
+	/* Count the number of codes of each length */
+	memset(count, 0, sizeof(count));
+	for (sym = 0; sym < ncodes; sym++)
+		count[lens[sym]]++;
+
+	/* Bound code lengths, force root to be within code lengths */
+	root = *bits;
+	for (max = MAXBITS; max >= 1; max--)
+		if (count[max] != 0)
+			break;
+	if (root > max)
+		root = max;
+	if (max == 0) {
+		/* No symbols to code at all: make a table that will
+		 * report an invalid code if it is ever used */
+		here.op = 64;
+		here.bits = 1;
+		here.val = 0;
+		*(*table)++ = here;
+		*(*table)++ = here;
+		*bits = 1;
+		return 0;
 	}
-
-	/* Find minimum and maximum length, bound *m by those */
-	for (j = 1; (j <= BMAX) && (c[j] == 0); j++)
-		continue;
-	k = j; /* minimum code length */
-	for (i = BMAX; (c[i] == 0) && i; i--)
-		continue;
-	g = i; /* maximum code length */
-	*m = (*m < j) ? j : ((*m > i) ? i : *m);
-
-	/* Adjust last length count to fill out codes, if needed */
-	for (y = 1 << j; j < i; j++, y <<= 1) {
-		y -= c[j];
-		if (y < 0)
-			return 2; /* bad input: more codes than bits */
+	for (min = 1; min < max; min++)
+		if (count[min] != 0)
+			break;
+	if (root < min)
+		root = min;
+
+	/* Check for an over-subscribed or incomplete set of lengths */
+	left = 1;
+	for (len = 1; len <= MAXBITS; len++) {
+		left <<= 1;
+		left -= count[len];
+		if (left < 0)
+			return 1; /* over-subscribed */
 	}
-	y -= c[i];
-	if (y < 0)
-		return 2;
-	c[i] += y;
-
-	/* Generate starting offsets into the value table for each length */
-	x[1] = j = 0;
-	p = c + 1;
-	xp = x + 2;
-	while (--i) { /* note that i == g from above */
-		j += *p++;
-		*xp++ = j;
+	if (left > 0 && (type == CODES || max != 1))
+		return 1; /* incomplete set */
+
+	/* Generate offsets into symbol table for each length for sorting */
+	offs[1] = 0;
+	for (len = 1; len < MAXBITS; len++)
+		offs[len + 1] = offs[len] + count[len];
+
+	/* Sort symbols by length, by symbol order within each length */
+	for (sym = 0; sym < ncodes; sym++)
+		if (lens[sym] != 0)
+			work[offs[lens[sym]]++] = (unsigned short)sym;
+
+	switch (type) {
+	case CODES:
+		base = NULL;
+		extra = NULL;
+		nbase = 0;
+		match = 20; /* all symbols are simple values */
+		break;
+	case LENS:
+		base = cplens;
+		extra = cplext;
+		nbase = sizeof(cplens) / sizeof(cplens[0]);
+		match = 257;
+		break;
+	default: /* DISTS */
+		base = cpdist;
+		extra = cpdext;
+		nbase = sizeof(cpdist) / sizeof(cpdist[0]);
+		match = 0;
 	}
 
-	/* Make a table of values in order of bit lengths */
-	p = (unsigned *) b;
-	i = 0;
-	do {
-		j = *p++;
-		if (j != 0) {
-			v[x[j]++] = i;
-		}
-	} while (++i < n);
-
-	/* Generate the Huffman codes and for each, make the table entries */
-	x[0] = i = 0;   /* first Huffman code is zero */
-	p = v;          /* grab values in bit order */
-	htl = -1;       /* no tables yet--level -1 */
-	w = ws[0] = 0;  /* bits decoded */
-	u[0] = NULL;    /* just to keep compilers happy */
-	q = NULL;       /* ditto */
-	z = 0;          /* ditto */
-
-	/* go through the bit lengths (k already is bits in shortest code) */
-	for (; k <= g; k++) {
-		a = c[k];
-		while (a--) {
-			/* here i is the Huffman code of length k bits for value *p */
-			/* make tables up to required level */
-			while (k > ws[htl + 1]) {
-				w = ws[++htl];
-
-				/* compute minimum size table less than or equal to *m bits */
-				z = g - w;
-				z = z > *m ? *m : z; /* upper limit on table size */
-				j = k - w;
-				f = 1 << j;
-				if (f > a + 1) { /* try a k-w bit table */
-					/* too few codes for k-w bit table */
-					f -= a + 1; /* deduct codes from patterns left */
-					xp = c + k;
-					while (++j < z) { /* try smaller tables up to z bits */
-						f <<= 1;
-						if (f <= *++xp) {
-							break; /* enough codes to use up j bits */
-						}
-						f -= *xp; /* else deduct codes from patterns */
-					}
-				}
-				j = ((w + j) > (int)eob_len && w < (int)eob_len) ? eob_len - w : j;	/* make EOB code end at table */
-				z = 1 << j;	/* table entries for j-bit table */
-				ws[htl+1] = w + j;	/* set bits decoded in stack */
-
-				/* allocate and link in new table */
-				q = xzalloc((z + 1) * sizeof(huft_t));
-				*t = q + 1;	/* link to list for huft_free() */
-				t = &(q->v.t);
-				u[htl] = ++q;	/* table starts after link */
-
-				/* connect to last table, if there is one */
-				if (htl) {
-					x[htl] = i; /* save pattern for backing up */
-					r.b = (unsigned char) (w - ws[htl - 1]); /* bits to dump before this table */
-					r.e = (unsigned char) (16 + j); /* bits in this table */
-					r.v.t = q; /* pointer to this table */
-					j = (i & ((1 << w) - 1)) >> ws[htl - 1];
-					u[htl - 1][j] = r; /* connect to last table */
-				}
-			}
-
-			/* set up table entry in r */
-			r.b = (unsigned char) (k - w);
-			if (p >= v + n) {
-				r.e = 99; /* out of values--invalid code */
-			} else if (*p < s) {
-				r.e = (unsigned char) (*p < 256 ? 16 : 15);	/* 256 is EOB code */
-				r.v.n = (unsigned short) (*p++); /* simple code is just the value */
+	/* Initialize state for loop */
+	huff = 0;            /* starting code */
+	sym = 0;             /* starting code symbol */
+	len = min;           /* starting code length */
+	next = *table;       /* current table to fill in */
+	curr = root;         /* current table index bits */
+	drop = 0;            /* current bits to drop from code for index */
+	low = (unsigned)(-1); /* trigger new sub-table when len > root */
+	used = 1U << root;   /* use root table entries */
+	mask = used - 1;     /* mask for comparing low */
+
+	if ((type == LENS && used > ENOUGH_LENS) || (type == DISTS && used > ENOUGH_DISTS))
+		return 1;
+
+	/* Process all codes and make table entries */
+	while (1) {
+		/* Create table entry */
+		here.bits = (unsigned char)(len - drop);
+		if (work[sym] + 1U < match) {
+			here.op = 0;
+			here.val = work[sym];
+		} else if (work[sym] >= match) {
+			idx = work[sym] - match;
+			if (idx < nbase && extra[idx] != 99) {
+				here.op = (unsigned char)(16 + extra[idx]);
+				here.val = base[idx];
 			} else {
-				r.e = (unsigned char) e[*p - s]; /* non-simple--look up in lists */
-				r.v.n = d[*p++ - s];
+				here.op = 64; /* invalid code */
+				here.val = 0;
 			}
+		} else {
+			here.op = 32 + 64; /* end of block */
+			here.val = 0;
+		}
 
-			/* fill code-like entries with r */
-			f = 1 << (k - w);
-			for (j = i >> w; j < z; j += f) {
-				q[j] = r;
-			}
+		/* Replicate for those indices with low len bits equal to huff */
+		incr = 1U << (len - drop);
+		fill = 1U << curr;
+		min = fill; /* save offset to next table */
+		do {
+			fill -= incr;
+			next[(huff >> drop) + fill] = here;
+		} while (fill != 0);
+
+		/* Backwards increment the len-bit code huff */
+		incr = 1U << (len - 1);
+		while (huff & incr)
+			incr >>= 1;
+		if (incr != 0) {
+			huff &= incr - 1;
+			huff += incr;
+		} else {
+			huff = 0;
+		}
 
-			/* backwards increment the k-bit code i */
-			for (j = 1 << (k - 1); i & j; j >>= 1) {
-				i ^= j;
-			}
-			i ^= j;
+		/* Go to next symbol, update count, len */
+		sym++;
+		if (--(count[len]) == 0) {
+			if (len == max)
+				break;
+			len = lens[work[sym]];
+		}
 
-			/* backup over finished tables */
-			while ((i & ((1 << w) - 1)) != x[htl]) {
-				w = ws[--htl];
+		/* Create new sub-table if needed */
+		if (len > root && (huff & mask) != low) {
+			/* If first time, transition to sub-tables */
+			if (drop == 0)
+				drop = root;
+
+			/* Increment past last table */
+			next += min; /* here min is 1 << curr */
+
+			/* Determine length of next table */
+			curr = len - drop;
+			left = (int)(1 << curr);
+			while (curr + drop < max) {
+				left -= count[curr + drop];
+				if (left <= 0)
+					break;
+				curr++;
+				left <<= 1;
 			}
+
+			/* Check for enough space */
+			used += 1U << curr;
+			if ((type == LENS && used > ENOUGH_LENS) || (type == DISTS && used > ENOUGH_DISTS))
+				return 1;
+
+			/* Point entry in root table to sub-table */
+			low = huff & mask;
+			(*table)[low].op = (unsigned char)curr;
+			(*table)[low].bits = (unsigned char)root;
+			(*table)[low].val = (unsigned short)(next - *table);
 		}
 	}
 
-	/* return actual size of base table */
-	*m = ws[1];
+	/* Fill in the remaining entry of an incomplete code (this can only
+	 * happen for a single code of length 1) */
+	if (huff != 0) {
+		here.op = 64;
+		here.bits = (unsigned char)(len - drop);
+		here.val = 0;
+		next[huff] = here;
+	}
 
-	/* Return 1 if we were given an incomplete table */
-	return y != 0 && g != 1;
+	*table += used;
+	*bits = root;
+	return 0;
 }
 
 
 /*
- * inflate (decompress) the codes in a deflated (compressed) block.
- * Return an error code or zero if it all goes ok.
- *
- * tl, td: literal/length and distance decoder tables
- * bl, bd: number of bits decoded by tl[] and td[]
+ * Copy a match of length len from distance dist back, using 8-byte moves
+ * when the source and destination are at least that far apart. Writes up
+ * to 7 bytes past the end of the match, which must be room in the window.
  */
-/* called once from inflate_block */
-
-/* map formerly local static variables to globals */
-#define ml inflate_codes_ml
-#define md inflate_codes_md
-#define bb inflate_codes_bb
-#define k  inflate_codes_k
-#define w  inflate_codes_w
-#define tl inflate_codes_tl
-#define td inflate_codes_td
-#define bl inflate_codes_bl
-#define bd inflate_codes_bd
-#define nn inflate_codes_nn
-#define dd inflate_codes_dd
-static void inflate_codes_setup(STATE_PARAM unsigned my_bl, unsigned my_bd)
+static ALWAYS_INLINE void copy_match(unsigned char *dst, const unsigned char *src,
+			unsigned len, unsigned dist)
 {
-	bl = my_bl;
-	bd = my_bd;
-	/* make local copies of globals */
-	bb = gunzip_bb;			/* initialize bit buffer */
-	k = gunzip_bk;
-	w = gunzip_outbuf_count;	/* initialize gunzip_window position */
-	/* inflate the coded data */
-	ml = mask_bits[bl];		/* precompute masks for speed */
-	md = mask_bits[bd];
+	unsigned char *end = dst + len;
+
+	if (dist >= 8) {
+		do {
+			memcpy(dst, src, 8);
+			dst += 8;
+			src += 8;
+		} while (dst < end);
+	} else if (dist == 1) {
+		memset(dst, *src, len);
+	} else {
+		do {
+			*dst++ = *src++;
+		} while (dst < end);
+	}
 }
+
+/*
+ * inflate (decompress) the codes in a deflated (compressed) block, until
+ * the end of the block or until the window is full. Return 1 if the window
+ * is full, 0 at the end of block.
+ *
+ * While there is plenty of input and room in the window, symbols are decoded
+ * by a fast loop that refills the bit buffer 8 bytes at a time, which is
+ * always enough for a full length/distance pair. Near the end of either
+ * buffer it falls back to decoding one symbol at a time, byte by byte.
+ */
 /* called once from inflate_get_next_window */
 static NOINLINE int inflate_codes(STATE_PARAM_ONLY)
 {
-	unsigned e;	/* table entry flag/number of extra bits */
-	huft_t *t;	/* pointer to table entry */
+	unsigned char *const window = gunzip_window;
+	const code_t *const lcode = inflate_codes_lcode;
+	const code_t *const dcode = inflate_codes_dcode;
+	const unsigned lmask = (1U << inflate_codes_lbits) - 1;
+	const unsigned dmask = (1U << inflate_codes_dbits) - 1;
+	uint64_t bb = gunzip_bb;	/* bit buffer */
+	unsigned bk = gunzip_bk;	/* number of bits in bit buffer */
+	unsigned w = gunzip_outbuf_count;	/* current gunzip_window position */
+	unsigned op, len, dist;
+	code_t here, last;
+	int ret = 0;
 
 	if (resume_copy)
 		goto do_copy;
 
-	while (1) {			/* do until end of block */
-		bb = fill_bitbuffer(PASS_STATE bb, &k, bl);
-		t = tl + ((unsigned) bb & ml);
-		e = t->e;
-		if (e > 16)
-			do {
-				if (e == 99)
-					abort_unzip(PASS_STATE_ONLY);;
-				bb >>= t->b;
-				k -= t->b;
-				e -= 16;
-				bb = fill_bitbuffer(PASS_STATE bb, &k, e);
-				t = t->v.t + ((unsigned) bb & mask_bits[e]);
-				e = t->e;
-			} while (e > 16);
-		bb >>= t->b;
-		k -= t->b;
-		if (e == 16) {	/* then it's a literal */
-			gunzip_window[w++] = (unsigned char) t->v.n;
-			if (w == GUNZIP_WSIZE) {
-				gunzip_outbuf_count = w;
-				//flush_gunzip_window();
-				w = 0;
-				return 1; // We have a block to read
+	while (1) {
+		/* Fast loop. The guard must be strict, as a MAX_MATCH copy from
+		 * GUNZIP_WSIZE - MAX_MATCH would leave w at GUNZIP_WSIZE, and the
+		 * slow path only checks for a full window after writing */
+		while (bytebuffer_size - bytebuffer_offset >= 8 && w < GUNZIP_WSIZE - MAX_MATCH) {
+			REFILL();
+			here = lcode[bb & lmask];
+			if (here.op == 0) {
+				/* Literals are the most common case, and the bit
+				 * buffer holds enough bits for two of them */
+				DROPBITS(here.bits);
+				window[w++] = (unsigned char)here.val;
+				here = lcode[bb & lmask];
+				if (here.op == 0) {
+					DROPBITS(here.bits);
+					window[w++] = (unsigned char)here.val;
+				}
+				continue;
 			}
-		} else {		/* it's an EOB or a length */
-			/* exit if end of block */
-			if (e == 15) {
-				break;
+			if ((here.op & (16 | 64)) == 0) {
+				/* second level table */
+				op = here.op;
+				DROPBITS(here.bits);
+				here = lcode[here.val + BITS(op)];
+				if (here.op == 0) {
+					DROPBITS(here.bits);
+					window[w++] = (unsigned char)here.val;
+					continue;
+				}
 			}
-
-			/* get length of block to copy */
-			bb = fill_bitbuffer(PASS_STATE bb, &k, e);
-			nn = t->v.n + ((unsigned) bb & mask_bits[e]);
-			bb >>= e;
-			k -= e;
-
-			/* decode distance of block to copy */
-			bb = fill_bitbuffer(PASS_STATE bb, &k, bd);
-			t = td + ((unsigned) bb & md);
-			e = t->e;
-			if (e > 16)
-				do {
-					if (e == 99)
-						abort_unzip(PASS_STATE_ONLY);
-					bb >>= t->b;
-					k -= t->b;
-					e -= 16;
-					bb = fill_bitbuffer(PASS_STATE bb, &k, e);
-					t = t->v.t + ((unsigned) bb & mask_bits[e]);
-					e = t->e;
-				} while (e > 16);
-			bb >>= t->b;
-			k -= t->b;
-			bb = fill_bitbuffer(PASS_STATE bb, &k, e);
-			dd = w - t->v.n - ((unsigned) bb & mask_bits[e]);
-			bb >>= e;
-			k -= e;
-
-			/* do the copy */
- do_copy:
-			do {
-				/* Was: nn -= (e = (e = GUNZIP_WSIZE - ((dd &= GUNZIP_WSIZE - 1) > w ? dd : w)) > nn ? nn : e); */
-				/* Who wrote THAT?? rewritten as: */
-				unsigned delta;
-
-				dd &= GUNZIP_WSIZE - 1;
-				e = GUNZIP_WSIZE - (dd > w ? dd : w);
-				delta = w > dd ? w - dd : dd - w;
-				if (e > nn) e = nn;
-				nn -= e;
-
-				/* copy to new buffer to prevent possible overwrite */
-				if (delta >= e) {
-					memcpy(gunzip_window + w, gunzip_window + dd, e);
-					w += e;
-					dd += e;
+			op = here.op;
+			DROPBITS(here.bits);
+			if (!(op & 16)) {
+				if (op & 32)
+					goto end_of_block;
+				abort_unzip(PASS_STATE_ONLY); /* invalid code */
+			}
+			op &= 15;
+			len = here.val + BITS(op);
+			DROPBITS(op);
+
+			here = dcode[bb & dmask];
+			if ((here.op & (16 | 64)) == 0) {
+				op = here.op;
+				DROPBITS(here.bits);
+				here = dcode[here.val + BITS(op)];
+			}
+			op = here.op;
+			DROPBITS(here.bits);
+			if (!(op & 16))
+				abort_unzip(PASS_STATE_ONLY); /* invalid distance code */
+			op &= 15;
+			dist = here.val + BITS(op);
+			DROPBITS(op);
+
+			if (dist <= w) {
+				copy_match(&window[w], &window[w - dist], len, dist);
+			} else {
+				if (!window_wrapped)
+					abort_unzip(PASS_STATE_ONLY); /* distance too far back */
+				/* The match starts at the end of the window. Unless it
+				 * also crosses the window boundary, it is at least
+				 * GUNZIP_WSIZE - 32K bytes away from w, so cannot overlap */
+				if (dist - w >= len) {
+					copy_match(&window[w], &window[GUNZIP_WSIZE + w - dist], len, GUNZIP_WSIZE);
 				} else {
-					/* do it slow to avoid memcpy() overlap */
-					/* !NOMEMCPY */
-					do {
-						gunzip_window[w++] = gunzip_window[dd++];
-					} while (--e);
+					unsigned d = GUNZIP_WSIZE + w - dist;
+					unsigned i;
+					for (i = 0; i < len; i++)
+						window[w + i] = window[(d + i) & (GUNZIP_WSIZE - 1)];
 				}
-				if (w == GUNZIP_WSIZE) {
-					gunzip_outbuf_count = w;
-					resume_copy = (nn != 0);
-					//flush_gunzip_window();
-					w = 0;
-					return 1;
-				}
-			} while (nn);
-			resume_copy = 0;
+			}
+			w += len;
+		}
+
+		/* Slow path: decode a single symbol, reading input as needed */
+		while (1) {
+			here = lcode[BITS(inflate_codes_lbits)];
+			if (here.bits <= bk)
+				break;
+			PULLBYTE();
+		}
+		if (here.op != 0 && (here.op & (16 | 64)) == 0) {
+			last = here;
+			while (1) {
+				here = lcode[last.val + (BITS(last.bits + last.op) >> last.bits)];
+				if ((unsigned)(last.bits + here.bits) <= bk)
+					break;
+				PULLBYTE();
+			}
+			DROPBITS(last.bits);
+		}
+		DROPBITS(here.bits);
+		op = here.op;
+		if (op == 0) {	/* literal */
+			window[w++] = (unsigned char)here.val;
+			if (w == GUNZIP_WSIZE)
+				goto window_full;
+			continue;
 		}
+		if (!(op & 16)) {
+			if (op & 32)
+				goto end_of_block;
+			abort_unzip(PASS_STATE_ONLY); /* invalid code */
+		}
+		op &= 15;
+		NEEDBITS(op);
+		len = here.val + BITS(op);
+		DROPBITS(op);
+
+		while (1) {
+			here = dcode[BITS(inflate_codes_dbits)];
+			if (here.bits <= bk)
+				break;
+			PULLBYTE();
+		}
+		if ((here.op & (16 | 64)) == 0) {
+			last = here;
+			while (1) {
+				here = dcode[last.val + (BITS(last.bits + last.op) >> last.bits)];
+				if ((unsigned)(last.bits + here.bits) <= bk)
+					break;
+				PULLBYTE();
+			}
+			DROPBITS(last.bits);
+		}
+		DROPBITS(here.bits);
+		op = here.op;
+		if (!(op & 16))
+			abort_unzip(PASS_STATE_ONLY); /* invalid distance code */
+		op &= 15;
+		NEEDBITS(op);
+		dist = here.val + BITS(op);
+		DROPBITS(op);
+		if (dist > w && !window_wrapped)
+			abort_unzip(PASS_STATE_ONLY); /* distance too far back */
+
+		inflate_codes_nn = len;
+		inflate_codes_dd = w - dist;
+
+		/* do the copy, which may be interrupted by a full window */
+ do_copy:
+		do {
+			window[w++] = window[inflate_codes_dd++ & (GUNZIP_WSIZE - 1)];
+			if (w == GUNZIP_WSIZE) {
+				resume_copy = (--inflate_codes_nn != 0);
+				goto window_full;
+			}
+		} while (--inflate_codes_nn);
+		resume_copy = 0;
 	}
 
+ window_full:
+	window_wrapped = 1;
+	ret = 1;
+ end_of_block:
 	/* restore the globals from the locals */
-	gunzip_outbuf_count = w;	/* restore global gunzip_window pointer */
-	gunzip_bb = bb;			/* restore global bit buffer */
-	gunzip_bk = k;
+	gunzip_outbuf_count = w;
+	gunzip_bb = bb;
+	gunzip_bk = bk;
+	return ret;
+}
 
-	/* normally just after call to inflate_codes, but save code by putting it here */
-	/* free the decoding tables (tl and td), return */
-	huft_free_all(PASS_STATE_ONLY);
 
-	/* done */
-	return 0;
-}
-#undef ml
-#undef md
-#undef bb
-#undef k
-#undef w
-#undef tl
-#undef td
-#undef bl
-#undef bd
-#undef nn
-#undef dd
-
-
-/* called once from inflate_block */
-static void inflate_stored_setup(STATE_PARAM int my_n, int my_b, int my_k)
-{
-	inflate_stored_n = my_n;
-	inflate_stored_b = my_b;
-	inflate_stored_k = my_k;
-	/* initialize gunzip_window position */
-	inflate_stored_w = gunzip_outbuf_count;
-}
 /* called once from inflate_get_next_window */
 static int inflate_stored(STATE_PARAM_ONLY)
 {
-	/* read and output the compressed data */
-	while (inflate_stored_n--) {
-		inflate_stored_b = fill_bitbuffer(PASS_STATE inflate_stored_b, &inflate_stored_k, 8);
-		gunzip_window[inflate_stored_w++] = (unsigned char) inflate_stored_b;
-		if (inflate_stored_w == GUNZIP_WSIZE) {
-			gunzip_outbuf_count = inflate_stored_w;
-			//flush_gunzip_window();
-			inflate_stored_w = 0;
-			inflate_stored_b >>= 8;
-			inflate_stored_k -= 8;
-			return 1; /* We have a block */
-		}
-		inflate_stored_b >>= 8;
-		inflate_stored_k -= 8;
+	unsigned w = gunzip_outbuf_count;
+	unsigned n;
+
+	/* Whole bytes left in the bit buffer come first */
+	while (inflate_stored_n != 0 && gunzip_bk >= 8) {
+		gunzip_window[w++] = (unsigned char)gunzip_bb;
+		gunzip_bb >>= 8;
+		gunzip_bk -= 8;
+		inflate_stored_n--;
+		if (w == GUNZIP_WSIZE)
+			goto window_full;
+	}
+	/* Drop the lookahead above the valid bits, since the bytes it came
+	 * from are now read straight from bytebuffer */
+	gunzip_bb &= ((uint64_t)1 << gunzip_bk) - 1;
+
+	/* read and output the rest of the compressed data */
+	while (inflate_stored_n != 0) {
+		if (bytebuffer_offset >= bytebuffer_size)
+			refill_bytebuffer(PASS_STATE_ONLY);
+		n = MIN(inflate_stored_n, bytebuffer_size - bytebuffer_offset);
+		n = MIN(n, GUNZIP_WSIZE - w);
+		memcpy(&gunzip_window[w], &bytebuffer[bytebuffer_offset], n);
+		bytebuffer_offset += n;
+		inflate_stored_n -= n;
+		w += n;
+		if (w == GUNZIP_WSIZE)
+			goto window_full;
 	}
 
-	/* restore the globals from the locals */
-	gunzip_outbuf_count = inflate_stored_w;		/* restore global gunzip_window pointer */
-	gunzip_bb = inflate_stored_b;	/* restore global bit buffer */
-	gunzip_bk = inflate_stored_k;
+	gunzip_outbuf_count = w;	/* restore global gunzip_window pointer */
 	return 0; /* Finished */
+
+ window_full:
+	gunzip_outbuf_count = w;
+	window_wrapped = 1;
+	return 1; /* We have a block */
 }
 
 
 /*
  * decompress an inflated block
  * e: last block flag
- *
- * GLOBAL VARIABLES: bb, kk,
  */
 /* Return values: -1 = inflate_stored, -2 = inflate_codes */
 /* One callsite in inflate_get_next_window */
 static int inflate_block(STATE_PARAM smallint *e)
 {
-	unsigned ll[286 + 30];  /* literal/length and distance code lengths */
+	unsigned short ll[286 + 30];  /* literal/length and distance code lengths */
 	unsigned t;     /* block type */
-	unsigned b;     /* bit buffer */
-	unsigned k;     /* number of bits in bit buffer */
+	uint64_t bb;    /* bit buffer */
+	unsigned bk;    /* number of bits in bit buffer */
+	code_t *next;
 
 	/* make local bit buffer */
+	bb = gunzip_bb;
+	bk = gunzip_bk;
 
-	b = gunzip_bb;
-	k = gunzip_bk;
-
-	/* read in last block bit */
-	b = fill_bitbuffer(PASS_STATE b, &k, 1);
-	*e = b & 1;
-	b >>= 1;
-	k -= 1;
-
-	/* read in block type */
-	b = fill_bitbuffer(PASS_STATE b, &k, 2);
-	t = (unsigned) b & 3;
-	b >>= 2;
-	k -= 2;
-
-	/* restore the global bit buffer */
-	gunzip_bb = b;
-	gunzip_bk = k;
-
-	/* Do we see block type 1 often? Yes!
-	 * TODO: fix performance problem (see below) */
-	//bb_error_msg("blktype %d", t);
+	/* read in last block bit and block type */
+	NEEDBITS(3);
+	*e = BITS(1);
+	DROPBITS(1);
+	t = BITS(2);
+	DROPBITS(2);
 
-	/* inflate that block type */
 	switch (t) {
 	case 0: /* Inflate stored */
 	{
 		unsigned n;	/* number of bytes in block */
-		unsigned b_stored;	/* bit buffer */
-		unsigned k_stored;	/* number of bits in bit buffer */
-
-		/* make local copies of globals */
-		b_stored = gunzip_bb;	/* initialize bit buffer */
-		k_stored = gunzip_bk;
 
 		/* go to byte boundary */
-		n = k_stored & 7;
-		b_stored >>= n;
-		k_stored -= n;
+		n = bk & 7;
+		DROPBITS(n);
 
 		/* get the length and its complement */
-		b_stored = fill_bitbuffer(PASS_STATE b_stored, &k_stored, 16);
-		n = ((unsigned) b_stored & 0xffff);
-		b_stored >>= 16;
-		k_stored -= 16;
-
-		b_stored = fill_bitbuffer(PASS_STATE b_stored, &k_stored, 16);
-		if (n != (unsigned) ((~b_stored) & 0xffff)) {
+		NEEDBITS(32);
+		n = BITS(16);
+		DROPBITS(16);
+		if (n != (BITS(16) ^ 0xffff)) {
 			abort_unzip(PASS_STATE_ONLY);	/* error in compressed data */
 		}
-		b_stored >>= 16;
-		k_stored -= 16;
-
-		inflate_stored_setup(PASS_STATE n, b_stored, k_stored);
+		DROPBITS(16);
 
+		inflate_stored_n = n;
+		gunzip_bb = bb;
+		gunzip_bk = bk;
 		return -1;
 	}
-	case 1:
-	/* Inflate fixed
-	 * decompress an inflated type 1 (fixed Huffman codes) block. We should
-	 * either replace this with a custom decoder, or at least precompute the
-	 * Huffman tables. TODO */
+	case 1: /* Inflate fixed */
 	{
-		int i;                  /* temporary variable */
-		unsigned bl;            /* lookup bits for tl */
-		unsigned bd;            /* lookup bits for td */
-		/* gcc 4.2.1 is too dumb to reuse stackspace. Moved up... */
-		//unsigned ll[288];     /* length list for huft_build */
-
-		/* set up literal table */
-		for (i = 0; i < 144; i++)
-			ll[i] = 8;
-		for (; i < 256; i++)
-			ll[i] = 9;
-		for (; i < 280; i++)
-			ll[i] = 7;
-		for (; i < 288; i++) /* make a complete, but wrong code set */
-			ll[i] = 8;
-		bl = 7;
-		huft_build(ll, 288, 257, cplens, cplext, &inflate_codes_tl, &bl);
-		/* huft_build() never return nonzero - we use known data */
-
-		/* set up distance table */
-		for (i = 0; i < 30; i++) /* make an incomplete code set */
-			ll[i] = 5;
-		bd = 5;
-		huft_build(ll, 30, 0, cpdist, cpdext, &inflate_codes_td, &bd);
-
-		/* set up data for inflate_codes() */
-		inflate_codes_setup(PASS_STATE bl, bd);
-
-		/* huft_free code moved into inflate_codes */
+		unsigned i;
+
+		/* The fixed tables never change, so build them once */
+		if (!fixed_built) {
+			unsigned lbits = LBITS, dbits = 5;
+
+			for (i = 0; i < 144; i++)
+				ll[i] = 8;
+			for (; i < 256; i++)
+				ll[i] = 9;
+			for (; i < 280; i++)
+				ll[i] = 7;
+			for (; i < 288; i++) /* make a complete, but wrong code set */
+				ll[i] = 8;
+			next = fixed_codes;
+			inflate_table(LENS, ll, 288, &next, &lbits);
+			for (i = 0; i < 32; i++) /* codes 30 and 31 are invalid */
+				ll[i] = 5;
+			inflate_table(DISTS, ll, 32, &next, &dbits);
+			/* inflate_table() never fails here - we use known data */
+			fixed_built = 1;
+		}
+		inflate_codes_lcode = fixed_codes;
+		inflate_codes_lbits = LBITS;
+		inflate_codes_dcode = fixed_codes + 512;
+		inflate_codes_dbits = 5;
 
+		gunzip_bb = bb;
+		gunzip_bk = bk;
 		return -2;
 	}
 	case 2: /* Inflate dynamic */
 	{
-		enum { dbits = 6 };     /* bits in base distance lookup table */
-		enum { lbits = 9 };     /* bits in base literal/length lookup table */
-
-		huft_t *td;             /* distance code table */
 		unsigned i;             /* temporary variables */
 		unsigned j;
 		unsigned l;             /* last length */
-		unsigned m;             /* mask for bit lengths table */
 		unsigned n;             /* number of lengths to get */
-		unsigned bl;            /* lookup bits for tl */
-		unsigned bd;            /* lookup bits for td */
+		unsigned bl;            /* lookup bits for tables */
 		unsigned nb;            /* number of bit length codes */
 		unsigned nl;            /* number of literal/length codes */
 		unsigned nd;            /* number of distance codes */
-
-		//unsigned ll[286 + 30];/* literal/length and distance code lengths */
-		unsigned b_dynamic;     /* bit buffer */
-		unsigned k_dynamic;     /* number of bits in bit buffer */
-
-		/* make local bit buffer */
-		b_dynamic = gunzip_bb;
-		k_dynamic = gunzip_bk;
+		code_t here;
 
 		/* read in table lengths */
-		b_dynamic = fill_bitbuffer(PASS_STATE b_dynamic, &k_dynamic, 5);
-		nl = 257 + ((unsigned) b_dynamic & 0x1f);	/* number of literal/length codes */
-
-		b_dynamic >>= 5;
-		k_dynamic -= 5;
-		b_dynamic = fill_bitbuffer(PASS_STATE b_dynamic, &k_dynamic, 5);
-		nd = 1 + ((unsigned) b_dynamic & 0x1f);	/* number of distance codes */
-
-		b_dynamic >>= 5;
-		k_dynamic -= 5;
-		b_dynamic = fill_bitbuffer(PASS_STATE b_dynamic, &k_dynamic, 4);
-		nb = 4 + ((unsigned) b_dynamic & 0xf);	/* number of bit length codes */
-
-		b_dynamic >>= 4;
-		k_dynamic -= 4;
+		NEEDBITS(14);
+		nl = 257 + BITS(5);	/* number of literal/length codes */
+		DROPBITS(5);
+		nd = 1 + BITS(5);	/* number of distance codes */
+		DROPBITS(5);
+		nb = 4 + BITS(4);	/* number of bit length codes */
+		DROPBITS(4);
 		if (nl > 286 || nd > 30)
 			abort_unzip(PASS_STATE_ONLY);	/* bad lengths */
 
 		/* read in bit-length-code lengths */
 		for (j = 0; j < nb; j++) {
-			b_dynamic = fill_bitbuffer(PASS_STATE b_dynamic, &k_dynamic, 3);
-			ll[border[j]] = (unsigned) b_dynamic & 7;
-			b_dynamic >>= 3;
-			k_dynamic -= 3;
+			NEEDBITS(3);
+			ll[border[j]] = (unsigned short)BITS(3);
+			DROPBITS(3);
 		}
 		for (; j < 19; j++)
 			ll[border[j]] = 0;
 
 		/* build decoding table for trees - single level, 7 bit lookup */
+		next = codes;
 		bl = 7;
-		i = huft_build(ll, 19, 19, NULL, NULL, &inflate_codes_tl, &bl);
-		if (i != 0) {
-			abort_unzip(PASS_STATE_ONLY); //return i;	/* incomplete code set */
-		}
+		if (inflate_table(CODES, ll, 19, &next, &bl) != 0)
+			abort_unzip(PASS_STATE_ONLY);	/* incomplete code set */
 
 		/* read in literal and distance code lengths */
 		n = nl + nd;
-		m = mask_bits[bl];
 		i = l = 0;
-		while ((unsigned) i < n) {
-			b_dynamic = fill_bitbuffer(PASS_STATE b_dynamic, &k_dynamic, (unsigned)bl);
-			td = inflate_codes_tl + ((unsigned) b_dynamic & m);
-			j = td->b;
-			b_dynamic >>= j;
-			k_dynamic -= j;
-			j = td->v.n;
+		while (i < n) {
+			while (1) {
+				here = codes[BITS(bl)];
+				if (here.bits <= bk)
+					break;
+				PULLBYTE();
+			}
+			DROPBITS(here.bits);
+			j = here.val;
 			if (j < 16) {	/* length of code in bits (0..15) */
-				ll[i++] = l = j;	/* save last length in l */
-			} else if (j == 16) {	/* repeat last length 3 to 6 times */
-				b_dynamic = fill_bitbuffer(PASS_STATE b_dynamic, &k_dynamic, 2);
-				j = 3 + ((unsigned) b_dynamic & 3);
-				b_dynamic >>= 2;
-				k_dynamic -= 2;
-				if ((unsigned) i + j > n) {
-					abort_unzip(PASS_STATE_ONLY); //return 1;
-				}
-				while (j--) {
-					ll[i++] = l;
-				}
+				ll[i++] = (unsigned short)(l = j);	/* save last length in l */
+				continue;
+			}
+			if (j == 16) {	/* repeat last length 3 to 6 times */
+				NEEDBITS(2);
+				j = 3 + BITS(2);
+				DROPBITS(2);
 			} else if (j == 17) {	/* 3 to 10 zero length codes */
-				b_dynamic = fill_bitbuffer(PASS_STATE b_dynamic, &k_dynamic, 3);
-				j = 3 + ((unsigned) b_dynamic & 7);
-				b_dynamic >>= 3;
-				k_dynamic -= 3;
-				if ((unsigned) i + j > n) {
-					abort_unzip(PASS_STATE_ONLY); //return 1;
-				}
-				while (j--) {
-					ll[i++] = 0;
-				}
+				NEEDBITS(3);
+				j = 3 + BITS(3);
+				DROPBITS(3);
 				l = 0;
 			} else {	/* j == 18: 11 to 138 zero length codes */
-				b_dynamic = fill_bitbuffer(PASS_STATE b_dynamic, &k_dynamic, 7);
-				j = 11 + ((unsigned) b_dynamic & 0x7f);
-				b_dynamic >>= 7;
-				k_dynamic -= 7;
-				if ((unsigned) i + j > n) {
-					abort_unzip(PASS_STATE_ONLY); //return 1;
-				}
-				while (j--) {
-					ll[i++] = 0;
-				}
+				NEEDBITS(7);
+				j = 11 + BITS(7);
+				DROPBITS(7);
 				l = 0;
 			}
+			if (i + j > n)
+				abort_unzip(PASS_STATE_ONLY);
+			while (j--)
+				ll[i++] = (unsigned short)l;
 		}
 
-		/* free decoding table for trees */
-		huft_free(inflate_codes_tl);
-
-		/* restore the global bit buffer */
-		gunzip_bb = b_dynamic;
-		gunzip_bk = k_dynamic;
+		/* the end-of-block code must be present */
+		if (ll[256] == 0)
+			abort_unzip(PASS_STATE_ONLY);
 
 		/* build the decoding tables for literal/length and distance codes */
-		bl = lbits;
-
-		i = huft_build(ll, nl, 257, cplens, cplext, &inflate_codes_tl, &bl);
-		if (i != 0)
+		next = codes;
+		inflate_codes_lcode = next;
+		inflate_codes_lbits = LBITS;
+		if (inflate_table(LENS, ll, nl, &next, &inflate_codes_lbits) != 0)
 			abort_unzip(PASS_STATE_ONLY);
-		bd = dbits;
-		i = huft_build(ll + nl, nd, 0, cpdist, cpdext, &inflate_codes_td, &bd);
-		if (i != 0)
+		inflate_codes_dcode = next;
+		inflate_codes_dbits = DBITS;
+		if (inflate_table(DISTS, ll + nl, nd, &next, &inflate_codes_dbits) != 0)
 			abort_unzip(PASS_STATE_ONLY);
 
-		/* set up data for inflate_codes() */
-		inflate_codes_setup(PASS_STATE bl, bd);
-
-		/* huft_free code moved into inflate_codes */
-
+		gunzip_bb = bb;
+		gunzip_bk = bk;
 		return -2;
 	}
 	default:
@@ -943,6 +982,12 @@ static int inflate_get_next_window(STATE_PARAM_ONLY)
 				/* NB: need_another_block is still set */
 				return 0; /* Last block */
 			}
+			if (gunzip_src_fd < 0 && gunzip_bk == 0 && bytebuffer_offset == bytebuffer_size) {
+				/* In-memory input, which ended in between two blocks */
+				calculate_gunzip_crc(PASS_STATE_ONLY);
+				input_ended = 1;
+				return 0;
+			}
 			method = inflate_block(PASS_STATE &end_reached);
 			need_another_block = 0;
 		}
@@ -968,29 +1013,39 @@ static int inflate_get_next_window(STATE_PARAM_ONLY)
 }
 
 
-/* Called from unpack_gz_stream() and inflate_unzip() */
+static ssize_t gz_mt_write(STATE_PARAM const void *buf, size_t size);
+
+/* Called from unpack_gz_stream() and inflate_unzip(). The caller sets up
+ * gunzip_src_fd, gunzip_crc and gunzip_bytes_out */
 static IF_DESKTOP(long long) int
 inflate_unzip_internal(STATE_PARAM transformer_state_t *xstate)
 {
 	IF_DESKTOP(long long) int n = 0;
 	ssize_t nwrote;
+	unsigned i;
 
 	/* Allocate all global buffers (for DYN_ALLOC option) */
-	gunzip_window = xmalloc(GUNZIP_WSIZE);
+	gunzip_window = xmalloc(GUNZIP_WSIZE + GUNZIP_WSLACK);
 	gunzip_outbuf_count = 0;
-	gunzip_bytes_out = 0;
-	gunzip_src_fd = xstate->src_fd;
 
 	/* (re) initialize state */
 	method = -1;
 	need_another_block = 1;
 	resume_copy = 0;
+	window_wrapped = 0;
+	input_ended = 0;
 	gunzip_bk = 0;
 	gunzip_bb = 0;
 
+	/* Resume with the history of a member we started decoding elsewhere */
+	if (preset_dict_size != 0) {
+		memcpy(&gunzip_window[GUNZIP_WSIZE - preset_dict_size], preset_dict, preset_dict_size);
+		window_wrapped = 1;
+		preset_dict_size = 0;
+	}
+
 	/* Create the crc table */
 	gunzip_crc_table = crc32_filltable(NULL, 0);
-	gunzip_crc = ~0;
 
 	error_msg = "corrupted data";
 	if (setjmp(error_jmp)) {
@@ -1001,9 +1056,21 @@ inflate_unzip_internal(STATE_PARAM transformer_state_t *xstate)
 
 	while (1) {
 		int r = inflate_get_next_window(PASS_STATE_ONLY);
-		nwrote = transformer_write(xstate, gunzip_window, gunzip_outbuf_count);
-		if (nwrote != (ssize_t)gunzip_outbuf_count) {
-			huft_free_all(PASS_STATE_ONLY);
+		unsigned char *buf = gunzip_window;
+		unsigned count = gunzip_outbuf_count;
+
+		if (skip_out != 0) {
+			/* This was already written, before we fell back to serial decoding */
+			i = (unsigned)MIN(skip_out, (uint64_t)count);
+			skip_out -= i;
+			buf += i;
+			count -= i;
+		}
+		if (mt_slot != NULL)
+			nwrote = gz_mt_write(PASS_STATE buf, count);
+		else
+			nwrote = transformer_write(xstate, buf, count);
+		if (nwrote != (ssize_t)count) {
 			n = (nwrote <0)?nwrote:-1;
 			goto ret;
 		}
@@ -1012,11 +1079,14 @@ inflate_unzip_internal(STATE_PARAM transformer_state_t *xstate)
 	}
 
 	/* Store unused bytes in a global buffer so calling applets can access it */
-	if (gunzip_bk >= 8) {
-		/* Undo too much lookahead. The next read will be byte aligned
-		 * so we can discard unused bits in the last meaningful byte. */
-		bytebuffer_offset--;
-		bytebuffer[bytebuffer_offset] = gunzip_bb & 0xff;
+	/* Undo too much lookahead. The next read will be byte aligned
+	 * so we can discard unused bits in the last meaningful byte, and
+	 * put the whole bytes still in the bit buffer back into bytebuffer. */
+	gunzip_bb >>= gunzip_bk & 7;
+	gunzip_bk &= ~7;
+	bytebuffer_offset -= gunzip_bk >> 3;
+	for (i = bytebuffer_offset; gunzip_bk != 0; i++) {
+		bytebuffer[i] = (unsigned char)gunzip_bb;
 		gunzip_bb >>= 8;
 		gunzip_bk -= 8;
 	}
@@ -1042,8 +1112,11 @@ inflate_unzip(transformer_state_t *xstate)
 
 	to_read = xstate->bytes_in;
 //	bytebuffer_max = 0x8000;
-	bytebuffer_offset = 4;
+	bytebuffer_offset = BYTEBUFFER_UNWIND;
 	bytebuffer = xmalloc(bytebuffer_max);
+	gunzip_src_fd = xstate->src_fd;
+	gunzip_crc = ~0;
+	gunzip_bytes_out = 0;
 	n = inflate_unzip_internal(PASS_STATE xstate);
 	free(bytebuffer);
 
@@ -1064,6 +1137,9 @@ static int top_up(STATE_PARAM unsigned n)
 	int count = bytebuffer_size - bytebuffer_offset;
 
 	if (count < (int)n) {
+		/* In-memory input has nothing more to read */
+		if (gunzip_src_fd < 0)
+			return 0;
 		memmove(bytebuffer, &bytebuffer[bytebuffer_offset], count);
 		bytebuffer_offset = 0;
 		bytebuffer_size = full_read(gunzip_src_fd, &bytebuffer[count], bytebuffer_max - count);
@@ -1181,68 +1257,49 @@ static int check_header_gzip(STATE_PARAM transformer_state_t *xstate)
 	return 1;
 }
 
-IF_DESKTOP(long long) int FAST_FUNC
-unpack_gz_stream(transformer_state_t *xstate)
+/* Where unpack_gz_members() starts, in the stream */
+enum {
+	GZ_AT_HEADER,	/* right after the magic of a member */
+	GZ_AT_MAGIC,	/* right after the trailer of a member */
+	GZ_IN_MEMBER,	/* in between two blocks of a member, with the state set up to resume */
+};
+
+static IF_DESKTOP(long long) int
+unpack_gz_members(STATE_PARAM transformer_state_t *xstate, int where)
 {
 	uint32_t v32;
 	IF_DESKTOP(long long) int total, n;
-	DECLARE_STATE;
-
-#if !ENABLE_FEATURE_SEAMLESS_Z
-	if (check_signature16(xstate, GZIP_MAGIC))
-		return -1;
-#else
-	if (xstate->check_signature) {
-		uint16_t magic2;
-
-		if (full_read(xstate->src_fd, &magic2, 2) != 2) {
- bad_magic:
-			bb_error_msg("invalid magic");
-			return -1;
-		}
-		if (magic2 == COMPRESS_MAGIC) {
-			xstate->check_signature = 0;
-			return unpack_Z_stream(xstate);
-		}
-		if (magic2 != GZIP_MAGIC)
-			goto bad_magic;
-	}
-#endif
 
 	total = 0;
-
-	ALLOC_STATE;
-	to_read = -1;
-//	bytebuffer_max = 0x8000;
-	bytebuffer = xmalloc(bytebuffer_max);
-	gunzip_src_fd = xstate->src_fd;
+	if (where == GZ_IN_MEMBER)
+		goto inflate;
+	if (where == GZ_AT_MAGIC)
+		goto next_member;
 
  again:
 	if (!check_header_gzip(PASS_STATE xstate)) {
 		bb_error_msg("corrupted data");
-		total = -1;
-		goto ret;
+		return -1;
 	}
+	gunzip_crc = ~0;
+	gunzip_bytes_out = 0;
 
+ inflate:
 	n = inflate_unzip_internal(PASS_STATE xstate);
-	if (n < 0) {
-		total = (n == -ENOSPC)?xstate->mem_output_size_max:n;
-		goto ret;
-	}
+	if (n < 0)
+		return (n == -ENOSPC)?xstate->mem_output_size_max:n;
 	total += n;
 
 	if (!top_up(PASS_STATE 8)) {
 		bb_error_msg("corrupted data");
-		total = -1;
-		goto ret;
+		return -1;
 	}
 
 	/* Validate decompression - crc */
 	v32 = buffer_read_le_u32(PASS_STATE_ONLY);
 	if ((~gunzip_crc) != v32) {
 		bb_error_msg("crc error");
-		total = -1;
-		goto ret;
+		return -1;
 	}
 
 	/* Validate decompression - size */
@@ -1252,8 +1309,9 @@ unpack_gz_stream(transformer_state_t *xstate)
 		total = -1;
 	}
 
+ next_member:
 	if (!top_up(PASS_STATE 2))
-		goto ret; /* EOF */
+		return total; /* EOF */
 
 	if (bytebuffer[bytebuffer_offset] == 0x1f
 	 && bytebuffer[bytebuffer_offset + 1] == 0x8b
@@ -1263,8 +1321,659 @@ unpack_gz_stream(transformer_state_t *xstate)
 	}
 	/* GNU gzip says: */
 	/*bb_error_msg("decompression OK, trailing garbage ignored");*/
+	return total;
+}
+
+/*
+ * Multithreaded decoding of streams that are made of independently decodable parts: the
+ * members of concatenated streams (which includes BGZF blocks), and the blocks that
+ * 'pigz --independent' or 'gzip --rsyncable' end with a full flush marker.
+ * The input is split into chunks that start at one of these candidate boundaries, and a
+ * pool of worker threads decodes each chunk from scratch, with the decoded data written in
+ * order. Since a candidate may be a false positive, or be followed by data that refers to
+ * the previous block, a chunk only counts as valid if the chunk before it ended exactly at
+ * its start and it decoded without ever referring to data from before that start. It then
+ * is guaranteed to produce the same output as serial decoding. Anything else has us finish
+ * the stream serially, from the last point where we know the output to be good.
+ */
+#define GZ_MT_CHUNK_SIZE        (4 * 1024 * 1024)
+#define GZ_MT_MAX_CHUNK_SIZE    (32 * 1024 * 1024)
+#define GZ_MT_READ_SIZE         (1024 * 1024)
+#define GZ_MT_PROBE_SIZE        (2 * GZ_MT_READ_SIZE)	/* the size of the carry buffer */
+#define GZ_MT_DICT_SIZE         (32 * 1024)
+
+/* How a chunk starts: with a member header, or with a deflate block inside a member */
+enum {
+	GZ_MT_MEMBER,
+	GZ_MT_BLOCK,
+};
+
+/* How a chunk ends */
+enum {
+	GZ_MT_PENDING,
+	GZ_MT_END_MEMBER,	/* right after a member trailer */
+	GZ_MT_END_BLOCK,	/* in between two blocks of a member */
+	GZ_MT_END_STREAM,	/* at the end of the gzip data */
+	GZ_MT_FAILED,
+};
+
+/* Decoded data, that follows the structure */
+struct gz_mt_piece {
+	struct gz_mt_piece *next;
+	size_t size;
+	bool head;	/* belongs to a member that started before the chunk */
+};
+
+struct gz_mt_slot {
+	/* Compressed chunk, after BYTEBUFFER_UNWIND free bytes */
+	uint8_t *in;
+	size_t in_size;
+	size_t in_max;
+	int64_t offset;
+	int start;
+	bool last;
+	/* Queue of decoded pieces */
+	CRITICAL_SECTION lock;
+	struct gz_mt_piece *queue;
+	struct gz_mt_piece *queue_end;
+	uint32_t num_pieces;
+	HANDLE data;
+	HANDLE space;
+	/* Results, that are valid once end is set */
+	volatile int end;
+	bool head_ended;		/* a member that started before the chunk ended in it */
+	uint32_t head_crc;		/* and its expected CRC and size */
+	uint32_t head_size;
+	uint32_t tail_crc;		/* running CRC and size of a member that goes on after the chunk */
+	off_t tail_size;
+};
+
+struct gz_mt {
+	struct bled_mt pool;
+	struct gz_mt_slot *slot;
+	uint32_t max_pieces;
+	/* Input splitting, done by the main thread */
+	uint8_t *carry;
+	size_t carry_size;
+	int64_t in_offset;
+	int in_start;
+	int64_t bgzf_next;
+	/* Last decoded bytes, for serial decoding to resume from */
+	uint8_t dict[GZ_MT_DICT_SIZE];
+	size_t dict_size;
+};
+
+/* Called by inflate_unzip_internal() to queue decoded data */
+static ssize_t gz_mt_write(STATE_PARAM const void *buf, size_t size)
+{
+	struct gz_mt_piece *piece;
+
+	if (size == 0)
+		return 0;
+	piece = malloc(sizeof(struct gz_mt_piece) + size);
+	if (piece == NULL)
+		return -1;
+	piece->next = NULL;
+	piece->size = size;
+	piece->head = mt_head;
+	memcpy(&piece[1], buf, size);
+
+	/* Only keep so many pieces around, so that we don't run ahead of the writer */
+	EnterCriticalSection(&mt_slot->lock);
+	while ((mt_slot->num_pieces >= mt_ctx->max_pieces) && !mt_ctx->pool.quit) {
+		LeaveCriticalSection(&mt_slot->lock);
+		WaitForSingleObject(mt_slot->space, INFINITE);
+		EnterCriticalSection(&mt_slot->lock);
+	}
+	if (mt_ctx->pool.quit) {
+		LeaveCriticalSection(&mt_slot->lock);
+		free(piece);
+		return -1;
+	}
+	if (mt_slot->queue == NULL)
+		mt_slot->queue = piece;
+	else
+		mt_slot->queue_end->next = piece;
+	mt_slot->queue_end = piece;
+	mt_slot->num_pieces++;
+	LeaveCriticalSection(&mt_slot->lock);
+	SetEvent(mt_slot->data);
+	return size;
+}
+
+/* Decode a chunk, with the whole input in memory, and return how it ends */
+static int gz_mt_decode(struct gz_mt *mt, struct gz_mt_slot *slot)
+{
+	transformer_state_t xstate = { 0 };
+	int end = GZ_MT_FAILED;
+	bool in_member = (slot->start == GZ_MT_BLOCK);
+	uint32_t v32;
+	DECLARE_STATE;
+
+	ALLOC_STATE;
+	if (state == NULL)
+		return GZ_MT_FAILED;
+	gunzip_src_fd = -1;
+	to_read = -1;
+	bytebuffer = slot->in;
+	bytebuffer_offset = BYTEBUFFER_UNWIND;
+	bytebuffer_size = BYTEBUFFER_UNWIND + (unsigned)slot->in_size;
+	mt_ctx = mt;
+	mt_slot = slot;
+	mt_head = in_member;
+	gunzip_crc = ~0;
+	gunzip_bytes_out = 0;
+
+	while (1) {
+		if (!in_member) {
+			/* Same as the end of unpack_gz_members() */
+			if (bytebuffer_offset == bytebuffer_size) {
+				end = slot->last ? GZ_MT_END_STREAM : GZ_MT_END_MEMBER;
+				break;
+			}
+			if (!top_up(PASS_STATE 2)) {
+				if (slot->last)
+					end = GZ_MT_END_STREAM;
+				break;
+			}
+			if (bytebuffer[bytebuffer_offset] != 0x1f || bytebuffer[bytebuffer_offset + 1] != 0x8b) {
+				end = GZ_MT_END_STREAM;
+				break;
+			}
+			bytebuffer_offset += 2;
+			if (!check_header_gzip(PASS_STATE &xstate))
+				break;
+			gunzip_crc = ~0;
+			gunzip_bytes_out = 0;
+			in_member = true;
+		}
+		if (inflate_unzip_internal(PASS_STATE &xstate) < 0)
+			break;
+		if (input_ended) {
+			if (!slot->last) {
+				end = GZ_MT_END_BLOCK;
+				slot->tail_crc = gunzip_crc;
+				slot->tail_size = gunzip_bytes_out;
+			}
+			break;
+		}
+		if (!top_up(PASS_STATE 8))
+			break;
+		if (mt_head) {
+			/* We only have the end of that member, so the writer checks it */
+			slot->head_ended = true;
+			slot->head_crc = buffer_read_le_u32(PASS_STATE_ONLY);
+			slot->head_size = buffer_read_le_u32(PASS_STATE_ONLY);
+			mt_head = 0;
+		} else {
+			if ((~gunzip_crc) != buffer_read_le_u32(PASS_STATE_ONLY))
+				break;
+			v32 = buffer_read_le_u32(PASS_STATE_ONLY);
+			if ((uint32_t)gunzip_bytes_out != v32)
+				break;
+		}
+		in_member = false;
+	}
+	DEALLOC_STATE;
+	return end;
+}
+
+static void gz_mt_decode_slot(void *ctx, void *worker, uint32_t index)
+{
+	struct gz_mt *mt = (struct gz_mt *)ctx;
+	struct gz_mt_slot *slot = &mt->slot[index];
+	int end;
+
+	end = gz_mt_decode(mt, slot);
+	EnterCriticalSection(&slot->lock);
+	slot->end = end;
+	LeaveCriticalSection(&slot->lock);
+	SetEvent(slot->data);
+}
+
+/* Wake the workers that wait for the writer to make space in their queue */
+static void gz_mt_wake(void *ctx)
+{
+	struct gz_mt *mt = (struct gz_mt *)ctx;
+	uint32_t i;
+
+	for (i = 0; i < mt->pool.num_slots; i++)
+		SetEvent(mt->slot[i].space);
+}
+
+/* Return the size of the BGZF block at p, 0 if it isn't one, or -1 if we need more data */
+static int64_t gz_mt_bgzf_size(const uint8_t *p, size_t avail)
+{
+	size_t xlen, i;
+
+	if (avail < 12)
+		return -1;
+	if (p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || !(p[3] & 0x04))
+		return 0;
+	xlen = get_le16(&p[10]);
+	if (avail < 12 + xlen)
+		return -1;
+	for (i = 12; i + 4 <= 12 + xlen; i += 4 + get_le16(&p[i + 2])) {
+		if (p[i] == 'B' && p[i + 1] == 'C' && get_le16(&p[i + 2]) == 2 && i + 6 <= 12 + xlen)
+			return (int64_t)get_le16(&p[i + 4]) + 1;
+	}
+	return 0;
+}
+
+/*
+ * Read the next chunk into slot, starting with what was left over from the previous one,
+ * and up to the first boundary past GZ_MT_CHUNK_SIZE. BGZF blocks are followed through
+ * their sizes, and otherwise we look for a member header or a full flush marker. Returns
+ * false if there is no boundary within GZ_MT_MAX_CHUNK_SIZE, or on read error.
+ */
+static bool gz_mt_read_chunk(struct gz_mt *mt, int fd, struct gz_mt_slot *slot)
+{
+	uint8_t *buf;
+	size_t len, lo = 1, p;
+	int64_t size;
+	int rb, start = GZ_MT_MEMBER;
+
+	slot->offset = mt->in_offset;
+	slot->start = mt->in_start;
+	slot->last = false;
+	if (slot->in_max < BYTEBUFFER_UNWIND + GZ_MT_CHUNK_SIZE + 2 * GZ_MT_READ_SIZE) {
+		slot->in_max = BYTEBUFFER_UNWIND + GZ_MT_CHUNK_SIZE + 2 * GZ_MT_READ_SIZE;
+		slot->in = xrealloc(slot->in, slot->in_max);
+		if (slot->in == NULL)
+			return false;
+	}
+	buf = &slot->in[BYTEBUFFER_UNWIND];
+	memcpy(buf, mt->carry, mt->carry_size);
+	len = mt->carry_size;
+
+	while (1) {
+		/* Follow BGZF blocks, for as long as they are */
+		while (mt->bgzf_next >= 0 && mt->bgzf_next < slot->offset + (int64_t)len) {
+			p = (size_t)(mt->bgzf_next - slot->offset);
+			if (p >= GZ_MT_CHUNK_SIZE)
+				goto found;
+			size = gz_mt_bgzf_size(&buf[p], len - p);
+			if (size < 0)
+				break;
+			if (size == 0)
+				mt->bgzf_next = -1;
+			else
+				mt->bgzf_next += size;
+		}
+		if (mt->bgzf_next < 0 && len >= GZ_MT_CHUNK_SIZE + 4) {
+			for (p = MAX(lo, GZ_MT_CHUNK_SIZE); p + 4 <= len; p++) {
+				if (buf[p] == 0x1f && buf[p + 1] == 0x8b && buf[p + 2] == 8 && (buf[p + 3] & 0xe0) == 0)
+					goto found;
+				if (get_le32(&buf[p - 4]) == 0xffff0000) {
+					start = GZ_MT_BLOCK;
+					goto found;
+				}
+			}
+			lo = p;
+		}
+		if (len >= GZ_MT_MAX_CHUNK_SIZE)
+			return false;
+		if (BYTEBUFFER_UNWIND + len + GZ_MT_READ_SIZE > slot->in_max) {
+			slot->in_max += 4 * GZ_MT_READ_SIZE;
+			slot->in = xrealloc(slot->in, slot->in_max);
+			if (slot->in == NULL)
+				return false;
+			buf = &slot->in[BYTEBUFFER_UNWIND];
+		}
+		rb = full_read(fd, &buf[len], GZ_MT_READ_SIZE);
+		if (rb < 0)
+			return false;
+		if (rb == 0) {
+			slot->in_size = len;
+			slot->last = true;
+			mt->carry_size = 0;
+			return true;
+		}
+		len += rb;
+	}
+
+ found:
+	slot->in_size = p;
+	mt->carry_size = len - p;
+	memcpy(mt->carry, &buf[p], mt->carry_size);
+	mt->in_offset = slot->offset + p;
+	mt->in_start = start;
+	return true;
+}
+
+/*
+ * Read the start of the stream into the carry buffer, and check that it has a candidate
+ * boundary. Most gzip images are a single member without flush markers, and finding that
+ * out from gz_mt_read_chunk() would mean reading up to GZ_MT_MAX_CHUNK_SIZE, which the
+ * regular decoder then has to read again.
+ */
+static bool gz_mt_probe(struct gz_mt *mt, int fd)
+{
+	size_t len, p;
+	int rb;
+
+	for (len = 0; len < GZ_MT_PROBE_SIZE; len += rb) {
+		rb = full_read(fd, &mt->carry[len], (unsigned)(GZ_MT_PROBE_SIZE - len));
+		if (rb <= 0)
+			return false;
+	}
+	mt->carry_size = len;
+	if (gz_mt_bgzf_size(mt->carry, len) > 0)
+		return true;
+	for (p = 4; p + 4 <= len; p++) {
+		if (mt->carry[p] == 0x1f && mt->carry[p + 1] == 0x8b && mt->carry[p + 2] == 8 && (mt->carry[p + 3] & 0xe0) == 0)
+			return true;
+		if (get_le32(&mt->carry[p - 4]) == 0xffff0000)
+			return true;
+	}
+	return false;
+}
+
+/* Keep the last GZ_MT_DICT_SIZE bytes written */
+static void gz_mt_update_dict(struct gz_mt *mt, const uint8_t *buf, size_t size)
+{
+	size_t keep;
+
+	if (size >= GZ_MT_DICT_SIZE) {
+		memcpy(mt->dict, &buf[size - GZ_MT_DICT_SIZE], GZ_MT_DICT_SIZE);
+		mt->dict_size = GZ_MT_DICT_SIZE;
+		return;
+	}
+	keep = MIN(mt->dict_size, GZ_MT_DICT_SIZE - size);
+	memmove(mt->dict, &mt->dict[mt->dict_size - keep], keep);
+	memcpy(&mt->dict[keep], buf, size);
+	mt->dict_size = keep + size;
+}
+
+/*
+ * Decode the rest of the stream serially, from the start of a chunk, where we either are
+ * in between two members or resume a member with the given history, CRC and size. The
+ * first skip bytes of output were already written.
+ */
+static IF_DESKTOP(long long) int gz_mt_fallback(transformer_state_t *xstate, int64_t offset,
+	bool in_member, const uint8_t *dict, size_t dict_size, uint32_t crc, off_t size, uint64_t skip)
+{
+	IF_DESKTOP(long long) int n;
+	int64_t pos;
+	DECLARE_STATE;
+
+	pos = _lseeki64(xstate->src_fd, 0, SEEK_CUR);
+	if (pos < 0 || _lseeki64(xstate->src_fd, offset, SEEK_SET) != offset) {
+		bb_error_msg("seek error (errno: %d)", errno);
+		return -1;
+	}
+	/* Don't count the data we read again towards progress */
+	bb_total_rb -= pos - offset;
+
+	ALLOC_STATE;
+	to_read = -1;
+	bytebuffer = xmalloc(bytebuffer_max);
+	bytebuffer_offset = 0;
+	bytebuffer_size = 0;
+	gunzip_src_fd = xstate->src_fd;
+	skip_out = skip;
+	if (in_member) {
+		preset_dict = dict;
+		preset_dict_size = (unsigned)MIN(dict_size, (size_t)size);
+		gunzip_crc = crc;
+		gunzip_bytes_out = size;
+	}
+	n = unpack_gz_members(PASS_STATE xstate, in_member ? GZ_IN_MEMBER : GZ_AT_MAGIC);
+	free(bytebuffer);
+	DEALLOC_STATE;
+	return n;
+}
+
+/* Returns false if the stream should be decoded with the regular decoder, or true and the result in *n */
+static bool unpack_gz_stream_mt(transformer_state_t *xstate, IF_DESKTOP(long long) int *n)
+{
+	bool r = false, stopped = false, in_member = false, bad_length = false;
+	struct gz_mt mt = { 0 };
+	struct gz_mt_slot *slot;
+	struct gz_mt_piece *piece;
+	int64_t start, end, resume_offset;
+	uint32_t i, next_read, next_write, *crc_table = NULL;
+	uint32_t crc = ~0, chunk_crc;
+	uint64_t total_rb;
+	off_t size = 0, chunk_size;
+	uint64_t chunk_written;
+	uint8_t *chunk_dict = NULL;
+	size_t chunk_dict_size;
+	int prev_end = GZ_MT_END_MEMBER, chunk_end;
+	ssize_t nwrote;
+
+	/* We need to seek the source, and only bother with output to a file */
+	if ((xstate->src_fd == bb_virtual_fd) || (bled_read != NULL) || (xstate->mem_output_size_max != 0))
+		return false;
+	/* The magic was already read */
+	total_rb = bb_total_rb;
+	start = _lseeki64(xstate->src_fd, 0, SEEK_CUR) - 2;
+	end = _lseeki64(xstate->src_fd, 0, SEEK_END);
+	if ((start < 0) || (end < start + 2 * GZ_MT_CHUNK_SIZE))
+		goto fallback;
+
+	/* A slot holds a chunk, along with at least 4 pieces of decoded data */
+	if (!bled_mt_init(&mt.pool, UINT32_MAX, BYTEBUFFER_UNWIND + GZ_MT_CHUNK_SIZE + 2 * GZ_MT_READ_SIZE + 4 * GUNZIP_WSIZE))
+		goto fallback;
+	mt.pool.decode = gz_mt_decode_slot;
+	mt.pool.wake = gz_mt_wake;
+	/* Use whatever is left of our memory budget to let the workers decode ahead */
+	mt.max_pieces = (uint32_t)MAX(4, (mt.pool.budget / mt.pool.num_slots - GZ_MT_CHUNK_SIZE - 2 * GZ_MT_READ_SIZE) / GUNZIP_WSIZE);
+	mt.slot = calloc(mt.pool.num_slots, sizeof(struct gz_mt_slot));
+	mt.carry = malloc(GZ_MT_PROBE_SIZE);
+	chunk_dict = malloc(GZ_MT_DICT_SIZE);
+	if ((mt.slot == NULL) || (mt.carry == NULL) || (chunk_dict == NULL))
+		goto fallback;
+	for (i = 0; i < mt.pool.num_slots; i++) {
+		InitializeCriticalSection(&mt.slot[i].lock);
+		mt.slot[i].data = CreateEvent(NULL, FALSE, FALSE, NULL);
+		mt.slot[i].space = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if ((mt.slot[i].data == NULL) || (mt.slot[i].space == NULL))
+			goto fallback;
+	}
+
+	/* Only go multithreaded if the first chunk ends on a boundary */
+	mt.in_offset = start;
+	mt.in_start = GZ_MT_MEMBER;
+	mt.bgzf_next = start;
+	if (_lseeki64(xstate->src_fd, start, SEEK_SET) != start)
+		goto fallback;
+	bb_total_rb -= 2;
+	if (!gz_mt_probe(&mt, xstate->src_fd) || !gz_mt_read_chunk(&mt, xstate->src_fd, &mt.slot[0]) ||
+		mt.slot[0].last)
+		goto fallback;
+
+	/* From this stage on, we are committed to multithreaded decoding */
+	r = true;
+	*n = 0;
+	crc_table = crc32_filltable(NULL, 0);
+	if (!bled_mt_start(&mt.pool, &mt))
+		bb_error_msg_and_err("could not create decoder thread");
+	bb_printf("Decoding gzip %s using %d threads", (mt.bgzf_next >= 0) ? "BGZF blocks" : "chunks", mt.pool.num_threads);
+	bled_mt_post(&mt.pool);
+
+	for (next_read = 1, next_write = 0; next_write < next_read; next_write++) {
+		/* Queue as many chunks as we have free slots */
+		for (; !stopped && (next_read - next_write < mt.pool.num_slots); next_read++) {
+			slot = &mt.slot[next_read % mt.pool.num_slots];
+			slot->end = GZ_MT_PENDING;
+			slot->head_ended = false;
+			if (!gz_mt_read_chunk(&mt, xstate->src_fd, slot)) {
+				stopped = true;
+				break;
+			}
+			stopped = slot->last;
+			bled_mt_post(&mt.pool);
+		}
+
+		/* A chunk is only valid if the previous one ended where it assumed it starts */
+		slot = &mt.slot[next_write % mt.pool.num_slots];
+		in_member = (prev_end == GZ_MT_END_BLOCK);
+		if (in_member != (slot->start == GZ_MT_BLOCK))
+			goto resume;
+
+		/* Write the chunk, as it gets decoded */
+		chunk_crc = crc;
+		chunk_size = size;
+		chunk_written = 0;
+		memcpy(chunk_dict, mt.dict, mt.dict_size);
+		chunk_dict_size = mt.dict_size;
+		while (1) {
+			EnterCriticalSection(&slot->lock);
+			piece = slot->queue;
+			if (piece != NULL) {
+				slot->queue = piece->next;
+				slot->num_pieces--;
+			}
+			chunk_end = slot->end;
+			LeaveCriticalSection(&slot->lock);
+			if (piece == NULL) {
+				if (chunk_end != GZ_MT_PENDING)
+					break;
+				WaitForSingleObject(slot->data, INFINITE);
+				continue;
+			}
+			SetEvent(slot->space);
+			nwrote = transformer_write(xstate, &piece[1], piece->size);
+			if (nwrote != (ssize_t)piece->size) {
+				free(piece);
+				*n = (nwrote < 0) ? nwrote : -1;
+				goto out;
+			}
+			*n += nwrote;
+			chunk_written += nwrote;
+			if (piece->head) {
+				crc = crc32_block_endian0(crc, (uint8_t *)&piece[1], piece->size, crc_table);
+				size += (off_t)piece->size;
+			}
+			gz_mt_update_dict(&mt, (uint8_t *)&piece[1], piece->size);
+			free(piece);
+		}
+		if (chunk_end == GZ_MT_FAILED) {
+			/* Redo that chunk serially, to find out if it really is corrupted */
+			resume_offset = slot->offset;
+			goto fallback_chunk;
+		}
+		if (slot->head_ended) {
+			/* Check the member that started before this chunk */
+			if ((~crc) != slot->head_crc) {
+				bb_error_msg("crc error");
+				*n = -1;
+				goto out;
+			}
+			if ((uint32_t)size != slot->head_size) {
+				bb_error_msg("incorrect length");
+				bad_length = true;
+			}
+		}
+		if (chunk_end == GZ_MT_END_STREAM)
+			goto out;
+		if ((chunk_end == GZ_MT_END_BLOCK) && (!in_member || slot->head_ended)) {
+			crc = slot->tail_crc;
+			size = slot->tail_size;
+		}
+		prev_end = chunk_end;
+	}
+	/* We stopped splitting the input, or a chunk started where we didn't expect it */
+	in_member = (prev_end == GZ_MT_END_BLOCK);
+	slot = &mt.slot[next_write % mt.pool.num_slots];
+
+ resume:
+	resume_offset = slot->offset;
+	chunk_crc = crc;
+	chunk_size = size;
+	chunk_written = 0;
+	memcpy(chunk_dict, mt.dict, mt.dict_size);
+	chunk_dict_size = mt.dict_size;
+
+ fallback_chunk:
+	/* Stop the workers before we use the source */
+	bled_mt_stop(&mt.pool);
+	nwrote = gz_mt_fallback(xstate, resume_offset, in_member, chunk_dict, chunk_dict_size,
+		chunk_crc, chunk_size, chunk_written);
+	*n = (nwrote < 0) ? nwrote : *n + nwrote;
+	goto out;
+
+err:
+	*n = -1;
+	goto out;
+
+fallback:
+	/* Rewind, so that the regular decoder can process the stream */
+	if (start >= 0) {
+		if (_lseeki64(xstate->src_fd, start + 2, SEEK_SET) != start + 2) {
+			*n = -1;
+			r = true;
+		}
+		bb_total_rb = total_rb;
+	}
+
+out:
+	/* Like the regular decoder, we carry on after a length mismatch, but report an error */
+	if (bad_length && (*n >= 0))
+		*n = -1;
+	bled_mt_free(&mt.pool);
+	if (mt.slot != NULL) {
+		for (i = 0; i < mt.pool.num_slots; i++) {
+			while (mt.slot[i].queue != NULL) {
+				piece = mt.slot[i].queue;
+				mt.slot[i].queue = piece->next;
+				free(piece);
+			}
+			free(mt.slot[i].in);
+			if (mt.slot[i].data != NULL) {
+				DeleteCriticalSection(&mt.slot[i].lock);
+				CloseHandle(mt.slot[i].data);
+			}
+			if (mt.slot[i].space != NULL)
+				CloseHandle(mt.slot[i].space);
+		}
+		free(mt.slot);
+	}
+	free(mt.carry);
+	free(chunk_dict);
+	free(crc_table);
+	return r;
+}
+
+IF_DESKTOP(long long) int FAST_FUNC
+unpack_gz_stream(transformer_state_t *xstate)
+{
+	IF_DESKTOP(long long) int total;
+	DECLARE_STATE;
+
+#if !ENABLE_FEATURE_SEAMLESS_Z
+	if (check_signature16(xstate, GZIP_MAGIC))
+		return -1;
+#else
+	if (xstate->check_signature) {
+		uint16_t magic2;
+
+		if (full_read(xstate->src_fd, &magic2, 2) != 2) {
+ bad_magic:
+			bb_error_msg("invalid magic");
+			return -1;
+		}
+		if (magic2 == COMPRESS_MAGIC) {
+			xstate->check_signature = 0;
+			return unpack_Z_stream(xstate);
+		}
+		if (magic2 != GZIP_MAGIC)
+			goto bad_magic;
+	}
+#endif
+
+	if (unpack_gz_stream_mt(xstate, &total))
+		return total;
+
+	ALLOC_STATE;
+	to_read = -1;
+//	bytebuffer_max = 0x8000;
+	bytebuffer = xmalloc(bytebuffer_max);
+	gunzip_src_fd = xstate->src_fd;
+
+	total = unpack_gz_members(PASS_STATE xstate, GZ_AT_HEADER);
 
- ret:
 	free(bytebuffer);
 	DEALLOC_STATE;
 	return total;
@@ -0,0 +1,118 @@
+/*
+ * Worker pool for the multithreaded decoders of Bled
+ *
+ * Copyright © 2025 Pete Batard <pete@akeo.ie>
+ *
+ * Licensed under GPLv2 or later, see file LICENSE in this source tree.
+ */
+
+#include "libbb.h"
+#include "bb_archive.h"
+
+/*
+ * The gzip, bzip2 and xz decoders all split their input into independent jobs, that
+ * they place into a ring of slots, for a pool of worker threads to decode, while they
+ * write the decoded slots in order. Since the ring holds num_slots jobs at most, with
+ * one worker per job, a worker that is woken up always has its job ready in the slot
+ * that follows the one the previous worker took.
+ *
+ * All the data these decoders keep in flight must fit in the same memory budget, which
+ * we cap to a quarter of the physical memory.
+ */
+#define BLED_MT_MAX_MEMORY      ((sizeof(size_t) > 4) ? (2048ULL * 1024 * 1024) : (512ULL * 1024 * 1024))
+
+static DWORD WINAPI bled_mt_worker(void *param)
+{
+	struct bled_mt *mt = (struct bled_mt *)param;
+	void *worker = (mt->worker_init != NULL) ? mt->worker_init(mt->ctx) : NULL;
+	uint32_t job;
+
+	while ((WaitForSingleObject(mt->work, INFINITE) == WAIT_OBJECT_0) && !mt->quit) {
+		/* Jobs are queued in order, so the job we get is always available */
+		job = (uint32_t)(InterlockedIncrement(&mt->next_job) - 1);
+		mt->decode(mt->ctx, worker, job % mt->num_slots);
+	}
+	if (mt->worker_free != NULL)
+		mt->worker_free(worker);
+	return 0;
+}
+
+/* How much memory all the slots, and the workers, may use */
+uint64_t FAST_FUNC bled_mt_memory(void)
+{
+	MEMORYSTATUSEX ms = { 0 };
+
+	ms.dwLength = sizeof(ms);
+	if (!GlobalMemoryStatusEx(&ms))
+		return BLED_MT_MAX_MEMORY / 4;
+	return MIN(BLED_MT_MAX_MEMORY, ms.ullTotalPhys / 4);
+}
+
+/*
+ * Size the pool for at most max_jobs jobs in flight, with slot_memory bytes for each slot and
+ * its worker, and set num_threads and num_slots. Returns false if there wouldn't be at least
+ * two workers, or if the pool couldn't be set up, in which case the regular decoder is to be
+ * used. The decoder must set decode, and can set worker_init/worker_free and wake, before
+ * calling bled_mt_start().
+ */
+bool FAST_FUNC bled_mt_init(struct bled_mt *mt, uint64_t max_jobs, uint64_t slot_memory)
+{
+	SYSTEM_INFO si;
+	uint64_t max_slots;
+
+	memset(mt, 0, sizeof(*mt));
+	mt->budget = bled_mt_memory();
+	GetSystemInfo(&si);
+	mt->num_threads = (uint32_t)MIN(MIN(si.dwNumberOfProcessors, BLED_MT_MAX_THREADS), max_jobs);
+	/* Keep enough jobs in flight to feed our threads, within our memory limit */
+	max_slots = mt->budget / MAX(slot_memory, 1);
+	mt->num_slots = (uint32_t)MIN(mt->num_threads + 2, max_slots);
+	mt->num_threads = MIN(mt->num_threads, mt->num_slots);
+	if (mt->num_threads < 2)
+		return false;
+	mt->work = CreateSemaphore(NULL, 0, mt->num_slots + mt->num_threads, NULL);
+	return (mt->work != NULL);
+}
+
+/* Create the worker threads. Returns false, with the workers that could be created running, on error. */
+bool FAST_FUNC bled_mt_start(struct bled_mt *mt, void *ctx)
+{
+	mt->ctx = ctx;
+	for (mt->num_workers = 0; mt->num_workers < mt->num_threads; mt->num_workers++) {
+		mt->thread[mt->num_workers] = CreateThread(NULL, 0, bled_mt_worker, mt, 0, NULL);
+		if (mt->thread[mt->num_workers] == NULL)
+			return false;
+	}
+	return true;
+}
+
+/* Queue the job that was placed in the next slot */
+void FAST_FUNC bled_mt_post(struct bled_mt *mt)
+{
+	ReleaseSemaphore(mt->work, 1, NULL);
+}
+
+/* Stop the workers, once they are done with their current job */
+void FAST_FUNC bled_mt_stop(struct bled_mt *mt)
+{
+	uint32_t i;
+
+	if (mt->num_workers == 0)
+		return;
+	mt->quit = TRUE;
+	if (mt->wake != NULL)
+		mt->wake(mt->ctx);
+	ReleaseSemaphore(mt->work, mt->num_workers, NULL);
+	WaitForMultipleObjects(mt->num_workers, mt->thread, TRUE, INFINITE);
+	for (i = 0; i < mt->num_workers; i++)
+		CloseHandle(mt->thread[i]);
+	mt->num_workers = 0;
+}
+
+void FAST_FUNC bled_mt_free(struct bled_mt *mt)
+{
+	bled_mt_stop(mt);
+	if (mt->work != NULL)
+		CloseHandle(mt->work);
+	mt->work = NULL;
+}
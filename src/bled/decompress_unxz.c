@@ -32,6 +32,293 @@ static uint32_t XZ_FUNC xz_crc32(const uint8_t *buf, size_t size, uint32_t crc)
 	return ~crc32_block_endian0(~crc, buf, size, global_crc32_table);
 }
 
+/*
+ * Multithreaded decoding of multi-block streams, such as the ones created with 'xz -T'.
+ * Each block listed in the stream index is wrapped into a standalone single-block stream,
+ * that a pool of worker threads decodes with the single-call decoder, and the decoded
+ * blocks are then written in order. Anything we can't handle this way (concatenated or
+ * padded streams, single block, oversized blocks...) uses the regular decoder instead.
+ */
+#define XZ_MT_MAX_BLOCK_SIZE    (256 * 1024 * 1024)
+/* Room for our one record index and stream footer, that follow a wrapped block */
+#define XZ_MT_TRAILER_SIZE      64
+
+struct xz_mt_block {
+	uint64_t offset;
+	vli_type unpadded;
+	vli_type uncompressed;
+};
+
+struct xz_mt_slot {
+	uint8_t *in;
+	size_t in_size;
+	uint8_t *out;
+	size_t out_size;
+	enum xz_ret ret;
+	HANDLE done;
+};
+
+struct xz_mt {
+	struct bled_mt pool;
+	struct xz_mt_slot *slot;
+};
+
+static size_t xz_mt_get_vli(const uint8_t *buf, size_t pos, size_t size, vli_type *vli)
+{
+	uint32_t shift;
+
+	*vli = 0;
+	for (shift = 0; (pos < size) && (shift < 63); shift += 7) {
+		*vli |= (vli_type)(buf[pos] & 0x7F) << shift;
+		if ((buf[pos++] & 0x80) == 0)
+			return pos;
+	}
+	return 0;
+}
+
+static size_t xz_mt_put_vli(uint8_t *buf, size_t pos, vli_type vli)
+{
+	while (vli >= 0x80) {
+		buf[pos++] = (uint8_t)vli | 0x80;
+		vli >>= 7;
+	}
+	buf[pos++] = (uint8_t)vli;
+	return pos;
+}
+
+static bool xz_mt_read_at(int fd, int64_t offset, void *buf, unsigned int size)
+{
+	return (_lseeki64(fd, offset, SEEK_SET) == offset) && (_read(fd, buf, size) == (int)size);
+}
+
+/*
+ * Wrap the block data, located after the STREAM_HEADER_SIZE bytes reserved at the beginning
+ * of the slot input buffer, into a single-block stream. Since the single-call decoder can
+ * only verify CRC32 checks, any other check is dropped.
+ */
+static void xz_mt_wrap_block(struct xz_mt_slot *slot, const uint8_t *flags, const struct xz_mt_block *block)
+{
+	uint8_t *buf = slot->in;
+	vli_type unpadded = block->unpadded;
+	size_t pos, index_start;
+
+	if (flags[1] > XZ_CHECK_CRC32)
+		unpadded -= check_sizes[flags[1]];
+	memcpy(buf, HEADER_MAGIC, HEADER_MAGIC_SIZE);
+	buf[HEADER_MAGIC_SIZE] = 0;
+	buf[HEADER_MAGIC_SIZE + 1] = (flags[1] > XZ_CHECK_CRC32) ? XZ_CHECK_NONE : flags[1];
+	put_unaligned_le32(xz_crc32(&buf[HEADER_MAGIC_SIZE], 2, 0), &buf[HEADER_MAGIC_SIZE + 2]);
+	/*
+	 * The Block Padding precedes the Check, so, when we drop the Check, what remains
+	 * is a block that ends with its original padding.
+	 */
+	pos = STREAM_HEADER_SIZE + (size_t)((unpadded + 3) & ~3ULL);
+	/* Index */
+	index_start = pos;
+	buf[pos++] = 0x00;
+	pos = xz_mt_put_vli(buf, pos, 1);
+	pos = xz_mt_put_vli(buf, pos, unpadded);
+	pos = xz_mt_put_vli(buf, pos, block->uncompressed);
+	while (pos & 3)
+		buf[pos++] = 0;
+	put_unaligned_le32(xz_crc32(&buf[index_start], pos - index_start, 0), &buf[pos]);
+	pos += 4;
+	/* Stream Footer */
+	put_unaligned_le32((uint32_t)((pos - index_start) / 4 - 1), &buf[pos + 4]);
+	buf[pos + 8] = buf[HEADER_MAGIC_SIZE];
+	buf[pos + 9] = buf[HEADER_MAGIC_SIZE + 1];
+	put_unaligned_le32(xz_crc32(&buf[pos + 4], 6, 0), &buf[pos]);
+	memcpy(&buf[pos + 10], FOOTER_MAGIC, FOOTER_MAGIC_SIZE);
+	slot->in_size = pos + 12;
+	slot->out_size = (size_t)block->uncompressed;
+}
+
+static void *xz_mt_worker_init(void *ctx)
+{
+	return xz_dec_init(XZ_SINGLE, 0);
+}
+
+static void xz_mt_worker_free(void *worker)
+{
+	xz_dec_end((struct xz_dec *)worker);
+}
+
+static void xz_mt_decode(void *ctx, void *worker, uint32_t index)
+{
+	struct xz_mt_slot *slot = &((struct xz_mt *)ctx)->slot[index];
+	struct xz_dec *s = (struct xz_dec *)worker;
+	struct xz_buf b;
+
+	if (s == NULL) {
+		slot->ret = XZ_MEM_ERROR;
+	} else {
+		b.in = slot->in;
+		b.in_pos = 0;
+		b.in_size = slot->in_size;
+		b.out = slot->out;
+		b.out_pos = 0;
+		b.out_size = slot->out_size;
+		slot->ret = xz_dec_run(s, &b);
+		if ((slot->ret == XZ_STREAM_END) && (b.out_pos != slot->out_size))
+			slot->ret = XZ_DATA_ERROR;
+	}
+	SetEvent(slot->done);
+}
+
+/* Returns false if the stream should be decoded with the regular decoder, or true and the result in *n */
+static bool unpack_xz_stream_mt(transformer_state_t *xstate, IF_DESKTOP(long long) int *n)
+{
+	bool r = false;
+	struct xz_mt mt = { 0 };
+	struct xz_mt_block *block = NULL;
+	uint8_t header[STREAM_HEADER_SIZE], footer[STREAM_HEADER_SIZE], *index = NULL;
+	int64_t start, end;
+	uint64_t offset;
+	size_t pos, index_size, max_in = 0, max_out = 0;
+	vli_type i, num_blocks = 0, next_read, next_write;
+	enum xz_ret ret;
+	ssize_t nwrote;
+
+	/* We need to seek the source, and only bother with output to a file */
+	if ((xstate->src_fd == bb_virtual_fd) || (bled_read != NULL) || (xstate->mem_output_size_max != 0))
+		return false;
+	start = _lseeki64(xstate->src_fd, 0, SEEK_CUR);
+	end = _lseeki64(xstate->src_fd, 0, SEEK_END);
+	if ((start < 0) || (end < start + 2 * STREAM_HEADER_SIZE))
+		goto fallback;
+
+	/* Validate the Stream Header and Footer, and get the Index */
+	if (!xz_mt_read_at(xstate->src_fd, start, header, sizeof(header)) ||
+		!xz_mt_read_at(xstate->src_fd, end - sizeof(footer), footer, sizeof(footer)))
+		goto fallback;
+	if (!memeq(header, HEADER_MAGIC, HEADER_MAGIC_SIZE) ||
+		(xz_crc32(&header[HEADER_MAGIC_SIZE], 2, 0) != get_le32(&header[HEADER_MAGIC_SIZE + 2])) ||
+		!memeq(&footer[10], FOOTER_MAGIC, FOOTER_MAGIC_SIZE) ||
+		(xz_crc32(&footer[4], 6, 0) != get_le32(footer)) ||
+		!memeq(&header[HEADER_MAGIC_SIZE], &footer[8], 2) || (header[HEADER_MAGIC_SIZE] != 0) ||
+		(header[HEADER_MAGIC_SIZE + 1] > XZ_CHECK_MAX))
+		goto fallback;
+	index_size = ((size_t)get_le32(&footer[4]) + 1) * 4;
+	if ((int64_t)index_size > end - start - 2 * STREAM_HEADER_SIZE)
+		goto fallback;
+	index = malloc(index_size);
+	if ((index == NULL) || !xz_mt_read_at(xstate->src_fd, end - STREAM_HEADER_SIZE - index_size, index, (unsigned int)index_size) ||
+		(index[0] != 0x00) || (xz_crc32(index, index_size - 4, 0) != get_le32(&index[index_size - 4])))
+		goto fallback;
+	pos = xz_mt_get_vli(index, 1, index_size - 4, &num_blocks);
+	if ((pos == 0) || (num_blocks < 2) || (num_blocks > index_size / 2))
+		goto fallback;
+	block = malloc((size_t)num_blocks * sizeof(struct xz_mt_block));
+	if (block == NULL)
+		goto fallback;
+	offset = start + STREAM_HEADER_SIZE;
+	for (i = 0; i < num_blocks; i++) {
+		block[i].offset = offset;
+		pos = xz_mt_get_vli(index, pos, index_size - 4, &block[i].unpadded);
+		if (pos != 0)
+			pos = xz_mt_get_vli(index, pos, index_size - 4, &block[i].uncompressed);
+		if ((pos == 0) || (block[i].unpadded > 2 * XZ_MT_MAX_BLOCK_SIZE) ||
+			(block[i].unpadded <= check_sizes[header[HEADER_MAGIC_SIZE + 1]]) ||
+			(block[i].uncompressed > XZ_MT_MAX_BLOCK_SIZE))
+			goto fallback;
+		offset += (block[i].unpadded + 3) & ~3ULL;
+		max_in = MAX(max_in, (size_t)((block[i].unpadded + 3) & ~3ULL));
+		max_out = MAX(max_out, (size_t)block[i].uncompressed);
+	}
+	/* This also rules out concatenated streams and Stream Padding */
+	if (offset + index_size + STREAM_HEADER_SIZE != (uint64_t)end)
+		goto fallback;
+
+	max_in += STREAM_HEADER_SIZE + XZ_MT_TRAILER_SIZE;
+	if (!bled_mt_init(&mt.pool, num_blocks, max_in + max_out))
+		goto fallback;
+	mt.pool.decode = xz_mt_decode;
+	mt.pool.worker_init = xz_mt_worker_init;
+	mt.pool.worker_free = xz_mt_worker_free;
+	mt.slot = calloc(mt.pool.num_slots, sizeof(struct xz_mt_slot));
+	if (mt.slot == NULL)
+		goto fallback;
+	for (i = 0; i < mt.pool.num_slots; i++) {
+		mt.slot[i].in = malloc(max_in);
+		mt.slot[i].out = malloc(MAX(max_out, 1));
+		mt.slot[i].done = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if ((mt.slot[i].in == NULL) || (mt.slot[i].out == NULL) || (mt.slot[i].done == NULL))
+			goto fallback;
+	}
+	/* From this stage on, we are committed to multithreaded decoding */
+	r = true;
+	*n = -XZ_DATA_ERROR;
+	if (_lseeki64(xstate->src_fd, start + STREAM_HEADER_SIZE, SEEK_SET) != start + STREAM_HEADER_SIZE)
+		bb_error_msg_and_err("seek error (errno: %d)", errno);
+	bb_total_rb += STREAM_HEADER_SIZE;
+	if (!bled_mt_start(&mt.pool, &mt))
+		bb_error_msg_and_err("could not create decoder thread");
+	bb_printf("Decoding %" PRIu64 " XZ blocks using %d threads", (uint64_t)num_blocks, mt.pool.num_threads);
+
+	*n = 0;
+	for (next_read = 0, next_write = 0; next_write < num_blocks; next_write++) {
+		/* Queue as many blocks as we have free slots */
+		for (; (next_read < num_blocks) && (next_read - next_write < mt.pool.num_slots); next_read++) {
+			struct xz_mt_slot *slot = &mt.slot[next_read % mt.pool.num_slots];
+			unsigned int size = (unsigned int)((block[next_read].unpadded + 3) & ~3ULL);
+			if (full_read(xstate->src_fd, &slot->in[STREAM_HEADER_SIZE], size) != (int)size)
+				bb_error_msg_and_err("read error (errno: %d)", errno);
+			xz_mt_wrap_block(slot, &header[HEADER_MAGIC_SIZE], &block[next_read]);
+			bled_mt_post(&mt.pool);
+		}
+		/* Then write the next block in order, once it has been decoded */
+		struct xz_mt_slot *slot = &mt.slot[next_write % mt.pool.num_slots];
+		WaitForSingleObject(slot->done, INFINITE);
+		ret = slot->ret;
+		switch (ret) {
+		case XZ_STREAM_END:
+			break;
+		case XZ_MEM_ERROR:
+			bb_error_msg_and_err("memory allocation error");
+		case XZ_OPTIONS_ERROR:
+			bb_error_msg_and_err("unsupported XZ header option");
+		default:
+			bb_error_msg_and_err("corrupted archive");
+		}
+		nwrote = transformer_write(xstate, slot->out, slot->out_size);
+		if (nwrote < 0)
+			bb_error_msg_and_err("write error (errno: %d)", errno);
+		*n += nwrote;
+	}
+	if (header[HEADER_MAGIC_SIZE + 1] > XZ_CHECK_CRC32)
+		bb_error_msg("unsupported check; not verifying file integrity");
+	/* Consume the Index and Stream Footer, as the regular decoder would */
+	if (_lseeki64(xstate->src_fd, end, SEEK_SET) == end)
+		bb_total_rb += index_size + STREAM_HEADER_SIZE;
+	goto out;
+
+err:
+	*n = -XZ_DATA_ERROR;
+	goto out;
+
+fallback:
+	/* Rewind, so that the regular decoder can process the stream */
+	if ((start >= 0) && (_lseeki64(xstate->src_fd, start, SEEK_SET) != start)) {
+		*n = -XZ_DATA_ERROR;
+		r = true;
+	}
+
+out:
+	bled_mt_free(&mt.pool);
+	if (mt.slot != NULL) {
+		for (i = 0; i < mt.pool.num_slots; i++) {
+			free(mt.slot[i].in);
+			free(mt.slot[i].out);
+			if (mt.slot[i].done != NULL)
+				CloseHandle(mt.slot[i].done);
+		}
+		free(mt.slot);
+	}
+	free(block);
+	free(index);
+	return r;
+}
+
 IF_DESKTOP(long long) int FAST_FUNC unpack_xz_stream(transformer_state_t *xstate)
 {
 	IF_DESKTOP(long long) int n = 0;
@@ -43,6 +330,9 @@ IF_DESKTOP(long long) int FAST_FUNC unpack_xz_stream(transformer_state_t *xstate
 
 	xz_crc32_init();
 
+	if (unpack_xz_stream_mt(xstate, &n))
+		return n;
+
 	/*
 	 * Support up to 64 MiB dictionary. The actually needed memory
 	 * is allocated once the headers have been parsed.
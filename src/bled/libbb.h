@@ -105,6 +105,9 @@ extern char* bb_virtual_buf;
 extern size_t bb_virtual_len, bb_virtual_pos;
 extern int bb_virtual_fd;
 
+/* Little endian tables hold the 8 slices used by crc32_le() */
+#define CRC32_LE_TABLE_SIZE (8 * 256)
+extern BOOL cpu_has_pclmulqdq;
 uint32_t* crc32_filltable(uint32_t *crc_table, int endian);
 uint32_t crc32_le(uint32_t crc, unsigned char const *p, size_t len, uint32_t *crc32table_le);
 uint32_t crc32_be(uint32_t crc, unsigned char const *p, size_t len, uint32_t *crc32table_be);
@@ -56,6 +56,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <inttypes.h>
 #include <errno.h>
 #include <windowsx.h>
@@ -66,12 +67,37 @@
 #include "resource.h"
 #include "msapi_utf8.h"
 #include "localization.h"
+#include "settings.h"
+
+#if defined(CPU_X86)
+#include <immintrin.h>
+#endif
 
 #undef BIG_ENDIAN_HOST
 
-#define BUFFER_SIZE         (64*KB)
 #define WAIT_TIME           5000
 
+/* Default and maximum number/size of the SumThread ring slots */
+#define RING_SLOTS          16
+#define RING_SLOT_SIZE      (1*MB)
+#define MAX_RING_SLOTS      256
+#define MAX_RING_SLOT_SIZE  (16*MB)
+/* Number of polls before a ring consumer/producer goes to the kernel to wait */
+#define RING_SPIN_COUNT     256
+
+/* Hash stream ring (for checksums computed while writing) */
+#define HASH_STREAM_SLOTS       8
+#define HASH_STREAM_SLOT_SIZE   (1*MB)
+
+/* Tree hash leaf size (must be a multiple of RING_SLOT_SIZE) and maximum number of leaf threads */
+#define TREE_LEAF_SIZE      (4*MB)
+/* Bounds for the tree hashes we load from a sidecar */
+#define MIN_TREE_LEAF_SIZE  (4*KB)
+#define MAX_TREE_LEAF_SIZE  (1*GB)
+#define MAX_TREE_LEAVES     (16*1024*1024)
+#define MAX_TREE_WORKERS    8
+#define MAX_CONSUMERS       (CHECKSUM_MAX + MAX_TREE_WORKERS)
+
 /* Blocksize for each algorithm - Must be a power of 2 */
 #define MD5_BLOCKSIZE       64
 #define SHA1_BLOCKSIZE      64
@@ -84,17 +110,38 @@
 #define SHA1_HASHSIZE       20
 #define SHA256_HASHSIZE     32
 #define SHA512_HASHSIZE     64
-#define MAX_HASHSIZE        SHA512_HASHSIZE
 
 /* Globals */
-char sum_str[CHECKSUM_MAX][150];
-uint32_t bufnum, sum_count[CHECKSUM_MAX] = { MD5_HASHSIZE, SHA1_HASHSIZE, SHA256_HASHSIZE, SHA512_HASHSIZE };
-HANDLE data_ready[CHECKSUM_MAX] = { 0 }, thread_ready[CHECKSUM_MAX] = { 0 };
-DWORD read_size[2];
-BOOL enable_extra_hashes = FALSE;
-uint8_t ALIGNED(64) buffer[2][BUFFER_SIZE];
+char sum_str[CHECKSUM_MAX][150], tree_str[2 * SHA256_HASHSIZE + 1];
+uint32_t sum_count[CHECKSUM_MAX] = { MD5_HASHSIZE, SHA1_HASHSIZE, SHA256_HASHSIZE, SHA512_HASHSIZE };
+BOOL enable_extra_hashes = FALSE, enable_tree_hash = FALSE;
 extern int default_thread_priority;
 
+/*
+ * SumThread reads the image into a ring of slots, that each IndividualSumThread consumes
+ * at its own pace. ring_write_pos is the number of slots published by the reader, and
+ * ring_read_pos[i] the number of slots that hash thread #i is done with, so that slot
+ * #n can be refilled once all the read positions are past n - ring_slots.
+ * A thread that finds the ring empty (or full) sets its 'waiting' flag before going
+ * to sleep on its event, so that the other side only needs to go to the kernel to
+ * wake it up when a stall actually occurs.
+ * When the tree hash is enabled, the TreeLeafThreads are additional consumers, that
+ * each process one leaf out of every num_tree_workers and release all the other slots.
+ */
+typedef struct {
+	uint32_t count;
+	uint64_t ticks;
+} RING_STALLS;
+static uint8_t* ring_buf = NULL;
+static DWORD ring_slots, ring_slot_size, ring_len[MAX_RING_SLOTS];
+static volatile LONG ring_write_pos, ring_read_pos[MAX_CONSUMERS];
+static volatile LONG reader_waiting, sum_waiting[MAX_CONSUMERS];
+static HANDLE slot_free = NULL, data_ready[MAX_CONSUMERS] = { 0 };
+static RING_STALLS reader_stalls, sum_stalls[MAX_CONSUMERS];
+static uint32_t reader_blocked_by[MAX_CONSUMERS];
+static int num_checksums, num_tree_workers, num_consumers;
+static TREE_HASH tree_hash = { 0 };
+
 /*
  * Rotate 32 or 64 bit integers by n bytes.
  * Don't bother trying to hand-optimize those, as the
@@ -930,6 +977,240 @@ static void md5_final(SUM_CONTEXT *ctx)
 #undef X
 }
 
+/*
+ * Accelerated kernels, which InitChecksumKernels() selects at runtime.
+ *
+ * Because a single digest is inherently sequential, the only SIMD that speeds up our
+ * hashing is the dedicated SHA instructions (SHA-NI, for SHA-1 and SHA-256), which are
+ * drop-in replacements for sum_write[].
+ */
+#if defined(CPU_X86)
+/* SHA-1 using the Intel SHA extensions - Based on the public domain code from Intel and Jeffrey Walton */
+TARGET("sha,ssse3,sse4.1") static void sha1_transform_ni(SUM_CONTEXT* ctx, const uint8_t* data, size_t num_blocks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i abcd, abcd_save, e0, e0_save, e1, msg0, msg1, msg2, msg3;
+	uint32_t ALIGNED(16) state[4];
+
+	abcd = _mm_set_epi32((int)ctx->state[0], (int)ctx->state[1], (int)ctx->state[2], (int)ctx->state[3]);
+	e0 = _mm_set_epi32((int)ctx->state[4], 0, 0, 0);
+
+// Process 4 rounds, with e/e_next alternating between e0 and e1
+#define ROUNDS4(e, e_next, m, f) do { e = _mm_sha1nexte_epu32(e, m); e_next = abcd; \
+	abcd = _mm_sha1rnds4_epu32(abcd, e, f); } while (0)
+// Message schedule, where m is the current message and m1, m2, m3 the next ones
+#define SCHEDULE(m, m1, m2, m3) do { m1 = _mm_sha1msg2_epu32(m1, m); \
+	m3 = _mm_sha1msg1_epu32(m3, m); m2 = _mm_xor_si128(m2, m); } while (0)
+#define LOAD(i) _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16 * (i))), mask)
+
+	while (num_blocks--) {
+		abcd_save = abcd;
+		e0_save = e0;
+
+		msg0 = LOAD(0);
+		e0 = _mm_add_epi32(e0, msg0);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+		msg1 = LOAD(1);
+		ROUNDS4(e1, e0, msg1, 0);
+		msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+		msg2 = LOAD(2);
+		ROUNDS4(e0, e1, msg2, 0);
+		msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+		msg0 = _mm_xor_si128(msg0, msg2);
+		msg3 = LOAD(3);
+		ROUNDS4(e1, e0, msg3, 0);
+		SCHEDULE(msg3, msg0, msg1, msg2);
+		ROUNDS4(e0, e1, msg0, 0);
+		SCHEDULE(msg0, msg1, msg2, msg3);
+
+		ROUNDS4(e1, e0, msg1, 1);
+		SCHEDULE(msg1, msg2, msg3, msg0);
+		ROUNDS4(e0, e1, msg2, 1);
+		SCHEDULE(msg2, msg3, msg0, msg1);
+		ROUNDS4(e1, e0, msg3, 1);
+		SCHEDULE(msg3, msg0, msg1, msg2);
+		ROUNDS4(e0, e1, msg0, 1);
+		SCHEDULE(msg0, msg1, msg2, msg3);
+		ROUNDS4(e1, e0, msg1, 1);
+		SCHEDULE(msg1, msg2, msg3, msg0);
+
+		ROUNDS4(e0, e1, msg2, 2);
+		SCHEDULE(msg2, msg3, msg0, msg1);
+		ROUNDS4(e1, e0, msg3, 2);
+		SCHEDULE(msg3, msg0, msg1, msg2);
+		ROUNDS4(e0, e1, msg0, 2);
+		SCHEDULE(msg0, msg1, msg2, msg3);
+		ROUNDS4(e1, e0, msg1, 2);
+		SCHEDULE(msg1, msg2, msg3, msg0);
+		ROUNDS4(e0, e1, msg2, 2);
+		SCHEDULE(msg2, msg3, msg0, msg1);
+
+		ROUNDS4(e1, e0, msg3, 3);
+		SCHEDULE(msg3, msg0, msg1, msg2);
+		ROUNDS4(e0, e1, msg0, 3);
+		SCHEDULE(msg0, msg1, msg2, msg3);
+		ROUNDS4(e1, e0, msg1, 3);
+		msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+		msg3 = _mm_xor_si128(msg3, msg1);
+		ROUNDS4(e0, e1, msg2, 3);
+		msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+		ROUNDS4(e1, e0, msg3, 3);
+
+		e0 = _mm_sha1nexte_epu32(e0, e0_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+		data += SHA1_BLOCKSIZE;
+	}
+
+#undef ROUNDS4
+#undef SCHEDULE
+#undef LOAD
+
+	_mm_store_si128((__m128i*)state, abcd);
+	ctx->state[0] = state[3];
+	ctx->state[1] = state[2];
+	ctx->state[2] = state[1];
+	ctx->state[3] = state[0];
+	_mm_store_si128((__m128i*)state, e0);
+	ctx->state[4] = state[3];
+}
+
+/* SHA-256 using the Intel SHA extensions - Based on the public domain code from Intel and Jeffrey Walton */
+TARGET("sha,ssse3,sse4.1") static void sha256_transform_ni(SUM_CONTEXT* ctx, const uint8_t* data, size_t num_blocks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, abef_save, cdgh_save, msg0, msg1, msg2, msg3, tmp;
+	uint32_t ALIGNED(16) state[8];
+	int i;
+
+	for (i = 0; i < 8; i++)
+		state[i] = (uint32_t)ctx->state[i];
+	tmp = _mm_shuffle_epi32(_mm_load_si128((const __m128i*)&state[0]), 0xB1);	// CDAB
+	state1 = _mm_shuffle_epi32(_mm_load_si128((const __m128i*)&state[4]), 0x1B);	// EFGH
+	state0 = _mm_alignr_epi8(tmp, state1, 8);	// ABEF
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);	// CDGH
+
+// Process 4 rounds, using the message m for the rounds starting at i
+#define ROUNDS4(m, i) do { tmp = _mm_add_epi32(m, _mm_loadu_si128((const __m128i*)&K256[i])); \
+	state1 = _mm_sha256rnds2_epu32(state1, state0, tmp); \
+	state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(tmp, 0x0E)); } while (0)
+// Message schedule, where m is the oldest message and m1, m2, m3 the more recent ones
+#define SCHEDULE(m, m1, m2, m3) m = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(m, m1), \
+	_mm_alignr_epi8(m3, m2, 4)), m3)
+#define LOAD(i) _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16 * (i))), mask)
+
+	while (num_blocks--) {
+		abef_save = state0;
+		cdgh_save = state1;
+
+		msg0 = LOAD(0);
+		ROUNDS4(msg0, 0);
+		msg1 = LOAD(1);
+		ROUNDS4(msg1, 4);
+		msg2 = LOAD(2);
+		ROUNDS4(msg2, 8);
+		msg3 = LOAD(3);
+		ROUNDS4(msg3, 12);
+		for (i = 16; i < 64; i += 16) {
+			SCHEDULE(msg0, msg1, msg2, msg3);
+			ROUNDS4(msg0, i);
+			SCHEDULE(msg1, msg2, msg3, msg0);
+			ROUNDS4(msg1, i + 4);
+			SCHEDULE(msg2, msg3, msg0, msg1);
+			ROUNDS4(msg2, i + 8);
+			SCHEDULE(msg3, msg0, msg1, msg2);
+			ROUNDS4(msg3, i + 12);
+		}
+
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+		data += SHA256_BLOCKSIZE;
+	}
+
+#undef ROUNDS4
+#undef SCHEDULE
+#undef LOAD
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);	// FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xB1);	// DCHG
+	_mm_store_si128((__m128i*)&state[0], _mm_blend_epi16(tmp, state1, 0xF0));	// DCBA
+	_mm_store_si128((__m128i*)&state[4], _mm_alignr_epi8(state1, tmp, 8));	// ABEF
+	for (i = 0; i < 8; i++)
+		ctx->state[i] = state[i];
+}
+
+/* Update the message digest with the contents of the buffer (SHA-1, using SHA-NI) */
+static void sha1_write_ni(SUM_CONTEXT *ctx, const uint8_t *buf, size_t len)
+{
+	size_t num = ctx->bytecount & (SHA1_BLOCKSIZE - 1);
+
+	/* Update bytecount */
+	ctx->bytecount += len;
+
+	/* Handle any leading odd-sized chunks */
+	if (num) {
+		uint8_t *p = ctx->buf + num;
+
+		num = SHA1_BLOCKSIZE - num;
+		if (len < num) {
+			memcpy(p, buf, len);
+			return;
+		}
+		memcpy(p, buf, num);
+		sha1_transform_ni(ctx, ctx->buf, 1);
+		buf += num;
+		len -= num;
+	}
+
+	/* Process data in blocksize chunks */
+	num = len / SHA1_BLOCKSIZE;
+	if (num) {
+		sha1_transform_ni(ctx, buf, num);
+		buf += num * SHA1_BLOCKSIZE;
+		len -= num * SHA1_BLOCKSIZE;
+	}
+
+	/* Handle any remaining bytes of data. */
+	memcpy(ctx->buf, buf, len);
+}
+
+/* Update the message digest with the contents of the buffer (SHA-256, using SHA-NI) */
+static void sha256_write_ni(SUM_CONTEXT *ctx, const uint8_t *buf, size_t len)
+{
+	size_t num = ctx->bytecount & (SHA256_BLOCKSIZE - 1);
+
+	/* Update bytecount */
+	ctx->bytecount += len;
+
+	/* Handle any leading odd-sized chunks */
+	if (num) {
+		uint8_t *p = ctx->buf + num;
+
+		num = SHA256_BLOCKSIZE - num;
+		if (len < num) {
+			memcpy(p, buf, len);
+			return;
+		}
+		memcpy(p, buf, num);
+		sha256_transform_ni(ctx, ctx->buf, 1);
+		buf += num;
+		len -= num;
+	}
+
+	/* Process data in blocksize chunks */
+	num = len / SHA256_BLOCKSIZE;
+	if (num) {
+		sha256_transform_ni(ctx, buf, num);
+		buf += num * SHA256_BLOCKSIZE;
+		len -= num * SHA256_BLOCKSIZE;
+	}
+
+	/* Handle any remaining bytes of data. */
+	memcpy(ctx->buf, buf, len);
+}
+
+#endif
+
 //#define NULL_TEST
 #ifdef NULL_TEST
 // These 'null' calls are useful for testing load balancing and individual algorithm speed
@@ -945,6 +1226,24 @@ sum_init_t *sum_init[CHECKSUM_MAX] = { md5_init, sha1_init , sha256_init, sha512
 sum_write_t *sum_write[CHECKSUM_MAX] = { md5_write, sha1_write , sha256_write, sha512_write };
 sum_final_t *sum_final[CHECKSUM_MAX] = { md5_final, sha1_final , sha256_final, sha512_final };
 
+/*
+ * Select the fastest kernels the CPU supports.
+ * Must be called after DetectCpuFeatures() and before any checksum operation is started.
+ */
+void InitChecksumKernels(void)
+{
+	char str[64] = "";
+
+#if defined(CPU_X86)
+	if (cpu_has_sha && cpu_has_ssse3 && cpu_has_sse41) {
+		sum_write[CHECKSUM_SHA1] = sha1_write_ni;
+		sum_write[CHECKSUM_SHA256] = sha256_write_ni;
+		static_strcat(str, "SHA-NI ");
+	}
+#endif
+	uprintf("Checksum acceleration: %s", (str[0] == 0) ? "None" : str);
+}
+
 // Compute an individual checksum without threading or buffering, for a single file
 BOOL HashFile(const unsigned type, const char* path, uint8_t* sum)
 {
@@ -1006,13 +1305,180 @@ out:
 	return r;
 }
 
+/*
+ * Tree hash: the image is split in TREE_LEAF_SIZE leaves that get hashed with SHA-256 in
+ * parallel, and the root is the top of a binary Merkle tree over these leaves, where each
+ * node is the SHA-256 of the concatenation of its children, and an odd node is promoted as
+ * is to the next level. The leaves are saved to a sidecar, that can later be used to find
+ * which parts of an image (or of a drive it was written to) differ from the original.
+ */
+void ComputeTreeHashRoot(TREE_HASH* tree)
+{
+	uint8_t* level;
+	uint8_t pair[2 * SHA256_HASHSIZE];
+	uint32_t i, n;
+
+	if ((tree == NULL) || (tree->leaf_sum == NULL) || (tree->num_leaves == 0))
+		return;
+	level = malloc((size_t)tree->num_leaves * SHA256_HASHSIZE);
+	if (level == NULL)
+		return;
+	memcpy(level, tree->leaf_sum, (size_t)tree->num_leaves * SHA256_HASHSIZE);
+	for (n = tree->num_leaves; n > 1; n = (n + 1) / 2) {
+		for (i = 0; i < n / 2; i++) {
+			memcpy(pair, &level[2 * i * SHA256_HASHSIZE], sizeof(pair));
+			HashBuffer(CHECKSUM_SHA256, pair, sizeof(pair), &level[i * SHA256_HASHSIZE]);
+		}
+		if (n & 1)
+			memmove(&level[i * SHA256_HASHSIZE], &level[(n - 1) * SHA256_HASHSIZE], SHA256_HASHSIZE);
+	}
+	memcpy(tree->root, level, SHA256_HASHSIZE);
+	free(level);
+}
+
+void FreeTreeHash(TREE_HASH* tree)
+{
+	if (tree == NULL)
+		return;
+	safe_free(tree->leaf_sum);
+	memset(tree, 0, sizeof(TREE_HASH));
+}
+
+static void hex_write(FILE* fd, const uint8_t* buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		fprintf(fd, "%02x", buf[i]);
+	fprintf(fd, "\n");
+}
+
+static BOOL hex_read(const char* str, uint8_t* buf, size_t len)
+{
+	size_t i;
+	unsigned int v;
+
+	for (i = 0; i < len; i++) {
+		if (!isxdigit(str[2 * i]) || !isxdigit(str[2 * i + 1]) || (sscanf(&str[2 * i], "%2x", &v) != 1))
+			return FALSE;
+		buf[i] = (uint8_t)v;
+	}
+	return TRUE;
+}
+
+BOOL SaveTreeHash(const char* path, const TREE_HASH* tree)
+{
+	FILE* fd;
+	uint32_t i;
+
+	if ((path == NULL) || (tree == NULL) || (tree->leaf_sum == NULL))
+		return FALSE;
+	fd = fopenU(path, "w");
+	if (fd == NULL) {
+		uprintf("Could not create '%s': %s", path, WindowsErrorString());
+		return FALSE;
+	}
+	fprintf(fd, "# Rufus SHA-256 tree hash\n");
+	fprintf(fd, "version %d\n", TREE_HASH_VERSION);
+	fprintf(fd, "size %" PRIu64 "\n", tree->size);
+	fprintf(fd, "leaf_size %" PRIu32 "\n", tree->leaf_size);
+	fprintf(fd, "root ");
+	hex_write(fd, tree->root, SHA256_HASHSIZE);
+	for (i = 0; i < tree->num_leaves; i++)
+		hex_write(fd, &tree->leaf_sum[i * SHA256_HASHSIZE], SHA256_HASHSIZE);
+	fclose(fd);
+	return TRUE;
+}
+
+BOOL LoadTreeHash(const char* path, TREE_HASH* tree)
+{
+	FILE* fd;
+	char line[128];
+	uint32_t i = 0, version = 0;
+	uint64_t num_leaves;
+	BOOL r = FALSE;
+
+	if ((path == NULL) || (tree == NULL))
+		return FALSE;
+	memset(tree, 0, sizeof(TREE_HASH));
+	fd = fopenU(path, "r");
+	if (fd == NULL)
+		return FALSE;
+	if ((fgets(line, sizeof(line), fd) == NULL) || (line[0] != '#') ||
+		(fscanf(fd, "version %" SCNu32 "\n", &version) != 1) || (version != TREE_HASH_VERSION) ||
+		(fscanf(fd, "size %" SCNu64 "\n", &tree->size) != 1) ||
+		(fscanf(fd, "leaf_size %" SCNu32 "\n", &tree->leaf_size) != 1) ||
+		(fgets(line, sizeof(line), fd) == NULL) || (strncmp(line, "root ", 5) != 0) ||
+		!hex_read(&line[5], tree->root, SHA256_HASHSIZE)) {
+		uprintf("'%s' is not a valid tree hash file", path);
+		goto out;
+	}
+	// Don't let a corrupted sidecar have us allocate something silly
+	if ((tree->leaf_size < MIN_TREE_LEAF_SIZE) || (tree->leaf_size > MAX_TREE_LEAF_SIZE) ||
+		!IS_POWER_OF_2(tree->leaf_size)) {
+		uprintf("'%s' has an invalid leaf size (%" PRIu32 ")", path, tree->leaf_size);
+		goto out;
+	}
+	num_leaves = max(1, (tree->size + tree->leaf_size - 1) / tree->leaf_size);
+	if (num_leaves > MAX_TREE_LEAVES) {
+		uprintf("'%s' has too many leaves (%" PRIu64 ")", path, num_leaves);
+		goto out;
+	}
+	tree->num_leaves = (uint32_t)num_leaves;
+	tree->leaf_sum = malloc((size_t)tree->num_leaves * SHA256_HASHSIZE);
+	if (tree->leaf_sum == NULL)
+		goto out;
+	for (i = 0; i < tree->num_leaves; i++) {
+		if ((fgets(line, sizeof(line), fd) == NULL) ||
+			!hex_read(line, &tree->leaf_sum[i * SHA256_HASHSIZE], SHA256_HASHSIZE)) {
+			uprintf("'%s' is truncated (%d/%d leaves)", path, i, tree->num_leaves);
+			goto out;
+		}
+	}
+	r = TRUE;
+
+out:
+	fclose(fd);
+	if (!r)
+		FreeTreeHash(tree);
+	return r;
+}
+
+// Report the ranges of leaves that differ between two tree hashes. Returns the number of different leaves.
+uint32_t CompareTreeHash(const TREE_HASH* ref, const TREE_HASH* tree)
+{
+	uint32_t i, start, diff = 0;
+
+	if ((ref->leaf_size != tree->leaf_size) || (ref->size != tree->size)) {
+		uprintf("Tree hash sidecar doesn't match this image (size or leaf size differs)");
+		return MAXDWORD;
+	}
+	if (memcmp(ref->root, tree->root, SHA256_HASHSIZE) == 0) {
+		uprintf("Tree hash matches the one from the sidecar");
+		return 0;
+	}
+	for (i = 0; i < tree->num_leaves; ) {
+		if (memcmp(&ref->leaf_sum[i * SHA256_HASHSIZE], &tree->leaf_sum[i * SHA256_HASHSIZE], SHA256_HASHSIZE) == 0) {
+			i++;
+			continue;
+		}
+		for (start = i; (i < tree->num_leaves) && (memcmp(&ref->leaf_sum[i * SHA256_HASHSIZE],
+			&tree->leaf_sum[i * SHA256_HASHSIZE], SHA256_HASHSIZE) != 0); i++);
+		uprintf("  Bytes 0x%" PRIx64 "-0x%" PRIx64 " differ from the sidecar", (uint64_t)start * tree->leaf_size,
+			min((uint64_t)i * tree->leaf_size, tree->size) - 1);
+		diff += i - start;
+	}
+	uprintf("Tree hash differs from the sidecar: %d/%d leaves do not match", diff, tree->num_leaves);
+	return diff;
+}
+
 /*
  * Checksum dialog callback
  */
 INT_PTR CALLBACK ChecksumCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam)
 {
 	int i, dw, dh;
-	RECT rc;
+	RECT rc, rc_tree;
 	HFONT hFont;
 	HDC hDC;
 
@@ -1028,6 +1494,7 @@ INT_PTR CALLBACK ChecksumCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM
 		SendDlgItemMessageA(hDlg, IDC_SHA1, WM_SETFONT, (WPARAM)hFont, TRUE);
 		SendDlgItemMessageA(hDlg, IDC_SHA256, WM_SETFONT, (WPARAM)hFont, TRUE);
 		SendDlgItemMessageA(hDlg, IDC_SHA512, WM_SETFONT, (WPARAM)hFont, TRUE);
+		SendDlgItemMessageA(hDlg, IDC_TREE_HASH, WM_SETFONT, (WPARAM)hFont, TRUE);
 		SetWindowTextA(GetDlgItem(hDlg, IDC_MD5), sum_str[0]);
 		SetWindowTextA(GetDlgItem(hDlg, IDC_SHA1), sum_str[1]);
 		SetWindowTextA(GetDlgItem(hDlg, IDC_SHA256), sum_str[2]);
@@ -1035,6 +1502,7 @@ INT_PTR CALLBACK ChecksumCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM
 			SetWindowTextA(GetDlgItem(hDlg, IDC_SHA512), sum_str[3]);
 		else
 			SetWindowTextU(GetDlgItem(hDlg, IDC_SHA512), lmprintf(MSG_311, "<Alt>-<H>"));
+		SetWindowTextA(GetDlgItem(hDlg, IDC_TREE_HASH), tree_str);
 
 		// Move/Resize the controls as needed to fit our text
 		hDC = GetDC(GetDlgItem(hDlg, IDC_MD5));
@@ -1048,6 +1516,8 @@ INT_PTR CALLBACK ChecksumCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM
 		dh = rc.bottom - rc.top - dh + 6;
 		ResizeMoveCtrl(hDlg, GetDlgItem(hDlg, IDC_SHA256), 0, 0, dw, dh, 1.0f);
 		ResizeMoveCtrl(hDlg, GetDlgItem(hDlg, IDC_SHA512), 0, 0, dw, dh, 1.0f);
+		ResizeMoveCtrl(hDlg, GetDlgItem(hDlg, IDC_TREE_HASH), 0, dh, dw, dh, 1.0f);
+		ResizeMoveCtrl(hDlg, GetDlgItem(hDlg, IDC_TREE_HASH_TXT), 0, dh, 0, 0, 1.0f);
 
 		GetWindowRect(GetDlgItem(hDlg, IDC_SHA1), &rc);
 		dw = rc.right - rc.left;
@@ -1057,6 +1527,16 @@ INT_PTR CALLBACK ChecksumCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM
 		ResizeMoveCtrl(hDlg, GetDlgItem(hDlg, IDC_SHA1), 0, 0, dw, 0, 1.0f);
 		ResizeButtonHeight(hDlg, IDOK);
 
+		// Only display the tree hash row if we computed one
+		if (tree_str[0] == 0) {
+			GetWindowRect(GetDlgItem(hDlg, IDC_SHA512), &rc);
+			GetWindowRect(GetDlgItem(hDlg, IDC_TREE_HASH), &rc_tree);
+			ShowWindow(GetDlgItem(hDlg, IDC_TREE_HASH), SW_HIDE);
+			ShowWindow(GetDlgItem(hDlg, IDC_TREE_HASH_TXT), SW_HIDE);
+			ResizeMoveCtrl(hDlg, GetDlgItem(hDlg, IDOK), 0, rc.bottom - rc_tree.bottom, 0, 0, 1.0f);
+			ResizeMoveCtrl(hDlg, hDlg, 0, 0, 0, rc.bottom - rc_tree.bottom, 1.0f);
+		}
+
 		safe_release_dc(GetDlgItem(hDlg, IDC_MD5), hDC);
 
 		for (i=(int)safe_strlen(image_path); (i>0)&&(image_path[i]!='\\'); i--);
@@ -1078,59 +1558,259 @@ INT_PTR CALLBACK ChecksumCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM
 	return (INT_PTR)FALSE;
 }
 
+// Atomic read of a ring position
+#define RING_POS(x) InterlockedCompareExchange(&(x), 0, 0)
+
+static LONG ring_min_read_pos(int* slowest)
+{
+	int i;
+	LONG pos, min_pos = RING_POS(ring_read_pos[0]);
+
+	*slowest = 0;
+	for (i = 1; i < num_consumers; i++) {
+		pos = RING_POS(ring_read_pos[i]);
+		if (pos < min_pos) {
+			min_pos = pos;
+			*slowest = i;
+		}
+	}
+	return min_pos;
+}
+
+/*
+ * Wait for the reader to have published slot #pos, for consumer #i.
+ */
+static BOOL ring_wait_data(int i, LONG pos)
+{
+	int spin;
+	LARGE_INTEGER start, end;
+
+	for (spin = 0; spin < RING_SPIN_COUNT; spin++) {
+		if (RING_POS(ring_write_pos) > pos)
+			return TRUE;
+		YieldProcessor();
+	}
+
+	QueryPerformanceCounter(&start);
+	sum_stalls[i].count++;
+	while (1) {
+		InterlockedExchange(&sum_waiting[i], 1);
+		if (RING_POS(ring_write_pos) > pos) {
+			InterlockedExchange(&sum_waiting[i], 0);
+			break;
+		}
+		// Slow media can take longer than WAIT_TIME to fill a slot, so we only give up on cancel
+		switch (WaitForSingleObject(data_ready[i], WAIT_TIME)) {
+		case WAIT_OBJECT_0:
+			break;
+		case WAIT_TIMEOUT:
+			if (IS_ERROR(FormatStatus))
+				return FALSE;
+			break;
+		default:
+			uprintf("Failed to wait for event for checksum consumer #%d: %s", i, WindowsErrorString());
+			return FALSE;
+		}
+	}
+	QueryPerformanceCounter(&end);
+	sum_stalls[i].ticks += end.QuadPart - start.QuadPart;
+	return TRUE;
+}
+
+/*
+ * Wait for all the hash threads to be done with the slot that held data #(pos - ring_slots),
+ * so that the reader can reuse it for data #pos.
+ */
+static BOOL ring_wait_slot(LONG pos)
+{
+	int spin, slowest;
+	LARGE_INTEGER start, end;
+
+	for (spin = 0; spin < RING_SPIN_COUNT; spin++) {
+		if (ring_min_read_pos(&slowest) > pos - (LONG)ring_slots)
+			return TRUE;
+		YieldProcessor();
+	}
+
+	QueryPerformanceCounter(&start);
+	reader_stalls.count++;
+	reader_blocked_by[slowest]++;
+	while (1) {
+		InterlockedExchange(&reader_waiting, 1);
+		if (ring_min_read_pos(&slowest) > pos - (LONG)ring_slots) {
+			InterlockedExchange(&reader_waiting, 0);
+			break;
+		}
+		// Same as above, for a hash that is slower than WAIT_TIME per slot
+		switch (WaitForSingleObject(slot_free, WAIT_TIME)) {
+		case WAIT_OBJECT_0:
+			break;
+		case WAIT_TIMEOUT:
+			if (IS_ERROR(FormatStatus))
+				return FALSE;
+			break;
+		default:
+			uprintf("Checksum threads failed to signal: %s", WindowsErrorString());
+			return FALSE;
+		}
+	}
+	QueryPerformanceCounter(&end);
+	reader_stalls.ticks += end.QuadPart - start.QuadPart;
+	return TRUE;
+}
+
+/*
+ * Release all the slots before #pos for consumer #i, and wake the reader if it is waiting.
+ */
+static BOOL ring_release(int i, LONG pos)
+{
+	InterlockedExchange(&ring_read_pos[i], pos);
+	if (InterlockedExchange(&reader_waiting, 0) && !SetEvent(slot_free)) {
+		uprintf("Failed to set event for checksum consumer #%d: %s", i, WindowsErrorString());
+		return FALSE;
+	}
+	return TRUE;
+}
+
 // Individual thread that computes one of MD5, SHA1, SHA256 or SHA512 in parallel
 DWORD WINAPI IndividualSumThread(void* param)
 {
 	SUM_CONTEXT sum_ctx = { {0} }; // There's a memset in sum_init, but static analyzers still bug us
-	uint32_t i = (uint32_t)(uintptr_t)param, j;
+	uint32_t i = (uint32_t)(uintptr_t)param, j, slot;
+	LONG pos;
 
 	sum_init[i](&sum_ctx);
-	// Signal that we're ready to service requests
-	if (!SetEvent(thread_ready[i]))
-		goto error;
 
-	// Wait for requests
-	while (1) {
-		if (WaitForSingleObject(data_ready[i], WAIT_TIME) != WAIT_OBJECT_0) {
-			uprintf("Failed to wait for event for checksum thread #%d: %s", i, WindowsErrorString());
+	for (pos = 0; ; pos++) {
+		if (!ring_wait_data(i, pos))
 			return 1;
+		slot = (uint32_t)pos % ring_slots;
+		if (ring_len[slot] == 0)
+			break;
+		sum_write[i](&sum_ctx, &ring_buf[(size_t)slot * ring_slot_size], (size_t)ring_len[slot]);
+		if (!ring_release(i, pos + 1))
+			return 1;
+	}
+
+	sum_final[i](&sum_ctx);
+	memset(&sum_str[i], 0, ARRAYSIZE(sum_str[i]));
+	for (j = 0; j < sum_count[i]; j++) {
+		sum_str[i][2 * j] = ((sum_ctx.buf[j] >> 4) < 10) ?
+			((sum_ctx.buf[j] >> 4) + '0') : ((sum_ctx.buf[j] >> 4) - 0xa + 'a');
+		sum_str[i][2 * j + 1] = ((sum_ctx.buf[j] & 15) < 10) ?
+			((sum_ctx.buf[j] & 15) + '0') : ((sum_ctx.buf[j] & 15) - 0xa + 'a');
+	}
+	sum_str[i][2 * j] = 0;
+	return 0;
+}
+
+// Thread that computes the SHA-256 of one out of every num_tree_workers leaves, for the tree hash
+DWORD WINAPI TreeLeafThread(void* param)
+{
+	SUM_CONTEXT sum_ctx = { {0} };
+	int i = (int)(uintptr_t)param;
+	uint32_t leaf, slot, leaf_slots = TREE_LEAF_SIZE / ring_slot_size;
+	LONG pos, end;
+
+	// The number of leaves is known from the file size, so we never wait on slots past EOF
+	for (leaf = i - num_checksums; leaf < tree_hash.num_leaves; leaf += num_tree_workers) {
+		pos = (LONG)(leaf * leaf_slots);
+		// We don't need any of the slots before the ones for our next leaf
+		if (!ring_release(i, pos))
+			return 1;
+		sum_init[CHECKSUM_SHA256](&sum_ctx);
+		for (end = pos + leaf_slots; pos < end; pos++) {
+			// Our leaf can be up to num_tree_workers - 1 leaves ahead of the reader, so
+			// this relies on ring_wait_data() waiting for as long as it takes
+			if (!ring_wait_data(i, pos))
+				return 1;
+			slot = (uint32_t)pos % ring_slots;
+			if (ring_len[slot] == 0)
+				break;
+			sum_write[CHECKSUM_SHA256](&sum_ctx, &ring_buf[(size_t)slot * ring_slot_size], (size_t)ring_len[slot]);
 		}
-		if (read_size[bufnum] != 0) {
-			sum_write[i](&sum_ctx, buffer[bufnum], (size_t)read_size[bufnum]);
-			if (!SetEvent(thread_ready[i]))
-				goto error;
-		} else {
-			sum_final[i](&sum_ctx);
-			memset(&sum_str[i], 0, ARRAYSIZE(sum_str[i]));
-			for (j = 0; j < sum_count[i]; j++) {
-				sum_str[i][2 * j] = ((sum_ctx.buf[j] >> 4) < 10) ?
-					((sum_ctx.buf[j] >> 4) + '0') : ((sum_ctx.buf[j] >> 4) - 0xa + 'a');
-				sum_str[i][2 * j + 1] = ((sum_ctx.buf[j] & 15) < 10) ?
-					((sum_ctx.buf[j] & 15) + '0') : ((sum_ctx.buf[j] & 15) - 0xa + 'a');
-			}
-			sum_str[i][2 * j] = 0;
-			return 0;
-		}
+		sum_final[CHECKSUM_SHA256](&sum_ctx);
+		memcpy(&tree_hash.leaf_sum[leaf * SHA256_HASHSIZE], sum_ctx.buf, SHA256_HASHSIZE);
 	}
-error:
-	uprintf("Failed to set event for checksum thread #%d: %s", i, WindowsErrorString());
-	return 1;
+
+	// Don't hold the reader on the final slot
+	return ring_release(i, MAXLONG) ? 0 : 1;
 }
 
 DWORD WINAPI SumThread(void* param)
 {
+	const char* sum_name[CHECKSUM_MAX] = { "MD5", "SHA1", "SHA256", "SHA512" };
 	DWORD_PTR* thread_affinity = (DWORD_PTR*)param;
-	HANDLE sum_thread[CHECKSUM_MAX] = { NULL, NULL, NULL, NULL };
+	HANDLE sum_thread[MAX_CONSUMERS] = { 0 };
 	HANDLE h = INVALID_HANDLE_VALUE;
-	uint64_t rb;
-	int i, _bufnum, r = -1;
-	int num_checksums = CHECKSUM_MAX - (enable_extra_hashes ? 0 : 1);
-
+	SYSTEM_INFO sys_info;
+	LARGE_INTEGER freq, file_size;
+	TREE_HASH saved_tree_hash = { 0 };
+	char* sidecar_path = NULL, consumer_name[16];
+	uint64_t rb, start_time;
+	uint32_t slot;
+	LONG pos;
+	int i, r = -1;
+
+	num_checksums = CHECKSUM_MAX - (enable_extra_hashes ? 0 : 1);
+	num_tree_workers = 0;
+	if (enable_tree_hash) {
+		// Use all the cores for the leaves, as the classic hashes mostly end up waiting on them
+		GetSystemInfo(&sys_info);
+		num_tree_workers = max(1, min(MAX_TREE_WORKERS, (int)sys_info.dwNumberOfProcessors));
+	}
+	num_consumers = num_checksums + num_tree_workers;
+	tree_str[0] = 0;
 	if ((image_path == NULL) || (thread_affinity == NULL))
 		ExitThread(r);
 
 	uprintf("\r\nComputing checksum for '%s'...", image_path);
 
+	h = CreateFileU(image_path, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if ((h == INVALID_HANDLE_VALUE) || (!GetFileSizeEx(h, &file_size))) {
+		uprintf("Could not open file: %s", WindowsErrorString());
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_OPEN_FAILED;
+		goto out;
+	}
+
+	// The ring size can be tuned with the ChecksumBufferCount and ChecksumBufferSize (in KB) settings
+	ring_slots = ReadSetting32(SETTING_CHECKSUM_BUFFER_COUNT);
+	if ((ring_slots < 2) || (ring_slots > MAX_RING_SLOTS))
+		ring_slots = RING_SLOTS;
+	ring_slot_size = ReadSetting32(SETTING_CHECKSUM_BUFFER_SIZE) * KB;
+	// Keep the slot size a multiple of the largest block size, so that the hashes
+	// only ever have to process their leading/trailing odd-sized chunks at EOF
+	if ((ring_slot_size < 64 * KB) || (ring_slot_size > MAX_RING_SLOT_SIZE) || (ring_slot_size % MAX_BLOCKSIZE != 0))
+		ring_slot_size = RING_SLOT_SIZE;
+	if (num_tree_workers != 0) {
+		// Leaves must span whole slots, and each leaf thread needs a leaf's worth of slots to itself
+		if ((TREE_LEAF_SIZE % ring_slot_size != 0) ||
+			((num_tree_workers + 2) * (TREE_LEAF_SIZE / ring_slot_size) > MAX_RING_SLOTS))
+			ring_slot_size = RING_SLOT_SIZE;
+		ring_slots = max(ring_slots, (num_tree_workers + 2) * (TREE_LEAF_SIZE / ring_slot_size));
+		tree_hash.size = file_size.QuadPart;
+		tree_hash.leaf_size = TREE_LEAF_SIZE;
+		tree_hash.num_leaves = (uint32_t)max(1, (tree_hash.size + TREE_LEAF_SIZE - 1) / TREE_LEAF_SIZE);
+		tree_hash.leaf_sum = malloc((size_t)tree_hash.num_leaves * SHA256_HASHSIZE);
+		if (tree_hash.leaf_sum == NULL) {
+			uprintf("Could not allocate tree hash leaves");
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+			goto out;
+		}
+	}
+	ring_buf = (uint8_t*)_mm_malloc((size_t)ring_slots * ring_slot_size, 64);
+	if (ring_buf == NULL) {
+		uprintf("Could not allocate checksum buffers");
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+		goto out;
+	}
+	ring_write_pos = 0;
+	reader_waiting = 0;
+	memset(&reader_stalls, 0, sizeof(reader_stalls));
+	memset(reader_blocked_by, 0, sizeof(reader_blocked_by));
+	memset(sum_stalls, 0, sizeof(sum_stalls));
+
 	if (thread_affinity[0] != 0)
 		// Use the first affinity mask, as our read thread is the least
 		// CPU intensive (mostly waits on disk I/O or on the other threads)
@@ -1138,78 +1818,70 @@ DWORD WINAPI SumThread(void* param)
 		// is usually in this first mask, for other tasks.
 		SetThreadAffinityMask(GetCurrentThread(), thread_affinity[0]);
 
-	for (i = 0; i < num_checksums; i++) {
+	slot_free = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (slot_free == NULL) {
+		uprintf("Unable to create checksum thread event: %s", WindowsErrorString());
+		goto out;
+	}
+	for (i = 0; i < num_consumers; i++) {
+		ring_read_pos[i] = 0;
+		sum_waiting[i] = 0;
 		// NB: Can't use a single manual-reset event for data_ready as we
 		// wouldn't be able to ensure the event is reset before the thread
 		// gets into its next wait loop
 		data_ready[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
-		thread_ready[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
-		if ((data_ready[i] == NULL) || (thread_ready[i] == NULL)) {
+		if (data_ready[i] == NULL) {
 			uprintf("Unable to create checksum thread event: %s", WindowsErrorString());
 			goto out;
 		}
-		sum_thread[i] = CreateThread(NULL, 0, IndividualSumThread, (LPVOID)(uintptr_t)i, 0, NULL);
+		sum_thread[i] = CreateThread(NULL, 0, (i < num_checksums) ? IndividualSumThread : TreeLeafThread,
+			(LPVOID)(uintptr_t)i, 0, NULL);
 		if (sum_thread[i] == NULL) {
 			uprintf("Unable to start checksum thread #%d", i);
 			goto out;
 		}
 		SetThreadPriority(sum_thread[i], default_thread_priority);
-		if (thread_affinity[i+1] != 0)
+		if ((i < num_checksums) && (thread_affinity[i+1] != 0))
 			SetThreadAffinityMask(sum_thread[i], thread_affinity[i+1]);
 	}
 
-	h = CreateFileU(image_path, GENERIC_READ, FILE_SHARE_READ, NULL,
-		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
-	if (h == INVALID_HANDLE_VALUE) {
-		uprintf("Could not open file: %s", WindowsErrorString());
-		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_OPEN_FAILED;
-		goto out;
-	}
-
-	bufnum = 0;
-	_bufnum = 0;
-	read_size[0] = 1;	// Don't trigger the first loop break
 	UpdateProgressWithInfoInit(hMainDialog, FALSE);
-	for (rb = 0; ;rb += read_size[_bufnum]) {
+	start_time = GetTickCount64();
+	for (rb = 0, pos = 0; ; pos++) {
 		// Update the progress and check for cancel
 		UpdateProgressWithInfo(OP_NOOP_WITH_TASKBAR, MSG_271, rb, img_report.image_size);
 		CHECK_FOR_USER_CANCEL;
 
-		// Signal the threads that we have data to process
-		if (rb != 0) {
-			bufnum = _bufnum;
-			// Toggle the read buffer
-			_bufnum = (bufnum + 1) % 2;
-			// Signal the waiting threads
-			for (i = 0; i < num_checksums; i++) {
-				if (!SetEvent(data_ready[i])) {
-					uprintf("Could not signal checksum thread %d: %s", i, WindowsErrorString());
-					goto out;
-				}
-			}
-		}
-
-		// Break the loop when data has been exhausted
-		if (read_size[bufnum] == 0)
-			break;
+		// Wait for the hash threads to release the slot we want to read into
+		if (!ring_wait_slot(pos))
+			goto out;
 
-		// Read data (double buffered)
-		if (!ReadFile(h, buffer[_bufnum], BUFFER_SIZE, &read_size[_bufnum], NULL)) {
+		// Read data. A zero read size signals the end of data to the hash threads
+		slot = (uint32_t)pos % ring_slots;
+		if (!ReadFile(h, &ring_buf[(size_t)slot * ring_slot_size], ring_slot_size, &ring_len[slot], NULL)) {
 			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_READ_FAULT;
 			uprintf("Read error: %s", WindowsErrorString());
 			goto out;
 		}
-
-		// Wait for the thread to signal they are ready to process data
-		if (WaitForMultipleObjects(num_checksums, thread_ready, TRUE, WAIT_TIME) != WAIT_OBJECT_0) {
-			uprintf("Checksum threads failed to signal: %s", WindowsErrorString());
-			goto out;
+		rb += ring_len[slot];
+
+		// Publish the slot, and wake up the hash threads that are waiting for it
+		InterlockedExchange(&ring_write_pos, pos + 1);
+		for (i = 0; i < num_consumers; i++) {
+			if (InterlockedExchange(&sum_waiting[i], 0) && !SetEvent(data_ready[i])) {
+				uprintf("Could not signal checksum thread %d: %s", i, WindowsErrorString());
+				goto out;
+			}
 		}
+
+		// Break the loop when data has been exhausted
+		if (ring_len[slot] == 0)
+			break;
 	}
 
-	// Our last event with read_size=0 signaled the threads to exit - wait for that to happen
-	if (WaitForMultipleObjects(num_checksums, sum_thread, TRUE, WAIT_TIME) != WAIT_OBJECT_0) {
-		uprintf("Checksum threads did not finalize: %s", WindowsErrorString());
+	// Our last slot with a zero size signaled the threads to exit - wait for that to happen
+	if (WaitForMultipleObjects(num_consumers, sum_thread, TRUE, WAIT_TIME) != WAIT_OBJECT_0) {
+		uprintf("Checksum threads failed to finalize: %s", WindowsErrorString());
 		goto out;
 	}
 
@@ -1223,22 +1895,328 @@ DWORD WINAPI SumThread(void* param)
 		sum_str[3][SHA512_HASHSIZE] = c;
 		uprintf("          %s", &sum_str[3][SHA512_HASHSIZE]);
 	}
+	if (num_tree_workers != 0) {
+		ComputeTreeHashRoot(&tree_hash);
+		for (i = 0; i < SHA256_HASHSIZE; i++)
+			sprintf(&tree_str[2 * i], "%02x", tree_hash.root[i]);
+		uprintf("  Tree:   %s (SHA256, %d x %d KB leaves)", tree_str, tree_hash.num_leaves, (int)(TREE_LEAF_SIZE / KB));
+		// If we have a sidecar from a previous run, report the leaves that differ, else create one
+		sidecar_path = malloc(strlen(image_path) + sizeof(TREE_HASH_EXT));
+		if (sidecar_path != NULL) {
+			sprintf(sidecar_path, "%s" TREE_HASH_EXT, image_path);
+			if (LoadTreeHash(sidecar_path, &saved_tree_hash)) {
+				CompareTreeHash(&saved_tree_hash, &tree_hash);
+			} else if (SaveTreeHash(sidecar_path, &tree_hash)) {
+				uprintf("Saved tree hash leaves to '%s'", sidecar_path);
+			}
+		}
+	}
+
+	// Report where the pipeline stalled, to tell whether I/O or a specific hash is the bottleneck
+	QueryPerformanceFrequency(&freq);
+	uprintf("Processed %s in %0.1fs, using %d x %d KB buffers", SizeToHumanReadable(rb, TRUE, FALSE),
+		(GetTickCount64() - start_time) / 1000.0f, ring_slots, (int)(ring_slot_size / KB));
+	uprintf("  Reader stalled %d times (%0.2fs) on a full ring", reader_stalls.count,
+		(float)reader_stalls.ticks / (float)freq.QuadPart);
+	for (i = 0; i < num_consumers; i++) {
+		if (i < num_checksums)
+			static_strcpy(consumer_name, sum_name[i]);
+		else
+			static_sprintf(consumer_name, "Tree leaf #%d", i - num_checksums);
+		uprintf("  %s stalled %d times (%0.2fs) waiting for data, and held the reader %d times",
+			consumer_name, sum_stalls[i].count, (float)sum_stalls[i].ticks / (float)freq.QuadPart,
+			reader_blocked_by[i]);
+	}
 	r = 0;
 
 out:
-	for (i = 0; i < num_checksums; i++) {
+	for (i = 0; i < num_consumers; i++) {
 		if (sum_thread[i] != NULL)
 			TerminateThread(sum_thread[i], 1);
 		safe_closehandle(data_ready[i]);
-		safe_closehandle(thread_ready[i]);
 	}
+	safe_closehandle(slot_free);
 	safe_closehandle(h);
+	safe_mm_free(ring_buf);
+	safe_free(sidecar_path);
+	FreeTreeHash(&saved_tree_hash);
+	FreeTreeHash(&tree_hash);
 	PostMessage(hMainDialog, UM_FORMAT_COMPLETED, (WPARAM)FALSE, 0);
 	if (r == 0)
 		MyDialogBox(hMainInstance, IDD_CHECKSUM, hMainDialog, ChecksumCallback);
 	ExitThread(r);
 }
 
+/*
+ * Hash streams let an operation that already goes through the data (e.g. WriteDrive) get its
+ * checksums without having to read it again. The producer copies the data into a ring of
+ * slots, that get hashed by one thread per checksum type while it carries on with its I/O.
+ * Each slot holds a reference for each hash thread, and is handed back to the producer once
+ * all of them are done with it.
+ * A stream can also record the SHA-256 of each leaf_size block of data (as a TREE_HASH), on
+ * an extra thread, so that a later comparison can tell where the data differs.
+ */
+#define HASH_STREAM_LEAVES      CHECKSUM_MAX
+#define HASH_STREAM_MAX         (CHECKSUM_MAX + 1)
+
+typedef struct {
+	HASH_STREAM* hs;
+	uint32_t type;
+} HASH_STREAM_THREAD_PARAM;
+
+struct hash_stream {
+	uint32_t type_mask;
+	uint32_t num_types;
+	uint32_t pos;				// index of the slot being filled by the producer
+	DWORD fill;				// amount of data in that slot
+	uint64_t bytecount;
+	uint8_t* buf;
+	DWORD len[HASH_STREAM_SLOTS];
+	volatile LONG refs[HASH_STREAM_SLOTS];
+	HANDLE free_slots;
+	HANDLE data_ready[HASH_STREAM_MAX];
+	HANDLE thread[HASH_STREAM_MAX];
+	HASH_STREAM_THREAD_PARAM param[HASH_STREAM_MAX];
+	SUM_CONTEXT ctx[HASH_STREAM_MAX];
+	TREE_HASH tree;
+	uint32_t max_leaves;
+};
+
+static BOOL hash_stream_add_leaf(HASH_STREAM* hs)
+{
+	SUM_CONTEXT* ctx = &hs->ctx[HASH_STREAM_LEAVES];
+	uint8_t* leaf_sum;
+
+	if (hs->tree.num_leaves >= hs->max_leaves) {
+		leaf_sum = realloc(hs->tree.leaf_sum, (size_t)(2 * hs->max_leaves + 64) * SHA256_HASHSIZE);
+		if (leaf_sum == NULL)
+			return FALSE;
+		hs->tree.leaf_sum = leaf_sum;
+		hs->max_leaves = 2 * hs->max_leaves + 64;
+	}
+	sum_final[CHECKSUM_SHA256](ctx);
+	memcpy(&hs->tree.leaf_sum[(size_t)hs->tree.num_leaves++ * SHA256_HASHSIZE], ctx->buf, SHA256_HASHSIZE);
+	sum_init[CHECKSUM_SHA256](ctx);
+	return TRUE;
+}
+
+static BOOL hash_stream_write_leaves(HASH_STREAM* hs, const uint8_t* buf, size_t len)
+{
+	SUM_CONTEXT* ctx = &hs->ctx[HASH_STREAM_LEAVES];
+	size_t size;
+
+	while (len > 0) {
+		size = (size_t)min(len, hs->tree.leaf_size - ctx->bytecount);
+		sum_write[CHECKSUM_SHA256](ctx, buf, size);
+		buf += size;
+		len -= size;
+		if ((ctx->bytecount == hs->tree.leaf_size) && !hash_stream_add_leaf(hs))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static DWORD WINAPI HashStreamThread(void* param)
+{
+	HASH_STREAM* hs = ((HASH_STREAM_THREAD_PARAM*)param)->hs;
+	uint32_t type = ((HASH_STREAM_THREAD_PARAM*)param)->type, pos, slot;
+	uint8_t* buf;
+
+	for (pos = 0; ; pos++) {
+		// The producer can legitimately take a long time between slots (e.g. on write retries)
+		if (WaitForSingleObject(hs->data_ready[type], INFINITE) != WAIT_OBJECT_0)
+			return 1;
+		slot = pos % HASH_STREAM_SLOTS;
+		if (hs->len[slot] == 0)
+			break;
+		buf = &hs->buf[(size_t)slot * HASH_STREAM_SLOT_SIZE];
+		if (type == HASH_STREAM_LEAVES) {
+			if (!hash_stream_write_leaves(hs, buf, hs->len[slot]))
+				return 1;
+		} else {
+			sum_write[type](&hs->ctx[type], buf, hs->len[slot]);
+		}
+		if ((InterlockedDecrement(&hs->refs[slot]) == 0) && !ReleaseSemaphore(hs->free_slots, 1, NULL))
+			return 1;
+	}
+	if (type != HASH_STREAM_LEAVES)
+		sum_final[type](&hs->ctx[type]);
+	// Like for the tree hash, empty data still has one (empty) leaf
+	else if (((hs->ctx[type].bytecount != 0) || (hs->tree.num_leaves == 0)) && !hash_stream_add_leaf(hs))
+		return 1;
+	return 0;
+}
+
+/*
+ * Wait for the hash threads to release a slot or, if all_done is set, to exit. The drive
+ * can take much longer than WAIT_TIME to hand us the next slot, so we only give up on
+ * cancel, or if a thread exited before it was told to.
+ */
+static BOOL hash_stream_wait(HASH_STREAM* hs, BOOL all_done)
+{
+	HANDLE handle[HASH_STREAM_MAX + 1];
+	DWORD n = 0, r;
+	uint32_t t;
+
+	if (!all_done)
+		handle[n++] = hs->free_slots;
+	for (t = 0; t < HASH_STREAM_MAX; t++) {
+		if (hs->thread[t] != NULL)
+			handle[n++] = hs->thread[t];
+	}
+	while (1) {
+		r = WaitForMultipleObjects(n, handle, all_done, WAIT_TIME);
+		if (r == WAIT_OBJECT_0)
+			return TRUE;
+		if ((r > WAIT_OBJECT_0) && (r < WAIT_OBJECT_0 + n)) {
+			uprintf("Hash stream thread exited unexpectedly");
+			return FALSE;
+		}
+		if (r != WAIT_TIMEOUT) {
+			uprintf("Could not wait for hash stream threads: %s", WindowsErrorString());
+			return FALSE;
+		}
+		if (IS_ERROR(FormatStatus))
+			return FALSE;
+	}
+}
+
+// Hand the current slot over to the hash threads (an empty slot tells them to exit)
+static BOOL hash_stream_publish(HASH_STREAM* hs)
+{
+	uint32_t t, slot = hs->pos % HASH_STREAM_SLOTS;
+
+	hs->len[slot] = hs->fill;
+	hs->refs[slot] = hs->num_types;
+	for (t = 0; t < HASH_STREAM_MAX; t++) {
+		if ((hs->type_mask & (1 << t)) && !ReleaseSemaphore(hs->data_ready[t], 1, NULL)) {
+			uprintf("Could not signal hash stream thread: %s", WindowsErrorString());
+			return FALSE;
+		}
+	}
+	if (hs->fill == 0)
+		return TRUE;
+	hs->pos++;
+	hs->fill = 0;
+	// Wait for all the hash threads to be done with the next slot
+	return hash_stream_wait(hs, FALSE);
+}
+
+/*
+ * Create a hash stream for the checksum types set in type_mask (as 1 << CHECKSUM_XYZ) and,
+ * if leaf_size is not zero, for the SHA-256 of each leaf_size block of data.
+ */
+HASH_STREAM* HashStreamOpen(uint32_t type_mask, uint32_t leaf_size)
+{
+	HASH_STREAM* hs;
+	uint32_t t;
+
+	hs = calloc(1, sizeof(HASH_STREAM));
+	if (hs == NULL)
+		return NULL;
+	hs->type_mask = type_mask & ((1 << CHECKSUM_MAX) - 1);
+	if (leaf_size != 0)
+		hs->type_mask |= 1 << HASH_STREAM_LEAVES;
+	hs->tree.leaf_size = leaf_size;
+	hs->buf = (uint8_t*)_mm_malloc((size_t)HASH_STREAM_SLOTS * HASH_STREAM_SLOT_SIZE, 64);
+	// The producer owns the first slot from the start
+	hs->free_slots = CreateSemaphore(NULL, HASH_STREAM_SLOTS - 1, HASH_STREAM_SLOTS, NULL);
+	if ((hs->type_mask == 0) || (hs->buf == NULL) || (hs->free_slots == NULL))
+		goto error;
+	for (t = 0; t < HASH_STREAM_MAX; t++) {
+		if (!(hs->type_mask & (1 << t)))
+			continue;
+		sum_init[(t == HASH_STREAM_LEAVES) ? CHECKSUM_SHA256 : t](&hs->ctx[t]);
+		hs->param[t].hs = hs;
+		hs->param[t].type = t;
+		hs->data_ready[t] = CreateSemaphore(NULL, 0, HASH_STREAM_SLOTS, NULL);
+		if (hs->data_ready[t] == NULL)
+			goto error;
+		hs->thread[t] = CreateThread(NULL, 0, HashStreamThread, &hs->param[t], 0, NULL);
+		if (hs->thread[t] == NULL)
+			goto error;
+		SetThreadPriority(hs->thread[t], default_thread_priority);
+		hs->num_types++;
+	}
+	return hs;
+
+error:
+	uprintf("Could not create hash stream: %s", WindowsErrorString());
+	HashStreamClose(hs, NULL, NULL, NULL);
+	return NULL;
+}
+
+BOOL HashStreamWrite(HASH_STREAM* hs, const uint8_t* buf, size_t len)
+{
+	DWORD size;
+
+	if ((hs == NULL) || (buf == NULL))
+		return FALSE;
+	hs->bytecount += len;
+	while (len > 0) {
+		size = (DWORD)min(len, (size_t)(HASH_STREAM_SLOT_SIZE - hs->fill));
+		memcpy(&hs->buf[(size_t)(hs->pos % HASH_STREAM_SLOTS) * HASH_STREAM_SLOT_SIZE + hs->fill], buf, size);
+		hs->fill += size;
+		buf += size;
+		len -= size;
+		if ((hs->fill == HASH_STREAM_SLOT_SIZE) && !hash_stream_publish(hs))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Wait for the hash threads to process the remaining data and free the stream.
+ * If sum is not NULL, the checksum for each type of the stream is copied there and, if
+ * tree is not NULL and the stream was created with a leaf size, it receives the leaves
+ * (to be freed with FreeTreeHash()).
+ */
+BOOL HashStreamClose(HASH_STREAM* hs, uint8_t sum[CHECKSUM_MAX][MAX_HASHSIZE], uint64_t* size, TREE_HASH* tree)
+{
+	BOOL r = FALSE;
+	DWORD code;
+	uint32_t t, n = 0;
+
+	if (hs == NULL)
+		return FALSE;
+	for (t = 0; t < HASH_STREAM_MAX; t++) {
+		if (hs->thread[t] != NULL)
+			n++;
+	}
+	// Flush the partial slot, if any, then publish the terminating empty slot
+	if ((n == hs->num_types) && (n != 0) && ((hs->fill == 0) || hash_stream_publish(hs)) &&
+		hash_stream_publish(hs) && hash_stream_wait(hs, TRUE))
+		r = TRUE;
+	for (t = 0; t < HASH_STREAM_MAX; t++) {
+		if (hs->thread[t] != NULL) {
+			// A leaf thread that failed to allocate memory exits early
+			if (r && (!GetExitCodeThread(hs->thread[t], &code) || (code != 0)))
+				r = FALSE;
+			if (!r)
+				TerminateThread(hs->thread[t], 1);
+		}
+		safe_closehandle(hs->thread[t]);
+		safe_closehandle(hs->data_ready[t]);
+	}
+	for (t = 0; r && (sum != NULL) && (t < CHECKSUM_MAX); t++) {
+		if (hs->type_mask & (1 << t))
+			memcpy(sum[t], hs->ctx[t].buf, sum_count[t]);
+	}
+	if (r && (size != NULL))
+		*size = hs->bytecount;
+	if (r && (tree != NULL) && (hs->tree.leaf_size != 0)) {
+		hs->tree.size = hs->bytecount;
+		ComputeTreeHashRoot(&hs->tree);
+		memcpy(tree, &hs->tree, sizeof(TREE_HASH));
+		hs->tree.leaf_sum = NULL;
+	}
+	safe_free(hs->tree.leaf_sum);
+	safe_closehandle(hs->free_slots);
+	safe_mm_free(hs->buf);
+	free(hs);
+	return r;
+}
+
 /*
  * The following 2 calls are used to check whether a buffer/file is in our hash DB
  */
@@ -1330,11 +2308,151 @@ const char* test_hash[CHECKSUM_MAX][4] = {
 	},
 };
 
+const char* hash_name[CHECKSUM_MAX] = { "MD5   ", "SHA1  ", "SHA256", "SHA512" };
+
+/*
+ * Compares the selected kernels against the scalar ones, using random data fed in
+ * irregular chunks, and reports the throughput of each kernel.
+ */
+static int TestChecksumKernels(void)
+{
+	sum_write_t* const sum_write_scalar[CHECKSUM_MAX] = { md5_write, sha1_write , sha256_write, sha512_write };
+	const size_t test_len[] = { 0, 1, 55, 56, 63, 64, 65, 111, 112, 127, 128, 129, 1000, 65536 + 3, 1 * MB };
+	const size_t bench_size = 64 * MB;
+	int i, j, errors = 0, prev_errors;
+	size_t len, pos, chunk;
+	uint32_t seed = 0x12345678;
+	uint64_t start, t_scalar, t_selected;
+	uint8_t ref[MAX_HASHSIZE], *data;
+	SUM_CONTEXT sum_ctx;
+
+	data = malloc(bench_size);
+	if (data == NULL)
+		return 1;
+	for (pos = 0; pos < bench_size; pos++) {
+		// xorshift32
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		data[pos] = (uint8_t)seed;
+	}
+
+	for (j = 0; j < CHECKSUM_MAX; j++) {
+		prev_errors = errors;
+		for (i = 0; i < ARRAYSIZE(test_len); i++) {
+			len = test_len[i];
+			// Deliberately misaligned buffer
+			sum_init[j](&sum_ctx);
+			sum_write_scalar[j](&sum_ctx, &data[1], len);
+			sum_final[j](&sum_ctx);
+			memcpy(ref, sum_ctx.buf, sum_count[j]);
+
+			sum_init[j](&sum_ctx);
+			for (pos = 0, chunk = 1; pos < len; pos += chunk, chunk = 3 * chunk + 7)
+				sum_write[j](&sum_ctx, &data[1 + pos], MIN(chunk, len - pos));
+			sum_final[j](&sum_ctx);
+			if (memcmp(ref, sum_ctx.buf, sum_count[j]) != 0) {
+				uprintf("Test %s kernel (%d bytes): FAIL", hash_name[j], (int)len);
+				errors++;
+			}
+		}
+		uprintf("Test %s kernels: %s", hash_name[j], (errors == prev_errors) ? "PASS" : "FAIL");
+	}
+
+	for (j = 0; j < CHECKSUM_MAX; j++) {
+		start = GetTickCount64();
+		sum_init[j](&sum_ctx);
+		sum_write_scalar[j](&sum_ctx, data, bench_size);
+		sum_final[j](&sum_ctx);
+		t_scalar = GetTickCount64() - start;
+		start = GetTickCount64();
+		sum_init[j](&sum_ctx);
+		sum_write[j](&sum_ctx, data, bench_size);
+		sum_final[j](&sum_ctx);
+		t_selected = GetTickCount64() - start;
+		uprintf("Bench %s: scalar %d MB/s, selected %d MB/s", hash_name[j],
+			(int)((bench_size / MB) * 1000 / max(t_scalar, 1)), (int)((bench_size / MB) * 1000 / max(t_selected, 1)));
+	}
+
+	free(data);
+	return errors;
+}
+
+extern uint32_t* crc32_filltable(uint32_t* crc_table, int endian);
+extern uint32_t crc32_le(uint32_t crc, unsigned char const* p, size_t len, uint32_t* crc32table_le);
+extern uint32_t ext2fs_crc32c_le(uint32_t crc, unsigned char const* p, size_t len);
+
+/*
+ * Compares the PCLMULQDQ CRC32 (bled) and CRC32C (ext2fs) folding kernels against
+ * the table driven implementations, for random lengths, alignments and seeds.
+ */
+static int TestCrc32Kernels(void)
+{
+	const unsigned char* check = (const unsigned char*)"123456789";
+	const size_t max_len = 1 * MB;
+	const BOOL has_pclmulqdq = cpu_has_pclmulqdq;
+	int i, errors = 0;
+	size_t pos, len, align;
+	uint32_t seed = 0x9e3779b9, crc, ref[2], val[2], *table;
+	uint8_t* data;
+
+	table = crc32_filltable(NULL, 0);
+	data = malloc(max_len + 16);
+	if ((table == NULL) || (data == NULL)) {
+		errors++;
+		goto out;
+	}
+	for (pos = 0; pos < max_len + 16; pos++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		data[pos] = (uint8_t)seed;
+	}
+
+	// Validate the tables themselves against the standard check values
+	cpu_has_pclmulqdq = FALSE;
+	if ((~crc32_le(~0, check, 9, table) != 0xcbf43926) || (~ext2fs_crc32c_le(~0, check, 9) != 0xe3069283)) {
+		uprintf("Test CRC32 tables: FAIL");
+		errors++;
+	}
+	if (!has_pclmulqdq) {
+		uprintf("Test CRC32 kernels: SKIPPED (no PCLMULQDQ)");
+		goto out;
+	}
+
+	for (i = 0; i < 4096; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		// Mostly lengths around the 64 byte minimum and the 16 byte tails, with a few large ones
+		len = (i % 256 == 0) ? max_len - (seed % 4096) : (i % 4 == 0) ? seed % 8192 : seed % 256;
+		align = (seed >> 24) % 16;
+		crc = (i % 2 == 0) ? ~0 : seed * 0x9e3779b9;
+		cpu_has_pclmulqdq = FALSE;
+		ref[0] = crc32_le(crc, &data[align], len, table);
+		ref[1] = ext2fs_crc32c_le(crc, &data[align], len);
+		cpu_has_pclmulqdq = TRUE;
+		val[0] = crc32_le(crc, &data[align], len, table);
+		val[1] = ext2fs_crc32c_le(crc, &data[align], len);
+		if ((val[0] != ref[0]) || (val[1] != ref[1])) {
+			uprintf("Test %s kernel (%d bytes at offset %d): FAIL", (val[0] != ref[0]) ? "CRC32" : "CRC32C",
+				(int)len, (int)align);
+			errors++;
+		}
+	}
+	uprintf("Test CRC32 kernels: %s", (errors == 0) ? "PASS" : "FAIL");
+
+out:
+	cpu_has_pclmulqdq = has_pclmulqdq;
+	free(data);
+	free(table);
+	return errors;
+}
+
 /* Tests the message digest aglorithms */
 int TestChecksum(void)
 {
 	const uint32_t blocksize[CHECKSUM_MAX] = { MD5_BLOCKSIZE, SHA1_BLOCKSIZE, SHA256_BLOCKSIZE, SHA512_BLOCKSIZE };
-	const char* hash_name[4] = { "MD5   ", "SHA1  ", "SHA256", "SHA512" };
 	int i, j, errors = 0;
 	uint8_t sum[MAX_HASHSIZE], *sum_expected;
 	size_t full_msg_len = strlen(test_msg);
@@ -1367,6 +2485,6 @@ int TestChecksum(void)
 	}
 
 	free(msg);
-	return errors;
+	return errors + TestChecksumKernels() + TestCrc32Kernels();
 }
 #endif
@@ -2035,6 +2035,56 @@ BOOL RefreshDriveLayout(HANDLE hDrive)
 	return r;
 }
 
+/*
+ * Tell the device that the sectors in [offset, offset + size) are no longer in use (TRIM/UNMAP).
+ * Note that, even when this succeeds, there's no guarantee that these sectors will read back as zeros.
+ */
+BOOL TrimDrive(HANDLE hDrive, uint64_t offset, uint64_t size)
+{
+	BOOL r;
+	DWORD dsize;
+	typedef struct {
+		DEVICE_MANAGE_DATA_SET_ATTRIBUTES Attributes;
+		DEVICE_DATA_SET_RANGE Range;
+	} TRIM_DATA_SET;
+	TRIM_DATA_SET trim;
+
+	memset(&trim, 0, sizeof(trim));
+	trim.Attributes.Size = sizeof(trim.Attributes);
+	trim.Attributes.Action = DeviceDsmAction_Trim;
+	trim.Attributes.Flags = DEVICE_DSM_FLAG_TRIM_NOT_FS_ALLOCATED;
+	trim.Attributes.DataSetRangesOffset = offsetof(TRIM_DATA_SET, Range);
+	trim.Attributes.DataSetRangesLength = sizeof(trim.Range);
+	trim.Range.StartingOffset = offset;
+	trim.Range.LengthInBytes = size;
+	r = DeviceIoControl(hDrive, IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES, &trim, sizeof(trim), NULL, 0, &dsize, NULL);
+	if (!r)
+		uprintf("Could not trim %s at offset %lld: %s", SizeToHumanReadable(size, FALSE, FALSE), offset, WindowsErrorString());
+	return r;
+}
+
+/*
+ * Returns TRUE if the device supports TRIM and reports that trimmed sectors read back as zeros.
+ */
+BOOL IsTrimZeroing(HANDLE hDrive)
+{
+	DWORD size;
+	STORAGE_PROPERTY_QUERY query = { 0 };
+	DEVICE_TRIM_DESCRIPTOR trim = { 0 };
+	DEVICE_LB_PROVISIONING_DESCRIPTOR provisioning = { 0 };
+
+	query.PropertyId = StorageDeviceTrimProperty;
+	query.QueryType = PropertyStandardQuery;
+	if (!DeviceIoControl(hDrive, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+		&trim, sizeof(trim), &size, NULL) || !trim.TrimEnabled)
+		return FALSE;
+	query.PropertyId = StorageDeviceLBProvisioningProperty;
+	if (!DeviceIoControl(hDrive, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+		&provisioning, sizeof(provisioning), &size, NULL))
+		return FALSE;
+	return (BOOL)provisioning.ThinProvisioningReadZeros;
+}
+
 /* Initialize disk for partitioning */
 BOOL InitializeDisk(HANDLE hDrive)
 {
@@ -0,0 +1,410 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * ext2fs formatter benchmark, for Linux hosts
+ * Copyright © 2025 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This formats an image file through ext2fs_format(), which is what
+ * FormatExtFs() from format_ext.c uses, with a counting wrapper around the
+ * unix_io manager, and reports how long it took and what I/O was issued.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "ext2fs.h"
+
+#define KB                  1024LL
+#define MB                  1048576LL
+#define GB                  1073741824LL
+#define TB                  1099511627776LL
+#define ARRAYSIZE(A)        (sizeof(A)/sizeof((A)[0]))
+#define HISTOGRAM_MIN_SHIFT 9		// Below 1 KB
+#define HISTOGRAM_MAX_SHIFT 26		// 64 MB and above
+
+enum {
+	OP_READ = 0,
+	OP_WRITE,
+	OP_ZEROOUT,
+	OP_DISCARD,
+	OP_FLUSH,
+	OP_MAX
+};
+
+static const char* op_name[OP_MAX] = { "read", "write", "zeroout", "discard", "flush" };
+
+static struct {
+	uint64_t calls[OP_MAX];
+	uint64_t bytes[OP_MAX];
+	uint64_t histogram[HISTOGRAM_MAX_SHIFT + 1];
+} stats;
+
+static struct struct_io_manager bench_manager;
+static io_manager base_manager;
+
+/*
+ * Functions that Rufus provides to libext2fs from format_ext.c and stdio.c
+ */
+const char* error_message(errcode_t error_code)
+{
+	static char msg[64];
+
+	if (error_code > 0 && error_code < 256)
+		return strerror((int)error_code);
+	snprintf(msg, sizeof(msg), "ext2fs error %ld (0x%08lx)", (long)error_code, (long)error_code);
+	return msg;
+}
+
+void _uprintf(const char* format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	fputc('\n', stderr);
+}
+
+errcode_t ext2fs_print_progress(int64_t cur_value, int64_t max_value)
+{
+	(void)cur_value;
+	(void)max_value;
+	return 0;
+}
+
+/*
+ * Counting I/O manager
+ */
+static __inline uint64_t blk_to_bytes(io_channel channel, int count)
+{
+	// Same convention as the I/O managers: a negative count is a size in bytes
+	return (count < 0) ? (uint64_t)-count : (uint64_t)count * channel->block_size;
+}
+
+static void account(int op, uint64_t size)
+{
+	int shift = HISTOGRAM_MIN_SHIFT;
+
+	stats.calls[op]++;
+	stats.bytes[op] += size;
+	if (op != OP_WRITE)
+		return;
+	while ((shift < HISTOGRAM_MAX_SHIFT) && ((1ULL << (shift + 1)) <= size))
+		shift++;
+	stats.histogram[shift]++;
+}
+
+static errcode_t bench_open(const char *name, int flags, io_channel *channel)
+{
+	errcode_t r = base_manager->open(name, flags, channel);
+
+	// The channel gets its manager from the base open call, so route it back through us
+	if (r == 0)
+		(*channel)->manager = &bench_manager;
+	return r;
+}
+
+static errcode_t bench_read_blk(io_channel channel, unsigned long block, int count, void *buf)
+{
+	account(OP_READ, blk_to_bytes(channel, count));
+	return base_manager->read_blk(channel, block, count, buf);
+}
+
+static errcode_t bench_read_blk64(io_channel channel, unsigned long long block, int count, void *buf)
+{
+	account(OP_READ, blk_to_bytes(channel, count));
+	return base_manager->read_blk64(channel, block, count, buf);
+}
+
+static errcode_t bench_write_blk(io_channel channel, unsigned long block, int count, const void *buf)
+{
+	account(OP_WRITE, blk_to_bytes(channel, count));
+	return base_manager->write_blk(channel, block, count, buf);
+}
+
+static errcode_t bench_write_blk64(io_channel channel, unsigned long long block, int count, const void *buf)
+{
+	account(OP_WRITE, blk_to_bytes(channel, count));
+	return base_manager->write_blk64(channel, block, count, buf);
+}
+
+static errcode_t bench_zeroout(io_channel channel, unsigned long long block, unsigned long long count)
+{
+	account(OP_ZEROOUT, count * channel->block_size);
+	return base_manager->zeroout(channel, block, count);
+}
+
+static errcode_t bench_discard(io_channel channel, unsigned long long block, unsigned long long count)
+{
+	account(OP_DISCARD, count * channel->block_size);
+	return base_manager->discard(channel, block, count);
+}
+
+static errcode_t bench_flush(io_channel channel)
+{
+	account(OP_FLUSH, 0);
+	return base_manager->flush(channel);
+}
+
+static io_manager bench_io_manager(int no_zeroout)
+{
+	base_manager = unix_io_manager;
+	bench_manager = *base_manager;
+	bench_manager.name = "Benchmark I/O Manager";
+	bench_manager.open = bench_open;
+	bench_manager.read_blk = bench_read_blk;
+	bench_manager.read_blk64 = bench_read_blk64;
+	bench_manager.write_blk = bench_write_blk;
+	bench_manager.write_blk64 = bench_write_blk64;
+	bench_manager.flush = bench_flush;
+	// Dropping zeroout and discard forces the library to write zeroed blocks
+	bench_manager.zeroout = no_zeroout ? NULL : bench_zeroout;
+	bench_manager.discard = no_zeroout ? NULL : bench_discard;
+	return &bench_manager;
+}
+
+/*
+ * Helpers
+ */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1.0e9;
+}
+
+static void random_bytes(uint8_t* buf, size_t len)
+{
+	size_t i;
+	int fd = open("/dev/urandom", O_RDONLY);
+
+	if ((fd < 0) || (read(fd, buf, len) != (ssize_t)len)) {
+		for (i = 0; i < len; i++)
+			buf[i] = (uint8_t)rand();
+	}
+	if (fd >= 0)
+		close(fd);
+}
+
+// Uses two alternating buffers, so that it can be called twice in the same printf()
+static const char* size_to_str(uint64_t size)
+{
+	static char str[2][16];
+	static int idx = 0;
+	const char* suffix[] = { "B", "KB", "MB", "GB" };
+	int i;
+
+	idx ^= 1;
+	for (i = 0; (i < (int)ARRAYSIZE(suffix) - 1) && (size >= KB); i++)
+		size /= KB;
+	snprintf(str[idx], sizeof(str[idx]), "%llu %s", (unsigned long long)size, suffix[i]);
+	return str[idx];
+}
+
+static int parse_size(const char* str, uint64_t* size)
+{
+	char* end;
+
+	*size = strtoull(str, &end, 0);
+	switch (*end) {
+	case 'k': case 'K': *size *= KB; end++; break;
+	case 'm': case 'M': *size *= MB; end++; break;
+	case 'g': case 'G': *size *= GB; end++; break;
+	case 't': case 'T': *size *= TB; end++; break;
+	default: break;
+	}
+	return ((*end == 0) && (*size != 0)) ? 0 : -1;
+}
+
+static void usage(const char* prog)
+{
+	fprintf(stderr, "Usage: %s [-t ext2|ext3|ext4] [-s size] [-b blocksize] [-q] [-d] [-n] [-k] image\n", prog);
+	fprintf(stderr, "  -t  File system to create (default: ext3)\n");
+	fprintf(stderr, "  -s  Image size, with an optional K, M, G or T suffix (default: 1G)\n");
+	fprintf(stderr, "  -b  Block size (default: same as Rufus for the image size)\n");
+	fprintf(stderr, "  -q  Quick format\n");
+	fprintf(stderr, "  -d  Use O_DIRECT\n");
+	fprintf(stderr, "  -n  Don't use zeroout or discard, so that zeroing goes through writes\n");
+	fprintf(stderr, "  -k  Keep the image once done\n");
+}
+
+/*
+ * Time the phases of ext2fs_format(), which FormatExtFs() also uses
+ */
+static double phase_start;
+
+static void format_notify(struct ext2_format_params* params, ext2_filsys fs)
+{
+	double* phase = (double*)params->priv;
+	double t = now();
+
+	(void)fs;
+	switch (params->stage) {
+	case EXT2_FORMAT_INIT:
+		phase_start = t;
+		break;
+	case EXT2_FORMAT_INODE_TABLES:
+		phase[0] = t - phase_start;
+		phase_start = t;
+		break;
+	case EXT2_FORMAT_JOURNAL:
+		phase[1] = t - phase_start;
+		phase_start = t;
+		break;
+	case EXT2_FORMAT_CLOSE:
+		phase[2] = t - phase_start;
+		phase_start = t;
+		break;
+	case EXT2_FORMAT_DONE:
+		phase[3] = t - phase_start;
+		break;
+	default:
+		break;
+	}
+}
+
+static errcode_t format(const char* path, const char* fs_name, uint64_t size, uint32_t block_size,
+	int quick, int direct, int no_zeroout, double* phase)
+{
+	struct ext2_super_block features;
+	struct ext2_format_params params = { 0 };
+	errcode_t r;
+
+	r = ext2fs_format_features(&features, fs_name, size, block_size);
+	if (r != 0)
+		return r;
+	params.label = "BENCH";
+	random_bytes(params.uuid, sizeof(params.uuid));
+	random_bytes(params.hash_seed, sizeof(params.hash_seed));
+	params.creator_os = EXT2_OS_LINUX;
+	params.flags = quick ? EXT2_FORMAT_QUICK : 0;
+	params.open_flags = direct ? EXT2_FLAG_DIRECT_IO : 0;
+	params.notify = format_notify;
+	params.priv = phase;
+	return ext2fs_format(path, &features, &params, bench_io_manager(no_zeroout));
+}
+
+int main(int argc, char** argv)
+{
+	const char* fs_name = "ext3";
+	const char* path;
+	const char* phase_name[4] = { "setup", "inode tables", "journal", "close" };
+	uint64_t size = 1 * GB;
+	uint32_t block_size = 0;
+	int c, i, fd, quick = 0, direct = 0, no_zeroout = 0, keep = 0;
+	double phase[4] = { 0 }, t;
+	errcode_t r;
+
+	while ((c = getopt(argc, argv, "t:s:b:qdnkh")) != -1) {
+		switch (c) {
+		case 't':
+			fs_name = optarg;
+			break;
+		case 's':
+			if (parse_size(optarg, &size) != 0) {
+				fprintf(stderr, "Invalid size '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		case 'b':
+			block_size = (uint32_t)strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			quick = 1;
+			break;
+		case 'd':
+			direct = 1;
+			break;
+		case 'n':
+			no_zeroout = 1;
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	path = argv[optind];
+	if ((strcmp(fs_name, "ext2") != 0) && (strcmp(fs_name, "ext3") != 0) && (strcmp(fs_name, "ext4") != 0)) {
+		fprintf(stderr, "Unsupported file system '%s'\n", fs_name);
+		return 1;
+	}
+	if ((block_size != 0) && ((block_size < EXT2_MIN_BLOCK_SIZE) || (block_size & (block_size - 1)))) {
+		fprintf(stderr, "Invalid block size %u\n", block_size);
+		return 1;
+	}
+
+	// Start from a sparse image, like a freshly created partition would be
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if ((fd < 0) || (ftruncate(fd, (off_t)size) != 0)) {
+		fprintf(stderr, "Could not create '%s': %s\n", path, strerror(errno));
+		return 1;
+	}
+	close(fd);
+
+	printf("Formatting %s as %s (%s%s%s%s)\n", path, fs_name, size_to_str(size),
+		quick ? ", quick" : "", direct ? ", O_DIRECT" : "", no_zeroout ? ", no zeroout" : "");
+	t = now();
+	r = format(path, fs_name, size, block_size, quick, direct, no_zeroout, phase);
+	t = now() - t;
+	if (!keep)
+		unlink(path);
+	if (r != 0) {
+		fprintf(stderr, "Format failed: %s\n", error_message(r));
+		return 1;
+	}
+
+	printf("\nWall time: %.3f s\n", t);
+	for (i = 0; i < (int)ARRAYSIZE(phase); i++)
+		printf("  %-13s %.3f s\n", phase_name[i], phase[i]);
+
+	printf("\n%-8s %12s %16s\n", "I/O", "calls", "bytes");
+	for (i = 0; i < OP_MAX; i++)
+		printf("%-8s %12llu %16llu\n", op_name[i], (unsigned long long)stats.calls[i],
+			(unsigned long long)stats.bytes[i]);
+
+	printf("\nWrite sizes:\n");
+	for (i = HISTOGRAM_MIN_SHIFT; i <= HISTOGRAM_MAX_SHIFT; i++) {
+		if (stats.histogram[i] == 0)
+			continue;
+		if (i == HISTOGRAM_MIN_SHIFT)
+			printf("  %8s - %-8s %12llu\n", "0 B", size_to_str(1ULL << (i + 1)),
+				(unsigned long long)stats.histogram[i]);
+		else if (i == HISTOGRAM_MAX_SHIFT)
+			printf("  %8s - %-8s %12llu\n", size_to_str(1ULL << i), "",
+				(unsigned long long)stats.histogram[i]);
+		else
+			printf("  %8s - %-8s %12llu\n", size_to_str(1ULL << i), size_to_str(1ULL << (i + 1)),
+				(unsigned long long)stats.histogram[i]);
+	}
+	return 0;
+}
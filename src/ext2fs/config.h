@@ -75,6 +75,11 @@
 /* Define to 1 if you have the `mempcpy' function. */
 #define HAVE_MEMPCPY 1
 
+/* Define to 1 if you have the `posix_memalign' function. */
+#ifndef _WIN32
+#define HAVE_POSIX_MEMALIGN 1
+#endif
+
 /* Define to 1 if you have the <pthread.h> header file. */
 #define HAVE_PTHREAD_H 1
 
@@ -174,7 +179,11 @@
 #define HAVE_WINT_T 1
 
 /* Define if you have 'winsock.h'. */
+#ifdef _WIN32
 #define HAVE_WINSOCK_H 1
+#else
+#define HAVE_NETINET_IN_H 1
+#endif
 
 /* Define to 1 if O_NOATIME works. */
 #define HAVE_WORKING_O_NOATIME 0
@@ -192,7 +201,11 @@
 #define SIZEOF_INT 4
 
 /* The size of `long', as computed by sizeof. */
+#if defined(_WIN32) || !defined(__LP64__)
 #define SIZEOF_LONG 4
+#else
+#define SIZEOF_LONG 8
+#endif
 
 /* The size of `long long', as computed by sizeof. */
 #define SIZEOF_LONG_LONG 8
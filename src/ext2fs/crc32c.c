@@ -72,6 +72,23 @@
 
 #include "crc32c_table.h"
 
+/*
+ * Rufus: Use bled's PCLMULQDQ folding kernel for bulk data when the CPU
+ * supports it. These are the CRC32C equivalents of the constants from
+ * bled/crc32.c.
+ */
+#if defined(_WIN32) && (defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__))
+#define CRC32C_CLMUL
+#include "bled/bled.h"
+extern BOOL cpu_has_pclmulqdq;
+static const crc32_clmul_t crc32c_clmul = {
+	{ 0x00740eef02ULL, 0x009e4addf8ULL },
+	{ 0x00f20c0dfeULL, 0x014cd00bd6ULL },
+	{ 0x00dd45aab8ULL, 0x0000000000ULL },
+	{ 0x0105ec76f1ULL, 0x00dea713f1ULL },
+};
+#endif
+
 #if CRC_LE_BITS > 8 || CRC_BE_BITS > 8
 
 /* implements slicing-by-4 or slicing-by-8 algorithm */
@@ -187,6 +204,13 @@ static inline uint32_t crc32_le_generic(uint32_t crc, unsigned char const *p,
 
 uint32_t ext2fs_crc32c_le(uint32_t crc, unsigned char const *p, size_t len)
 {
+#ifdef CRC32C_CLMUL
+	if (cpu_has_pclmulqdq && len >= 64) {
+		crc = crc32_clmul(crc, p, len & ~(size_t)15, &crc32c_clmul);
+		p += len & ~(size_t)15;
+		len &= 15;
+	}
+#endif
 	return crc32_le_generic(crc, p, len, crc32ctable_le, CRC32C_POLY_LE);
 }
 
@@ -39,14 +39,15 @@ typedef uint32_t __u32;
 typedef int32_t __s32;
 #endif /* HAVE___S32 */
 
+/* Use the same 64-bit types as linux/types.h, which uint64_t may not be */
 #ifndef HAVE___U64
 #define HAVE___U64
-typedef uint64_t __u64;
+typedef unsigned long long __u64;
 #endif /* HAVE___U64 */
 
 #ifndef HAVE___S64
 #define HAVE___S64
-typedef int64_t __s64;
+typedef long long __s64;
 #endif /* HAVE___S64 */
 
 #undef __S8_TYPEDEF
@@ -1740,6 +1740,44 @@ extern errcode_t ext2fs_write_bb_FILE(ext2_badblocks_list bb_list,
 /* Rufus addtional */
 extern errcode_t ext2fs_print_progress(int64_t cur, int64_t max);
 
+/* mkfs.c */
+#define EXT2_FORMAT_QUICK	0x0001
+
+enum ext2_format_stage {
+	EXT2_FORMAT_INIT = 0,
+	EXT2_FORMAT_ZERO,
+	EXT2_FORMAT_TABLES,
+	EXT2_FORMAT_INODE_TABLES,
+	EXT2_FORMAT_DIRS,
+	EXT2_FORMAT_BITMAPS,
+	EXT2_FORMAT_JOURNAL,
+	EXT2_FORMAT_CLOSE,
+	EXT2_FORMAT_DONE
+};
+
+struct ext2_format_params {
+	/* Set by the caller */
+	const char		*label;
+	__u8			uuid[16];
+	__u8			hash_seed[16];
+	__u32			creator_os;
+	int			flags;		/* EXT2_FORMAT_* */
+	int			open_flags;	/* Added to the ext2fs_initialize() flags */
+	/* Called when a stage starts. The file system is NULL before init and once closed. */
+	void			(*notify)(struct ext2_format_params *params, ext2_filsys fs);
+	void			*priv;
+	/* Set by ext2fs_format() */
+	enum ext2_format_stage	stage;
+	int			discarded;	/* The whole volume was discarded and reads back as zeros */
+	blk_t			journal_size;
+};
+
+extern errcode_t ext2fs_format_features(struct ext2_super_block *features,
+					const char *fs_name, __u64 size,
+					unsigned int block_size);
+extern errcode_t ext2fs_format(const char *name, struct ext2_super_block *features,
+			       struct ext2_format_params *params, io_manager manager);
+
 /* inline functions */
 #ifdef NO_INLINE_FUNCS
 extern errcode_t ext2fs_get_mem(unsigned long size, void *ptr);
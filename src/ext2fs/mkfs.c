@@ -0,0 +1,262 @@
+/*
+ * mkfs.c --- create a new file system, the way mke2fs would
+ *
+ * This only uses libext2fs, so that the same sequence can be exercised
+ * through any I/O manager, and not just the NT one.
+ *
+ * Copyright (C) 2019-2025 Pete Batard <pete@akeo.ie>
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+
+#define FORMAT_MB	(1024ULL * 1024ULL)
+#define FORMAT_GB	(1024ULL * FORMAT_MB)
+#define FORMAT_TB	(1024ULL * FORMAT_GB)
+
+/* Mostly taken from mke2fs.conf */
+static const float reserve_ratio = 0.05f;
+static const struct {
+	__u64		max_size;
+	unsigned int	block_size;
+	unsigned int	inode_size;
+	unsigned int	inode_ratio;
+} format_default[] = {
+	{ 3 * FORMAT_MB, 1024, 128, 3 },	/* "floppy" */
+	{ 512 * FORMAT_MB, 1024, 128, 2 },	/* "small" */
+	{ 4 * FORMAT_GB, 4096, 256, 2 },	/* "default" */
+	{ 16 * FORMAT_GB, 4096, 256, 3 },	/* "big" */
+	{ 1024 * FORMAT_TB, 4096, 256, 4 }	/* "huge" */
+};
+
+/*
+ * Set the base features of an "ext2", "ext3" or "ext4" file system, for
+ * a volume of 'size' bytes. If 'block_size' is zero, or too small, the
+ * mke2fs default for this volume size is used.
+ */
+errcode_t ext2fs_format_features(struct ext2_super_block *features,
+				 const char *fs_name, __u64 size,
+				 unsigned int block_size)
+{
+	int i, is_ext4;
+
+	if ((fs_name == NULL) || (strlen(fs_name) != 4) ||
+	    (strncmp(fs_name, "ext", 3) != 0) ||
+	    (fs_name[3] < '2') || (fs_name[3] > '4'))
+		return EXT2_ET_INVALID_ARGUMENT;
+	is_ext4 = (fs_name[3] == '4');
+
+	memset(features, 0, sizeof(*features));
+	for (i = 0; i < (int)(sizeof(format_default) / sizeof(format_default[0])) - 1; i++) {
+		if (size < format_default[i].max_size)
+			break;
+	}
+	if (block_size < EXT2_MIN_BLOCK_SIZE)
+		block_size = format_default[i].block_size;
+	for (features->s_log_block_size = 0;
+	     EXT2_BLOCK_SIZE_BITS(features) <= EXT2_MAX_BLOCK_LOG_SIZE;
+	     features->s_log_block_size++) {
+		if (EXT2_BLOCK_SIZE(features) == (int)block_size)
+			break;
+	}
+	if (EXT2_BLOCK_SIZE_BITS(features) > EXT2_MAX_BLOCK_LOG_SIZE)
+		return EXT2_ET_INVALID_ARGUMENT;
+	features->s_log_cluster_size = features->s_log_block_size;
+	size /= block_size;
+
+	/* ext2 and ext3 can only accommodate up to block size * 2^32 sized volumes */
+	if (!is_ext4 && (size >= 0x100000000ULL))
+		return EXT2_ET_FILE_TOO_BIG;
+
+	/* Set the blocks, reserved blocks and inodes */
+	ext2fs_blocks_count_set(features, size);
+	ext2fs_r_blocks_count_set(features, (blk64_t)(reserve_ratio * size));
+	features->s_rev_level = 1;
+	features->s_inode_size = format_default[i].inode_size;
+	features->s_inodes_count = ((ext2fs_blocks_count(features) >> format_default[i].inode_ratio) > UINT32_MAX) ?
+		UINT32_MAX : (__u32)(ext2fs_blocks_count(features) >> format_default[i].inode_ratio);
+
+	ext2fs_set_feature_dir_index(features);
+	ext2fs_set_feature_filetype(features);
+	ext2fs_set_feature_large_file(features);
+	ext2fs_set_feature_sparse_super(features);
+	ext2fs_set_feature_xattr(features);
+	if (fs_name[3] != '2')
+		ext2fs_set_feature_journal(features);
+	if (is_ext4) {
+		/* Same as the ext4 profile from mke2fs.conf */
+		ext2fs_set_feature_extents(features);
+		ext2fs_set_feature_flex_bg(features);
+		ext2fs_set_feature_huge_file(features);
+		ext2fs_set_feature_dir_nlink(features);
+		ext2fs_set_feature_extra_isize(features);
+		ext2fs_set_feature_metadata_csum(features);
+		ext2fs_set_feature_64bit(features);
+		features->s_log_groups_per_flex = 4;
+	}
+	features->s_default_mount_opts = EXT2_DEFM_XATTR_USER | EXT2_DEFM_ACL;
+	return 0;
+}
+
+static void format_notify(struct ext2_format_params *params, ext2_filsys fs,
+			  enum ext2_format_stage stage)
+{
+	params->stage = stage;
+	if (params->notify != NULL)
+		params->notify(params, fs);
+}
+
+/*
+ * Create a file system on 'name', through 'manager', from the features set
+ * by ext2fs_format_features(). On error, params->stage is the stage that
+ * failed.
+ */
+errcode_t ext2fs_format(const char *name, struct ext2_super_block *features,
+			struct ext2_format_params *params, io_manager manager)
+{
+	ext2_filsys fs = NULL;
+	errcode_t r;
+	blk64_t cur;
+	__u8 *buf;
+	int i, count, is_ext4, lazy_itable_init;
+
+	/* ext4 is the only one of our file systems that has extents */
+	is_ext4 = ext2fs_has_feature_extents(features);
+	/* With ext4, we leave the zeroing of unused inode tables to the kernel on quick format */
+	lazy_itable_init = is_ext4 && (params->flags & EXT2_FORMAT_QUICK);
+	params->discarded = 0;
+	params->journal_size = 0;
+
+	/* Initialize a virtual superblock from our base features */
+	format_notify(params, NULL, EXT2_FORMAT_INIT);
+	r = ext2fs_initialize(name, EXT2_FLAG_EXCLUSIVE | EXT2_FLAG_64BITS | params->open_flags,
+			      features, manager, &fs);
+	if (r != 0)
+		return r;
+
+	/*
+	 * If the device guarantees that discarded blocks read back as zeros, discarding the
+	 * whole volume means we don't have to write the inode tables or the journal
+	 */
+	format_notify(params, fs, EXT2_FORMAT_ZERO);
+	if (is_ext4 && io_channel_discard_zeroes_data(fs->io) &&
+	    (io_channel_discard(fs->io, 0, ext2fs_blocks_count(fs->super)) == 0))
+		params->discarded = 1;
+
+	/* Zero 16 blocks of data from the start of our volume */
+	buf = calloc(16, fs->io->block_size);
+	if (buf == NULL) {
+		r = EXT2_ET_NO_MEMORY;
+		goto out;
+	}
+	r = io_channel_write_blk64(fs->io, 0, 16, buf);
+	free(buf);
+	if (r != 0)
+		goto out;
+
+	/* Finish setting up the file system */
+	format_notify(params, fs, EXT2_FORMAT_TABLES);
+	memcpy(fs->super->s_uuid, params->uuid, sizeof(fs->super->s_uuid));
+	ext2fs_init_csum_seed(fs);
+	fs->super->s_def_hash_version = EXT2_HASH_HALF_MD4;
+	memcpy(fs->super->s_hash_seed, params->hash_seed, sizeof(fs->super->s_hash_seed));
+	fs->super->s_max_mnt_count = -1;
+	fs->super->s_creator_os = params->creator_os;
+	fs->super->s_errors = EXT2_ERRORS_CONTINUE;
+	if (ext2fs_has_feature_metadata_csum(fs->super))
+		fs->super->s_checksum_type = EXT2_CRC32C_CHKSUM;
+	if (params->label != NULL)
+		strncpy((char *)fs->super->s_volume_name, params->label,
+			sizeof(fs->super->s_volume_name) - 1);
+
+	r = ext2fs_allocate_tables(fs);
+	if (r != 0)
+		goto out;
+	r = ext2fs_convert_subcluster_bitmap(fs, &fs->block_map);
+	if (r != 0)
+		goto out;
+
+	format_notify(params, fs, EXT2_FORMAT_INODE_TABLES);
+	for (i = 0; i < (int)fs->group_desc_count; i++) {
+		r = ext2fs_print_progress((int64_t)i, (int64_t)fs->group_desc_count);
+		if (r != 0)
+			goto out;
+		cur = ext2fs_inode_table_loc(fs, i);
+		/* Only the part of the inode table that is in use needs to be zeroed for lazy init */
+		if (lazy_itable_init)
+			count = ext2fs_div_ceil((fs->super->s_inodes_per_group - ext2fs_bg_itable_unused(fs, i))
+				* EXT2_INODE_SIZE(fs->super), EXT2_BLOCK_SIZE(fs->super));
+		else
+			count = fs->inode_blocks_per_group;
+		if (!params->discarded) {
+			r = ext2fs_zero_blocks2(fs, cur, count, &cur, &count);
+			if (r != 0)
+				goto out;
+		}
+		/* Let the kernel know that it doesn't have to zero the table */
+		if (!lazy_itable_init || params->discarded)
+			ext2fs_bg_flags_set(fs, i, EXT2_BG_INODE_ZEROED);
+		/* The descriptor checksum must also be updated for the UUID we set */
+		ext2fs_group_desc_csum_set(fs, i);
+	}
+
+	/* Create root and lost+found dirs */
+	format_notify(params, fs, EXT2_FORMAT_DIRS);
+	r = ext2fs_mkdir(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, 0);
+	if (r != 0)
+		goto out;
+	fs->umask = 077;
+	r = ext2fs_mkdir(fs, EXT2_ROOT_INO, 0, "lost+found");
+	if (r != 0)
+		goto out;
+
+	/* Create bitmaps */
+	format_notify(params, fs, EXT2_FORMAT_BITMAPS);
+	for (i = EXT2_ROOT_INO + 1; i < (int)EXT2_FIRST_INODE(fs->super); i++)
+		ext2fs_inode_alloc_stats(fs, i, 1);
+	ext2fs_mark_ib_dirty(fs);
+	r = ext2fs_mark_inode_bitmap2(fs->inode_map, EXT2_BAD_INO);
+	if (r != 0)
+		goto out;
+	ext2fs_inode_alloc_stats(fs, EXT2_BAD_INO, 1);
+	r = ext2fs_update_bb_inode(fs, NULL);
+	if (r != 0)
+		goto out;
+
+	/* Create the journal, with the same size as mke2fs for ext4 */
+	if (ext2fs_has_feature_journal(fs->super)) {
+		params->journal_size = ext2fs_default_journal_size(ext2fs_blocks_count(fs->super));
+		if (!is_ext4)
+			params->journal_size /= 2;	/* That journal init is really killing us! */
+	}
+	format_notify(params, fs, EXT2_FORMAT_JOURNAL);
+	if (params->journal_size != 0) {
+		r = ext2fs_add_journal_inode(fs, params->journal_size, EXT2_MKJOURNAL_NO_MNT_CHECK |
+			(((params->flags & EXT2_FORMAT_QUICK) || params->discarded) ? EXT2_MKJOURNAL_LAZYINIT : 0));
+		if (r != 0)
+			goto out;
+	}
+
+	/* Finally we can call close() to get the file system created */
+	format_notify(params, fs, EXT2_FORMAT_CLOSE);
+	r = ext2fs_close(fs);
+	if (r != 0)
+		goto out;
+	fs = NULL;
+	format_notify(params, NULL, EXT2_FORMAT_DONE);
+
+out:
+	if (fs != NULL)
+		ext2fs_free(fs);
+	return r;
+}
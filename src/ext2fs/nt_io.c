@@ -1,7 +1,7 @@
 /*
  * nt_io.c --- This is the Nt I/O interface to the I/O manager.
  *
- * Implements a one-block write-through cache.
+ * Implements an N-way set associative write-back cache.
  *
  * Copyright (C) 1993, 1994, 1995 Theodore Ts'o.
  * Copyright (C) 1998 Andrey Shedel <andreys@ns.cr.cyco.com>
@@ -53,14 +53,40 @@ PF_TYPE_DECL(NTAPI, NTSTATUS, NtDelayExecution, (BOOLEAN, PLARGE_INTEGER));
 
 #define EXT2_ET_MAGIC_NT_IO_CHANNEL         0x10ed
 
+// Cache geometry. The number of sets depends on the block size, so that the cache uses
+// about NT_CACHE_BYTES
+#define NT_CACHE_WAYS                       8
+#define NT_CACHE_BYTES                      (16 * 1024 * 1024)
+// Writes larger than this go straight to the device
+#define NT_CACHE_MAX_WRITE                  (64 * 1024)
+// Largest write we issue when flushing adjacent dirty blocks, zeroing or reading ahead
+#define NT_FLUSH_MAX_WRITE                  (4 * 1024 * 1024)
+// Unmap granularity to use if the device doesn't report one
+#define NT_DISCARD_GRANULARITY              (1024 * 1024)
+
+// Cache entry
+typedef struct _NT_CACHE_ENTRY {
+    unsigned long long block;
+    char*   buf;
+    ULONG   access_time;
+    BOOLEAN in_use;
+    BOOLEAN dirty;
+} NT_CACHE_ENTRY, *PNT_CACHE_ENTRY;
+
 // Private data block
 typedef struct _NT_PRIVATE_DATA {
     int     magic;
     HANDLE  handle;
     int     flags;
-    char*   buffer;
-    __u32   buffer_block_number;
-    ULONG   buffer_size;
+    PNT_CACHE_ENTRY cache;
+    char*   cache_buffer;
+    char*   flush_buffer;
+    ULONG   cache_sets;
+    ULONG   access_time;
+    __u64   discard_granularity;
+    __u64   discard_alignment;
+    BOOLEAN discard;
+    BOOLEAN zero_data;
     BOOLEAN read_only;
     BOOLEAN written;
     // Used by Rufus
@@ -80,6 +106,9 @@ static errcode_t nt_read_blk64(io_channel channel, unsigned long long block, int
 static errcode_t nt_write_blk(io_channel channel, unsigned long block, int count, const void *data);
 static errcode_t nt_write_blk64(io_channel channel, unsigned long long block, int count, const void* data);
 static errcode_t nt_flush(io_channel channel);
+static errcode_t nt_discard(io_channel channel, unsigned long long block, unsigned long long count);
+static errcode_t nt_cache_readahead(io_channel channel, unsigned long long block, unsigned long long count);
+static errcode_t nt_zeroout(io_channel channel, unsigned long long block, unsigned long long count);
 
 static struct struct_io_manager struct_nt_manager = {
 	.magic		= EXT2_ET_MAGIC_IO_MANAGER,
@@ -91,7 +120,10 @@ static struct struct_io_manager struct_nt_manager = {
 	.read_blk64	= nt_read_blk64,
 	.write_blk	= nt_write_blk,
 	.write_blk64	= nt_write_blk64,
-	.flush		= nt_flush
+	.flush		= nt_flush,
+	.discard	= nt_discard,
+	.cache_readahead = nt_cache_readahead,
+	.zeroout	= nt_zeroout
 };
 
 io_manager nt_io_manager(void)
@@ -441,6 +473,354 @@ static BOOLEAN _SetPartType(IN HANDLE Handle, IN UCHAR Type)
 						  IOCTL_DISK_SET_PARTITION_INFO, &Type, sizeof(Type), NULL, 0));
 }
 
+// Find out if the device supports TRIM/unmap, and if unmapped sectors read back as zeros
+static VOID _GetDiscardInfo(IN HANDLE Handle, OUT PBOOLEAN Supported, OUT PBOOLEAN ReadZeros,
+	OUT __u64 *Granularity, OUT __u64 *Alignment)
+{
+	STORAGE_PROPERTY_QUERY Query;
+	DEVICE_TRIM_DESCRIPTOR Trim;
+	DEVICE_LB_PROVISIONING_DESCRIPTOR Provisioning;
+	IO_STATUS_BLOCK IoStatusBlock;
+
+	*Supported = *ReadZeros = FALSE;
+	*Granularity = NT_DISCARD_GRANULARITY;
+	*Alignment = 0;
+	PF_INIT(NtDeviceIoControlFile, NtDll);
+	if (pfNtDeviceIoControlFile == NULL)
+		return;
+
+	RtlZeroMemory(&Query, sizeof(Query));
+	RtlZeroMemory(&Trim, sizeof(Trim));
+	Query.PropertyId = StorageDeviceTrimProperty;
+	Query.QueryType = PropertyStandardQuery;
+	if (!NT_SUCCESS(pfNtDeviceIoControlFile(Handle, NULL, NULL, NULL, &IoStatusBlock,
+						IOCTL_STORAGE_QUERY_PROPERTY, &Query, sizeof(Query), &Trim, sizeof(Trim))) ||
+	    !Trim.TrimEnabled)
+		return;
+	*Supported = TRUE;
+
+	RtlZeroMemory(&Provisioning, sizeof(Provisioning));
+	Query.PropertyId = StorageDeviceLBProvisioningProperty;
+	if (!NT_SUCCESS(pfNtDeviceIoControlFile(Handle, NULL, NULL, NULL, &IoStatusBlock,
+						IOCTL_STORAGE_QUERY_PROPERTY, &Query, sizeof(Query), &Provisioning, sizeof(Provisioning))))
+		return;
+	*ReadZeros = (BOOLEAN)Provisioning.ThinProvisioningReadZeros;
+	if (Provisioning.OptimalUnmapGranularity != 0)
+		*Granularity = Provisioning.OptimalUnmapGranularity;
+	if (Provisioning.UnmapGranularityAlignmentValid)
+		*Alignment = Provisioning.UnmapGranularityAlignment % *Granularity;
+}
+
+static BOOLEAN _Discard(IN HANDLE Handle, IN __u64 Offset, IN __u64 Bytes, OUT errcode_t *Errno)
+{
+	typedef struct {
+		DEVICE_MANAGE_DATA_SET_ATTRIBUTES Attributes;
+		DEVICE_DATA_SET_RANGE Range;
+	} TRIM_DATA_SET;
+	TRIM_DATA_SET Trim;
+	IO_STATUS_BLOCK IoStatusBlock;
+	NTSTATUS Status = STATUS_DLL_NOT_FOUND;
+	PF_INIT_OR_OUT(NtDeviceIoControlFile, NtDll);
+
+	RtlZeroMemory(&Trim, sizeof(Trim));
+	Trim.Attributes.Size = sizeof(Trim.Attributes);
+	Trim.Attributes.Action = DeviceDsmAction_Trim;
+	Trim.Attributes.Flags = DEVICE_DSM_FLAG_TRIM_NOT_FS_ALLOCATED;
+	Trim.Attributes.DataSetRangesOffset = FIELD_OFFSET(TRIM_DATA_SET, Range);
+	Trim.Attributes.DataSetRangesLength = sizeof(Trim.Range);
+	Trim.Range.StartingOffset = Offset;
+	Trim.Range.LengthInBytes = Bytes;
+	Status = pfNtDeviceIoControlFile(Handle, NULL, NULL, NULL, &IoStatusBlock,
+					 IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES, &Trim, sizeof(Trim), NULL, 0);
+
+out:
+	if (!NT_SUCCESS(Status)) {
+		*Errno = _MapNtStatus(Status);
+		return FALSE;
+	}
+	*Errno = 0;
+	return TRUE;
+}
+
+// Have the file system zero (or deallocate, for sparse image files) a range of a file
+static BOOLEAN _SetZeroData(IN HANDLE Handle, IN __u64 Offset, IN __u64 Bytes, OUT errcode_t *Errno)
+{
+	FILE_ZERO_DATA_INFORMATION ZeroData;
+	IO_STATUS_BLOCK IoStatusBlock;
+	NTSTATUS Status = STATUS_DLL_NOT_FOUND;
+	PF_INIT_OR_OUT(NtFsControlFile, NtDll);
+
+	ZeroData.FileOffset.QuadPart = Offset;
+	ZeroData.BeyondFinalZero.QuadPart = Offset + Bytes;
+	Status = pfNtFsControlFile(Handle, NULL, NULL, NULL, &IoStatusBlock,
+				   FSCTL_SET_ZERO_DATA, &ZeroData, sizeof(ZeroData), NULL, 0);
+
+out:
+	if (!NT_SUCCESS(Status)) {
+		*Errno = _MapNtStatus(Status);
+		return FALSE;
+	}
+	*Errno = 0;
+	return TRUE;
+}
+
+//
+// Block cache
+//
+static void _CacheFree(IN PNT_PRIVATE_DATA NtData)
+{
+	free(NtData->cache);
+	free(NtData->cache_buffer);
+	free(NtData->flush_buffer);
+	NtData->cache = NULL;
+	NtData->cache_buffer = NULL;
+	NtData->flush_buffer = NULL;
+}
+
+static errcode_t _CacheAlloc(IN PNT_PRIVATE_DATA NtData, IN int BlockSize)
+{
+	ULONG i;
+
+	_CacheFree(NtData);
+	NtData->cache_sets = max(NT_CACHE_BYTES / (BlockSize * NT_CACHE_WAYS), 1);
+	NtData->cache = calloc(NtData->cache_sets * NT_CACHE_WAYS, sizeof(NT_CACHE_ENTRY));
+	NtData->cache_buffer = malloc((size_t)NtData->cache_sets * NT_CACHE_WAYS * BlockSize);
+	if (NtData->cache == NULL || NtData->cache_buffer == NULL) {
+		_CacheFree(NtData);
+		return ENOMEM;
+	}
+	for (i = 0; i < NtData->cache_sets * NT_CACHE_WAYS; i++)
+		NtData->cache[i].buf = &NtData->cache_buffer[(size_t)i * BlockSize];
+	return 0;
+}
+
+// Metadata sits at the same offset in each block group, so hash the block number
+// rather than use it modulo the number of sets
+static __inline PNT_CACHE_ENTRY _CacheSet(IN PNT_PRIVATE_DATA NtData, IN unsigned long long Block)
+{
+	return &NtData->cache[(((Block * 0x9E3779B97F4A7C15ULL) >> 32) % NtData->cache_sets) * NT_CACHE_WAYS];
+}
+
+static PNT_CACHE_ENTRY _CacheFind(IN PNT_PRIVATE_DATA NtData, IN unsigned long long Block)
+{
+	PNT_CACHE_ENTRY set = _CacheSet(NtData, Block);
+	int i;
+
+	for (i = 0; i < NT_CACHE_WAYS; i++) {
+		if (set[i].in_use && set[i].block == Block) {
+			set[i].access_time = ++NtData->access_time;
+			return &set[i];
+		}
+	}
+	return NULL;
+}
+
+static int _CacheCompare(const void* a, const void* b)
+{
+	const NT_CACHE_ENTRY* ea = *(const NT_CACHE_ENTRY**)a;
+	const NT_CACHE_ENTRY* eb = *(const NT_CACHE_ENTRY**)b;
+
+	return (ea->block < eb->block) ? -1 : ((ea->block > eb->block) ? 1 : 0);
+}
+
+// Write all the dirty blocks, in order, and merging adjacent ones into single writes
+static errcode_t _CacheFlush(IN io_channel Channel, IN PNT_PRIVATE_DATA NtData)
+{
+	PNT_CACHE_ENTRY* dirty = NULL;
+	LARGE_INTEGER offset;
+	ULONG i, j, k, num_dirty = 0, run_max = NT_FLUSH_MAX_WRITE / Channel->block_size;
+	ULONG size;
+	char* data;
+	errcode_t errcode = 0;
+
+	if (NtData->cache == NULL)
+		return 0;
+	for (i = 0; i < NtData->cache_sets * NT_CACHE_WAYS; i++) {
+		if (NtData->cache[i].dirty)
+			num_dirty++;
+	}
+	if (num_dirty == 0)
+		return 0;
+
+	dirty = malloc(num_dirty * sizeof(PNT_CACHE_ENTRY));
+	if (dirty == NULL)
+		return ENOMEM;
+	for (i = 0, j = 0; i < NtData->cache_sets * NT_CACHE_WAYS; i++) {
+		if (NtData->cache[i].dirty)
+			dirty[j++] = &NtData->cache[i];
+	}
+	qsort(dirty, num_dirty, sizeof(PNT_CACHE_ENTRY), _CacheCompare);
+
+	for (i = 0; i < num_dirty; i = j) {
+		// Find the run of adjacent blocks that starts here
+		for (j = i + 1; j < num_dirty && j - i < run_max && dirty[j]->block == dirty[j - 1]->block + 1; j++);
+		size = (j - i) * Channel->block_size;
+		if (j - i == 1) {
+			data = dirty[i]->buf;
+		} else {
+			if (NtData->flush_buffer == NULL) {
+				NtData->flush_buffer = malloc(NT_FLUSH_MAX_WRITE);
+				if (NtData->flush_buffer == NULL) {
+					errcode = ENOMEM;
+					break;
+				}
+			}
+			data = NtData->flush_buffer;
+			for (k = i; k < j; k++)
+				memcpy(&data[(k - i) * Channel->block_size], dirty[k]->buf, Channel->block_size);
+		}
+		offset.QuadPart = dirty[i]->block * Channel->block_size + NtData->offset;
+		if (!_RawWrite(NtData->handle, offset, size, data, &errcode)) {
+			if (Channel->write_error)
+				errcode = (Channel->write_error)(Channel, dirty[i]->block, j - i, data, size, 0, errcode);
+			if (errcode)
+				break;
+		}
+		for (k = i; k < j; k++)
+			dirty[k]->dirty = FALSE;
+	}
+
+	free(dirty);
+	return errcode;
+}
+
+// Get an entry to cache Block into, reusing the least recently used one of its set
+static PNT_CACHE_ENTRY _CacheGet(IN io_channel Channel, IN PNT_PRIVATE_DATA NtData, IN unsigned long long Block, OUT errcode_t* Errno)
+{
+	PNT_CACHE_ENTRY set = _CacheSet(NtData, Block), entry = NULL;
+	int i;
+
+	for (i = 0; i < NT_CACHE_WAYS; i++) {
+		if (!set[i].in_use) {
+			entry = &set[i];
+			break;
+		}
+		if (entry == NULL || set[i].access_time < entry->access_time)
+			entry = &set[i];
+	}
+
+	// Rather than write this block alone, write everything that's dirty
+	if (entry->dirty) {
+		*Errno = _CacheFlush(Channel, NtData);
+		if (*Errno)
+			return NULL;
+	}
+
+	entry->block = Block;
+	entry->in_use = TRUE;
+	entry->dirty = FALSE;
+	entry->access_time = ++NtData->access_time;
+	return entry;
+}
+
+// Keep the cache in line with a direct read or write of Size bytes from Block. On read, we
+// copy the blocks that are more recent in the cache, and on write, we update the cache.
+static void _CacheSync(IN io_channel Channel, IN PNT_PRIVATE_DATA NtData, IN unsigned long long Block, IN ULONG Size, IN OUT PCHAR Buffer, IN BOOLEAN Read)
+{
+	PNT_CACHE_ENTRY entry;
+	unsigned long long num_blocks = (Size + Channel->block_size - 1) / Channel->block_size, i;
+	ULONG pos, len;
+
+	if (NtData->cache == NULL)
+		return;
+	for (i = 0; i < NtData->cache_sets * NT_CACHE_WAYS; i++) {
+		// Look up each block, unless the range is larger than the cache
+		if (num_blocks <= NtData->cache_sets * NT_CACHE_WAYS) {
+			if (i >= num_blocks)
+				break;
+			entry = _CacheFind(NtData, Block + i);
+			if (entry == NULL)
+				continue;
+		} else {
+			entry = &NtData->cache[i];
+			if (!entry->in_use || entry->block < Block || entry->block >= Block + num_blocks)
+				continue;
+		}
+		pos = (ULONG)(entry->block - Block) * Channel->block_size;
+		len = min(Size - pos, (ULONG)Channel->block_size);
+		if (!Read)
+			memcpy(entry->buf, &Buffer[pos], len);
+		else if (entry->dirty)
+			memcpy(&Buffer[pos], entry->buf, len);
+	}
+}
+
+// Forget about the cached copies of Count blocks from Block, dirty or not
+static void _CacheDrop(IN PNT_PRIVATE_DATA NtData, IN unsigned long long Block, IN unsigned long long Count)
+{
+	PNT_CACHE_ENTRY entry;
+	unsigned long long i;
+
+	if (NtData->cache == NULL)
+		return;
+	for (i = 0; i < NtData->cache_sets * NT_CACHE_WAYS; i++) {
+		if (Count <= NtData->cache_sets * NT_CACHE_WAYS) {
+			if (i >= Count)
+				break;
+			entry = _CacheFind(NtData, Block + i);
+			if (entry == NULL)
+				continue;
+		} else {
+			entry = &NtData->cache[i];
+			if (!entry->in_use || entry->block < Block || entry->block >= Block + Count)
+				continue;
+		}
+		entry->in_use = FALSE;
+		entry->dirty = FALSE;
+	}
+}
+
+//
+// Zeroing and discard
+//
+static errcode_t _WriteZeros(IN PNT_PRIVATE_DATA NtData, IN __u64 Start, IN __u64 End)
+{
+	LARGE_INTEGER offset;
+	ULONG size;
+	errcode_t errcode = 0;
+
+	if (Start >= End)
+		return 0;
+	if (NtData->flush_buffer == NULL) {
+		NtData->flush_buffer = malloc(NT_FLUSH_MAX_WRITE);
+		if (NtData->flush_buffer == NULL)
+			return ENOMEM;
+	}
+	memset(NtData->flush_buffer, 0, (size_t)min(End - Start, NT_FLUSH_MAX_WRITE));
+
+	// Issue the largest writes we can, aligned to their size
+	while (Start < End) {
+		size = (ULONG)min(End - Start, NT_FLUSH_MAX_WRITE - (Start % NT_FLUSH_MAX_WRITE));
+		offset.QuadPart = Start;
+		if (!_RawWrite(NtData->handle, offset, size, NtData->flush_buffer, &errcode))
+			return errcode;
+		Start += size;
+	}
+	return 0;
+}
+
+// Unmap the part of [Start, End) that matches the device granularity, and optionally zero the rest
+static errcode_t _Unmap(IN PNT_PRIVATE_DATA NtData, IN __u64 Start, IN __u64 End, IN BOOLEAN ZeroEdges)
+{
+	__u64 g = NtData->discard_granularity, a = NtData->discard_alignment;
+	__u64 aligned_start, aligned_end;
+	errcode_t errcode = 0;
+
+	aligned_start = ((Start + g - 1 - a) / g) * g + a;
+	aligned_end = (End < a) ? 0 : ((End - a) / g) * g + a;
+	if (aligned_start >= aligned_end)
+		return ZeroEdges ? _WriteZeros(NtData, Start, End) : 0;
+
+	if (!_Discard(NtData->handle, aligned_start, aligned_end - aligned_start, &errcode))
+		return errcode;
+	if (ZeroEdges) {
+		errcode = _WriteZeros(NtData, Start, aligned_start);
+		if (!errcode)
+			errcode = _WriteZeros(NtData, aligned_end, End);
+	}
+	return errcode;
+}
+
 //
 // Interface functions.
 // Is_mounted is set to 1 if the device is mounted, 0 otherwise
@@ -522,11 +902,9 @@ static errcode_t nt_open(const char *name, int flags, io_channel *channel)
 		goto out;
 	}
 
-	nt_data->buffer = malloc(EXT2_MIN_BLOCK_SIZE);
-	if (nt_data->buffer == NULL) {
-		errcode = ENOMEM;
+	errcode = _CacheAlloc(nt_data, EXT2_MIN_BLOCK_SIZE);
+	if (errcode)
 		goto out;
-	}
 
 	// Initialize data
 	io->magic = EXT2_ET_MAGIC_IO_CHANNEL;
@@ -536,8 +914,6 @@ static errcode_t nt_open(const char *name, int flags, io_channel *channel)
 	io->refcount = 1;
 
 	nt_data->magic = EXT2_ET_MAGIC_NT_IO_CHANNEL;
-	nt_data->buffer_block_number = 0xffffffff;
-	nt_data->buffer_size = EXT2_MIN_BLOCK_SIZE;
 	io->private_data = nt_data;
 
 	// Open the device
@@ -548,6 +924,16 @@ static errcode_t nt_open(const char *name, int flags, io_channel *channel)
 		goto out;
 	}
 
+	// Find out what we can use for discard and zeroout
+	if (!nt_data->read_only) {
+		BOOLEAN read_zeros;
+		_GetDiscardInfo(nt_data->handle, &nt_data->discard, &read_zeros,
+			&nt_data->discard_granularity, &nt_data->discard_alignment);
+		if (nt_data->discard && read_zeros)
+			io->flags |= CHANNEL_FLAGS_DISCARD_ZEROES;
+		nt_data->zero_data = TRUE;
+	}
+
 	// Done
 	*channel = io;
 
@@ -563,7 +949,7 @@ out:
 				_UnlockDrive(nt_data->handle);
 				_CloseDisk(nt_data->handle);
 			}
-			free(nt_data->buffer);
+			_CacheFree(nt_data);
 			free(nt_data);
 		}
 	}
@@ -574,6 +960,7 @@ out:
 static errcode_t nt_close(io_channel channel)
 {
 	PNT_PRIVATE_DATA nt_data = NULL;
+	errcode_t errcode = 0;
 
 	if (channel == NULL)
 		return 0;
@@ -585,17 +972,21 @@ static errcode_t nt_close(io_channel channel)
 	if (--channel->refcount > 0)
 		return 0;
 
+	// Write what we still have in the cache
+	if (!nt_data->read_only)
+		errcode = _CacheFlush(channel, nt_data);
+
 	free(channel->name);
 	free(channel);
 
 	if (nt_data != NULL) {
 		if (nt_data->handle != NULL)
 			CloseHandle(nt_data->handle);
-		free(nt_data->buffer);
+		_CacheFree(nt_data);
 		free(nt_data);
 	}
 
-	return 0;
+	return errcode;
 }
 
 static errcode_t nt_set_blksize(io_channel channel, int blksize)
@@ -607,16 +998,14 @@ static errcode_t nt_set_blksize(io_channel channel, int blksize)
 	EXT2_CHECK_MAGIC(nt_data, EXT2_ET_MAGIC_NT_IO_CHANNEL);
 
 	if (channel->block_size != blksize) {
-		channel->block_size = blksize;
+		errcode_t errcode = _CacheFlush(channel, nt_data);
+		if (errcode)
+			return errcode;
 
-		free(nt_data->buffer);
-		nt_data->buffer_block_number = 0xffffffff;
-		nt_data->buffer_size = channel->block_size;
-		assert((nt_data->buffer_size % 512) == 0);
+		channel->block_size = blksize;
+		assert((channel->block_size % 512) == 0);
 
-		nt_data->buffer = malloc(nt_data->buffer_size);
-		if (nt_data->buffer == NULL)
-			return ENOMEM;
+		return _CacheAlloc(nt_data, blksize);
 	}
 
 	return 0;
@@ -624,8 +1013,7 @@ static errcode_t nt_set_blksize(io_channel channel, int blksize)
 
 static errcode_t nt_read_blk64(io_channel channel, unsigned long long block, int count, void *buf)
 {
-	PVOID read_buffer;
-	ULONG read_size;
+	PNT_CACHE_ENTRY entry;
 	ULONG size;
 	LARGE_INTEGER offset;
 	PNT_PRIVATE_DATA nt_data = NULL;
@@ -635,40 +1023,36 @@ static errcode_t nt_read_blk64(io_channel channel, unsigned long long block, int
 	nt_data = (PNT_PRIVATE_DATA) channel->private_data;
 	EXT2_CHECK_MAGIC(nt_data, EXT2_ET_MAGIC_NT_IO_CHANNEL);
 
-	// If it's in the cache, use it!
-	if ((count == 1) && (block == nt_data->buffer_block_number) &&
-	    (nt_data->buffer_block_number != 0xffffffff)) {
-		memcpy(buf, nt_data->buffer, channel->block_size);
-		return 0;
-	}
-
 	size = (count < 0) ? (ULONG)(-count) : (ULONG)(count * channel->block_size);
-
 	offset.QuadPart = block * channel->block_size + nt_data->offset;
 
-	// If not fit to the block
-	if (size <= nt_data->buffer_size) {
-		// Update the cache
-		nt_data->buffer_block_number = block;
-		read_buffer = nt_data->buffer;
-		read_size = nt_data->buffer_size;
-	} else {
-		read_size = size;
-		read_buffer = buf;
-		assert((read_size % channel->block_size) == 0);
+	// Single blocks go through the cache
+	if (count == 1) {
+		entry = _CacheFind(nt_data, block);
+		if (entry == NULL) {
+			entry = _CacheGet(channel, nt_data, block, &errcode);
+			if (entry == NULL)
+				return errcode;
+			if (!_RawRead(nt_data->handle, offset, size, entry->buf, &errcode)) {
+				entry->in_use = FALSE;
+				if (channel->read_error)
+					return (channel->read_error)(channel, block, count, buf, size, 0, errcode);
+				else
+					return errcode;
+			}
+		}
+		memcpy(buf, entry->buf, size);
+		return 0;
 	}
 
-	if (!_RawRead(nt_data->handle, offset, read_size, read_buffer, &errcode)) {
+	// Anything else is read directly, with what's more recent in the cache on top
+	if (!_RawRead(nt_data->handle, offset, size, buf, &errcode)) {
 		if (channel->read_error)
 			return (channel->read_error)(channel, block, count, buf, size, 0, errcode);
 		else
 			return errcode;
 	}
-
-	if (read_buffer != buf) {
-		assert(size <= read_size);
-		memcpy(buf, read_buffer, size);
-	}
+	_CacheSync(channel, nt_data, block, size, buf, TRUE);
 
 	return 0;
 }
@@ -680,10 +1064,12 @@ static errcode_t nt_read_blk(io_channel channel, unsigned long block, int count,
 
 static errcode_t nt_write_blk64(io_channel channel, unsigned long long block, int count, const void *buf)
 {
+	PNT_CACHE_ENTRY entry;
 	ULONG write_size;
 	LARGE_INTEGER offset;
 	PNT_PRIVATE_DATA nt_data = NULL;
 	errcode_t errcode = 0;
+	int i;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	nt_data = (PNT_PRIVATE_DATA) channel->private_data;
@@ -692,18 +1078,29 @@ static errcode_t nt_write_blk64(io_channel channel, unsigned long long block, in
 	if (nt_data->read_only)
 		return EACCES;
 
-	if (count == 1) {
-		write_size = channel->block_size;
-	} else {
-		nt_data->buffer_block_number = 0xffffffff;
-		if (count < 0)
-			write_size = (ULONG)(-count);
-		else
-			write_size = (ULONG)(count * channel->block_size);
-	}
-
+	if (count < 0)
+		write_size = (ULONG)(-count);
+	else
+		write_size = (ULONG)(count * channel->block_size);
 
 	assert((write_size % 512) == 0);
+	nt_data->written = TRUE;
+
+	// Small writes of whole blocks only go to the cache, until we flush it
+	if ((count > 0) && (write_size <= NT_CACHE_MAX_WRITE) && !(channel->flags & CHANNEL_FLAGS_WRITETHROUGH)) {
+		for (i = 0; i < count; i++) {
+			entry = _CacheFind(nt_data, block + i);
+			if (entry == NULL) {
+				entry = _CacheGet(channel, nt_data, block + i, &errcode);
+				if (entry == NULL)
+					return errcode;
+			}
+			memcpy(entry->buf, (const char*)buf + (size_t)i * channel->block_size, channel->block_size);
+			entry->dirty = TRUE;
+		}
+		return 0;
+	}
+
 	offset.QuadPart = block * channel->block_size + nt_data->offset;
 
 	if (!_RawWrite(nt_data->handle, offset, write_size, buf, &errcode)) {
@@ -713,14 +1110,9 @@ static errcode_t nt_write_blk64(io_channel channel, unsigned long long block, in
 			return errcode;
 	}
 
-
-	// Stash a copy.
-	if(write_size >= nt_data->buffer_size) {
-		nt_data->buffer_block_number = block;
-		memcpy(nt_data->buffer, buf, nt_data->buffer_size);
-	}
-
-	nt_data->written = TRUE;
+	// Update the blocks we have in the cache. Dirty ones stay dirty, and are
+	// written with the data we got here when we flush them.
+	_CacheSync(channel, nt_data, block, write_size, (PCHAR)buf, FALSE);
 
 	return 0;
 }
@@ -733,6 +1125,7 @@ static errcode_t nt_write_blk(io_channel channel, unsigned long block, int count
 static errcode_t nt_flush(io_channel channel)
 {
 	PNT_PRIVATE_DATA nt_data = NULL;
+	errcode_t errcode = 0;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	nt_data = (PNT_PRIVATE_DATA) channel->private_data;
@@ -741,6 +1134,10 @@ static errcode_t nt_flush(io_channel channel)
 	if(nt_data->read_only)
 		return 0;
 
+	// Write the cached blocks.
+	errcode = _CacheFlush(channel, nt_data);
+	if (errcode)
+		return errcode;
 
 	// Flush file buffers.
 	_FlushDrive(nt_data->handle);
@@ -752,3 +1149,108 @@ static errcode_t nt_flush(io_channel channel)
 
 	return 0;
 }
+
+static errcode_t nt_discard(io_channel channel, unsigned long long block, unsigned long long count)
+{
+	PNT_PRIVATE_DATA nt_data = NULL;
+	__u64 start;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	nt_data = (PNT_PRIVATE_DATA) channel->private_data;
+	EXT2_CHECK_MAGIC(nt_data, EXT2_ET_MAGIC_NT_IO_CHANNEL);
+
+	if (nt_data->read_only)
+		return EACCES;
+	if (!nt_data->discard)
+		return EXT2_ET_UNIMPLEMENTED;
+
+	_CacheDrop(nt_data, block, count);
+	nt_data->written = TRUE;
+	start = block * channel->block_size + nt_data->offset;
+
+	// If we advertised that discarded blocks read back as zeros, make sure it's true for the
+	// parts of the range that are not aligned to the unmap granularity
+	return _Unmap(nt_data, start, start + count * channel->block_size,
+		(BOOLEAN)BooleanFlagOn(channel->flags, CHANNEL_FLAGS_DISCARD_ZEROES));
+}
+
+static errcode_t nt_cache_readahead(io_channel channel, unsigned long long block, unsigned long long count)
+{
+	PNT_CACHE_ENTRY entry;
+	LARGE_INTEGER offset;
+	PNT_PRIVATE_DATA nt_data = NULL;
+	unsigned long long i, j, k, run_max;
+	char* buf = NULL;
+	errcode_t errcode = 0;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	nt_data = (PNT_PRIVATE_DATA) channel->private_data;
+	EXT2_CHECK_MAGIC(nt_data, EXT2_ET_MAGIC_NT_IO_CHANNEL);
+
+	// No point in reading more than what the cache can hold
+	count = min(count, (unsigned long long)nt_data->cache_sets * NT_CACHE_WAYS);
+	run_max = min(count, NT_FLUSH_MAX_WRITE / channel->block_size);
+
+	for (i = 0; i < count; i = j) {
+		if (_CacheFind(nt_data, block + i) != NULL) {
+			j = i + 1;
+			continue;
+		}
+		// Read the run of blocks we don't have at once
+		for (j = i + 1; j < count && j - i < run_max && _CacheFind(nt_data, block + j) == NULL; j++);
+		if (buf == NULL) {
+			buf = malloc((size_t)run_max * channel->block_size);
+			if (buf == NULL)
+				return ENOMEM;
+		}
+		offset.QuadPart = (block + i) * channel->block_size + nt_data->offset;
+		if (!_RawRead(nt_data->handle, offset, (ULONG)((j - i) * channel->block_size), buf, &errcode))
+			break;
+		for (k = i; k < j; k++) {
+			entry = _CacheGet(channel, nt_data, block + k, &errcode);
+			if (entry == NULL)
+				break;
+			memcpy(entry->buf, &buf[(k - i) * channel->block_size], channel->block_size);
+		}
+		if (errcode)
+			break;
+	}
+
+	free(buf);
+	return errcode;
+}
+
+static errcode_t nt_zeroout(io_channel channel, unsigned long long block, unsigned long long count)
+{
+	PNT_PRIVATE_DATA nt_data = NULL;
+	__u64 start, end;
+	errcode_t errcode = 0;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	nt_data = (PNT_PRIVATE_DATA) channel->private_data;
+	EXT2_CHECK_MAGIC(nt_data, EXT2_ET_MAGIC_NT_IO_CHANNEL);
+
+	if (nt_data->read_only)
+		return EACCES;
+
+	// Whatever we cached for these blocks is superseded
+	_CacheDrop(nt_data, block, count);
+	nt_data->written = TRUE;
+	start = block * channel->block_size + nt_data->offset;
+	end = start + count * channel->block_size;
+
+	// Image files can have the file system zero (or deallocate) the range for us.
+	// Devices fail that request, so we don't try it again once it did.
+	if (nt_data->zero_data) {
+		if (_SetZeroData(nt_data->handle, start, end - start, &errcode))
+			return 0;
+		nt_data->zero_data = FALSE;
+	}
+
+	// Unmapping is the fastest, when the device guarantees that we'll read zeros afterwards
+	if (BooleanFlagOn(channel->flags, CHANNEL_FLAGS_DISCARD_ZEROES) &&
+	    (_Unmap(nt_data, start, end, TRUE) == 0))
+		return 0;
+
+	return _WriteZeros(nt_data, start, end);
+}
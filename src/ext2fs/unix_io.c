@@ -0,0 +1,510 @@
+/*
+ * unix_io.c --- This is the Unix (well, really POSIX) implementation
+ * 	of the I/O manager.
+ *
+ * Rufus: This is a reduced version of the e2fsprogs manager, for regular
+ * files only, so that the formatting code can be run and measured on
+ * Linux hosts, without a device attached. It isn't part of the Windows
+ * build, which uses nt_io.c.
+ *
+ * Copyright (C) 1993, 1994, 1995 Theodore Ts'o.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+
+/* Alignment of the buffers, offsets and sizes used with O_DIRECT */
+#define UNIX_IO_DIRECT_ALIGN	4096
+
+struct unix_private_data {
+	int	magic;
+	int	dev;
+	int	flags;
+	int	align;
+	char	*bounce;
+	size_t	bounce_size;
+	struct struct_io_stats io_stats;
+};
+
+static errcode_t unix_open(const char *name, int flags, io_channel *channel);
+static errcode_t unix_close(io_channel channel);
+static errcode_t unix_set_blksize(io_channel channel, int blksize);
+static errcode_t unix_read_blk(io_channel channel, unsigned long block,
+			       int count, void *data);
+static errcode_t unix_write_blk(io_channel channel, unsigned long block,
+				int count, const void *data);
+static errcode_t unix_flush(io_channel channel);
+static errcode_t unix_get_stats(io_channel channel, io_stats *stats);
+static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
+				 int count, void *data);
+static errcode_t unix_write_blk64(io_channel channel, unsigned long long block,
+				  int count, const void *data);
+static errcode_t unix_discard(io_channel channel, unsigned long long block,
+			      unsigned long long count);
+static errcode_t unix_cache_readahead(io_channel channel,
+				      unsigned long long block,
+				      unsigned long long count);
+static errcode_t unix_zeroout(io_channel channel, unsigned long long block,
+			      unsigned long long count);
+
+static struct struct_io_manager struct_unix_manager = {
+	.magic		= EXT2_ET_MAGIC_IO_MANAGER,
+	.name		= "Unix I/O Manager",
+	.open		= unix_open,
+	.close		= unix_close,
+	.set_blksize	= unix_set_blksize,
+	.read_blk	= unix_read_blk,
+	.write_blk	= unix_write_blk,
+	.flush		= unix_flush,
+	.get_stats	= unix_get_stats,
+	.read_blk64	= unix_read_blk64,
+	.write_blk64	= unix_write_blk64,
+	.discard	= unix_discard,
+	.cache_readahead = unix_cache_readahead,
+	.zeroout	= unix_zeroout,
+};
+
+io_manager unix_io_manager = &struct_unix_manager;
+
+/*
+ * Make sure we have an aligned buffer of at least size bytes, for the
+ * requests that O_DIRECT can't take as they are.
+ */
+static errcode_t get_bounce(struct unix_private_data *data, size_t size)
+{
+	errcode_t	retval;
+
+	if (data->bounce_size >= size)
+		return 0;
+	ext2fs_free_mem(&data->bounce);
+	data->bounce_size = 0;
+	retval = ext2fs_get_memalign(size, data->align, &data->bounce);
+	if (retval)
+		return retval;
+	data->bounce_size = size;
+	return 0;
+}
+
+static errcode_t raw_pread(struct unix_private_data *data, ext2_loff_t offset,
+			   size_t size, char *buf, size_t *actual)
+{
+	ssize_t		r;
+
+	*actual = 0;
+	while (*actual < size) {
+		r = pread(data->dev, buf + *actual, size - *actual,
+			  offset + *actual);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		if (r == 0)
+			break;
+		*actual += r;
+	}
+	data->io_stats.bytes_read += *actual;
+	return 0;
+}
+
+static errcode_t raw_pwrite(struct unix_private_data *data, ext2_loff_t offset,
+			    size_t size, const char *buf)
+{
+	ssize_t		r;
+	size_t		done = 0;
+
+	while (done < size) {
+		r = pwrite(data->dev, buf + done, size - done, offset + done);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		if (r == 0)
+			return EXT2_ET_SHORT_WRITE;
+		done += r;
+	}
+	data->io_stats.bytes_written += done;
+	return 0;
+}
+
+static int is_aligned(struct unix_private_data *data, ext2_loff_t offset,
+		      size_t size, const void *buf)
+{
+	return !(data->flags & IO_FLAG_DIRECT_IO) ||
+		(((offset | size | (uintptr_t) buf) &
+		  (unsigned) (data->align - 1)) == 0);
+}
+
+static errcode_t raw_read_blk(io_channel channel,
+			      struct unix_private_data *data,
+			      unsigned long long block,
+			      int count, void *bufv)
+{
+	errcode_t	retval;
+	size_t		size, actual = 0;
+	ext2_loff_t	location, start;
+	size_t		len;
+
+	size = (count < 0) ? (size_t) -count : (size_t) count * channel->block_size;
+	location = (ext2_loff_t) block * channel->block_size;
+
+	if (is_aligned(data, location, size, bufv)) {
+		retval = raw_pread(data, location, size, bufv, &actual);
+	} else {
+		/* Go through an aligned buffer that covers the request */
+		start = location & ~((ext2_loff_t) data->align - 1);
+		len = (location - start + size + data->align - 1) &
+			~((size_t) data->align - 1);
+		retval = get_bounce(data, len);
+		if (retval == 0)
+			retval = raw_pread(data, start, len, data->bounce,
+					   &actual);
+		actual = (actual > (size_t) (location - start)) ?
+			actual - (location - start) : 0;
+		if (actual > size)
+			actual = size;
+		memcpy(bufv, data->bounce + (location - start), actual);
+	}
+	if (retval == 0 && actual != size)
+		retval = EXT2_ET_SHORT_READ;
+	if (retval) {
+		/* Don't hand out stale data for what we couldn't read */
+		memset((char *) bufv + actual, 0, size - actual);
+		if (channel->read_error)
+			retval = (channel->read_error)(channel, block, count,
+						       bufv, size, actual,
+						       retval);
+	}
+	return retval;
+}
+
+static errcode_t raw_write_blk(io_channel channel,
+			       struct unix_private_data *data,
+			       unsigned long long block,
+			       int count, const void *bufv)
+{
+	errcode_t	retval;
+	size_t		size, actual;
+	ext2_loff_t	location, start;
+	size_t		len;
+
+	size = (count < 0) ? (size_t) -count : (size_t) count * channel->block_size;
+	location = (ext2_loff_t) block * channel->block_size;
+
+	if (is_aligned(data, location, size, bufv)) {
+		retval = raw_pwrite(data, location, size, bufv);
+	} else {
+		/* Read, modify and write the aligned region around the request */
+		start = location & ~((ext2_loff_t) data->align - 1);
+		len = (location - start + size + data->align - 1) &
+			~((size_t) data->align - 1);
+		retval = get_bounce(data, len);
+		if (retval == 0)
+			retval = raw_pread(data, start, len, data->bounce,
+					   &actual);
+		if (retval == 0) {
+			if (actual < len)
+				memset(data->bounce + actual, 0, len - actual);
+			memcpy(data->bounce + (location - start), bufv, size);
+			retval = raw_pwrite(data, start, len, data->bounce);
+		}
+	}
+	if (retval && channel->write_error)
+		retval = (channel->write_error)(channel, block, count, bufv,
+						size, 0, retval);
+	return retval;
+}
+
+static errcode_t unix_open(const char *name, int flags, io_channel *channel)
+{
+	io_channel	io = NULL;
+	struct unix_private_data *data = NULL;
+	errcode_t	retval;
+	int		open_flags;
+	struct stat	st;
+
+	if (name == 0)
+		return EXT2_ET_BAD_DEVICE_NAME;
+	retval = ext2fs_get_mem(sizeof(struct struct_io_channel), &io);
+	if (retval)
+		goto cleanup;
+	memset(io, 0, sizeof(struct struct_io_channel));
+	io->magic = EXT2_ET_MAGIC_IO_CHANNEL;
+	retval = ext2fs_get_mem(sizeof(struct unix_private_data), &data);
+	if (retval)
+		goto cleanup;
+
+	io->manager = unix_io_manager;
+	retval = ext2fs_get_mem(strlen(name)+1, &io->name);
+	if (retval)
+		goto cleanup;
+
+	strcpy(io->name, name);
+	io->private_data = data;
+	io->block_size = 1024;
+	io->read_error = 0;
+	io->write_error = 0;
+	io->refcount = 1;
+
+	memset(data, 0, sizeof(struct unix_private_data));
+	data->magic = EXT2_ET_MAGIC_UNIX_IO_CHANNEL;
+	data->io_stats.num_fields = 2;
+	data->flags = flags;
+	data->align = 1;
+	data->dev = -1;
+
+	open_flags = (flags & IO_FLAG_RW) ? O_RDWR : O_RDONLY;
+	if (flags & IO_FLAG_EXCLUSIVE)
+		open_flags |= O_EXCL;
+#ifdef O_DIRECT
+	if (flags & IO_FLAG_DIRECT_IO) {
+		open_flags |= O_DIRECT;
+		data->align = UNIX_IO_DIRECT_ALIGN;
+		io->align = UNIX_IO_DIRECT_ALIGN;
+	}
+#else
+	data->flags &= ~IO_FLAG_DIRECT_IO;
+#endif
+
+	data->dev = open(io->name, open_flags);
+	if (data->dev < 0) {
+		retval = errno;
+		goto cleanup;
+	}
+	if (fstat(data->dev, &st) == 0 && !S_ISREG(st.st_mode)) {
+		retval = EXT2_ET_UNIMPLEMENTED;
+		goto cleanup;
+	}
+
+	/*
+	 * Discarding a range of a regular file punches a hole in it, and holes
+	 * always read back as zeros.
+	 */
+	io->flags |= CHANNEL_FLAGS_DISCARD_ZEROES;
+
+	*channel = io;
+	return 0;
+
+cleanup:
+	if (data) {
+		if (data->dev >= 0)
+			close(data->dev);
+		ext2fs_free_mem(&data);
+	}
+	if (io) {
+		if (io->name)
+			ext2fs_free_mem(&io->name);
+		ext2fs_free_mem(&io);
+	}
+	return retval;
+}
+
+static errcode_t unix_close(io_channel channel)
+{
+	struct unix_private_data *data;
+	errcode_t	retval = 0;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (--channel->refcount > 0)
+		return 0;
+
+	if (close(data->dev) < 0)
+		retval = errno;
+	ext2fs_free_mem(&data->bounce);
+	ext2fs_free_mem(&channel->private_data);
+	if (channel->name)
+		ext2fs_free_mem(&channel->name);
+	ext2fs_free_mem(&channel);
+	return retval;
+}
+
+static errcode_t unix_set_blksize(io_channel channel, int blksize)
+{
+	struct unix_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	channel->block_size = blksize;
+	return 0;
+}
+
+static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
+				 int count, void *buf)
+{
+	struct unix_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	return raw_read_blk(channel, data, block, count, buf);
+}
+
+static errcode_t unix_read_blk(io_channel channel, unsigned long block,
+			       int count, void *buf)
+{
+	return unix_read_blk64(channel, block, count, buf);
+}
+
+static errcode_t unix_write_blk64(io_channel channel, unsigned long long block,
+				  int count, const void *buf)
+{
+	struct unix_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	return raw_write_blk(channel, data, block, count, buf);
+}
+
+static errcode_t unix_write_blk(io_channel channel, unsigned long block,
+				int count, const void *buf)
+{
+	return unix_write_blk64(channel, block, count, buf);
+}
+
+static errcode_t unix_flush(io_channel channel)
+{
+	struct unix_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if ((data->flags & IO_FLAG_RW) && fsync(data->dev) < 0)
+		return errno;
+	return 0;
+}
+
+static errcode_t unix_get_stats(io_channel channel, io_stats *stats)
+{
+	struct unix_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (stats)
+		*stats = &data->io_stats;
+	return 0;
+}
+
+static errcode_t unix_discard(io_channel channel, unsigned long long block,
+			      unsigned long long count)
+{
+	struct unix_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+	if (fallocate(data->dev, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      (off_t) block * channel->block_size,
+		      (off_t) count * channel->block_size) == 0)
+		return 0;
+	if (errno == EOPNOTSUPP)
+		return EXT2_ET_UNIMPLEMENTED;
+	return errno;
+#else
+	return EXT2_ET_UNIMPLEMENTED;
+#endif
+}
+
+static errcode_t unix_cache_readahead(io_channel channel,
+				      unsigned long long block,
+				      unsigned long long count)
+{
+	struct unix_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+#ifdef POSIX_FADV_WILLNEED
+	return posix_fadvise(data->dev, (off_t) block * channel->block_size,
+			     (off_t) count * channel->block_size,
+			     POSIX_FADV_WILLNEED);
+#else
+	return EXT2_ET_OP_NOT_SUPPORTED;
+#endif
+}
+
+static errcode_t unix_zeroout(io_channel channel, unsigned long long block,
+			      unsigned long long count)
+{
+	struct unix_private_data *data;
+	struct stat	st;
+	off_t		start, len;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (!(data->flags & IO_FLAG_RW))
+		return EXT2_ET_RO_FILSYS;
+	start = (off_t) block * channel->block_size;
+	len = (off_t) count * channel->block_size;
+
+	/* Extending the file is enough for what lies past its end */
+	if (fstat(data->dev, &st) < 0)
+		return errno;
+	if (st.st_size < start + len) {
+		if (ftruncate(data->dev, start + len) < 0)
+			return errno;
+		if (st.st_size <= start)
+			return 0;
+		len = st.st_size - start;
+	}
+
+#ifdef FALLOC_FL_ZERO_RANGE
+	if (fallocate(data->dev, FALLOC_FL_ZERO_RANGE, start, len) == 0)
+		return 0;
+#endif
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+	if (fallocate(data->dev, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      start, len) == 0)
+		return 0;
+#endif
+	/* Let the caller write the zeros */
+	return EXT2_ET_UNIMPLEMENTED;
+}
+
+/*
+ * We only ever deal with image files, which can't be mounted
+ */
+errcode_t ext2fs_check_mount_point(const char *file EXT2FS_ATTR((unused)),
+				   int *mount_flags,
+				   char *mtpt, int mtlen)
+{
+	*mount_flags = 0;
+	if (mtpt && mtlen > 0)
+		*mtpt = 0;
+	return 0;
+}
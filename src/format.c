@@ -60,15 +60,23 @@ DWORD FormatStatus = 0, LastWriteError = 0;
 badblocks_report report = { 0 };
 static float format_percent = 0.0f;
 static int task_number = 0;
-static unsigned int sec_buf_pos = 0;
 extern const int nb_steps[FS_MAX];
 extern uint32_t dur_mins, dur_secs;
+extern uint32_t sum_count[CHECKSUM_MAX];
+extern BOOL enable_extra_hashes;
+extern int default_thread_priority;
 extern uint32_t wim_nb_files, wim_proc_files, wim_extra_files;
 static int actual_fs_type, wintogo_index = -1, wininst_index = 0;
 extern BOOL force_large_fat32, enable_ntfs_compression, lock_drive, zero_drive, fast_zeroing, enable_file_indexing, write_as_image;
 extern BOOL use_vds, write_as_esp;
-uint8_t *grub2_buf = NULL, *sec_buf = NULL;
+uint8_t *grub2_buf = NULL;
 long grub2_len;
+// Checksums of the data written by WriteDrive, when EnableWriteHash or EnableWriteVerify are set
+static HASH_STREAM* write_hs = NULL;
+static uint8_t write_sum[CHECKSUM_MAX][MAX_HASHSIZE];
+static uint64_t write_sum_size = 0;
+static uint32_t write_sum_mask = 0;
+static TREE_HASH write_tree = { 0 };
 
 /*
  * Convert the fmifs outputs messages (that use an OEM code page) to UTF-8
@@ -1442,227 +1450,866 @@ static void update_progress(const uint64_t processed_bytes)
 	UpdateProgressWithInfo(OP_FORMAT, MSG_261, processed_bytes, img_report.image_size);
 }
 
-// Some compressed images use streams that aren't multiple of the sector
-// size and cause write failures => Use a write override that alleviates
-// the problem. See GitHub issue #1422 for details.
-static int sector_write(int fd, const void* _buf, unsigned int count)
+/*
+ * Start/stop computing the checksums of the data we write, on separate threads, so that we
+ * don't have to read the source again to get them. For verification, we also record the
+ * SHA-256 of each VERIFY_LEAF_SIZE block, so that we can tell where a readback differs.
+ */
+static void OpenWriteHash(void)
 {
-	const uint8_t* buf = (const uint8_t*)_buf;
-	unsigned int sec_size = (unsigned int)SelectedDrive.SectorSize;
-	int written, fill_size = 0;
-
-	if (sec_size == 0)
-		sec_size = 512;
-
-	// If we are on a sector boundary and count is multiple of the
-	// sector size, just issue a regular write
-	if ((sec_buf_pos == 0) && (count % sec_size == 0))
-		return _write(fd, buf, count);
-
-	// If we have an existing partial sector, fill and write it
-	if (sec_buf_pos > 0) {
-		fill_size = min(sec_size - sec_buf_pos, count);
-		memcpy(&sec_buf[sec_buf_pos], buf, fill_size);
-		sec_buf_pos += fill_size;
-		// If we don't have a full sector just buffer it for next call
-		if (sec_buf_pos < sec_size)
-			return (int)count;
-		sec_buf_pos = 0;
-		written = _write(fd, sec_buf, sec_size);
-		if (written != sec_size)
-			return written;
-	}
-
-	// Now write as many full sectors as we can
-	uint32_t sec_num = (count - fill_size) / sec_size;
-	written = _write(fd, &buf[fill_size], sec_num * sec_size);
-	if (written < 0)
-		return written;
-	else if (written != sec_num * sec_size)
-		return fill_size + written;
-	sec_buf_pos = count - fill_size - written;
-	assert(sec_buf_pos < sec_size);
-
-	// Keep leftover bytes, if any, in the sector buffer
-	if (sec_buf_pos != 0)
-		memcpy(sec_buf, &buf[fill_size + written], sec_buf_pos);
-	return (int)count;
+	BOOL verify = ReadSettingBool(SETTING_ENABLE_WRITE_VERIFY);
+
+	write_sum_size = 0;
+	write_sum_mask = 0;
+	FreeTreeHash(&write_tree);
+	if (ReadSettingBool(SETTING_ENABLE_WRITE_HASH))
+		write_sum_mask = (1 << CHECKSUM_MD5) | (1 << CHECKSUM_SHA1) | (1 << CHECKSUM_SHA256) |
+			(enable_extra_hashes ? (1 << CHECKSUM_SHA512) : 0);
+	if ((write_sum_mask == 0) && !verify)
+		return;
+	write_hs = HashStreamOpen(write_sum_mask, verify ? VERIFY_LEAF_SIZE : 0);
+	if (write_hs == NULL)
+		write_sum_mask = 0;
 }
 
-/* Write an image file or zero a drive */
-static BOOL WriteDrive(HANDLE hPhysicalDrive, HANDLE hSourceImage)
+static void WriteHash(const uint8_t* buf, size_t len)
+{
+	if ((write_hs != NULL) && !HashStreamWrite(write_hs, buf, len)) {
+		uprintf("Could not hash written data - checksums disabled");
+		HashStreamClose(write_hs, NULL, NULL, NULL);
+		write_hs = NULL;
+		write_sum_mask = 0;
+	}
+}
+
+static void CloseWriteHash(BOOL success)
 {
-	BOOL s, ret = FALSE;
+	const char* sum_name[CHECKSUM_MAX] = { "MD5", "SHA1", "SHA256", "SHA512" };
+	char str[2 * MAX_HASHSIZE + 1];
+	uint32_t i, j;
+
+	if (write_hs == NULL)
+		return;
+	if (!HashStreamClose(write_hs, write_sum, &write_sum_size, &write_tree) || !success) {
+		write_sum_mask = 0;
+		FreeTreeHash(&write_tree);
+	}
+	write_hs = NULL;
+	if (write_sum_mask == 0)
+		return;
+	uprintf("Checksums of the %s written:", SizeToHumanReadable(write_sum_size, FALSE, FALSE));
+	for (i = 0; i < CHECKSUM_MAX; i++) {
+		if (!(write_sum_mask & (1 << i)))
+			continue;
+		for (j = 0; j < sum_count[i]; j++)
+			sprintf(&str[2 * j], "%02x", write_sum[i][j]);
+		uprintf("  %-7s %s", sum_name[i], str);
+	}
+}
+
+/*
+ * Read back the data that WriteDrive wrote, and compare the SHA-256 of each leaf with the
+ * ones that were computed during the write. The hashing happens on a hash stream thread,
+ * so it is overlapped with the reads, and we should be close to the sequential read speed
+ * of the device.
+ */
+static BOOL VerifyDrive(HANDLE hPhysicalDrive)
+{
+	BOOL ret = FALSE;
+	HASH_STREAM* hs = NULL;
+	TREE_HASH tree = { 0 };
 	LARGE_INTEGER li;
-	DWORD rSize, wSize, xSize, BufSize;
-	uint64_t wb, target_size = hSourceImage?img_report.image_size:SelectedDrive.DiskSize;
-	int64_t bled_ret;
-	uint8_t *buffer = NULL;
-	uint8_t *cmp_buffer = NULL;
-	int i, *ptr, zero_data, throttle_fast_zeroing = 0;
+	DWORD BufSize, rSize, xSize, size;
+	uint64_t rb, start_time, first_sector, last_sector;
+	uint8_t* buffer = NULL;
+	uint32_t i, j, num_bad = 0;
+	const DWORD SectorSize = SelectedDrive.SectorSize;
+
+	uprintf("Verifying written data...");
+	BufSize = ((VERIFY_BUFFER_SIZE + SectorSize - 1) / SectorSize) * SectorSize;
+	buffer = (uint8_t*)_mm_malloc(BufSize, SectorSize);
+	hs = HashStreamOpen(0, write_tree.leaf_size);
+	if ((buffer == NULL) || (hs == NULL)) {
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+		uprintf("Could not allocate verification buffers");
+		goto out;
+	}
 
-	// We poked the MBR and other stuff, so we need to rewind
+	// Make sure we don't read anything that hasn't been committed to the device yet
+	if (!FlushFileBuffers(hPhysicalDrive))
+		uprintf("Warning: Could not flush drive before verification: %s", WindowsErrorString());
 	li.QuadPart = 0;
-	if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN))
-		uprintf("Warning: Unable to rewind image position - wrong data might be copied!");
+	if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
+		uprintf("Error: Could not rewind for verification - %s", WindowsErrorString());
+		goto out;
+	}
+
 	UpdateProgressWithInfoInit(NULL, FALSE);
+	start_time = GetTickCount64();
+	for (rb = 0; rb < write_tree.size; rb += size) {
+		UpdateProgressWithInfo(OP_FORMAT, MSG_319, rb, write_tree.size);
+		CHECK_FOR_USER_CANCEL;
+		size = (DWORD)min(BufSize, write_tree.size - rb);
+		// ReadFile fails unless the size is a multiple of sector size
+		rSize = ((size + SectorSize - 1) / SectorSize) * SectorSize;
+		if (!ReadFile(hPhysicalDrive, buffer, rSize, &xSize, NULL) || (xSize < size)) {
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_READ_FAULT;
+			uprintf("Read error at sector %lld: %s", rb / SectorSize, WindowsErrorString());
+			goto out;
+		}
+		if (!HashStreamWrite(hs, buffer, size))
+			goto out;
+	}
+	i = HashStreamClose(hs, NULL, NULL, &tree);
+	hs = NULL;
+	if (!i || (tree.num_leaves != write_tree.num_leaves))
+		goto out;
 
-	if (img_report.compression_type != BLED_COMPRESSION_NONE) {
-		uprintf("Writing compressed image...");
-		sec_buf = (uint8_t*)_mm_malloc(SelectedDrive.SectorSize, SelectedDrive.SectorSize);
-		if (sec_buf == NULL) {
-			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
-			uprintf("Could not allocate disk write buffer");
+#define LEAF_DIFFERS(i) (memcmp(&tree.leaf_sum[(i) * sizeof(tree.root)], \
+	&write_tree.leaf_sum[(i) * sizeof(tree.root)], sizeof(tree.root)) != 0)
+	for (i = 0; i < tree.num_leaves; i++) {
+		if (LEAF_DIFFERS(i))
+			num_bad++;
+	}
+	if (num_bad == 0) {
+		uprintf("Verification successful (%0.1f MB/s)", (float)write_tree.size / MB /
+			max(0.001f, (GetTickCount64() - start_time) / 1000.0f));
+		ret = TRUE;
+		goto out;
+	}
+
+	// Report the first range of consecutive bad leaves, in sectors
+	for (i = 0; !LEAF_DIFFERS(i); i++);
+	for (j = i + 1; (j < tree.num_leaves) && LEAF_DIFFERS(j); j++);
+#undef LEAF_DIFFERS
+	first_sector = ((uint64_t)i * tree.leaf_size) / SectorSize;
+	last_sector = (min((uint64_t)j * tree.leaf_size, tree.size) - 1) / SectorSize;
+	uprintf("Verification failed: Sectors %lld-%lld do not match the data that was written", first_sector, last_sector);
+	uprintf("%d out of %d blocks of %s differ - the device may be faulty or counterfeit", num_bad, tree.num_leaves,
+		SizeToHumanReadable(tree.leaf_size, FALSE, FALSE));
+	FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
+
+out:
+	if (hs != NULL)
+		HashStreamClose(hs, NULL, NULL, NULL);
+	FreeTreeHash(&tree);
+	safe_mm_free(buffer);
+	return ret;
+}
+
+/*
+ * Write a block of sectors at offset wb, with retries
+ */
+static BOOL WriteDriveBlock(HANDLE hPhysicalDrive, const uint8_t* buf, DWORD size, uint64_t wb)
+{
+	BOOL s;
+	LARGE_INTEGER li;
+	DWORD wSize;
+	int i;
+
+	for (i = 1; i <= WRITE_RETRIES; i++) {
+		CHECK_FOR_USER_CANCEL;
+		s = WriteFile(hPhysicalDrive, buf, size, &wSize, NULL);
+		if ((s) && (wSize == size))
+			return TRUE;
+		if (s)
+			uprintf("Write error: Wrote %d bytes, expected %d bytes", wSize, size);
+		else
+			uprintf("Write error at sector %lld: %s", wb / SelectedDrive.SectorSize, WindowsErrorString());
+		if (i < WRITE_RETRIES) {
+			li.QuadPart = wb;
+			uprintf("Retrying in %d seconds...", WRITE_TIMEOUT / 1000);
+			Sleep(WRITE_TIMEOUT);
+			if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
+				uprintf("Write error: Could not reset position - %s", WindowsErrorString());
+				goto out;
+			}
+		} else {
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
 			goto out;
 		}
-		assert((uintptr_t)sec_buf % SelectedDrive.SectorSize == 0);
-		sec_buf_pos = 0;
-		bled_init(_uprintf, NULL, sector_write, update_progress, NULL, &FormatStatus);
-		bled_ret = bled_uncompress_with_handles(hSourceImage, hPhysicalDrive, img_report.compression_type);
-		bled_exit();
-		if ((bled_ret >= 0) && (sec_buf_pos != 0)) {
-			// A disk image that doesn't end up on disk boundary should be a rare
-			// enough case, so we dont bother checking the write operation and
-			// just issue a notice about it in the log.
+		Sleep(200);
+	}
+out:
+	return FALSE;
+}
+
+/*
+ * Raw images are written through a pipeline, where a reader thread fills a queue of sector
+ * aligned buffers from the source, that the writer (the format thread) drains to the device,
+ * so that the device is kept busy while we read from the source, and vice versa.
+ * For compressed images, the reader thread is replaced by a decompression thread, on which
+ * bled fills the buffers, so that decompressing and writing can also overlap. Since buffers
+ * are only handed over once full, this also ensures that all our writes are sector aligned,
+ * even for streams that aren't a multiple of the sector size (see GitHub issue #1422).
+ * The number and size of the buffers can be tuned with the WriteBufferCount and
+ * WriteBufferSize (in KB) settings, and WriteBenchmark reports the throughput of each stage.
+ *
+ * With SparseImageWrite, runs of zeroed blocks are not written, but either skipped (if the
+ * user knows the target to be zeroed) or trimmed. Unallocated ranges of a sparse source are
+ * never read, and are handed to the writer as "holes", i.e. buffers with a hole size but no data.
+ */
+typedef struct {
+	HANDLE hSourceImage;
+	uint64_t target_size;
+	uint8_t* buf;
+	uint8_t* zero_buf;
+	DWORD buf_size;
+	DWORD num_bufs;
+	DWORD len[MAX_WRITE_BUFFERS];
+	uint64_t hole[MAX_WRITE_BUFFERS];
+	HANDLE free_bufs;
+	HANDLE full_bufs;
+	volatile BOOL abort;
+	uint64_t read_ticks, read_stall_ticks;
+	// Decompression data
+	BOOL compressed;
+	DWORD fill_slot, fill_pos;
+	int64_t bled_ret;
+	// Sparse write data
+	int sparse;
+	BOOL trim_failed;
+	FILE_ALLOCATED_RANGE_BUFFER* ranges;
+	DWORD num_ranges, cur_range;
+	uint64_t dev_pos;
+	uint64_t zero_start, zero_size;
+	uint64_t skipped, zeroed, from_holes;
+} WRITE_PIPELINE;
+static WRITE_PIPELINE pipeline;
+
+/*
+ * Query the ranges of a sparse source that actually hold data. Returns NULL if the file
+ * system doesn't report them, in which case the whole source is considered allocated.
+ */
+static FILE_ALLOCATED_RANGE_BUFFER* GetAllocatedRanges(HANDLE hFile, uint64_t size, DWORD* num_ranges)
+{
+	FILE_ALLOCATED_RANGE_BUFFER query, *ranges = NULL, *new_ranges;
+	DWORD max_ranges = 64, rsize;
+
+	query.FileOffset.QuadPart = 0;
+	query.Length.QuadPart = size;
+	while (1) {
+		new_ranges = (FILE_ALLOCATED_RANGE_BUFFER*)realloc(ranges, max_ranges * sizeof(FILE_ALLOCATED_RANGE_BUFFER));
+		if (new_ranges == NULL)
+			break;
+		ranges = new_ranges;
+		if (DeviceIoControl(hFile, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query), ranges,
+			max_ranges * sizeof(FILE_ALLOCATED_RANGE_BUFFER), &rsize, NULL)) {
+			*num_ranges = rsize / sizeof(FILE_ALLOCATED_RANGE_BUFFER);
+			return ranges;
+		}
+		if (GetLastError() != ERROR_MORE_DATA)
+			break;
+		max_ranges *= 2;
+	}
+	free(ranges);
+	return NULL;
+}
+
+/*
+ * Return the size of the (sector aligned) hole of a sparse source at offset rb, if any, or
+ * else reduce *size so that we don't read past the end of the current allocated range.
+ */
+static uint64_t GetSourceHole(uint64_t rb, uint64_t max_size, DWORD* size)
+{
+	const FILE_ALLOCATED_RANGE_BUFFER* range;
+	const DWORD SectorSize = SelectedDrive.SectorSize;
+	uint64_t start = max_size, end = max_size;
+
+	while ((pipeline.cur_range < pipeline.num_ranges) &&
+		((uint64_t)(pipeline.ranges[pipeline.cur_range].FileOffset.QuadPart +
+		pipeline.ranges[pipeline.cur_range].Length.QuadPart) <= rb))
+		pipeline.cur_range++;
+	if (pipeline.cur_range < pipeline.num_ranges) {
+		range = &pipeline.ranges[pipeline.cur_range];
+		start = min(max((uint64_t)range->FileOffset.QuadPart, rb), max_size);
+		end = min((uint64_t)(range->FileOffset.QuadPart + range->Length.QuadPart), max_size);
+	}
+	if (start - rb >= SectorSize)
+		return ((start - rb) / SectorSize) * SectorSize;
+	if (end - rb < *size)
+		*size = (DWORD)(((end - rb + SectorSize - 1) / SectorSize) * SectorSize);
+	return 0;
+}
+
+static DWORD WINAPI ImageReadThread(void* param)
+{
+	LARGE_INTEGER t0, t1, t2, li;
+	DWORD slot, rSize, size;
+	uint64_t rb = 0, pos, hole, max_size = min(pipeline.target_size, (uint64_t)SelectedDrive.DiskSize);
+
+	for (slot = 0; ; slot = (slot + 1) % pipeline.num_bufs) {
+		QueryPerformanceCounter(&t0);
+		if ((WaitForSingleObject(pipeline.free_bufs, INFINITE) != WAIT_OBJECT_0) || pipeline.abort)
+			return 1;
+		QueryPerformanceCounter(&t1);
+		rSize = 0;
+		pipeline.hole[slot] = 0;
+		size = pipeline.buf_size;
+		if ((rb < max_size) && (pipeline.ranges != NULL) && !IS_ERROR(FormatStatus)) {
+			hole = GetSourceHole(rb, max_size, &size);
+			if (hole != 0) {
+				li.QuadPart = rb + hole;
+				if (!SetFilePointerEx(pipeline.hSourceImage, li, NULL, FILE_BEGIN)) {
+					FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_SEEK;
+					uprintf("Read error: Could not skip source hole - %s", WindowsErrorString());
+				} else {
+					// The hash must still account for the zeros of the hole
+					for (pos = 0; (write_hs != NULL) && (pos < hole); pos += size) {
+						size = (DWORD)min(pipeline.buf_size, hole - pos);
+						WriteHash(pipeline.zero_buf, size);
+					}
+					pipeline.hole[slot] = hole;
+					rb += hole;
+				}
+			}
+		}
+		if ((rb < max_size) && (pipeline.hole[slot] == 0) && !IS_ERROR(FormatStatus)) {
+			if (!ReadFile(pipeline.hSourceImage, &pipeline.buf[(size_t)slot * pipeline.buf_size],
+				size, &rSize, NULL)) {
+				FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_READ_FAULT;
+				uprintf("Read error: %s", WindowsErrorString());
+				rSize = 0;
+			}
+			// Don't overflow our projected size (mostly for VHDs)
+			if (rb + rSize > max_size)
+				rSize = (DWORD)(max_size - rb);
+			// Hashing happens on the write hash threads, while the writer writes this block
+			WriteHash(&pipeline.buf[(size_t)slot * pipeline.buf_size], rSize);
+			rb += rSize;
+		}
+		QueryPerformanceCounter(&t2);
+		pipeline.read_stall_ticks += t1.QuadPart - t0.QuadPart;
+		pipeline.read_ticks += t2.QuadPart - t1.QuadPart;
+		// An empty buffer, that isn't a hole, tells the writer that we are done
+		pipeline.len[slot] = rSize;
+		if (!ReleaseSemaphore(pipeline.full_bufs, 1, NULL))
+			return 1;
+		if ((rSize == 0) && (pipeline.hole[slot] == 0))
+			break;
+	}
+	return 0;
+}
+
+/*
+ * Hand the buffer being filled by bled over to the writer, and wait for the next one
+ */
+static BOOL PostDecompressedBuffer(void)
+{
+	LARGE_INTEGER t0, t1;
+
+	WriteHash(&pipeline.buf[(size_t)pipeline.fill_slot * pipeline.buf_size], pipeline.fill_pos);
+	pipeline.len[pipeline.fill_slot] = pipeline.fill_pos;
+	if (!ReleaseSemaphore(pipeline.full_bufs, 1, NULL))
+		return FALSE;
+	pipeline.fill_slot = (pipeline.fill_slot + 1) % pipeline.num_bufs;
+	pipeline.fill_pos = 0;
+	QueryPerformanceCounter(&t0);
+	if ((WaitForSingleObject(pipeline.free_bufs, INFINITE) != WAIT_OBJECT_0) || pipeline.abort)
+		return FALSE;
+	QueryPerformanceCounter(&t1);
+	pipeline.read_stall_ticks += t1.QuadPart - t0.QuadPart;
+	return TRUE;
+}
+
+// bled write override, that copies the decompressed data to the pipeline buffers
+static int pipeline_write(int fd, const void* _buf, unsigned int count)
+{
+	const uint8_t* buf = (const uint8_t*)_buf;
+	unsigned int size, written;
+
+	// Once the writer has given up, fail the write so that bled unwinds on its own
+	if (pipeline.abort)
+		return -1;
+	for (written = 0; written < count; written += size) {
+		size = min(count - written, pipeline.buf_size - pipeline.fill_pos);
+		memcpy(&pipeline.buf[(size_t)pipeline.fill_slot * pipeline.buf_size + pipeline.fill_pos], &buf[written], size);
+		pipeline.fill_pos += size;
+		if ((pipeline.fill_pos == pipeline.buf_size) && !PostDecompressedBuffer())
+			return -1;
+	}
+	return (int)count;
+}
+
+static DWORD WINAPI DecompressThread(void* param)
+{
+	HANDLE hPhysicalDrive = (HANDLE)param;
+	LARGE_INTEGER t0, t1;
+	DWORD pad;
+	const DWORD SectorSize = SelectedDrive.SectorSize;
+
+	QueryPerformanceCounter(&t0);
+	if ((WaitForSingleObject(pipeline.free_bufs, INFINITE) != WAIT_OBJECT_0) || pipeline.abort)
+		return 1;
+	bled_init(_uprintf, NULL, pipeline_write, update_progress, NULL, &FormatStatus);
+	pipeline.bled_ret = bled_uncompress_with_handles(pipeline.hSourceImage, hPhysicalDrive, img_report.compression_type);
+	bled_exit();
+	if (pipeline.abort)
+		return 1;
+	if ((pipeline.bled_ret >= 0) && (pipeline.fill_pos != 0)) {
+		if (pipeline.fill_pos % SectorSize != 0) {
+			// A disk image that doesn't end up on disk boundary should be a rare enough
+			// case, so we just pad the last sector with zeros and issue a notice about it.
 			uprintf("Notice: Compressed image data didn't end on block boundary.");
-			// Gonna assert that WriteFile() and _write() share the same file offset
-			WriteFile(hPhysicalDrive, sec_buf, SelectedDrive.SectorSize, &wSize, NULL);
+			pad = SectorSize - (pipeline.fill_pos % SectorSize);
+			memset(&pipeline.buf[(size_t)pipeline.fill_slot * pipeline.buf_size + pipeline.fill_pos], 0, pad);
 		}
-		safe_mm_free(sec_buf);
-		if ((bled_ret < 0) && (SCODE_CODE(FormatStatus) != ERROR_CANCELLED)) {
-			// Unfortunately, different compression backends return different negative error codes
-			uprintf("Could not write compressed image: %lld", bled_ret);
-			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
-			goto out;
+		if (!PostDecompressedBuffer())
+			return 1;
+	}
+	QueryPerformanceCounter(&t1);
+	pipeline.read_ticks = t1.QuadPart - t0.QuadPart - pipeline.read_stall_ticks;
+	// An empty buffer tells the writer that we are done
+	pipeline.len[pipeline.fill_slot] = 0;
+	if (!ReleaseSemaphore(pipeline.full_bufs, 1, NULL))
+		return 1;
+	return 0;
+}
+
+static BOOL SetDrivePosition(HANDLE hPhysicalDrive, uint64_t pos)
+{
+	LARGE_INTEGER li;
+
+	if (pipeline.dev_pos == pos)
+		return TRUE;
+	li.QuadPart = pos;
+	if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
+		uprintf("Write error: Could not set position - %s", WindowsErrorString());
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_SEEK;
+		return FALSE;
+	}
+	pipeline.dev_pos = pos;
+	return TRUE;
+}
+
+/*
+ * Dispose of the pending run of zeroed sectors, by skipping it or trimming it. If trimming
+ * isn't supported, we have to write the zeros after all.
+ */
+static BOOL FlushZeroRun(HANDLE hPhysicalDrive)
+{
+	uint64_t pos, end = pipeline.zero_start + pipeline.zero_size;
+	DWORD size;
+
+	if (pipeline.zero_size == 0)
+		return TRUE;
+	if ((pipeline.sparse == SPARSE_WRITE_TRIM) && !pipeline.trim_failed &&
+		!TrimDrive(hPhysicalDrive, pipeline.zero_start, pipeline.zero_size)) {
+		uprintf("Trimming is not available - zeroed blocks will be written instead");
+		pipeline.trim_failed = TRUE;
+	}
+	if (pipeline.trim_failed) {
+		if (!SetDrivePosition(hPhysicalDrive, pipeline.zero_start))
+			return FALSE;
+		for (pos = pipeline.zero_start; pos < end; pos += size) {
+			size = (DWORD)min(pipeline.buf_size, end - pos);
+			if (!WriteDriveBlock(hPhysicalDrive, pipeline.zero_buf, size, pos))
+				return FALSE;
 		}
+		pipeline.dev_pos = end;
+		pipeline.zeroed += pipeline.zero_size;
 	} else {
-		uprintf(hSourceImage?"Writing Image...":fast_zeroing?"Fast-zeroing drive...":"Zeroing drive...");
-		// Our buffer size must be a multiple of the sector size and *ALIGNED* to the sector size
-		BufSize = ((DD_BUFFER_SIZE + SelectedDrive.SectorSize - 1) / SelectedDrive.SectorSize) * SelectedDrive.SectorSize;
-		buffer = (uint8_t*)_mm_malloc(BufSize, SelectedDrive.SectorSize);
-		if (buffer == NULL) {
+		pipeline.skipped += pipeline.zero_size;
+	}
+	pipeline.zero_size = 0;
+	return TRUE;
+}
+
+static void AddZeroRun(uint64_t start, uint64_t size)
+{
+	if (pipeline.zero_size == 0)
+		pipeline.zero_start = start;
+	assert(pipeline.zero_start + pipeline.zero_size == start);
+	pipeline.zero_size += size;
+}
+
+/*
+ * Write the non-zeroed parts of a block of sectors at offset wb, and coalesce the zeroed ones
+ */
+static BOOL WriteSparseBlock(HANDLE hPhysicalDrive, const uint8_t* buf, DWORD size, uint64_t wb)
+{
+	BOOL zero;
+	DWORD pos, end;
+
+	for (pos = 0; pos < size; pos = end) {
+		// Find the end of the run of blocks that are either all zeroed or all not zeroed
+		zero = IsBufferUniform(&buf[pos], min(SPARSE_BLOCK_SIZE, size - pos), 0);
+		for (end = pos + min(SPARSE_BLOCK_SIZE, size - pos); end < size; end += min(SPARSE_BLOCK_SIZE, size - end)) {
+			if (IsBufferUniform(&buf[end], min(SPARSE_BLOCK_SIZE, size - end), 0) != zero)
+				break;
+		}
+		if (zero) {
+			AddZeroRun(wb + pos, end - pos);
+			continue;
+		}
+		if (!FlushZeroRun(hPhysicalDrive) || !SetDrivePosition(hPhysicalDrive, wb + pos) ||
+			!WriteDriveBlock(hPhysicalDrive, &buf[pos], end - pos, wb + pos))
+			return FALSE;
+		pipeline.dev_pos = wb + end;
+	}
+	return TRUE;
+}
+
+static BOOL WriteImage(HANDLE hPhysicalDrive, HANDLE hSourceImage, uint64_t target_size)
+{
+	BOOL ret = FALSE, benchmark = ReadSettingBool(SETTING_WRITE_BENCHMARK);
+	HANDLE hReadThread = NULL, wait_handles[2];
+	LARGE_INTEGER freq, t_start, t0, t1, t2;
+	DWORD slot, size;
+	uint64_t wb, hole, start_time, write_ticks = 0, write_stall_ticks = 0;
+	int64_t read_ticks;
+	const DWORD SectorSize = SelectedDrive.SectorSize;
+
+	memset(&pipeline, 0, sizeof(pipeline));
+	pipeline.hSourceImage = hSourceImage;
+	pipeline.target_size = target_size;
+	pipeline.compressed = (img_report.compression_type != BLED_COMPRESSION_NONE);
+	pipeline.num_bufs = ReadSetting32(SETTING_WRITE_BUFFER_COUNT);
+	if ((pipeline.num_bufs < 2) || (pipeline.num_bufs > MAX_WRITE_BUFFERS))
+		pipeline.num_bufs = WRITE_BUFFERS;
+	pipeline.buf_size = ReadSetting32(SETTING_WRITE_BUFFER_SIZE);
+	if ((pipeline.buf_size < DD_BUFFER_SIZE / KB) || (pipeline.buf_size > MAX_WRITE_BUFFER_SIZE / KB))
+		pipeline.buf_size = WRITE_BUFFER_SIZE / KB;
+	pipeline.buf_size *= KB;
+	// Our buffer size must be a multiple of the sector size and *ALIGNED* to the sector size
+	pipeline.buf_size = ((pipeline.buf_size + SectorSize - 1) / SectorSize) * SectorSize;
+	pipeline.buf = (uint8_t*)_mm_malloc((size_t)pipeline.num_bufs * pipeline.buf_size, SectorSize);
+	if (pipeline.buf == NULL) {
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+		uprintf("Could not allocate disk write buffers");
+		goto out;
+	}
+	assert((uintptr_t)pipeline.buf % SectorSize == 0);
+	pipeline.sparse = ReadSetting32(SETTING_SPARSE_IMAGE_WRITE);
+	if ((pipeline.sparse < SPARSE_WRITE_NONE) || (pipeline.sparse > SPARSE_WRITE_TRIM))
+		pipeline.sparse = SPARSE_WRITE_NONE;
+	if (pipeline.sparse != SPARSE_WRITE_NONE) {
+		// Trimmed blocks that don't read back as zeros would leave stale data in the image
+		// and fail the verification pass, so write these blocks instead
+		if ((pipeline.sparse == SPARSE_WRITE_TRIM) && !IsTrimZeroing(hPhysicalDrive)) {
+			uprintf("Sparse write: The target doesn't guarantee that trimmed blocks read back as zeros");
+			pipeline.trim_failed = TRUE;
+		}
+		uprintf("Sparse write: %s zeroed blocks", (pipeline.sparse == SPARSE_WRITE_TRIM) ?
+			(pipeline.trim_failed ? "writing" : "trimming") : "skipping (the target is assumed to be zeroed)");
+		pipeline.zero_buf = (uint8_t*)_mm_malloc(pipeline.buf_size, SectorSize);
+		if (pipeline.zero_buf == NULL) {
 			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
-			uprintf("Could not allocate disk write buffer");
+			uprintf("Could not allocate zeroed buffer");
+			goto out;
+		}
+		memset(pipeline.zero_buf, 0, pipeline.buf_size);
+		// The unallocated ranges of a compressed source tell us nothing about its content
+		if (!pipeline.compressed)
+			pipeline.ranges = GetAllocatedRanges(hSourceImage, target_size, &pipeline.num_ranges);
+	}
+	pipeline.free_bufs = CreateSemaphore(NULL, pipeline.num_bufs, pipeline.num_bufs + 1, NULL);
+	pipeline.full_bufs = CreateSemaphore(NULL, 0, pipeline.num_bufs, NULL);
+	if ((pipeline.free_bufs == NULL) || (pipeline.full_bufs == NULL)) {
+		uprintf("Could not create write pipeline semaphores: %s", WindowsErrorString());
+		goto out;
+	}
+	hReadThread = CreateThread(NULL, 0, pipeline.compressed ? DecompressThread : ImageReadThread,
+		(void*)hPhysicalDrive, 0, NULL);
+	if (hReadThread == NULL) {
+		uprintf("Unable to start image %s thread", pipeline.compressed ? "decompression" : "read");
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | APPERR(ERROR_CANT_START_THREAD);
+		goto out;
+	}
+	SetThreadPriority(hReadThread, default_thread_priority);
+	// If the reader exits without handing us a last buffer, we want to know about it
+	wait_handles[0] = pipeline.full_bufs;
+	wait_handles[1] = hReadThread;
+
+	start_time = GetTickCount64();
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&t_start);
+	for (wb = 0, slot = 0; ; slot = (slot + 1) % pipeline.num_bufs) {
+		// For compressed images, bled reports the progress from the decompression thread
+		if (!pipeline.compressed)
+			UpdateProgressWithInfo(OP_FORMAT, MSG_261, wb, target_size);
+		QueryPerformanceCounter(&t0);
+		if (WaitForMultipleObjects(2, wait_handles, FALSE, INFINITE) != WAIT_OBJECT_0) {
+			uprintf("Image %s thread exited unexpectedly", pipeline.compressed ? "decompression" : "read");
 			goto out;
 		}
-		assert((uintptr_t)buffer % SelectedDrive.SectorSize == 0);
+		QueryPerformanceCounter(&t1);
+		size = pipeline.len[slot];
+		hole = pipeline.hole[slot];
+		if ((size == 0) && (hole == 0))
+			break;
+		// WriteFile fails unless the size is a multiple of sector size
+		if (size % SectorSize != 0)
+			size = ((size + SectorSize - 1) / SectorSize) * SectorSize;
+		if (hole != 0) {
+			AddZeroRun(wb, hole);
+			pipeline.from_holes += hole;
+			wb += hole;
+		} else if (pipeline.sparse != SPARSE_WRITE_NONE) {
+			if (!WriteSparseBlock(hPhysicalDrive, &pipeline.buf[(size_t)slot * pipeline.buf_size], size, wb))
+				goto out;
+			wb += size;
+		} else {
+			if (!WriteDriveBlock(hPhysicalDrive, &pipeline.buf[(size_t)slot * pipeline.buf_size], size, wb))
+				goto out;
+			wb += size;
+		}
+		QueryPerformanceCounter(&t2);
+		write_stall_ticks += t1.QuadPart - t0.QuadPart;
+		write_ticks += t2.QuadPart - t1.QuadPart;
+		// Tell whether the decompressor or the drive is the bottleneck, while we write
+		if (pipeline.compressed) {
+			read_ticks = t2.QuadPart - t_start.QuadPart - (int64_t)pipeline.read_stall_ticks;
+			SetProgressRates((uint64_t)((double)wb * freq.QuadPart / max(read_ticks, 1)),
+				(uint64_t)((double)wb * freq.QuadPart / max(write_ticks, 1)));
+		}
+		if (!ReleaseSemaphore(pipeline.free_bufs, 1, NULL))
+			goto out;
+	}
+	if (pipeline.compressed && (pipeline.bled_ret < 0) && (SCODE_CODE(FormatStatus) != ERROR_CANCELLED)) {
+		// Unfortunately, different compression backends return different negative error codes
+		uprintf("Could not write compressed image: %lld", pipeline.bled_ret);
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
+		goto out;
+	}
+	// The reader may also have stopped on a read error
+	if (IS_ERROR(FormatStatus) || !FlushZeroRun(hPhysicalDrive))
+		goto out;
+	ret = TRUE;
+
+	uprintf("Wrote %s in %0.1fs, using %d x %d KB buffers", SizeToHumanReadable(wb, FALSE, FALSE),
+		(GetTickCount64() - start_time) / 1000.0f, pipeline.num_bufs, (int)(pipeline.buf_size / KB));
+	// Always report the decompression throughput, as it tells if the CPU or the device is the bottleneck
+	if (benchmark || pipeline.compressed) {
+		uprintf("  %s %0.1f MB/s, stalled %0.2fs waiting for the writer", pipeline.compressed ? "Decompress:" : "Read: ",
+			(float)wb / MB / max(0.001f, (float)pipeline.read_ticks / freq.QuadPart),
+			(float)pipeline.read_stall_ticks / freq.QuadPart);
+		uprintf("  Write: %0.1f MB/s, stalled %0.2fs waiting for the reader",
+			(float)wb / MB / max(0.001f, (float)write_ticks / freq.QuadPart),
+			(float)write_stall_ticks / freq.QuadPart);
+	}
+	if (pipeline.sparse != SPARSE_WRITE_NONE) {
+		uprintf("Sparse write: %s %s of zeroed blocks", (pipeline.sparse == SPARSE_WRITE_TRIM) ? "trimmed" : "skipped",
+			SizeToHumanReadable(pipeline.skipped, FALSE, FALSE));
+		if (pipeline.from_holes != 0)
+			uprintf("  %s of which were unallocated in the source", SizeToHumanReadable(pipeline.from_holes, FALSE, FALSE));
+		if (pipeline.zeroed != 0)
+			uprintf("  %s of zeroed blocks had to be written", SizeToHumanReadable(pipeline.zeroed, FALSE, FALSE));
+	}
+
+out:
+	SetProgressRates(0, 0);
+	if (hReadThread != NULL) {
+		// Unblock the reader if it is waiting on us. We don't terminate it, as that would
+		// leave bled and its worker threads in an undefined state, but rely on the write
+		// callback returning an error once abort is set.
+		pipeline.abort = TRUE;
+		ReleaseSemaphore(pipeline.free_bufs, 1, NULL);
+		WaitForSingleObject(hReadThread, INFINITE);
+		safe_closehandle(hReadThread);
+	}
+	safe_closehandle(pipeline.free_bufs);
+	safe_closehandle(pipeline.full_bufs);
+	safe_mm_free(pipeline.buf);
+	safe_mm_free(pipeline.zero_buf);
+	safe_free(pipeline.ranges);
+	return ret;
+}
 
-		// Clear buffer
-		memset(buffer, fast_zeroing ? 0xff : 0x00, BufSize);
+static __inline BOOL IsEmptyBlock(const uint8_t* buf, DWORD size)
+{
+	return ((buf[0] == 0x00) || (buf[0] == 0xff)) && IsBufferUniform(buf, size, buf[0]);
+}
 
-		cmp_buffer = (uint8_t*)_mm_malloc(BufSize, SelectedDrive.SectorSize);
+/*
+ * Zero a drive, in batches of ZERO_BATCH_SIZE.
+ * Fast-zeroing: Depending on your hardware, reading from flash may be much faster than writing, so
+ * we might speed things up by reading each batch ahead and skipping its empty blocks. A block is
+ * declared empty when all bits are either 0 (zeros) or 1 (flash block erased).
+ * Reading only pays off if the time it takes is less than the time saved on skipped writes, so we
+ * measure the read and write throughput of the device, along with the proportion of empty blocks,
+ * and back off from reading, for an exponentially increasing number of batches, when it doesn't.
+ */
+static BOOL ZeroDrive(HANDLE hPhysicalDrive, uint64_t target_size)
+{
+	BOOL s, ret = FALSE, probing = FALSE;
+	LARGE_INTEGER li, freq, t0, t1;
+	DWORD BufSize, size, rSize, pos, end, blk;
+	uint64_t wb, dev_pos, empty, skipped = 0, rewritten = 0, unchecked = 0;
+	uint64_t read_bytes = 0, read_ticks = 0, write_bytes = 0, write_ticks = 0, start_time;
+	uint8_t *buffer = NULL, *cmp_buffer = NULL;
+	uint32_t backoff = 0, throttle = 0;
+	float empty_ratio = 1.0f, read_speed, write_speed;
+	const DWORD SectorSize = SelectedDrive.SectorSize;
+	// Emptiness is checked per block of DD_BUFFER_SIZE
+	const DWORD BlockSize = ((DD_BUFFER_SIZE + SectorSize - 1) / SectorSize) * SectorSize;
+
+	// Our buffer size must be a multiple of the block size and *ALIGNED* to the sector size
+	BufSize = ((ZERO_BATCH_SIZE + BlockSize - 1) / BlockSize) * BlockSize;
+	buffer = (uint8_t*)_mm_malloc(BufSize, SectorSize);
+	if (buffer == NULL) {
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+		uprintf("Could not allocate disk write buffer");
+		goto out;
+	}
+	assert((uintptr_t)buffer % SectorSize == 0);
+	memset(buffer, fast_zeroing ? 0xff : 0x00, BufSize);
+	if (fast_zeroing) {
+		cmp_buffer = (uint8_t*)_mm_malloc(BufSize, SectorSize);
 		if (cmp_buffer == NULL) {
 			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
 			uprintf("Could not allocate disk comparison buffer");
 			goto out;
 		}
-		assert((uintptr_t)cmp_buffer % SelectedDrive.SectorSize == 0);
-
-		// Don't bother trying for something clever, using double buffering overlapped and whatnot:
-		// With Windows' default optimizations, sync read + sync write for sequential operations
-		// will be as fast, if not faster, than whatever async scheme you can come up with.
-		rSize = BufSize;
-		for (wb = 0, wSize = 0; wb < (uint64_t)SelectedDrive.DiskSize; wb += wSize) {
-			UpdateProgressWithInfo(OP_FORMAT, hSourceImage ? MSG_261 : fast_zeroing ? MSG_306 : MSG_286, wb, target_size);
-			if (hSourceImage != NULL) {
-				s = ReadFile(hSourceImage, buffer, BufSize, &rSize, NULL);
-				if (!s) {
-					FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_READ_FAULT;
-					uprintf("Read error: %s", WindowsErrorString());
-					goto out;
-				}
-				if (rSize == 0)
-					break;
-			}
-			// Don't overflow our projected size (mostly for VHDs)
-			if (wb + rSize > target_size) {
-				rSize = (DWORD)(target_size - wb);
-			}
-
-			// WriteFile fails unless the size is a multiple of sector size
-			if (rSize % SelectedDrive.SectorSize != 0)
-				rSize = ((rSize + SelectedDrive.SectorSize - 1) / SelectedDrive.SectorSize) * SelectedDrive.SectorSize;
-
-			// Fast-zeroing: Depending on your hardware, reading from flash may be much faster than writing, so
-			// we might speed things up by skipping empty blocks, or skipping the write if the data is the same.
-			// Notes: A block is declared empty when all bits are either 0 (zeros) or 1 (flash block erased).
-			// Also, a back-off strategy is used to limit reading.
-			if (throttle_fast_zeroing) {
-				throttle_fast_zeroing--;
-			} else if (fast_zeroing) {
-				assert(hSourceImage == NULL);	// Only enabled for zeroing
-				CHECK_FOR_USER_CANCEL;
-
-				// Read block and compare against the block that needs to be written
-				s = ReadFile(hPhysicalDrive, cmp_buffer, rSize, &xSize, NULL);
-				if ((!s) || (xSize != rSize) ) {
-					uprintf("Read error: Could not read data for comparison - %s", WindowsErrorString());
-					goto out;
-				}
-
-				// Check for an empty block
-				ptr = (int*)(cmp_buffer);
-				// Get first element
-				zero_data = ptr[0];
-				// Check all bits are the same
-				if ((zero_data == 0) || (zero_data == -1)) {
-					// Compare the rest of the block against the first element
-					for (i = 1; i < (int)(rSize / sizeof(int)); i++) {
-						if (ptr[i] != zero_data)
-							break;
-					}
-					if (i >= (int)(rSize / sizeof(int))) {
-						// Block is empty, skip write
-						wSize = rSize;
-						continue;
-					}
-				}
+		assert((uintptr_t)cmp_buffer % SectorSize == 0);
+	}
 
-				// Move the file pointer position back for writing
-				li.QuadPart = wb;
-				if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
-					uprintf("Error: Could not reset position - %s", WindowsErrorString());
-					goto out;
-				}
-				// Throttle read operations
-				throttle_fast_zeroing = 15;
+	start_time = GetTickCount64();
+	for (wb = 0; wb < target_size; wb += size) {
+		UpdateProgressWithInfo(OP_FORMAT, fast_zeroing ? MSG_306 : MSG_286, wb, target_size);
+		CHECK_FOR_USER_CANCEL;
+		size = (DWORD)min(BufSize, target_size - wb);
+		// WriteFile fails unless the size is a multiple of sector size
+		if (size % SectorSize != 0)
+			size = ((size + SectorSize - 1) / SectorSize) * SectorSize;
+
+		if (!fast_zeroing || (throttle > 0)) {
+			if (throttle > 0) {
+				// Probe the drive again once we're done backing off
+				if (--throttle == 0)
+					probing = TRUE;
+				unchecked += size;
 			}
+			QueryPerformanceCounter(&t0);
+			if (!WriteDriveBlock(hPhysicalDrive, buffer, size, wb))
+				goto out;
+			QueryPerformanceCounter(&t1);
+			write_bytes += size;
+			write_ticks += t1.QuadPart - t0.QuadPart;
+			continue;
+		}
 
-			for (i = 1; i <= WRITE_RETRIES; i++) {
-				CHECK_FOR_USER_CANCEL;
-				s = WriteFile(hPhysicalDrive, buffer, rSize, &wSize, NULL);
-				if ((s) && (wSize == rSize))
+		// Read the whole batch ahead, then only write the runs of blocks that aren't empty
+		QueryPerformanceCounter(&t0);
+		s = ReadFile(hPhysicalDrive, cmp_buffer, size, &rSize, NULL);
+		if ((!s) || (rSize != size)) {
+			uprintf("Read error: Could not read data for comparison - %s", WindowsErrorString());
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_READ_FAULT;
+			goto out;
+		}
+		QueryPerformanceCounter(&t1);
+		read_bytes += size;
+		read_ticks += t1.QuadPart - t0.QuadPart;
+		dev_pos = wb + size;
+		empty = 0;
+		for (pos = 0; pos < size; pos = end) {
+			blk = min(BlockSize, size - pos);
+			if (IsEmptyBlock(&cmp_buffer[pos], blk)) {
+				empty += blk;
+				end = pos + blk;
+				continue;
+			}
+			for (end = pos + blk; end < size; end += blk) {
+				blk = min(BlockSize, size - end);
+				if (IsEmptyBlock(&cmp_buffer[end], blk))
 					break;
-				if (s)
-					uprintf("Write error: Wrote %d bytes, expected %d bytes", wSize, rSize);
-				else
-					uprintf("Write error at sector %lld: %s", wb / SelectedDrive.SectorSize, WindowsErrorString());
-				if (i < WRITE_RETRIES) {
-					li.QuadPart = wb;
-					uprintf("Retrying in %d seconds...", WRITE_TIMEOUT / 1000);
-					Sleep(WRITE_TIMEOUT);
-					if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
-						uprintf("Write error: Could not reset position - %s", WindowsErrorString());
-						goto out;
-					}
-				} else {
-					FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
-					goto out;
-				}
-				Sleep(200);
 			}
-			if (i > WRITE_RETRIES)
+			// Only reposition once per run of blocks to write
+			li.QuadPart = wb + pos;
+			if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
+				uprintf("Error: Could not reset position - %s", WindowsErrorString());
+				FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_SEEK;
 				goto out;
+			}
+			QueryPerformanceCounter(&t0);
+			if (!WriteDriveBlock(hPhysicalDrive, buffer, end - pos, wb + pos))
+				goto out;
+			QueryPerformanceCounter(&t1);
+			write_bytes += end - pos;
+			write_ticks += t1.QuadPart - t0.QuadPart;
+			rewritten += end - pos;
+			dev_pos = wb + end;
+		}
+		skipped += empty;
+		if (dev_pos != wb + size) {
+			li.QuadPart = wb + size;
+			if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
+				uprintf("Error: Could not set position - %s", WindowsErrorString());
+				FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_SEEK;
+				goto out;
+			}
+		}
+
+		// A probe resets our estimate, as the drive may have become emptier since the last one
+		empty_ratio = probing ? (float)empty / size : (empty_ratio + (float)empty / size) / 2.0f;
+		probing = FALSE;
+		// Until we have written something, we have nothing to compare reads against
+		if ((write_ticks == 0) || (read_ticks == 0))
+			continue;
+		read_speed = (float)read_bytes / read_ticks;
+		write_speed = (float)write_bytes / write_ticks;
+		// Reading pays off if: read_time + (1 - empty_ratio) * write_time < write_time
+		if (empty_ratio * read_speed > write_speed) {
+			backoff = 0;
+		} else {
+			backoff = (backoff == 0) ? 1 : min(2 * backoff, MAX_FAST_ZEROING_BACKOFF);
+			throttle = backoff;
 		}
 	}
-	RefreshDriveLayout(hPhysicalDrive);
 	ret = TRUE;
+
+	uprintf("Zeroed %s in %0.1fs", SizeToHumanReadable(target_size, FALSE, FALSE),
+		(GetTickCount64() - start_time) / 1000.0f);
+	if (fast_zeroing) {
+		QueryPerformanceFrequency(&freq);
+		uprintf("  Skipped %s of empty blocks", SizeToHumanReadable(skipped, FALSE, FALSE));
+		uprintf("  Rewrote %s of non empty blocks", SizeToHumanReadable(rewritten, FALSE, FALSE));
+		uprintf("  Wrote %s without checking", SizeToHumanReadable(unchecked, FALSE, FALSE));
+		uprintf("  Read: %0.1f MB/s, Write: %0.1f MB/s",
+			(float)read_bytes / MB / max(0.001f, (float)read_ticks / freq.QuadPart),
+			(float)write_bytes / MB / max(0.001f, (float)write_ticks / freq.QuadPart));
+	}
+
 out:
 	safe_mm_free(buffer);
 	safe_mm_free(cmp_buffer);
 	return ret;
 }
 
+/* Write an image file or zero a drive */
+static BOOL WriteDrive(HANDLE hPhysicalDrive, HANDLE hSourceImage)
+{
+	BOOL ret = FALSE;
+	LARGE_INTEGER li;
+	uint64_t target_size = hSourceImage?img_report.image_size:SelectedDrive.DiskSize;
+
+	// We poked the MBR and other stuff, so we need to rewind
+	li.QuadPart = 0;
+	if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN))
+		uprintf("Warning: Unable to rewind image position - wrong data might be copied!");
+	UpdateProgressWithInfoInit(NULL, FALSE);
+
+	if (hSourceImage != NULL) {
+		uprintf((img_report.compression_type != BLED_COMPRESSION_NONE) ? "Writing compressed image..." : "Writing Image...");
+		OpenWriteHash();
+		if (!WriteImage(hPhysicalDrive, hSourceImage, target_size))
+			goto out;
+	} else {
+		uprintf(fast_zeroing?"Fast-zeroing drive...":"Zeroing drive...");
+		if (!ZeroDrive(hPhysicalDrive, target_size))
+			goto out;
+	}
+	CloseWriteHash(TRUE);
+	if ((write_tree.leaf_sum != NULL) && !VerifyDrive(hPhysicalDrive))
+		goto out;
+	RefreshDriveLayout(hPhysicalDrive);
+	ret = TRUE;
+out:
+	CloseWriteHash(FALSE);
+	FreeTreeHash(&write_tree);
+	return ret;
+}
+
 /*
  * Standalone thread for the formatting operation
  * According to http://msdn.microsoft.com/en-us/library/windows/desktop/aa364562.aspx
@@ -2020,6 +2667,20 @@ DWORD WINAPI FormatThread(void* param)
 	// Try to continue
 	CHECK_FOR_USER_CANCEL;
 
+	// Windows can't mount ext, so we populate it from the ISO through libext2fs instead
+	if ((fs_type >= FS_EXT2) && (fs_type <= FS_EXT4) && (boot_type == BT_IMAGE) &&
+		(image_path != NULL) && img_report.is_iso) {
+		UpdateProgress(OP_FILE_COPY, 0.0f);
+		if (!ExtractISOToExtFs(image_path, DriveIndex, partition_offset[PI_MAIN])) {
+			if (!IS_ERROR(FormatStatus))
+				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|APPERR(ERROR_ISO_EXTRACT);
+			goto out;
+		}
+		UpdateProgress(OP_FINALIZE, -1.0f);
+		PrintInfoDebug(0, MSG_233);
+		goto out;
+	}
+
 	volume_name = GetLogicalName(DriveIndex, partition_offset[PI_MAIN], TRUE, TRUE);
 	if (volume_name == NULL) {
 		uprintf("Could not get volume name");
@@ -109,6 +109,20 @@ typedef BOOLEAN (WINAPI* EnableVolumeCompression_t)(
 	ULONG                CompressionFlags	// FILE_SYSTEM_PROP_FLAG
 );
 
+/* Sparse image write modes, for the SparseImageWrite setting */
+enum {
+	SPARSE_WRITE_NONE = 0,
+	SPARSE_WRITE_SKIP,		// Zeroed blocks are skipped, as the target is assumed to be zeroed already
+	SPARSE_WRITE_TRIM,		// Zeroed blocks are trimmed on the target
+};
+
 BOOL WritePBR(HANDLE hLogicalDrive);
 BOOL FormatLargeFAT32(DWORD DriveIndex, uint64_t PartitionOffset, DWORD ClusterSize, LPCSTR FSName, LPCSTR Label, DWORD Flags);
 BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LPCSTR FSName, LPCSTR Label, DWORD Flags);
+BOOL OpenExtFs(DWORD DriveIndex, uint64_t PartitionOffset);
+BOOL CloseExtFs(void);
+BOOL CreateExtFsDir(const char* path, uint16_t mode, uint32_t mtime);
+BOOL CreateExtFsSymlink(const char* path, const char* target);
+BOOL CreateExtFsFile(const char* path, uint64_t size, uint16_t mode, uint32_t mtime);
+BOOL WriteExtFsFile(const uint8_t* buf, uint32_t size);
+BOOL CloseExtFsFile(void);
@@ -44,13 +44,6 @@ extern DWORD ext2_last_winerror(DWORD default_error);
 static float ext2_percent_start = 0.0f, ext2_percent_share = 0.5f;
 const float ext2_max_marker = 80.0f;
 
-typedef struct {
-	uint64_t max_size;
-	uint32_t block_size;
-	uint32_t inode_size;
-	uint32_t inode_ratio;
-} ext2fs_default_t;
-
 const char* error_message(errcode_t error_code)
 {
 	static char error_string[256];
@@ -218,31 +211,108 @@ const char* GetExtFsLabel(DWORD DriveIndex, uint64_t PartitionOffset)
 	return (r == 0) ? label : NULL;
 }
 
+// What FormatStatus defaults to, and what we report, when a formatting stage fails
+static const struct {
+	DWORD error;
+	const char* msg;
+} ext2_stage_error[EXT2_FORMAT_DONE] = {
+	{ ERROR_INVALID_DATA, "Could not initialize %s features: %s" },
+	{ ERROR_WRITE_FAULT, "Could not zero %s superblock area: %s" },
+	{ ERROR_INVALID_DATA, "Could not allocate %s tables: %s" },
+	{ ERROR_WRITE_FAULT, "Could not zero %s inode sets: %s" },
+	{ ERROR_DIR_NOT_ROOT, "Failed to create %s root and 'lost+found' dirs: %s" },
+	{ ERROR_WRITE_FAULT, "Could not set %s inode bitmaps: %s" },
+	{ ERROR_WRITE_FAULT, "Could not create %s journal: %s" },
+	{ ERROR_WRITE_FAULT, "Could not create %s volume: %s" },
+};
+
+// What our ext2fs_format() notification callback needs to know
+typedef struct {
+	LPCSTR FSName;
+	DWORD Flags;
+} ext2_format_ctx_t;
+
+// Create a 'persistence.conf' file on a file system that is being formatted
+static void ext2_create_persistence_conf(ext2_filsys ext2fs)
+{
+	// You *do* want the LF at the end of the "/ union" line, else Debian Live bails out...
+	const char* name = "persistence.conf", data[] = "/ union\n";
+	int written = 0, fsize = sizeof(data) - 1;
+	ext2_file_t ext2fd;
+	ext2_ino_t inode_id;
+	uint32_t ctime = (uint32_t)time(0);
+	struct ext2_inode inode = { 0 };
+	inode.i_mode = 0100644;
+	inode.i_links_count = 1;
+	inode.i_atime = ctime;
+	inode.i_ctime = ctime;
+	inode.i_mtime = ctime;
+	inode.i_size = fsize;
+
+	ext2fs_namei(ext2fs, EXT2_ROOT_INO, EXT2_ROOT_INO, name, &inode_id);
+	ext2fs_new_inode(ext2fs, EXT2_ROOT_INO, 010755, 0, &inode_id);
+	ext2fs_link(ext2fs, EXT2_ROOT_INO, name, inode_id, EXT2_FT_REG_FILE);
+	ext2fs_inode_alloc_stats(ext2fs, inode_id, 1);
+	ext2fs_write_new_inode(ext2fs, inode_id, &inode);
+	ext2fs_file_open(ext2fs, inode_id, EXT2_FILE_WRITE, &ext2fd);
+	if ((ext2fs_file_write(ext2fd, data, fsize, &written) != 0) || (written != fsize))
+		uprintf("Error: Could not create '%s' file", name);
+	else
+		uprintf("Created '%s' file", name);
+	ext2fs_file_close(ext2fd);
+}
+
+// Report the progress of ext2fs_format()
+static void ext2_format_notify(struct ext2_format_params* params, ext2_filsys ext2fs)
+{
+	ext2_format_ctx_t* ctx = (ext2_format_ctx_t*)params->priv;
+	LPCSTR FSName = ctx->FSName;
+
+	switch (params->stage) {
+	case EXT2_FORMAT_TABLES:
+		if (params->discarded)
+			uprintf("Discarded %s volume blocks", FSName);
+		break;
+	case EXT2_FORMAT_INODE_TABLES:
+		ext2_percent_start = 0.0f;
+		ext2_percent_share = (FSName[3] == '2') ? 1.0f : 0.5f;
+		uprintf("Creating %d inode sets: [1 marker = %0.1f set(s)]", ext2fs->group_desc_count,
+			max((float)ext2fs->group_desc_count / ext2_max_marker, 1.0f));
+		break;
+	case EXT2_FORMAT_DIRS:
+		uprintfs("\r\n");
+		break;
+	case EXT2_FORMAT_JOURNAL:
+		if (params->journal_size == 0)
+			break;
+		ext2_percent_start = 0.5f;
+		uprintf("Creating %d journal blocks: [1 marker = %0.1f block(s)]", params->journal_size,
+			max((float)params->journal_size / ext2_max_marker, 1.0f));
+		break;
+	case EXT2_FORMAT_CLOSE:
+		if (params->journal_size != 0)
+			uprintfs("\r\n");
+		if (ctx->Flags & FP_CREATE_PERSISTENCE_CONF)
+			ext2_create_persistence_conf(ext2fs);
+		break;
+	default:
+		break;
+	}
+}
+
 #define TEST_IMG_PATH               "\\??\\C:\\tmp\\disk.img"
 #define TEST_IMG_SIZE               4000		// Size in MB
 
 BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LPCSTR FSName, LPCSTR Label, DWORD Flags)
 {
-	// Mostly taken from mke2fs.conf
-	const float reserve_ratio = 0.05f;
-	const ext2fs_default_t ext2fs_default[5] = {
-		{ 3 * MB, 1024, 128, 3},	// "floppy"
-		{ 512 * MB, 1024, 128, 2},	// "small"
-		{ 4 * GB, 4096, 256, 2},	// "default"
-		{ 16 * GB, 4096, 256, 3},	// "big"
-		{ 1024 * TB, 4096, 256, 4}	// "huge"
-	};
-
 	BOOL ret = FALSE;
 	char* volume_name = NULL;
-	int i, count;
 	struct ext2_super_block features = { 0 };
+	struct ext2_format_params params = { 0 };
+	ext2_format_ctx_t ctx = { 0 };
 	io_manager manager = nt_io_manager();
-	blk_t journal_size;
-	blk64_t size = 0, cur;
-	ext2_filsys ext2fs = NULL;
+	blk64_t size = 0;
 	errcode_t r;
-	uint8_t* buf = NULL;
 
 #if defined(RUFUS_TEST)
 	// Create a disk image file to test
@@ -250,6 +320,7 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 	HANDLE h;
 	DWORD dwSize;
 	HCRYPTPROV hCryptProv = 0;
+	int i;
 	volume_name = strdup(TEST_IMG_PATH);
 	uprintf("Creating '%s'...", volume_name);
 	if (!CryptAcquireContext(&hCryptProv, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT) || !CryptGenRandom(hCryptProv, sizeof(zb), zb)) {
@@ -275,18 +346,16 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 	if (strchr(volume_name, ' ') != NULL)
 		uprintf("Notice: Using physical device to access partition data");
 
-	if ((strcmp(FSName, FileSystemLabel[FS_EXT2]) != 0) && (strcmp(FSName, FileSystemLabel[FS_EXT3]) != 0)) {
-		if (strcmp(FSName, FileSystemLabel[FS_EXT4]) == 0)
-			uprintf("ext4 file system is not supported, defaulting to ext3");
-		else
-			uprintf("Invalid ext file system version requested, defaulting to ext3");
+	if ((strcmp(FSName, FileSystemLabel[FS_EXT2]) != 0) && (strcmp(FSName, FileSystemLabel[FS_EXT3]) != 0) &&
+		(strcmp(FSName, FileSystemLabel[FS_EXT4]) != 0)) {
+		uprintf("Invalid ext file system version requested, defaulting to ext3");
 		FSName = FileSystemLabel[FS_EXT3];
 	}
 
 	PrintInfoDebug(0, MSG_222, FSName);
 	UpdateProgressWithInfoInit(NULL, TRUE);
 
-	// Figure out the volume size and block size
+	// Figure out the volume size and set our base features from it
 	r = ext2fs_get_device_size2(volume_name, KB, &size);
 	if ((r != 0) || (size == 0)) {
 		FormatStatus = ext2_last_winerror(ERROR_READ_FAULT);
@@ -294,205 +363,381 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 		goto out;
 	}
 	size *= KB;
-	for (i = 0; i < ARRAYSIZE(ext2fs_default); i++) {
-		if (size < ext2fs_default[i].max_size)
-			break;
-	}
-	assert(i < ARRAYSIZE(ext2fs_default));
-	if ((BlockSize == 0) || (BlockSize < EXT2_MIN_BLOCK_SIZE))
-		BlockSize = ext2fs_default[i].block_size;
-	assert(IS_POWER_OF_2(BlockSize));
-	for (features.s_log_block_size = 0; EXT2_BLOCK_SIZE_BITS(&features) <= EXT2_MAX_BLOCK_LOG_SIZE; features.s_log_block_size++) {
-		if (EXT2_BLOCK_SIZE(&features) == BlockSize)
-			break;
-	}
-	assert(EXT2_BLOCK_SIZE_BITS(&features) <= EXT2_MAX_BLOCK_LOG_SIZE);
-	features.s_log_cluster_size = features.s_log_block_size;
-	size /= BlockSize;
-
-	// ext2 and ext3 have a can only accomodate up to Blocksize * 2^32 sized volumes
-	if (((strcmp(FSName, FileSystemLabel[FS_EXT2]) == 0) || (strcmp(FSName, FileSystemLabel[FS_EXT3]) == 0)) &&
-		(size >= 0x100000000ULL)) {
+	assert((BlockSize < EXT2_MIN_BLOCK_SIZE) || IS_POWER_OF_2(BlockSize));
+	r = ext2fs_format_features(&features, FSName, size, BlockSize);
+	if (r == EXT2_ET_FILE_TOO_BIG) {
+		// ext2 and ext3 have a can only accomodate up to Blocksize * 2^32 sized volumes
 		FormatStatus = ext2_last_winerror(ERROR_INVALID_VOLUME_SIZE);
 		uprintf("Volume size is too large for ext2 or ext3");
 		goto out;
 	}
-
-	// Set the blocks, reserved blocks and inodes
-	ext2fs_blocks_count_set(&features, size);
-	ext2fs_r_blocks_count_set(&features, (blk64_t)(reserve_ratio * size));
-	features.s_rev_level = 1;
-	features.s_inode_size = ext2fs_default[i].inode_size;
-	features.s_inodes_count = ((ext2fs_blocks_count(&features) >> ext2fs_default[i].inode_ratio) > UINT32_MAX) ?
-		UINT32_MAX : (uint32_t)(ext2fs_blocks_count(&features) >> ext2fs_default[i].inode_ratio);
-	uprintf("%d possible inodes out of %lld blocks (block size = %d)", features.s_inodes_count, size, EXT2_BLOCK_SIZE(&features));
-	uprintf("%lld blocks (%0.1f%%) reserved for the super user", ext2fs_r_blocks_count(&features), reserve_ratio * 100.0f);
-
-	// Set features
-	ext2fs_set_feature_dir_index(&features);
-	ext2fs_set_feature_filetype(&features);
-	ext2fs_set_feature_large_file(&features);
-	ext2fs_set_feature_sparse_super(&features);
-	ext2fs_set_feature_xattr(&features);
-	if (FSName[3] != '2')
-		ext2fs_set_feature_journal(&features);
-	features.s_default_mount_opts = EXT2_DEFM_XATTR_USER | EXT2_DEFM_ACL;
-
-	// Now that we have set our base features, initialize a virtual superblock
-	r = ext2fs_initialize(volume_name, EXT2_FLAG_EXCLUSIVE | EXT2_FLAG_64BITS, &features, manager, &ext2fs);
 	if (r != 0) {
-		FormatStatus = ext2_last_winerror(ERROR_INVALID_DATA);
-		uprintf("Could not initialize %s features: %s", FSName, error_message(r));
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_INVALID_PARAMETER;
+		uprintf("Could not set %s features: %s", FSName, error_message(r));
 		goto out;
 	}
-
-	// Zero 16 blocks of data from the start of our volume
-	buf = calloc(16, ext2fs->io->block_size);
-	assert(buf != NULL);
-	r = io_channel_write_blk64(ext2fs->io, 0, 16, buf);
-	safe_free(buf);
+	uprintf("%d possible inodes out of %lld blocks (block size = %d)", features.s_inodes_count,
+		ext2fs_blocks_count(&features), EXT2_BLOCK_SIZE(&features));
+	uprintf("%lld blocks (%0.1f%%) reserved for the super user", ext2fs_r_blocks_count(&features),
+		100.0f * ext2fs_r_blocks_count(&features) / ext2fs_blocks_count(&features));
+
+	// Now that we have set our base features, create the file system
+	params.label = Label;
+	IGNORE_RETVAL(CoCreateGuid((GUID*)params.uuid));
+	IGNORE_RETVAL(CoCreateGuid((GUID*)params.hash_seed));
+	params.creator_os = EXT2_OS_WINDOWS;
+	params.flags = (Flags & FP_QUICK) ? EXT2_FORMAT_QUICK : 0;
+	params.notify = ext2_format_notify;
+	ctx.FSName = FSName;
+	ctx.Flags = Flags;
+	params.priv = &ctx;
+	r = ext2fs_format(volume_name, &features, &params, manager);
 	if (r != 0) {
-		FormatStatus = ext2_last_winerror(ERROR_WRITE_FAULT);
-		uprintf("Could not zero %s superblock area: %s", FSName, error_message(r));
+		if (!IS_ERROR(FormatStatus))
+			FormatStatus = ext2_last_winerror(ext2_stage_error[params.stage].error);
+		if (r != EXT2_ET_CANCEL_REQUESTED) {
+			// Terminate the line of progress markers, if any
+			if ((params.stage == EXT2_FORMAT_INODE_TABLES) ||
+				((params.stage == EXT2_FORMAT_JOURNAL) && (params.journal_size != 0)))
+				uprintfs("\r\n");
+			uprintf(ext2_stage_error[params.stage].msg, FSName, error_message(r));
+		}
 		goto out;
 	}
+	UpdateProgressWithInfo(OP_FORMAT, MSG_217, 100, 100);
+	uprintf("Done");
+	ret = TRUE;
+
+out:
+	free(volume_name);
+	return ret;
+}
+
+/*
+ * Population of an ext file system, without going through a mounted volume
+ *
+ * This is meant to be fed sequentially, such as from ISO extraction: the data of each
+ * new file is allocated right after the one of the previous file, and the bitmaps,
+ * group descriptors and superblock are only written once, when the file system is
+ * closed. Only one file can be open at any time.
+ */
+static ext2_filsys ext2_target = NULL;
+static blk64_t ext2_goal;
+static ext2_ino_t ext2_dir_ino;
+static char ext2_dir_path[MAX_PATH];
+static struct {
+	ext2_ino_t ino;
+	struct ext2_inode inode;
+	blk64_t lblk;		// Next logical block to write
+	uint8_t* carry;		// Data that was left over from a write that didn't end on a block
+	uint32_t carry_size;
+} ext2_cur_file = { 0 };
+
+BOOL OpenExtFs(DWORD DriveIndex, uint64_t PartitionOffset)
+{
+	errcode_t r;
+	char* volume_name = GetExtPartitionName(DriveIndex, PartitionOffset);
 
-	// Finish setting up the file system
-	IGNORE_RETVAL(CoCreateGuid((GUID*)ext2fs->super->s_uuid));
-	ext2fs_init_csum_seed(ext2fs);
-	ext2fs->super->s_def_hash_version = EXT2_HASH_HALF_MD4;
-	IGNORE_RETVAL(CoCreateGuid((GUID*)ext2fs->super->s_hash_seed));
-	ext2fs->super->s_max_mnt_count = -1;
-	ext2fs->super->s_creator_os = EXT2_OS_WINDOWS;
-	ext2fs->super->s_errors = EXT2_ERRORS_CONTINUE;
-	if (Label != NULL)
-		static_strcpy(ext2fs->super->s_volume_name, Label);
-
-	r = ext2fs_allocate_tables(ext2fs);
+	assert(ext2_target == NULL);
+	if (volume_name == NULL)
+		return FALSE;
+	r = ext2fs_open(volume_name, EXT2_FLAG_RW | EXT2_FLAG_64BITS | EXT2_FLAG_EXCLUSIVE, 0, 0,
+		nt_io_manager(), &ext2_target);
+	free(volume_name);
+	if (r == 0)
+		r = ext2fs_read_bitmaps(ext2_target);
+	if (r == 0)
+		r = ext2fs_get_memalign(ext2_target->blocksize, ext2_target->blocksize, &ext2_cur_file.carry);
 	if (r != 0) {
-		FormatStatus = ext2_last_winerror(ERROR_INVALID_DATA);
-		uprintf("Could not allocate %s tables: %s", FSName, error_message(r));
-		goto out;
+		uprintf("Could not open ext file system: %s", error_message(r));
+		if (ext2_target != NULL)
+			ext2fs_free(ext2_target);
+		ext2_target = NULL;
+		return FALSE;
 	}
-	r = ext2fs_convert_subcluster_bitmap(ext2fs, &ext2fs->block_map);
+	ext2_target->umask = 022;
+	ext2_goal = 0;
+	ext2_dir_ino = 0;
+	ext2_cur_file.ino = 0;
+	ext2_cur_file.carry_size = 0;
+	return TRUE;
+}
+
+BOOL CloseExtFs(void)
+{
+	errcode_t r;
+
+	if (ext2_target == NULL)
+		return FALSE;
+	CloseExtFsFile();
+	ext2fs_free_mem(&ext2_cur_file.carry);
+	// This is where all the metadata we held back gets written
+	r = ext2fs_close(ext2_target);
 	if (r != 0) {
-		uprintf("Could not set %s cluster bitmap: %s", FSName, error_message(r));
-		goto out;
+		uprintf("Could not close ext file system: %s", error_message(r));
+		ext2fs_free(ext2_target);
 	}
+	ext2_target = NULL;
+	return (r == 0);
+}
 
-	ext2_percent_start = 0.0f;
-	ext2_percent_share = (FSName[3] == '2') ? 1.0f : 0.5f;
-	uprintf("Creating %d inode sets: [1 marker = %0.1f set(s)]", ext2fs->group_desc_count,
-		max((float)ext2fs->group_desc_count / ext2_max_marker, 1.0f));
-	for (i = 0; i < (int)ext2fs->group_desc_count; i++) {
-		if (ext2fs_print_progress((int64_t)i, (int64_t)ext2fs->group_desc_count))
-			goto out;
-		cur = ext2fs_inode_table_loc(ext2fs, i);
-		count = ext2fs_div_ceil((ext2fs->super->s_inodes_per_group - ext2fs_bg_itable_unused(ext2fs, i))
-			* EXT2_INODE_SIZE(ext2fs->super), EXT2_BLOCK_SIZE(ext2fs->super));
-		r = ext2fs_zero_blocks2(ext2fs, cur, count, &cur, &count);
-		if (r != 0) {
-			FormatStatus = ext2_last_winerror(ERROR_WRITE_FAULT);
-			uprintf("\r\nCould not zero inode set at position %llu (%d blocks): %s", cur, count, error_message(r));
-			goto out;
-		}
+// Find the inode of the directory that holds 'path', and point 'name' to its last component.
+// Files come grouped by directory, so we keep the last directory we looked up.
+static errcode_t ext2_resolve_parent(const char* path, ext2_ino_t* parent, const char** name)
+{
+	errcode_t r;
+	const char* p = strrchr(path, '/');
+	size_t len = (p == NULL) ? 0 : p - path;
+
+	*name = (p == NULL) ? path : &p[1];
+	*parent = EXT2_ROOT_INO;
+	if (len == 0)
+		return 0;
+	if (len >= sizeof(ext2_dir_path))
+		return EXT2_ET_INVALID_ARGUMENT;
+	if ((ext2_dir_ino != 0) && (strncmp(path, ext2_dir_path, len) == 0) && (ext2_dir_path[len] == 0)) {
+		*parent = ext2_dir_ino;
+		return 0;
 	}
-	uprintfs("\r\n");
+	memcpy(ext2_dir_path, path, len);
+	ext2_dir_path[len] = 0;
+	r = ext2fs_namei(ext2_target, EXT2_ROOT_INO, EXT2_ROOT_INO, ext2_dir_path, &ext2_dir_ino);
+	if (r != 0)
+		ext2_dir_ino = 0;
+	*parent = ext2_dir_ino;
+	return r;
+}
 
-	// Create root and lost+found dirs
-	r = ext2fs_mkdir(ext2fs, EXT2_ROOT_INO, EXT2_ROOT_INO, 0);
-	if (r != 0) {
-		FormatStatus = ext2_last_winerror(ERROR_DIR_NOT_ROOT);
-		uprintf("Failed to create %s root dir: %s", FSName, error_message(r));
+static __inline void ext2_set_times(struct ext2_inode* inode, uint32_t t)
+{
+	inode->i_atime = t;
+	inode->i_ctime = t;
+	inode->i_mtime = t;
+}
+
+BOOL CreateExtFsDir(const char* path, uint16_t mode, uint32_t mtime)
+{
+	errcode_t r;
+	ext2_ino_t parent, ino = 0;
+	struct ext2_inode inode;
+	const char* name;
+
+	assert(ext2_target != NULL);
+	r = ext2_resolve_parent(path, &parent, &name);
+	if (r != 0)
 		goto out;
+	if (ext2fs_lookup(ext2_target, parent, name, (int)strlen(name), NULL, &ino) != 0) {
+		r = ext2fs_mkdir(ext2_target, parent, 0, name);
+		if (r == EXT2_ET_DIR_NO_SPACE) {
+			r = ext2fs_expand_dir(ext2_target, parent);
+			if (r == 0)
+				r = ext2fs_mkdir(ext2_target, parent, 0, name);
+		}
+		if (r == 0)
+			r = ext2fs_lookup(ext2_target, parent, name, (int)strlen(name), NULL, &ino);
+		if (r != 0)
+			goto out;
 	}
-	ext2fs->umask = 077;
-	r = ext2fs_mkdir(ext2fs, EXT2_ROOT_INO, 0, "lost+found");
-	if (r != 0) {
-		FormatStatus = ext2_last_winerror(ERROR_DIR_NOT_ROOT);
-		uprintf("Failed to create %s 'lost+found' dir: %s", FSName, error_message(r));
+	r = ext2fs_read_inode(ext2_target, ino, &inode);
+	if (r != 0)
 		goto out;
-	}
+	if (mode != 0)
+		inode.i_mode = LINUX_S_IFDIR | (mode & 07777);
+	ext2_set_times(&inode, mtime);
+	r = ext2fs_write_inode(ext2_target, ino, &inode);
 
-	// Create bitmaps
-	for (i = EXT2_ROOT_INO + 1; i < (int)EXT2_FIRST_INODE(ext2fs->super); i++)
-		ext2fs_inode_alloc_stats(ext2fs, i, 1);
-	ext2fs_mark_ib_dirty(ext2fs);
+out:
+	if (r != 0)
+		uprintf("  Could not create directory '%s': %s", path, error_message(r));
+	return (r == 0);
+}
 
-	r = ext2fs_mark_inode_bitmap2(ext2fs->inode_map, EXT2_BAD_INO);
-	if (r != 0) {
-		FormatStatus = ext2_last_winerror(ERROR_WRITE_FAULT);
-		uprintf("Could not set inode bitmaps: %s", error_message(r));
+BOOL CreateExtFsSymlink(const char* path, const char* target)
+{
+	errcode_t r;
+	ext2_ino_t parent;
+	const char* name;
+
+	assert(ext2_target != NULL);
+	r = ext2_resolve_parent(path, &parent, &name);
+	if (r == 0)
+		r = ext2fs_symlink(ext2_target, parent, 0, name, target);
+	if (r == EXT2_ET_DIR_NO_SPACE) {
+		r = ext2fs_expand_dir(ext2_target, parent);
+		if (r == 0)
+			r = ext2fs_symlink(ext2_target, parent, 0, name, target);
+	}
+	if (r != 0)
+		uprintf("  Could not create symbolic link '%s': %s", path, error_message(r));
+	return (r == 0);
+}
+
+// We are populating a new file system from a single image, so names are unique and
+// we don't need to look them up before we create a file.
+BOOL CreateExtFsFile(const char* path, uint64_t size, uint16_t mode, uint32_t mtime)
+{
+	errcode_t r;
+	ext2_ino_t parent, ino = 0;
+	ext2_extent_handle_t handle;
+	struct ext2_inode* inode = &ext2_cur_file.inode;
+	const char* name;
+	blk64_t nb_blocks;
+
+	assert(ext2_target != NULL);
+	assert(ext2_cur_file.ino == 0);
+	r = ext2_resolve_parent(path, &parent, &name);
+	if (r != 0)
 		goto out;
+	r = ext2fs_new_inode(ext2_target, parent, LINUX_S_IFREG, NULL, &ino);
+	if (r != 0)
+		goto out;
+	memset(inode, 0, sizeof(*inode));
+	inode->i_mode = LINUX_S_IFREG | ((mode == 0) ? 0644 : (mode & 07777));
+	inode->i_links_count = 1;
+	ext2_set_times(inode, mtime);
+	r = ext2fs_inode_size_set(ext2_target, inode, size);
+	if (r != 0)
+		goto out;
+	// Opening an extent handle on an empty inode sets it up for extents
+	if (ext2fs_has_feature_extents(ext2_target->super)) {
+		r = ext2fs_extent_open2(ext2_target, ino, inode, &handle);
+		if (r != 0)
+			goto out;
+		ext2fs_extent_free(handle);
 	}
-	ext2fs_inode_alloc_stats(ext2fs, EXT2_BAD_INO, 1);
-	r = ext2fs_update_bb_inode(ext2fs, NULL);
-	if (r != 0) {
-		FormatStatus = ext2_last_winerror(ERROR_WRITE_FAULT);
-		uprintf("Could not set inode stats: %s", error_message(r));
+	r = ext2fs_write_new_inode(ext2_target, ino, inode);
+	if (r != 0)
 		goto out;
+	r = ext2fs_link(ext2_target, parent, name, ino, EXT2_FT_REG_FILE);
+	if (r == EXT2_ET_DIR_NO_SPACE) {
+		r = ext2fs_expand_dir(ext2_target, parent);
+		if (r == 0)
+			r = ext2fs_link(ext2_target, parent, name, ino, EXT2_FT_REG_FILE);
 	}
+	if (r != 0)
+		goto out;
+	ext2fs_inode_alloc_stats2(ext2_target, ino, +1, 0);
+	ext2_cur_file.ino = ino;
+	ext2_cur_file.lblk = 0;
+	ext2_cur_file.carry_size = 0;
+
+	// Extent based files get all their blocks at once, right after the previous file's.
+	// Block mapped files get theirs as they are written, since ext2fs_fallocate() would
+	// zero them one by one.
+	nb_blocks = ext2fs_div64_ceil(size, ext2_target->blocksize);
+	if ((inode->i_flags & EXT4_EXTENTS_FL) && (nb_blocks != 0))
+		r = ext2fs_fallocate(ext2_target, EXT2_FALLOCATE_FORCE_INIT, ino, inode,
+			(ext2_goal == 0) ? ~0ULL : ext2_goal, 0, nb_blocks);
 
-	if (FSName[3] != '2') {
-		// Create the journal
-		ext2_percent_start = 0.5f;
-		journal_size = ext2fs_default_journal_size(ext2fs_blocks_count(ext2fs->super));
-		journal_size /= 2;	// That journal init is really killing us!
-		uprintf("Creating %d journal blocks: [1 marker = %0.1f block(s)]", journal_size,
-			max((float)journal_size / ext2_max_marker, 1.0f));
-		// Even with EXT2_MKJOURNAL_LAZYINIT, this call is absolutely dreadful in terms of speed...
-		r = ext2fs_add_journal_inode(ext2fs, journal_size, EXT2_MKJOURNAL_NO_MNT_CHECK | ((Flags & FP_QUICK) ? EXT2_MKJOURNAL_LAZYINIT : 0));
-		uprintfs("\r\n");
-		if (r != 0) {
-			FormatStatus = ext2_last_winerror(ERROR_WRITE_FAULT);
-			uprintf("Could not create %s journal: %s", FSName, error_message(r));
-			goto out;
+out:
+	if (r != 0)
+		uprintf("  Could not create file '%s': %s", path, error_message(r));
+	return (r == 0);
+}
+
+// Write blocks of file data, with physically contiguous blocks coalesced into a single write
+static errcode_t ext2_write_file_blocks(const uint8_t* buf, blk64_t count)
+{
+	errcode_t r = 0;
+	blk64_t pblk, next, run;
+	ext2_extent_handle_t handle = NULL;
+	struct ext2fs_extent extent;
+
+	// Extent based files are already fully allocated, so we just walk their extents
+	if (ext2_cur_file.inode.i_flags & EXT4_EXTENTS_FL) {
+		r = ext2fs_extent_open2(ext2_target, ext2_cur_file.ino, &ext2_cur_file.inode, &handle);
+		if (r != 0)
+			return r;
+	}
+	while (count > 0) {
+		if (handle != NULL) {
+			r = ext2fs_extent_goto(handle, ext2_cur_file.lblk);
+			if (r == 0)
+				r = ext2fs_extent_get(handle, EXT2_EXTENT_CURRENT, &extent);
+			// Only happens if we are given more data than the size the file was created with
+			if (r == EXT2_ET_EXTENT_NOT_FOUND)
+				r = EXT2_ET_FILE_TOO_BIG;
+			if (r != 0)
+				break;
+			pblk = extent.e_pblk + (ext2_cur_file.lblk - extent.e_lblk);
+			run = min(count, extent.e_lblk + extent.e_len - ext2_cur_file.lblk);
+		} else {
+			r = ext2fs_bmap2(ext2_target, ext2_cur_file.ino, &ext2_cur_file.inode, NULL, BMAP_ALLOC,
+				ext2_cur_file.lblk, NULL, &pblk);
+			if (r != 0)
+				break;
+			for (run = 1; run < count; run++) {
+				r = ext2fs_bmap2(ext2_target, ext2_cur_file.ino, &ext2_cur_file.inode, NULL, BMAP_ALLOC,
+					ext2_cur_file.lblk + run, NULL, &next);
+				if ((r != 0) || (next != pblk + run))
+					break;
+			}
+			if (r != 0)
+				break;
 		}
+		r = io_channel_write_blk64(ext2_target->io, pblk, (int)run, buf);
+		if (r != 0)
+			break;
+		ext2_cur_file.lblk += run;
+		ext2_goal = pblk + run;
+		buf = &buf[run * ext2_target->blocksize];
+		count -= run;
 	}
+	if (handle != NULL)
+		ext2fs_extent_free(handle);
+	return r;
+}
 
-	// Create a 'persistence.conf' file if required
-	if (Flags & FP_CREATE_PERSISTENCE_CONF) {
-		// You *do* want the LF at the end of the "/ union" line, else Debian Live bails out...
-		const char* name = "persistence.conf", data[] = "/ union\n";
-		int written = 0, fsize = sizeof(data) - 1;
-		ext2_file_t ext2fd;
-		ext2_ino_t inode_id;
-		uint32_t ctime = (uint32_t)time(0);
-		struct ext2_inode inode = { 0 };
-		inode.i_mode = 0100644;
-		inode.i_links_count = 1;
-		inode.i_atime = ctime;
-		inode.i_ctime = ctime;
-		inode.i_mtime = ctime;
-		inode.i_size = fsize;
-
-		ext2fs_namei(ext2fs, EXT2_ROOT_INO, EXT2_ROOT_INO, name, &inode_id);
-		ext2fs_new_inode(ext2fs, EXT2_ROOT_INO, 010755, 0, &inode_id);
-		ext2fs_link(ext2fs, EXT2_ROOT_INO, name, inode_id, EXT2_FT_REG_FILE);
-		ext2fs_inode_alloc_stats(ext2fs, inode_id, 1);
-		ext2fs_write_new_inode(ext2fs, inode_id, &inode);
-		ext2fs_file_open(ext2fs, inode_id, EXT2_FILE_WRITE, &ext2fd);
-		if ((ext2fs_file_write(ext2fd, data, fsize, &written) != 0) || (written != fsize))
-			uprintf("Error: Could not create '%s' file", name);
-		else
-			uprintf("Created '%s' file", name);
-		ext2fs_file_close(ext2fd);
+BOOL WriteExtFsFile(const uint8_t* buf, uint32_t size)
+{
+	errcode_t r = 0;
+	uint32_t len, block_size;
+
+	assert(ext2_cur_file.ino != 0);
+	block_size = ext2_target->blocksize;
+	// Complete the block that a previous write left partial
+	if (ext2_cur_file.carry_size != 0) {
+		len = min(size, block_size - ext2_cur_file.carry_size);
+		memcpy(&ext2_cur_file.carry[ext2_cur_file.carry_size], buf, len);
+		ext2_cur_file.carry_size += len;
+		buf = &buf[len];
+		size -= len;
+		if (ext2_cur_file.carry_size == block_size) {
+			r = ext2_write_file_blocks(ext2_cur_file.carry, 1);
+			ext2_cur_file.carry_size = 0;
+		}
 	}
-
-	// Finally we can call close() to get the file system gets created
-	r = ext2fs_close(ext2fs);
-	if (r != 0) {
-		FormatStatus = ext2_last_winerror(ERROR_WRITE_FAULT);
-		uprintf("Could not create %s volume: %s", FSName, error_message(r));
-		goto out;
+	if ((r == 0) && (size >= block_size)) {
+		len = size - (size % block_size);
+		r = ext2_write_file_blocks(buf, len / block_size);
+		buf = &buf[len];
+		size -= len;
 	}
-	UpdateProgressWithInfo(OP_FORMAT, MSG_217, 100, 100);
-	uprintf("Done");
-	ret = TRUE;
+	if ((r == 0) && (size != 0)) {
+		memcpy(&ext2_cur_file.carry[ext2_cur_file.carry_size], buf, size);
+		ext2_cur_file.carry_size += size;
+	}
+	if (r != 0)
+		uprintf("  Error writing file: %s", error_message(r));
+	return (r == 0);
+}
 
-out:
-	free(volume_name);
-	ext2fs_free(ext2fs);
-	free(buf);
-	return ret;
+BOOL CloseExtFsFile(void)
+{
+	errcode_t r = 0;
+
+	if (ext2_cur_file.ino == 0)
+		return TRUE;
+	// The last block is padded with zeros
+	if (ext2_cur_file.carry_size != 0) {
+		memset(&ext2_cur_file.carry[ext2_cur_file.carry_size], 0, ext2_target->blocksize - ext2_cur_file.carry_size);
+		r = ext2_write_file_blocks(ext2_cur_file.carry, 1);
+		ext2_cur_file.carry_size = 0;
+	}
+	if (r == 0)
+		r = ext2fs_write_inode(ext2_target, ext2_cur_file.ino, &ext2_cur_file.inode);
+	ext2_cur_file.ino = 0;
+	if (r != 0)
+		uprintf("  Error closing file: %s", error_message(r));
+	return (r == 0);
 }
@@ -43,6 +43,7 @@
 #include <cdio/udf.h>
 
 #include "rufus.h"
+#include "format.h"
 #include "libfat.h"
 #include "missing.h"
 #include "resource.h"
@@ -53,6 +54,14 @@
 // How often should we update the progress bar (in 2K blocks) as updating
 // the progress bar for every block will bring extraction to a crawl
 #define PROGRESS_THRESHOLD        128
+// Size of the buffer used to copy file extents (must be a multiple of ISO_BLOCKSIZE/UDF_BLOCKSIZE)
+#define EXTRACT_BUFFER_SIZE       (4 * 1024 * 1024)
+// Files up to this size are handed over to the extraction workers
+#define EXTRACT_SMALL_FILE_SIZE   (256 * 1024)
+#define EXTRACT_QUEUE_SIZE        64
+#define EXTRACT_THREADS           4
+// Number of bits used to remember which (case-folded) paths have been handed over to the workers
+#define EXTRACT_POSTED_BITS       (64 * 1024)
 #define FOUR_GIGABYTES            4294967296LL
 
 // Needed for UDF symbolic link testing
@@ -78,12 +87,79 @@ typedef struct {
 	BOOLEAN is_old_c32[NB_OLD_C32];
 } EXTRACT_PROPS;
 
+// A small file, along with its content, waiting to be created by an extraction worker
+typedef struct {
+	char* path;
+	uint8_t* data;
+	DWORD size;
+	BOOL set_time;
+	FILETIME ft[3];		// Creation, last access and last modification times
+	HANDLE event;		// For a job without a path, the event to signal once all previous jobs are done
+} EXTRACT_JOB;
+
+// The jobs of a single extraction worker
+typedef struct {
+	EXTRACT_JOB job[EXTRACT_QUEUE_SIZE];
+	DWORD head, tail;
+	HANDLE free_slots, full_slots;
+} EXTRACT_RING;
+
+/*
+ * With images that contain thousands of small files, most of the extraction time is spent
+ * creating, preallocating, timestamping and closing files on the target, rather than reading
+ * them. So, while the image is still walked and read sequentially, small files are handed over
+ * to a pool of workers that perform these operations in parallel. Directories, as well as large
+ * files, are still processed inline and in order, which guarantees that a directory exists before
+ * any of its children are queued. Config files, which may need fixing once written, are never
+ * queued, and the queue is drained before we proceed with any post extraction processing.
+ * Because two entries of an image may end up with the same path on the target, once sanitized
+ * or when they only differ by case, each worker has its own queue, and a file is always sent to
+ * the worker that its case-folded path hashes to, so that these entries are written in order.
+ * For the same reason, a file that is written inline first waits for the worker its path was
+ * sent to, if any, to be done with its previous jobs.
+ */
+typedef struct {
+	EXTRACT_RING ring[EXTRACT_THREADS];
+	HANDLE thread[EXTRACT_THREADS];
+	DWORD num_threads;
+	BOOL initialized;
+	HANDLE synced;
+	uint8_t posted[EXTRACT_POSTED_BITS / 8];
+} EXTRACT_QUEUE;
+
+// An entry of the ISO9660 file index
+typedef struct {
+	uint32_t name;		// Offset of the path in the name pool
+	uint32_t hash;
+	lsn_t lsn;
+	int64_t size;
+} ISO_INDEX_ENTRY;
+
+/*
+ * Once an image has been scanned, we need to look up a handful of files (isolinux.bin,
+ * install.wim, efi.img, ...) which, with libcdio, means reopening the image and resolving
+ * each path, one directory sector at a time, from the root. Since the scan already walks
+ * the whole ISO9660 file system, we use it to build a compact index of the files, with all
+ * the paths interned in a single pool, and a hash table to look them up. A lookup that fails
+ * is never an error, as callers then fall back to resolving the path through libcdio.
+ */
+typedef struct {
+	char* image_path;
+	ISO_INDEX_ENTRY* entry;
+	uint32_t nb_entries, max_entries;
+	char* pool;
+	uint32_t pool_size, pool_max;
+	uint32_t* table;	// Index of the entry + 1, or 0 for an empty slot
+	uint32_t table_size;
+} ISO_INDEX;
+
 RUFUS_IMG_REPORT img_report;
 int64_t iso_blocking_status = -1;
 extern BOOL preserve_timestamps, enable_ntfs_compression;
 extern char* archive_path;
 BOOL enable_iso = TRUE, enable_joliet = TRUE, enable_rockridge = TRUE, has_ldlinux_c32;
-#define ISO_BLOCKING(x) do {x; iso_blocking_status++; } while(0)
+// Can be called from the extraction worker threads, hence the interlocked increment
+#define ISO_BLOCKING(x) do {x; InterlockedIncrement64(&iso_blocking_status); } while(0)
 static const char* psz_extract_dir;
 static const char* bootmgr_name = "bootmgr";
 static const char* bootmgr_efi_name = "bootmgr.efi";
@@ -120,7 +196,10 @@ const char* old_c32_name[NB_OLD_C32] = OLD_C32_NAMES;
 static const int64_t old_c32_threshold[NB_OLD_C32] = OLD_C32_THRESHOLD;
 static uint8_t joliet_level = 0;
 static uint64_t total_blocks, nb_blocks;
-static BOOL scan_only = FALSE;
+static BOOL scan_only = FALSE, extract_to_ext = FALSE;
+static uint8_t* extract_buf = NULL;
+static EXTRACT_QUEUE extract_queue = { 0 };
+static ISO_INDEX iso_index = { 0 };
 static StrArray config_path, isolinux_path, modified_path;
 
 // Ensure filenames do not contain invalid FAT32 or NTFS characters
@@ -453,6 +532,335 @@ static void __inline set_directory_timestamp(char* path, LPFILETIME creation, LP
 	safe_closehandle(dir_handle);
 }
 
+// Update the progress bar, every PROGRESS_THRESHOLD blocks, after blocks have been read
+static __inline void update_extract_progress(uint64_t blocks)
+{
+	if ((nb_blocks / PROGRESS_THRESHOLD) != ((nb_blocks + blocks) / PROGRESS_THRESHOLD))
+		UpdateProgressWithInfo(OP_FILE_COPY, MSG_231, nb_blocks + blocks, total_blocks);
+	nb_blocks += blocks;
+}
+
+// Create a file from a queued job. Returns FALSE on error.
+static BOOL write_extracted_file(EXTRACT_JOB* job)
+{
+	HANDLE file_handle;
+	DWORD wr_size, err;
+	BOOL r = TRUE;
+
+	file_handle = CreatePreallocatedFile(job->path, GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, job->size);
+	if (file_handle == INVALID_HANDLE_VALUE) {
+		err = GetLastError();
+		uprintf("  Unable to create file '%s': %s", job->path, WindowsErrorString());
+		if (((err == ERROR_ACCESS_DENIED) || (err == ERROR_INVALID_HANDLE)) &&
+			(safe_strcmp(&job->path[3], autorun_name) == 0)) {
+			uprintf(stupid_antivirus);
+			return TRUE;
+		}
+		return FALSE;
+	}
+	if (job->size != 0) {
+		ISO_BLOCKING(r = WriteFileWithRetry(file_handle, job->data, job->size, &wr_size, WRITE_RETRIES));
+		if (!r)
+			uprintf("  Error writing file '%s': %s", job->path, WindowsErrorString());
+	}
+	if ((r) && (job->set_time) && (!SetFileTime(file_handle, &job->ft[0], &job->ft[1], &job->ft[2])))
+		uprintf("  Could not set timestamp for '%s': %s", job->path, WindowsErrorString());
+	ISO_BLOCKING(safe_closehandle(file_handle));
+	return r;
+}
+
+static DWORD WINAPI ExtractThread(void* param)
+{
+	EXTRACT_RING* ring = (EXTRACT_RING*)param;
+	EXTRACT_JOB job;
+
+	while (WaitForSingleObject(ring->full_slots, INFINITE) == WAIT_OBJECT_0) {
+		job = ring->job[ring->tail];
+		ring->tail = (ring->tail + 1) % EXTRACT_QUEUE_SIZE;
+		ReleaseSemaphore(ring->free_slots, 1, NULL);
+		// A job without a path is either a synchronization request or our signal to exit
+		if (job.path == NULL) {
+			if (job.event == NULL)
+				break;
+			SetEvent(job.event);
+			continue;
+		}
+		// Once an error or cancellation has occurred, we just drain the queue
+		if ((FormatStatus == 0) && (!write_extracted_file(&job)) && (FormatStatus == 0))
+			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|APPERR(ERROR_ISO_EXTRACT);
+		free(job.path);
+		free(job.data);
+	}
+	ExitThread(0);
+}
+
+// Hash a path the way it is compared by the target file system, i.e. without regards to case
+static uint32_t extract_path_hash(const char* path)
+{
+	uint32_t hash = 2166136261U;
+	wchar_t* wpath = utf8_to_wchar(path);
+	size_t i;
+
+	if (wpath != NULL) {
+		CharUpperBuffW(wpath, (DWORD)wcslen(wpath));
+		for (i = 0; wpath[i] != 0; i++)
+			hash = (hash ^ wpath[i]) * 16777619U;
+		free(wpath);
+	} else {
+		for (i = 0; path[i] != 0; i++)
+			hash = (hash ^ (uint8_t)toupper((uint8_t)path[i])) * 16777619U;
+	}
+	return hash;
+}
+
+// Add a job to a worker's queue. Must only be called from the extraction thread.
+static BOOL extract_ring_push(EXTRACT_RING* ring, EXTRACT_JOB* job)
+{
+	if (WaitForSingleObject(ring->free_slots, INFINITE) != WAIT_OBJECT_0) {
+		uprintf("Could not queue file for extraction: %s", WindowsErrorString());
+		return FALSE;
+	}
+	ring->job[ring->head] = *job;
+	ring->head = (ring->head + 1) % EXTRACT_QUEUE_SIZE;
+	ReleaseSemaphore(ring->full_slots, 1, NULL);
+	return TRUE;
+}
+
+/*
+ * Hand a file over to the extraction worker its path is assigned to. The worker takes
+ * ownership of path and data. Must only be called from the extraction thread.
+ */
+static BOOL extract_queue_post(char* path, uint8_t* data, DWORD size,
+	LPFILETIME creation, LPFILETIME last_access, LPFILETIME modify)
+{
+	EXTRACT_JOB job = { 0 };
+	uint32_t hash = extract_path_hash(path);
+
+	job.path = path;
+	job.data = data;
+	job.size = size;
+	job.set_time = (creation != NULL);
+	if (job.set_time) {
+		job.ft[0] = *creation;
+		job.ft[1] = *last_access;
+		job.ft[2] = *modify;
+	}
+	if (!extract_ring_push(&extract_queue.ring[hash % extract_queue.num_threads], &job)) {
+		free(path);
+		free(data);
+		return FALSE;
+	}
+	extract_queue.posted[(hash % EXTRACT_POSTED_BITS) / 8] |= 1 << (hash % 8);
+	return TRUE;
+}
+
+/*
+ * Before a file is written inline, make sure that the worker its path may have been
+ * sent to is done with it. Must only be called from the extraction thread.
+ */
+static BOOL extract_queue_sync(const char* path)
+{
+	EXTRACT_JOB job = { 0 };
+	uint32_t hash;
+
+	if (extract_queue.num_threads == 0)
+		return TRUE;
+	hash = extract_path_hash(path);
+	if (!(extract_queue.posted[(hash % EXTRACT_POSTED_BITS) / 8] & (1 << (hash % 8))))
+		return TRUE;
+	job.event = extract_queue.synced;
+	if (!extract_ring_push(&extract_queue.ring[hash % extract_queue.num_threads], &job))
+		return FALSE;
+	if (WaitForSingleObject(extract_queue.synced, INFINITE) != WAIT_OBJECT_0) {
+		uprintf("Could not wait for extraction worker: %s", WindowsErrorString());
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// Wait for all queued files to be written and stop the extraction workers
+static void extract_queue_stop(void)
+{
+	EXTRACT_JOB job = { 0 };
+	DWORD i;
+
+	if (!extract_queue.initialized)
+		return;
+	for (i = 0; i < extract_queue.num_threads; i++)
+		extract_ring_push(&extract_queue.ring[i], &job);
+	if (extract_queue.num_threads != 0)
+		WaitForMultipleObjects(extract_queue.num_threads, extract_queue.thread, TRUE, INFINITE);
+	for (i = 0; i < EXTRACT_THREADS; i++) {
+		safe_closehandle(extract_queue.thread[i]);
+		safe_closehandle(extract_queue.ring[i].free_slots);
+		safe_closehandle(extract_queue.ring[i].full_slots);
+	}
+	safe_closehandle(extract_queue.synced);
+	memset(&extract_queue, 0, sizeof(extract_queue));
+}
+
+// Start the extraction workers. If this fails, files are extracted sequentially.
+static BOOL extract_queue_start(void)
+{
+	EXTRACT_RING* ring;
+	DWORD i;
+
+	memset(&extract_queue, 0, sizeof(extract_queue));
+	extract_queue.initialized = TRUE;
+	extract_queue.synced = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (extract_queue.synced == NULL) {
+		uprintf("Could not create extraction queue event: %s", WindowsErrorString());
+		goto out;
+	}
+	for (i = 0; i < EXTRACT_THREADS; i++) {
+		ring = &extract_queue.ring[i];
+		ring->free_slots = CreateSemaphore(NULL, EXTRACT_QUEUE_SIZE, EXTRACT_QUEUE_SIZE, NULL);
+		ring->full_slots = CreateSemaphore(NULL, 0, EXTRACT_QUEUE_SIZE, NULL);
+		if ((ring->free_slots == NULL) || (ring->full_slots == NULL)) {
+			uprintf("Could not create extraction queue semaphores: %s", WindowsErrorString());
+			break;
+		}
+		extract_queue.thread[i] = CreateThread(NULL, 0, ExtractThread, ring, 0, NULL);
+		if (extract_queue.thread[i] == NULL)
+			break;
+		extract_queue.num_threads++;
+	}
+
+out:
+	if (extract_queue.num_threads == 0) {
+		uprintf("Unable to start extraction threads - files will be extracted sequentially");
+		extract_queue_stop();
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// Small files, that we don't need to alter once written, are extracted by the workers
+static __inline BOOL is_queued_file(int64_t file_length, EXTRACT_PROPS* props)
+{
+	return (extract_queue.num_threads != 0) && (file_length <= EXTRACT_SMALL_FILE_SIZE) && (!props->is_cfg);
+}
+
+// Read a small UDF file into a newly allocated buffer
+static uint8_t* udf_read_file(udf_dirent_t* p_udf_dirent, int64_t file_length, const char* psz_name)
+{
+	uint8_t* buf;
+	int64_t pos, read;
+	size_t nb_blocks_left = (size_t)((file_length + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE);
+
+	// Add an extra block, in case an extent that isn't the last one isn't block aligned
+	buf = (uint8_t*)malloc((nb_blocks_left + 1) * UDF_BLOCKSIZE);
+	if (buf == NULL) {
+		uprintf("  Could not allocate buffer for %s", psz_name);
+		return NULL;
+	}
+	for (pos = 0; pos < file_length; pos += read) {
+		nb_blocks_left = (size_t)((file_length - pos + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE);
+		read = udf_read_blocks(p_udf_dirent, &buf[pos], nb_blocks_left);
+		if (read <= 0) {
+			uprintf("  Error reading UDF file %s", psz_name);
+			free(buf);
+			return NULL;
+		}
+		update_extract_progress((read + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE);
+	}
+	return buf;
+}
+
+// Read a small ISO9660 file into a newly allocated buffer
+static uint8_t* iso_read_file(iso9660_t* p_iso, lsn_t lsn, int64_t file_length, const char* psz_name)
+{
+	uint8_t* buf;
+	long int nb_read = (long int)((file_length + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE);
+
+	buf = (uint8_t*)malloc((size_t)nb_read * ISO_BLOCKSIZE);
+	if (buf == NULL) {
+		uprintf("  Could not allocate buffer for %s", psz_name);
+		return NULL;
+	}
+	if (iso9660_iso_seek_read(p_iso, buf, lsn, nb_read) != nb_read * ISO_BLOCKSIZE) {
+		uprintf("  Error reading ISO9660 file %s at LSN %lu", psz_name, (long unsigned int)lsn);
+		free(buf);
+		return NULL;
+	}
+	update_extract_progress(nb_read);
+	return buf;
+}
+
+// Permissions to apply to an ISO9660 file or directory on ext, if Rock Ridge provides them
+static __inline uint16_t iso_posix_mode(iso9660_stat_t* p_statbuf)
+{
+	return ((p_statbuf->rr.b3_rock == yep) && enable_rockridge) ? (uint16_t)(p_statbuf->rr.st_mode & 07777) : 0;
+}
+
+// Stream a UDF file into the ext file system we are populating
+static BOOL udf_extract_ext_file(udf_dirent_t* p_udf_dirent, int64_t file_length, const char* psz_name)
+{
+	int64_t read;
+
+	if (!CreateExtFsFile(psz_name, file_length, (uint16_t)(udf_get_posix_filemode(p_udf_dirent) & 07777),
+		(uint32_t)udf_get_modification_time(p_udf_dirent)))
+		return FALSE;
+	while (file_length > 0) {
+		if (FormatStatus)
+			goto out;
+		read = udf_read_blocks(p_udf_dirent, extract_buf, (size_t)MIN((file_length + UDF_BLOCKSIZE - 1)
+			/ UDF_BLOCKSIZE, EXTRACT_BUFFER_SIZE / UDF_BLOCKSIZE));
+		if (read <= 0) {
+			uprintf("  Error reading UDF file %s", psz_name);
+			goto out;
+		}
+		if (!WriteExtFsFile(extract_buf, (uint32_t)MIN(file_length, read)))
+			goto out;
+		file_length -= read;
+		update_extract_progress((read + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE);
+	}
+	return CloseExtFsFile();
+
+out:
+	CloseExtFsFile();
+	return FALSE;
+}
+
+// Stream an ISO9660 file, or create a Rock Ridge symbolic link, in the ext file system we are populating
+static BOOL iso_extract_ext_file(iso9660_t* p_iso, iso9660_stat_t* p_statbuf, const char* psz_iso_name, BOOL is_symlink)
+{
+	BOOL r;
+	DWORD buf_size;
+	long int nb_read;
+	lsn_t lsn = p_statbuf->lsn;
+	int64_t file_length = p_statbuf->total_size;
+
+	if (is_symlink) {
+		r = CreateExtFsSymlink(psz_iso_name, p_statbuf->rr.psz_symlink);
+		safe_free(p_statbuf->rr.psz_symlink);
+		return r;
+	}
+	if (!CreateExtFsFile(psz_iso_name, file_length, iso_posix_mode(p_statbuf), (uint32_t)mktime(&p_statbuf->tm)))
+		return FALSE;
+	while (file_length > 0) {
+		if (FormatStatus)
+			goto out;
+		buf_size = (DWORD)MIN(file_length, EXTRACT_BUFFER_SIZE);
+		nb_read = (buf_size + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE;
+		if (iso9660_iso_seek_read(p_iso, extract_buf, lsn, nb_read) != nb_read * ISO_BLOCKSIZE) {
+			uprintf("  Error reading ISO9660 file %s at LSN %lu", psz_iso_name, (long unsigned int)lsn);
+			goto out;
+		}
+		if (!WriteExtFsFile(extract_buf, buf_size))
+			goto out;
+		update_extract_progress(nb_read);
+		lsn += (lsn_t)nb_read;
+		file_length -= buf_size;
+	}
+	return CloseExtFsFile();
+
+out:
+	CloseExtFsFile();
+	return FALSE;
+}
+
 // Returns 0 on success, nonzero on error
 static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const char *psz_path)
 {
@@ -465,7 +873,7 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 	char tmp[128], *psz_fullpath = NULL, *psz_sanpath = NULL;
 	const char* psz_basename;
 	udf_dirent_t *p_udf_dirent2;
-	uint8_t buf[UDF_BLOCKSIZE];
+	uint8_t* data;
 	int64_t read, file_length;
 
 	if ((p_udf_dirent == NULL) || (psz_path == NULL))
@@ -491,7 +899,12 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 		if (S_ISLNK(udf_get_posix_filemode(p_udf_dirent)))
 			img_report.has_symlinks = SYMLINKS_UDF;
 		if (udf_is_dir(p_udf_dirent)) {
-			if (!scan_only) {
+			if (!scan_only && extract_to_ext) {
+				if (!CreateExtFsDir(&psz_fullpath[strlen(psz_extract_dir)],
+					(uint16_t)(udf_get_posix_filemode(p_udf_dirent) & 07777),
+					(uint32_t)udf_get_modification_time(p_udf_dirent)))
+					goto out;
+			} else if (!scan_only) {
 				psz_sanpath = sanitize_filename(psz_fullpath, &is_identical);
 				IGNORE_RETVAL(_mkdirU(psz_sanpath));
 				if (preserve_timestamps) {
@@ -507,6 +920,15 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 			}
 		} else {
 			file_length = udf_get_file_length(p_udf_dirent);
+			// Files that go to ext are neither patched nor replaced, as this only applies to
+			// boot methods that ext isn't used with
+			if (extract_to_ext) {
+				print_extracted_file(psz_fullpath, file_length);
+				if (!udf_extract_ext_file(p_udf_dirent, file_length, &psz_fullpath[strlen(psz_extract_dir)]))
+					goto out;
+				safe_free(psz_fullpath);
+				continue;
+			}
 			if (check_iso_props(psz_path, file_length, psz_basename, psz_fullpath, &props)) {
 				safe_free(psz_fullpath);
 				continue;
@@ -527,6 +949,23 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 			psz_sanpath = sanitize_filename(psz_fullpath, &is_identical);
 			if (!is_identical)
 				uprintf("  File name sanitized to '%s'", psz_sanpath);
+			if (is_queued_file(file_length, &props)) {
+				data = NULL;
+				if ((file_length != 0) && ((data = udf_read_file(p_udf_dirent, file_length,
+					&psz_fullpath[strlen(psz_extract_dir)])) == NULL))
+					goto out;
+				// The workers take ownership of the sanitized path and data
+				r = extract_queue_post(psz_sanpath, data, (DWORD)file_length,
+					preserve_timestamps ? to_filetime(udf_get_attribute_time(p_udf_dirent)) : NULL,
+					to_filetime(udf_get_access_time(p_udf_dirent)), to_filetime(udf_get_modification_time(p_udf_dirent)));
+				psz_sanpath = NULL;
+				if (!r)
+					goto out;
+				safe_free(psz_fullpath);
+				continue;
+			}
+			if (!extract_queue_sync(psz_sanpath))
+				goto out;
 			file_handle = CreatePreallocatedFile(psz_sanpath, GENERIC_READ | GENERIC_WRITE,
 				FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, file_length);
 			if (file_handle == INVALID_HANDLE_VALUE) {
@@ -538,23 +977,23 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 				else
 					goto out;
 			} else {
+				// Read whole extents, up to the size of our buffer, at once
 				while (file_length > 0) {
 					if (FormatStatus) goto out;
-					memset(buf, 0, UDF_BLOCKSIZE);
-					read = udf_read_block(p_udf_dirent, buf, 1);
-					if (read < 0) {
+					read = udf_read_blocks(p_udf_dirent, extract_buf, (size_t)MIN((file_length + UDF_BLOCKSIZE - 1)
+						/ UDF_BLOCKSIZE, EXTRACT_BUFFER_SIZE / UDF_BLOCKSIZE));
+					if (read <= 0) {
 						uprintf("  Error reading UDF file %s", &psz_fullpath[strlen(psz_extract_dir)]);
 						goto out;
 					}
 					buf_size = (DWORD)MIN(file_length, read);
-					ISO_BLOCKING(r = WriteFileWithRetry(file_handle, buf, buf_size, &wr_size, WRITE_RETRIES));
+					ISO_BLOCKING(r = WriteFileWithRetry(file_handle, extract_buf, buf_size, &wr_size, WRITE_RETRIES));
 					if (!r) {
 						uprintf("  Error writing file: %s", WindowsErrorString());
 						goto out;
 					}
 					file_length -= read;
-					if (nb_blocks++ % PROGRESS_THRESHOLD == 0)
-						UpdateProgressWithInfo(OP_FILE_COPY, MSG_231, nb_blocks, total_blocks);
+					update_extract_progress((read + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE);
 				}
 			}
 			if ((preserve_timestamps) && (!SetFileTime(file_handle, to_filetime(udf_get_attribute_time(p_udf_dirent)),
@@ -640,22 +1079,186 @@ out:
 	StrArrayDestroy(&modified_path);
 }
 
-// Returns 0 on success, >0 on error, <0 to ignore current dir
-static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
+/*
+ * Copy an ISO9660 file extent to file_handle, using reads and writes of up to
+ * EXTRACT_BUFFER_SIZE rather than one block at a time. libcdio guarantees
+ * that the total_size bytes of a file are contiguous from its LSN, even when
+ * the file uses multiple extents, so we can read it in one go.
+ * Returns the number of bytes read from the image (rounded to ISO_BLOCKSIZE)
+ * or -1 on error.
+ */
+static int64_t iso_copy_extent(iso9660_t* p_iso, lsn_t lsn, int64_t file_length, HANDLE file_handle,
+	uint8_t* buf, const char* psz_iso_name, BOOL update_progress)
+{
+	DWORD buf_size, wr_size;
+	long int nb_read;
+	int64_t r = 0;
+	BOOL s;
+
+	while (file_length > 0) {
+		if (FormatStatus)
+			return -1;
+		buf_size = (DWORD)MIN(file_length, EXTRACT_BUFFER_SIZE);
+		nb_read = (buf_size + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE;
+		if (iso9660_iso_seek_read(p_iso, buf, lsn, nb_read) != nb_read * ISO_BLOCKSIZE) {
+			uprintf("  Error reading ISO9660 file %s at LSN %lu", psz_iso_name, (long unsigned int)lsn);
+			return -1;
+		}
+		ISO_BLOCKING(s = WriteFileWithRetry(file_handle, buf, buf_size, &wr_size, WRITE_RETRIES));
+		if (!s) {
+			uprintf("  Error writing file: %s", WindowsErrorString());
+			return -1;
+		}
+		if (update_progress)
+			update_extract_progress(nb_read);
+		lsn += (lsn_t)nb_read;
+		file_length -= buf_size;
+		r += (int64_t)nb_read * ISO_BLOCKSIZE;
+	}
+	return r;
+}
+
+static void iso_index_free(void)
+{
+	safe_free(iso_index.image_path);
+	safe_free(iso_index.entry);
+	safe_free(iso_index.pool);
+	safe_free(iso_index.table);
+	memset(&iso_index, 0, sizeof(iso_index));
+}
+
+// Case insensitive FNV-1a hash of a path, ignoring any leading slash
+static uint32_t iso_index_hash(const char* path)
+{
+	uint32_t hash = 2166136261U;
+
+	while (*path == '/')
+		path++;
+	for (; *path != 0; path++)
+		hash = (hash ^ (uint8_t)tolower(*path)) * 16777619U;
+	return hash;
+}
+
+static BOOL iso_index_resize_table(uint32_t size)
+{
+	uint32_t i, j, *table = (uint32_t*)calloc(size, sizeof(uint32_t));
+
+	if (table == NULL)
+		return FALSE;
+	for (i = 0; i < iso_index.nb_entries; i++) {
+		for (j = iso_index.entry[i].hash & (size - 1); table[j] != 0; j = (j + 1) & (size - 1));
+		table[j] = i + 1;
+	}
+	free(iso_index.table);
+	iso_index.table = table;
+	iso_index.table_size = size;
+	return TRUE;
+}
+
+// Add a file to the index. If we run out of memory, we just stop indexing.
+static void iso_index_add(const char* path, lsn_t lsn, int64_t size)
+{
+	uint32_t i, len;
+	void* p;
+
+	if (iso_index.image_path == NULL)
+		return;
+	while (*path == '/')
+		path++;
+	len = (uint32_t)strlen(path) + 1;
+	if (iso_index.nb_entries >= iso_index.max_entries) {
+		p = realloc(iso_index.entry, (iso_index.max_entries + 1024) * sizeof(ISO_INDEX_ENTRY));
+		if (p == NULL)
+			goto oom;
+		iso_index.entry = (ISO_INDEX_ENTRY*)p;
+		iso_index.max_entries += 1024;
+	}
+	if (iso_index.pool_size + len > iso_index.pool_max) {
+		p = realloc(iso_index.pool, 2 * iso_index.pool_max + len + 64 * KB);
+		if (p == NULL)
+			goto oom;
+		iso_index.pool = (char*)p;
+		iso_index.pool_max = 2 * iso_index.pool_max + len + 64 * KB;
+	}
+	// Keep the table at most half full
+	if ((2 * (iso_index.nb_entries + 1) > iso_index.table_size) &&
+		(!iso_index_resize_table(iso_index.table_size == 0 ? 4096 : 2 * iso_index.table_size)))
+		goto oom;
+	memcpy(&iso_index.pool[iso_index.pool_size], path, len);
+	iso_index.entry[iso_index.nb_entries].name = iso_index.pool_size;
+	iso_index.entry[iso_index.nb_entries].hash = iso_index_hash(path);
+	iso_index.entry[iso_index.nb_entries].lsn = lsn;
+	iso_index.entry[iso_index.nb_entries].size = size;
+	iso_index.pool_size += len;
+	for (i = iso_index.entry[iso_index.nb_entries].hash & (iso_index.table_size - 1); iso_index.table[i] != 0;
+		i = (i + 1) & (iso_index.table_size - 1));
+	iso_index.table[i] = ++iso_index.nb_entries;
+	return;
+
+oom:
+	uprintf("  Could not allocate ISO index - Indexing disabled");
+	iso_index_free();
+}
+
+// Look up the LSN and size of a file from the image we indexed during the scan
+static BOOL iso_index_lookup(const char* iso, const char* path, lsn_t* lsn, int64_t* size)
+{
+	uint32_t i, hash;
+	ISO_INDEX_ENTRY* entry;
+
+	if ((iso_index.table == NULL) || (iso == NULL) || (path == NULL) || (strcmp(iso, iso_index.image_path) != 0))
+		return FALSE;
+	hash = iso_index_hash(path);
+	while (*path == '/')
+		path++;
+	for (i = hash & (iso_index.table_size - 1); iso_index.table[i] != 0; i = (i + 1) & (iso_index.table_size - 1)) {
+		entry = &iso_index.entry[iso_index.table[i] - 1];
+		if ((entry->hash == hash) && (_stricmp(&iso_index.pool[entry->name], path) == 0)) {
+			if (lsn != NULL)
+				*lsn = entry->lsn;
+			if (size != NULL)
+				*size = entry->size;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+// Find the LSN and size of a file, through our index if possible, or through libcdio otherwise
+static BOOL iso_get_file_lsn(iso9660_t* p_iso, const char* iso, const char* path, lsn_t* lsn, int64_t* size)
+{
+	iso9660_stat_t* p_statbuf;
+
+	if (iso_index_lookup(iso, path, lsn, size))
+		return TRUE;
+	p_statbuf = iso9660_ifs_stat_translate(p_iso, path);
+	if (p_statbuf == NULL)
+		return FALSE;
+	*lsn = p_statbuf->lsn;
+	if (size != NULL)
+		*size = p_statbuf->total_size;
+	safe_free(p_statbuf->rr.psz_symlink);
+	free(p_statbuf);
+	return TRUE;
+}
+
+// Returns 0 on success, nonzero on error
+// p_dir is the stat of the directory to process, or NULL for the root.
+static int iso_extract_files(iso9660_t* p_iso, iso9660_stat_t* p_dir, const char *psz_path)
 {
 	HANDLE file_handle = NULL;
-	DWORD buf_size, wr_size, err;
+	DWORD err;
 	EXTRACT_PROPS props;
 	BOOL is_symlink, is_identical;
 	int length, r = 1;
 	char tmp[128], psz_fullpath[MAX_PATH], *psz_basename = NULL, *psz_sanpath = NULL;
 	const char *psz_iso_name = &psz_fullpath[strlen(psz_extract_dir)];
-	unsigned char buf[ISO_BLOCKSIZE];
 	CdioListNode_t* p_entnode;
 	iso9660_stat_t *p_statbuf;
 	CdioISO9660FileList_t* p_entlist;
 	size_t i;
-	lsn_t lsn;
+	uint8_t* data;
+	LPFILETIME ft;
 	int64_t file_length;
 
 	if ((p_iso == NULL) || (psz_path == NULL))
@@ -666,7 +1269,8 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 		return 1;
 	psz_basename = &psz_fullpath[length];
 
-	p_entlist = iso9660_ifs_readdir(p_iso, psz_path);
+	// Reading the directory from its stat avoids having libcdio resolve its path from the root
+	p_entlist = (p_dir == NULL) ? iso9660_ifs_readdir(p_iso, psz_path) : iso9660_ifs_readdir_stat(p_iso, p_dir);
 	if (!p_entlist) {
 		uprintf("Could not access directory %s", psz_path);
 		return 1;
@@ -678,23 +1282,13 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 		if (FormatStatus) goto out;
 		p_statbuf = (iso9660_stat_t*) _cdio_list_node_data(p_entnode);
 		if (scan_only && (p_statbuf->rr.b3_rock == yep) && enable_rockridge) {
-			if (p_statbuf->rr.u_su_fields & ISO_ROCK_SUF_PL) {
-				if (!img_report.has_deep_directories)
-					uprintf("  Note: The selected ISO uses Rock Ridge 'deep directories'.\r\n"
-						"  Because of this, it may take a very long time to scan or extract...");
+			// Rock Ridge deep directories used to require a *very costly* search of the
+			// whole ISO9660 file system for each entry, which we worked around by cutting
+			// the scan short. Now that libcdio indexes directories by LSN, we process them
+			// in full, so that our projected size is accurate.
+			if ((p_statbuf->rr.u_su_fields & ISO_ROCK_SUF_PL) && !img_report.has_deep_directories) {
+				uprintf("  Note: The selected ISO uses Rock Ridge 'deep directories'");
 				img_report.has_deep_directories = TRUE;
-				// Due to the nature of the parsing of Rock Ridge deep directories
-				// which requires performing a *very costly* search of the whole
-				// ISO9660 file system to find the matching LSN, ISOs with loads of
-				// deep directory entries (e.g. OPNsense) are very slow to parse...
-				// To speed up the scan process, and since we expect deep directory
-				// entries to appear below anything we care for, we cut things
-				// short by telling the parent not to bother any further once we
-				// find that we are dealing with a deep directory.
-				r = -1;
-				// Add at least one extra block, since we're skipping content.
-				total_blocks++;
-				goto out;
 			}
 		}
 		// Eliminate . and .. entries
@@ -718,7 +1312,12 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 			iso9660_name_translate_ext(p_statbuf->filename, psz_basename, joliet_level);
 		}
 		if (p_statbuf->type == _STAT_DIR) {
-			if (!scan_only) {
+			if (!scan_only && extract_to_ext) {
+				if (!CreateExtFsDir(psz_iso_name, iso_posix_mode(p_statbuf), (uint32_t)mktime(&p_statbuf->tm))) {
+					r = 1;
+					goto out;
+				}
+			} else if (!scan_only) {
 				psz_sanpath = sanitize_filename(psz_fullpath, &is_identical);
 				IGNORE_RETVAL(_mkdirU(psz_sanpath));
 				if (preserve_timestamps) {
@@ -727,13 +1326,21 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 				}
 				safe_free(psz_sanpath);
 			}
-			r = iso_extract_files(p_iso, psz_iso_name);
-			if (r > 0)
+			r = iso_extract_files(p_iso, p_statbuf, psz_iso_name);
+			if (r != 0)
 				goto out;
-			if (r < 0)	// Stop processing current dir
-				break;
 		} else {
 			file_length = p_statbuf->total_size;
+			if (scan_only)
+				iso_index_add(psz_iso_name, p_statbuf->lsn, file_length);
+			// See the note in udf_extract_files() about files that go to ext
+			if (extract_to_ext) {
+				print_extracted_file(psz_fullpath, file_length);
+				r = 1;
+				if (!iso_extract_ext_file(p_iso, p_statbuf, psz_iso_name, is_symlink))
+					goto out;
+				continue;
+			}
 			if (check_iso_props(psz_path, file_length, psz_basename, psz_fullpath, &props)) {
 				continue;
 			}
@@ -758,6 +1365,25 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 					uprintf("  Ignoring Rock Ridge symbolic link to '%s'", p_statbuf->rr.psz_symlink);
 				safe_free(p_statbuf->rr.psz_symlink);
 			}
+			if (is_queued_file(file_length, &props)) {
+				data = NULL;
+				r = 1;
+				if ((file_length != 0) &&
+					((data = iso_read_file(p_iso, p_statbuf->lsn, file_length, psz_iso_name)) == NULL))
+					goto out;
+				ft = preserve_timestamps ? to_filetime(mktime(&p_statbuf->tm)) : NULL;
+				// The workers take ownership of the sanitized path and data
+				if (!extract_queue_post(psz_sanpath, data, (DWORD)file_length, ft, ft, ft)) {
+					psz_sanpath = NULL;
+					goto out;
+				}
+				psz_sanpath = NULL;
+				continue;
+			}
+			if (!extract_queue_sync(psz_sanpath)) {
+				r = 1;
+				goto out;
+			}
 			file_handle = CreatePreallocatedFile(psz_sanpath, GENERIC_READ | GENERIC_WRITE,
 				FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, file_length);
 			if (file_handle == INVALID_HANDLE_VALUE) {
@@ -768,24 +1394,10 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 					uprintf(stupid_antivirus);
 				else
 					goto out;
-			} else for (i = 0; file_length > 0; i++) {
-				if (FormatStatus) goto out;
-				memset(buf, 0, ISO_BLOCKSIZE);
-				lsn = p_statbuf->lsn + (lsn_t)i;
-				if (iso9660_iso_seek_read(p_iso, buf, lsn, 1) != ISO_BLOCKSIZE) {
-					uprintf("  Error reading ISO9660 file %s at LSN %lu",
-						psz_iso_name, (long unsigned int)lsn);
-					goto out;
-				}
-				buf_size = (DWORD)MIN(file_length, ISO_BLOCKSIZE);
-				ISO_BLOCKING(r = WriteFileWithRetry(file_handle, buf, buf_size, &wr_size, WRITE_RETRIES));
-				if (!r) {
-					uprintf("  Error writing file: %s", WindowsErrorString());
-					goto out;
-				}
-				file_length -= ISO_BLOCKSIZE;
-				if (nb_blocks++ % PROGRESS_THRESHOLD == 0)
-					UpdateProgressWithInfo(OP_FILE_COPY, MSG_231, nb_blocks, total_blocks);
+			} else if (iso_copy_extent(p_iso, p_statbuf->lsn, file_length, file_handle, extract_buf,
+				psz_iso_name, TRUE) < 0) {
+				r = 1;
+				goto out;
 			}
 			if (preserve_timestamps) {
 				LPFILETIME ft = to_filetime(mktime(&p_statbuf->tm));
@@ -866,6 +1478,8 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 		// String array of all isolinux/syslinux locations
 		StrArrayCreate(&config_path, 8);
 		StrArrayCreate(&isolinux_path, 8);
+		iso_index_free();
+		iso_index.image_path = safe_strdup(src_iso);
 		PrintInfo(0, MSG_202);
 	} else {
 		uprintf("Extracting files...\n");
@@ -878,6 +1492,15 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 		nb_blocks = 0;
 		iso_blocking_status = 0;
 		StrArrayCreate(&modified_path, 8);
+		extract_buf = (uint8_t*)_mm_malloc(EXTRACT_BUFFER_SIZE, ISO_BLOCKSIZE);
+		if (extract_buf == NULL) {
+			uprintf("Could not allocate extraction buffer");
+			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_NOT_ENOUGH_MEMORY;
+			goto out;
+		}
+		// libext2fs is not thread safe, so files that go to ext are extracted sequentially
+		if (!extract_to_ext)
+			extract_queue_start();
 	}
 
 	// First try to open as UDF - fallback to ISO if it failed
@@ -904,7 +1527,8 @@ try_iso:
 	// Perform our first scan with Joliet disabled (if Rock Ridge is enabled), so that we can find if
 	// there exists a Rock Ridge file with a name > 64 chars or if there are symlinks. If that is the
 	// case then we also disable Joliet during the extract phase.
-	if ((!enable_joliet) || (enable_rockridge && (scan_only || img_report.has_long_filename ||
+	// Rock Ridge is always preferred for ext, as it also gives us permissions and symbolic links.
+	if ((!enable_joliet) || (enable_rockridge && (scan_only || extract_to_ext || img_report.has_long_filename ||
 		(img_report.has_symlinks == SYMLINKS_RR)))) {
 		iso_extension_mask &= ~ISO_EXTENSION_JOLIET;
 	}
@@ -933,9 +1557,13 @@ try_iso:
 		else
 			uprintf("%sThis image will not be extracted using any ISO extensions", spacing);
 	}
-	r = iso_extract_files(p_iso, "");
+	r = iso_extract_files(p_iso, NULL, "");
 
 out:
+	// Make sure all the queued files have been written before we process them any further
+	extract_queue_stop();
+	if ((r == 0) && (FormatStatus != 0))
+		r = 1;
 	iso_blocking_status = -1;
 	if (scan_only) {
 		struct __stat64 stat;
@@ -1083,6 +1711,9 @@ out:
 		StrArrayDestroy(&config_path);
 		StrArrayDestroy(&isolinux_path);
 		SendMessage(hMainDialog, UM_PROGRESS_EXIT, 0, 0);
+	} else if (extract_to_ext) {
+		// None of the boot setup below applies to ext, where we can't patch files anyway
+		StrArrayDestroy(&modified_path);
 	} else {
 		// Solus and other ISOs only provide EFI boot files in a FAT efi.img
 		if (img_report.has_efi == 0x8000)
@@ -1128,6 +1759,7 @@ out:
 			bled_exit();
 		}
 	}
+	safe_mm_free(extract_buf);
 	if (p_iso != NULL)
 		iso9660_close(p_iso);
 	if (p_udf != NULL)
@@ -1137,17 +1769,39 @@ out:
 	return (r == 0);
 }
 
+/*
+ * Extract an ISO straight into the ext file system of a partition through libext2fs,
+ * since Windows can't mount it. As with ExtractISO(), the ISO must have been scanned.
+ */
+BOOL ExtractISOToExtFs(const char* src_iso, DWORD DriveIndex, uint64_t PartitionOffset)
+{
+	BOOL r;
+
+	if (!OpenExtFs(DriveIndex, PartitionOffset)) {
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_OPEN_FAILED;
+		return FALSE;
+	}
+	extract_to_ext = TRUE;
+	r = ExtractISO(src_iso, "", FALSE);
+	extract_to_ext = FALSE;
+	// Always close, so that the metadata matches whatever was written
+	if (!CloseExtFs()) {
+		if (!IS_ERROR(FormatStatus))
+			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+		r = FALSE;
+	}
+	return r;
+}
+
 int64_t ExtractISOFile(const char* iso, const char* iso_file, const char* dest_file, DWORD attributes)
 {
-	size_t i;
 	ssize_t read_size;
 	int64_t file_length, r = 0;
-	char buf[UDF_BLOCKSIZE];
+	uint8_t* buf = NULL;
 	DWORD buf_size, wr_size;
 	iso9660_t* p_iso = NULL;
 	udf_t* p_udf = NULL;
 	udf_dirent_t *p_udf_root = NULL, *p_udf_file = NULL;
-	iso9660_stat_t *p_statbuf = NULL;
 	lsn_t lsn;
 	HANDLE file_handle = INVALID_HANDLE_VALUE;
 
@@ -1157,6 +1811,15 @@ int64_t ExtractISOFile(const char* iso, const char* iso_file, const char* dest_f
 		uprintf("  Could not create file %s: %s", dest_file, WindowsErrorString());
 		goto out;
 	}
+	buf = (uint8_t*)_mm_malloc(EXTRACT_BUFFER_SIZE, ISO_BLOCKSIZE);
+	if (buf == NULL) {
+		uprintf("Could not allocate extraction buffer");
+		goto out;
+	}
+
+	// If this is the image we indexed during the scan, we already know where the file is
+	if (iso_index_lookup(iso, iso_file, NULL, NULL))
+		goto try_iso;
 
 	// First try to open as UDF - fallback to ISO if it failed
 	p_udf = udf_open(iso);
@@ -1175,9 +1838,9 @@ int64_t ExtractISOFile(const char* iso, const char* iso_file, const char* dest_f
 	}
 	file_length = udf_get_file_length(p_udf_file);
 	while (file_length > 0) {
-		memset(buf, 0, UDF_BLOCKSIZE);
-		read_size = udf_read_block(p_udf_file, buf, 1);
-		if (read_size < 0) {
+		read_size = udf_read_blocks(p_udf_file, buf, (size_t)MIN((file_length + UDF_BLOCKSIZE - 1)
+			/ UDF_BLOCKSIZE, EXTRACT_BUFFER_SIZE / UDF_BLOCKSIZE));
+		if (read_size <= 0) {
 			uprintf("Error reading UDF file %s", iso_file);
 			goto out;
 		}
@@ -1200,34 +1863,18 @@ try_iso:
 		goto out;
 	}
 
-	p_statbuf = iso9660_ifs_stat_translate(p_iso, iso_file);
-	if (p_statbuf == NULL) {
+	if (!iso_get_file_lsn(p_iso, iso, iso_file, &lsn, &file_length)) {
 		uprintf("Could not get ISO-9660 file information for file %s", iso_file);
 		goto out;
 	}
 
-	file_length = p_statbuf->total_size;
-	for (i = 0; file_length > 0; i++) {
-		memset(buf, 0, ISO_BLOCKSIZE);
-		lsn = p_statbuf->lsn + (lsn_t)i;
-		if (iso9660_iso_seek_read(p_iso, buf, lsn, 1) != ISO_BLOCKSIZE) {
-			uprintf("  Error reading ISO9660 file %s at LSN %lu", iso_file, (long unsigned int)lsn);
-			goto out;
-		}
-		buf_size = (DWORD)MIN(file_length, ISO_BLOCKSIZE);
-		if (!WriteFileWithRetry(file_handle, buf, buf_size, &wr_size, WRITE_RETRIES)) {
-			uprintf("  Error writing file %s: %s", dest_file, WindowsErrorString());
-			goto out;
-		}
-		file_length -= ISO_BLOCKSIZE;
-		r += ISO_BLOCKSIZE;
-	}
+	r = iso_copy_extent(p_iso, lsn, file_length, file_handle, buf, iso_file, FALSE);
+	if (r < 0)
+		r = 0;
 
 out:
 	safe_closehandle(file_handle);
-	if (p_statbuf != NULL)
-		safe_free(p_statbuf->rr.psz_symlink);
-	safe_free(p_statbuf);
+	safe_mm_free(buf);
 	if (p_udf_root != NULL)
 		udf_dirent_free(p_udf_root);
 	if (p_udf_file != NULL)
@@ -1246,7 +1893,7 @@ uint32_t GetInstallWimVersion(const char* iso)
 	iso9660_t* p_iso = NULL;
 	udf_t* p_udf = NULL;
 	udf_dirent_t *p_udf_root = NULL, *p_udf_file = NULL;
-	iso9660_stat_t *p_statbuf = NULL;
+	lsn_t lsn;
 
 	wim_path = safe_strdup(&img_report.wininst_path[0][2]);
 	if (wim_path == NULL)
@@ -1256,6 +1903,9 @@ uint32_t GetInstallWimVersion(const char* iso)
 	for (p = wim_path; *p != 0; p++)
 		if (*p == '\\') *p = '/';
 
+	if (iso_index_lookup(iso, wim_path, NULL, NULL))
+		goto try_iso;
+
 	// First try to open as UDF - fallback to ISO if it failed
 	p_udf = udf_open(iso);
 	if (p_udf == NULL)
@@ -1284,21 +1934,17 @@ try_iso:
 		uprintf("Could not open image '%s'", iso);
 		goto out;
 	}
-	p_statbuf = iso9660_ifs_stat_translate(p_iso, wim_path);
-	if (p_statbuf == NULL) {
+	if (!iso_get_file_lsn(p_iso, iso, wim_path, &lsn, NULL)) {
 		uprintf("Could not get ISO-9660 file information for file %s", wim_path);
 		goto out;
 	}
-	if (iso9660_iso_seek_read(p_iso, buf, p_statbuf->lsn, 1) != ISO_BLOCKSIZE) {
-		uprintf("Error reading ISO-9660 file %s at LSN %d", wim_path, p_statbuf->lsn);
+	if (iso9660_iso_seek_read(p_iso, buf, lsn, 1) != ISO_BLOCKSIZE) {
+		uprintf("Error reading ISO-9660 file %s at LSN %d", wim_path, lsn);
 		goto out;
 	}
 	r = wim_header[3];
 
 out:
-	if (p_statbuf != NULL)
-		safe_free(p_statbuf->rr.psz_symlink);
-	safe_free(p_statbuf);
 	if (p_udf_root != NULL)
 		udf_dirent_free(p_udf_root);
 	if (p_udf_file != NULL)
@@ -1355,7 +2001,7 @@ BOOL HasEfiImgBootLoaders(void)
 {
 	BOOL ret = FALSE;
 	iso9660_t* p_iso = NULL;
-	iso9660_stat_t* p_statbuf = NULL;
+	lsn_t lsn;
 	iso9660_readfat_private* p_private = NULL;
 	int32_t dc, c;
 	struct libfat_filesystem *lf_fs = NULL;
@@ -1371,8 +2017,7 @@ BOOL HasEfiImgBootLoaders(void)
 		uprintf("Could not open image '%s' as an ISO-9660 file system", image_path);
 		goto out;
 	}
-	p_statbuf = iso9660_ifs_stat_translate(p_iso, img_report.efi_img_path);
-	if (p_statbuf == NULL) {
+	if (!iso_get_file_lsn(p_iso, image_path, img_report.efi_img_path, &lsn, NULL)) {
 		uprintf("Could not get ISO-9660 file information for file %s\n", img_report.efi_img_path);
 		goto out;
 	}
@@ -1380,7 +2025,7 @@ BOOL HasEfiImgBootLoaders(void)
 	if (p_private == NULL)
 		goto out;
 	p_private->p_iso = p_iso;
-	p_private->lsn = p_statbuf->lsn;
+	p_private->lsn = lsn;
 	p_private->sec_start = 0;
 	// Populate our intial buffer
 	if (iso9660_iso_seek_read(p_private->p_iso, p_private->buf, p_private->lsn, ISO_NB_BLOCKS) != ISO_NB_BLOCKS * ISO_BLOCKSIZE) {
@@ -1425,9 +2070,6 @@ BOOL HasEfiImgBootLoaders(void)
 out:
 	if (lf_fs != NULL)
 		libfat_close(lf_fs);
-	if (p_statbuf != NULL)
-		safe_free(p_statbuf->rr.psz_symlink);
-	safe_free(p_statbuf);
 	safe_free(p_private);
 	if (p_iso != NULL)
 		iso9660_close(p_iso);
@@ -1447,7 +2089,7 @@ BOOL DumpFatDir(const char* path, int32_t cluster)
 	libfat_dirpos_t dirpos = { cluster, -1, 0 };
 	libfat_sector_t s;
 	iso9660_t* p_iso = NULL;
-	iso9660_stat_t* p_statbuf = NULL;
+	lsn_t lsn;
 	iso9660_readfat_private* p_private = NULL;
 
 	if (path == NULL)
@@ -1462,8 +2104,7 @@ BOOL DumpFatDir(const char* path, int32_t cluster)
 			uprintf("Could not open image '%s' as an ISO-9660 file system", image_path);
 			goto out;
 		}
-		p_statbuf = iso9660_ifs_stat_translate(p_iso, img_report.efi_img_path);
-		if (p_statbuf == NULL) {
+		if (!iso_get_file_lsn(p_iso, image_path, img_report.efi_img_path, &lsn, NULL)) {
 			uprintf("Could not get ISO-9660 file information for file %s\n", img_report.efi_img_path);
 			goto out;
 		}
@@ -1471,7 +2112,7 @@ BOOL DumpFatDir(const char* path, int32_t cluster)
 		if (p_private == NULL)
 			goto out;
 		p_private->p_iso = p_iso;
-		p_private->lsn = p_statbuf->lsn;
+		p_private->lsn = lsn;
 		p_private->sec_start = 0;
 		// Populate our intial buffer
 		if (iso9660_iso_seek_read(p_private->p_iso, p_private->buf, p_private->lsn, ISO_NB_BLOCKS) != ISO_NB_BLOCKS * ISO_BLOCKSIZE) {
@@ -1552,9 +2193,6 @@ out:
 			libfat_close(lf_fs);
 			lf_fs = NULL;
 		}
-		if (p_statbuf != NULL)
-			safe_free(p_statbuf->rr.psz_symlink);
-		safe_free(p_statbuf);
 		safe_free(p_private);
 		if (p_iso != NULL)
 			iso9660_close(p_iso);
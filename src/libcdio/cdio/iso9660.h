@@ -692,6 +692,22 @@ typedef struct _iso9660_s iso9660_t;
   long int iso9660_iso_seek_read (const iso9660_t *p_iso, /*out*/ void *ptr,
                                   lsn_t start, long int i_size);
 
+  /*!
+    Rufus addition: Same as iso9660_iso_seek_read(), except that the
+    data is not copied. Instead, a read-only pointer to it is returned,
+    which remains valid until it is released with iso9660_iso_seek_unmap().
+
+    @return NULL if the image does not support direct access, in which
+    case iso9660_iso_seek_read() should be used.
+  */
+  const void *iso9660_iso_seek_map (const iso9660_t *p_iso, lsn_t start,
+                                    long int i_size);
+
+  /*!
+    Rufus addition: Release a pointer returned by iso9660_iso_seek_map().
+  */
+  void iso9660_iso_seek_unmap (const iso9660_t *p_iso, const void *ptr);
+
   /*!
     Read the Primary Volume Descriptor for a CD.
     True is returned if read, and false if there was an error.
@@ -1098,6 +1114,21 @@ CdioList_t * iso9660_fs_readdir (CdIo_t *p_cdio, const char psz_path[]);
 */
 CdioList_t * iso9660_ifs_readdir (iso9660_t *p_iso, const char psz_path[]);
 
+/*!
+  Read the directory described by p_stat (as returned by a previous
+  readdir or stat call) and return a list of iso9660_stat_t pointers
+  for the files inside that directory, without resolving its path.
+
+  @param p_iso the ISO-9660 file image to get data from
+
+  @param p_stat the file status of the directory to read.
+
+  @return a list of file status. The caller must free the returned
+  result using iso9660_filelist_free().
+*/
+CdioList_t * iso9660_ifs_readdir_stat (iso9660_t *p_iso,
+                                       const iso9660_stat_t *p_stat);
+
 /*!
   Return the PVD's application ID.
 
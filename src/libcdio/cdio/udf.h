@@ -48,6 +48,14 @@ typedef struct udf_dirent_s {
     uint64_t           dir_left;
     uint8_t           *sector;
     udf_fileid_desc_t *fid;
+    /* Rufus addition: Allocation descriptor cursor used by offset_to_lba(),
+       i.e. the index of the last extent we read from and its file offset. */
+    uint32_t           i_ad;
+    uint64_t           i_ad_offset;
+    /* Rufus addition: The mapping fid points into, if the directory was
+       mapped rather than read into sector, and the end of the FIDs. */
+    const uint8_t     *p_map;
+    const uint8_t     *p_fid_end;
     
     /* This field has to come last because it is variable in length. */
     udf_file_entry_t   fe;
@@ -87,6 +95,21 @@ extern "C" {
   driver_return_code_t udf_read_sectors (const udf_t *p_udf, void *ptr, 
                                          lsn_t i_start,  long int i_blocks);
 
+  /*!
+    Rufus addition: Return a read-only pointer to i_blocks sectors,
+    starting at i_start, without copying them, or NULL if the source
+    does not support direct access, in which case udf_read_sectors()
+    should be used. The data remains valid until it is released with
+    udf_unmap_sectors().
+  */
+  const void *udf_map_sectors (const udf_t *p_udf, lsn_t i_start,
+                               long int i_blocks);
+
+  /*!
+    Rufus addition: Release a pointer returned by udf_map_sectors().
+  */
+  void udf_unmap_sectors (const udf_t *p_udf, const void *ptr);
+
   /*!
     Open an UDF for reading. Maybe in the future we will have
     a mode. NULL is returned on error.
@@ -88,6 +88,16 @@ extern "C" {
   ssize_t udf_read_block(const udf_dirent_t *p_udf_dirent, 
 			 void * buf, size_t count);
 
+  /**
+    Same as udf_read_block(), except that a read that goes past the end
+    of the current extent is silently truncated to the end of that extent,
+    so that files can be read one extent at a time. Returns the number of
+    bytes read, which may not be a multiple of UDF_BLOCKSIZE for the last
+    extent of a file.
+  */
+  ssize_t udf_read_blocks(const udf_dirent_t *p_udf_dirent,
+			  void * buf, size_t count);
+
   /**
     Advances p_udf_direct to the the next directory entry in the
     pointed to by p_udf_dir. It also returns this as the value.  NULL
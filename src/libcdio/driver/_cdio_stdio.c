@@ -91,18 +91,246 @@ static inline int _stati64_utf8(const char *path, struct _stati64 *buffer) {
 
 #define CDIO_STDIO_BUFSIZE (128*1024)
 
+/*
+  Rufus addition: On Windows, images that reside on a local non-removable
+  disk are read through a read-only memory mapping rather than through the
+  CRT, which avoids the locking and extra buffer copies of fread(), and lets
+  callers access the data in place through cdio_stream_map(). 64-bit builds
+  map the whole image, whereas 32-bit builds, which don't have the address
+  space for that, use a sliding window for anything larger than it.
+
+  An I/O error on a mapped view is raised as an EXCEPTION_IN_PAGE_ERROR
+  rather than returned, so every copy from the view is guarded with SEH
+  and turned into a short read on error. Since MinGW's gcc doesn't have
+  __try/__except for C, its builds keep reading images through stdio.
+*/
+#if defined(_WIN32) && defined(_MSC_VER)
+#define CDIO_STDIO_MMAP
+#include <windows.h>
+#include <winioctl.h>
+/* Views must start on a multiple of the allocation granularity, which
+   has been 64 KB on every version of Windows */
+#define CDIO_MMAP_GRANULARITY (64*1024)
+#if defined(_WIN64)
+#define CDIO_MMAP_WINDOW_SIZE 0 /* map everything */
+#else
+#define CDIO_MMAP_WINDOW_SIZE (64*1024*1024)
+#endif
+/* How many ranges handed out by _stdio_map() can be in use at once */
+#define CDIO_MMAP_MAX_LOCKS 64
+#endif
+
 typedef struct {
   char *pathname;
   FILE *fd;
   char *fd_buf;
   off_t st_size; /* used only for source */
+#ifdef CDIO_STDIO_MMAP
+  HANDLE h_map;          /* file mapping, or NULL if we use stdio */
+  const uint8_t *view;   /* currently mapped view */
+  off_t view_offset;     /* offset of the view in the image */
+  size_t view_size;      /* size of the view */
+  off_t map_pos;         /* current position, for mapped reads */
+  size_t page_size;
+  struct {               /* ranges handed out by _stdio_map() */
+    const uint8_t *ptr;
+    size_t size;
+  } locks[CDIO_MMAP_MAX_LOCKS];
+  unsigned int i_locks;
+#endif
 } _UserData;
 
+#ifdef CDIO_STDIO_MMAP
+/* Return true if the whole image is mapped, in which case the data we
+   hand out through cdio_stream_map() can't go away before we close. */
+static inline bool
+_stdio_mmap_is_whole(const _UserData *ud)
+{
+  return (ud->view != NULL && ud->view_offset == 0 &&
+          (off_t)ud->view_size == ud->st_size);
+}
+
+static void
+_stdio_mmap_close(_UserData *ud)
+{
+  /* This also unlocks anything _stdio_map() locked */
+  if (ud->view != NULL)
+    UnmapViewOfFile(ud->view);
+  if (ud->h_map != NULL)
+    CloseHandle(ud->h_map);
+  ud->view = NULL;
+  ud->view_offset = 0;
+  ud->view_size = 0;
+  ud->h_map = NULL;
+  ud->map_pos = 0;
+  ud->i_locks = 0;
+}
+
+/*
+  Make sure that the count bytes at offset are part of the current view,
+  sliding it if needed, and return a pointer to them, or NULL if they
+  can't be accessed at once.
+*/
+static const uint8_t *
+_stdio_mmap_view(_UserData *ud, off_t offset, size_t count)
+{
+  off_t base;
+  size_t size;
+  const uint8_t *view;
+
+  if (offset < 0 || offset + (off_t)count > ud->st_size)
+    return NULL;
+  if (ud->view != NULL && offset >= ud->view_offset &&
+      offset + (off_t)count <= ud->view_offset + (off_t)ud->view_size)
+    return ud->view + (offset - ud->view_offset);
+  if (CDIO_MMAP_WINDOW_SIZE == 0 || _stdio_mmap_is_whole(ud))
+    return NULL;
+
+  base = offset & ~((off_t)CDIO_MMAP_GRANULARITY - 1);
+  if (offset + (off_t)count - base > CDIO_MMAP_WINDOW_SIZE)
+    return NULL;
+  size = (size_t)MIN((off_t)CDIO_MMAP_WINDOW_SIZE, ud->st_size - base);
+  view = MapViewOfFile(ud->h_map, FILE_MAP_READ, (DWORD)(base >> 32),
+                       (DWORD)base, size);
+  if (view == NULL) {
+    cdio_error ("MapViewOfFile (): error %lu", (unsigned long)GetLastError());
+    return NULL;
+  }
+  if (ud->view != NULL)
+    UnmapViewOfFile(ud->view);
+  ud->view = view;
+  ud->view_offset = base;
+  ud->view_size = size;
+  return ud->view + (offset - base);
+}
+
+/*
+  Copy count bytes from the view. Return false if the data could not be
+  paged in, e.g. because of a bad sector or of a drive that went away.
+*/
+static bool
+_stdio_mmap_copy(void *dst, const uint8_t *src, size_t count)
+{
+  __try {
+    memcpy(dst, src, count);
+  } __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ?
+              EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+    return false;
+  }
+  return true;
+}
+
+/*
+  Return true if the volume that holds wpathname is on a local disk that
+  can't be removed. A view of anything else, such as a file on a USB drive
+  that gets unplugged, or on a network share, is much more likely to fault.
+*/
+static bool
+_stdio_mmap_is_local(const wchar_t *wpathname)
+{
+  wchar_t wroot[MAX_PATH], wvolume[MAX_PATH];
+  size_t len;
+  HANDLE h_volume;
+  STORAGE_PROPERTY_QUERY query = { StorageDeviceProperty, PropertyStandardQuery };
+  STORAGE_DEVICE_DESCRIPTOR desc = { 0 };
+  DWORD size;
+  BOOL r;
+
+  if (!GetVolumePathNameW(wpathname, wroot, MAX_PATH) ||
+      GetDriveTypeW(wroot) != DRIVE_FIXED ||
+      !GetVolumeNameForVolumeMountPointW(wroot, wvolume, MAX_PATH))
+    return false;
+  /* The volume can't be opened with the trailing backslash */
+  len = wcslen(wvolume);
+  if (len > 0 && wvolume[len - 1] == L'\\')
+    wvolume[len - 1] = 0;
+  h_volume = CreateFileW(wvolume, 0, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                         NULL, OPEN_EXISTING, 0, NULL);
+  if (h_volume == INVALID_HANDLE_VALUE)
+    return false;
+  /* This fails for volumes that span more than one disk, which we skip */
+  r = DeviceIoControl(h_volume, IOCTL_STORAGE_QUERY_PROPERTY, &query,
+                      sizeof(query), &desc, sizeof(desc), &size, NULL);
+  CloseHandle(h_volume);
+  if (!r || size < offsetof(STORAGE_DEVICE_DESCRIPTOR, BusType) + sizeof(desc.BusType))
+    return false;
+  if (desc.RemovableMedia)
+    return false;
+  switch (desc.BusType) {
+  case BusTypeUsb:
+  case BusType1394:
+  case BusTypeSd:
+  case BusTypeMmc:
+  case BusTypeiScsi:
+  case BusTypeVirtual:
+  case BusTypeFileBackedVirtual:
+    return false;
+  default:
+    return true;
+  }
+}
+
+/*
+  Try to set up a mapping for the image. Return false if we should use
+  stdio instead, which we do for anything that isn't on a local fixed disk.
+*/
+static bool
+_stdio_mmap_open(_UserData *ud)
+{
+  wchar_t *wpathname;
+  HANDLE h_file;
+  SYSTEM_INFO si;
+
+  if (ud->st_size <= 0)
+    return false;
+  wpathname = cdio_utf8_to_wchar(ud->pathname);
+  if (wpathname == NULL)
+    return false;
+  if (!_stdio_mmap_is_local(wpathname)) {
+    cdio_free(wpathname);
+    return false;
+  }
+  h_file = CreateFileW(wpathname, GENERIC_READ, FILE_SHARE_READ, NULL,
+                       OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  cdio_free(wpathname);
+  if (h_file == INVALID_HANDLE_VALUE)
+    return false;
+  /* The mapping keeps its own reference to the file */
+  ud->h_map = CreateFileMappingW(h_file, NULL, PAGE_READONLY, 0, 0, NULL);
+  CloseHandle(h_file);
+  if (ud->h_map == NULL)
+    return false;
+
+  if (CDIO_MMAP_WINDOW_SIZE == 0 || ud->st_size <= CDIO_MMAP_WINDOW_SIZE) {
+    ud->view = MapViewOfFile(ud->h_map, FILE_MAP_READ, 0, 0, 0);
+    ud->view_size = (size_t)ud->st_size;
+  } else {
+    ud->view = NULL;
+    _stdio_mmap_view(ud, 0, 1);
+  }
+  if (ud->view == NULL) {
+    cdio_debug ("could not map `%s', using stdio", ud->pathname);
+    _stdio_mmap_close(ud);
+    return false;
+  }
+  GetSystemInfo(&si);
+  ud->page_size = si.dwPageSize;
+  ud->map_pos = 0;
+  ud->i_locks = 0;
+  return true;
+}
+#endif
+
 static int
 _stdio_open (void *user_data)
 {
   _UserData *const ud = user_data;
 
+#ifdef CDIO_STDIO_MMAP
+  if (_stdio_mmap_open(ud))
+    return 0;
+#endif
+
   if ((ud->fd = CDIO_FOPEN (ud->pathname, "rb")))
     {
       ud->fd_buf = calloc (1, CDIO_STDIO_BUFSIZE);
@@ -117,6 +345,13 @@ _stdio_close(void *user_data)
 {
   _UserData *const ud = user_data;
 
+#ifdef CDIO_STDIO_MMAP
+  if (ud->h_map != NULL) {
+    _stdio_mmap_close(ud);
+    return 0;
+  }
+#endif
+
   if (fclose (ud->fd))
     cdio_error ("fclose (): %s", strerror (errno));
 
@@ -138,6 +373,9 @@ _stdio_free(void *user_data)
 
   if (ud->fd) /* should be NULL anyway... */
     _stdio_close(user_data);
+#ifdef CDIO_STDIO_MMAP
+  _stdio_mmap_close(ud);
+#endif
 
   free(ud);
 }
@@ -172,6 +410,21 @@ _stdio_seek(void *p_user_data, off_t i_offset, int whence)
   }
 #endif
 
+#ifdef CDIO_STDIO_MMAP
+  if (ud->h_map != NULL) {
+    switch (whence) {
+    case SEEK_CUR: i_offset += ud->map_pos; break;
+    case SEEK_END: i_offset += ud->st_size; break;
+    }
+    if (i_offset < 0) {
+      errno = EINVAL;
+      return DRIVER_OP_ERROR;
+    }
+    ud->map_pos = i_offset;
+    return DRIVER_OP_SUCCESS;
+  }
+#endif
+
   if ( (ret=CDIO_FSEEK (ud->fd, i_offset, whence)) ) {
     cdio_error ( STRINGIFY(CDIO_FSEEK) " (): %s", strerror (errno));
   }
@@ -210,6 +463,40 @@ _stdio_read(void *user_data, void *buf, size_t count)
   _UserData *const ud = user_data;
   long read_count;
 
+#ifdef CDIO_STDIO_MMAP
+  if (ud->h_map != NULL) {
+    uint8_t *dst = buf;
+    size_t chunk;
+    const uint8_t *src;
+
+    if (ud->map_pos >= ud->st_size) {
+      cdio_debug ("fread (): EOF encountered");
+      return 0;
+    }
+    if ((off_t)count > ud->st_size - ud->map_pos)
+      count = (size_t)(ud->st_size - ud->map_pos);
+    read_count = 0;
+    while (count > 0) {
+      src = _stdio_mmap_view(ud, ud->map_pos, 1);
+      if (src == NULL)
+        break;
+      /* Copy at most one granule at a time, so that a fault only loses that */
+      chunk = (size_t)MIN((off_t)MIN(count, CDIO_MMAP_GRANULARITY),
+                          ud->view_offset + (off_t)ud->view_size - ud->map_pos);
+      if (!_stdio_mmap_copy(dst, src, chunk)) {
+        cdio_error ("read (): I/O error at offset %lld",
+                   (long long)ud->map_pos);
+        break;
+      }
+      dst += chunk;
+      count -= chunk;
+      ud->map_pos += chunk;
+      read_count += (long)chunk;
+    }
+    return read_count;
+  }
+#endif
+
   read_count = fread(buf, 1, count, ud->fd);
 
   if (read_count != count)
@@ -231,6 +518,72 @@ _stdio_read(void *user_data, void *buf, size_t count)
   return read_count;
 }
 
+#ifdef CDIO_STDIO_MMAP
+/*!
+  Return a pointer to count bytes of the mapped image at offset. Since
+  sliding the window would invalidate the pointers we handed out before,
+  this is only available when the whole image is mapped.
+
+  Unlike our copies, the callers access this data without any exception
+  handler, so we lock it in memory until _stdio_unmap(), which pages it
+  in and guarantees that accessing it can't fault. If the data can't be
+  read, or if it is more than the process is allowed to lock, we return
+  NULL and the caller reads it instead.
+*/
+static const void *
+_stdio_map(void *user_data, off_t offset, size_t count)
+{
+  _UserData *const ud = user_data;
+  const uint8_t *ptr;
+
+  if (ud->h_map == NULL || !_stdio_mmap_is_whole(ud) || count == 0 ||
+      ud->i_locks >= CDIO_MMAP_MAX_LOCKS)
+    return NULL;
+  ptr = _stdio_mmap_view(ud, offset, count);
+  if (ptr == NULL || !VirtualLock((void *)ptr, count))
+    return NULL;
+  ud->locks[ud->i_locks].ptr = ptr;
+  ud->locks[ud->i_locks].size = count;
+  ud->i_locks++;
+  return ptr;
+}
+
+/*!
+  Unlock the pages of a range returned by _stdio_map(). Since locks are
+  not counted, pages that are shared with another range still in use
+  are left alone.
+*/
+static void
+_stdio_unmap(void *user_data, const void *ptr)
+{
+  _UserData *const ud = user_data;
+  uintptr_t page, start, end;
+  unsigned int i, j;
+
+  for (i = ud->i_locks; i > 0; i--) {
+    if (ud->locks[i - 1].ptr == ptr)
+      break;
+  }
+  if (i == 0)
+    return;
+  i--;
+  start = (uintptr_t)ptr & ~((uintptr_t)ud->page_size - 1);
+  end = (uintptr_t)ptr + ud->locks[i].size;
+  ud->i_locks--;
+  ud->locks[i] = ud->locks[ud->i_locks];
+
+  for (page = start; page < end; page += ud->page_size) {
+    for (j = 0; j < ud->i_locks; j++) {
+      if ((uintptr_t)ud->locks[j].ptr < page + ud->page_size &&
+          (uintptr_t)ud->locks[j].ptr + ud->locks[j].size > page)
+        break;
+    }
+    if (j == ud->i_locks)
+      VirtualUnlock((void *)page, 1);
+  }
+}
+#endif
+
 /*!
   Deallocate resources assocaited with obj. After this obj is unusable.
 */
@@ -244,7 +597,7 @@ CdioDataSource_t *
 cdio_stdio_new(const char pathname[])
 {
   CdioDataSource_t *new_obj = NULL;
-  cdio_stream_io_functions funcs = { NULL, NULL, NULL, NULL, NULL, NULL };
+  cdio_stream_io_functions funcs = { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL };
   _UserData *ud = NULL;
   struct CDIO_STAT_STRUCT statbuf;
   char* pathdup;
@@ -277,6 +630,10 @@ cdio_stdio_new(const char pathname[])
   funcs.read   = _stdio_read;
   funcs.close  = _stdio_close;
   funcs.free   = _stdio_free;
+#ifdef CDIO_STDIO_MMAP
+  funcs.map    = _stdio_map;
+  funcs.unmap  = _stdio_unmap;
+#endif
 
   new_obj = cdio_stream_new(ud, &funcs);
 
@@ -42,6 +42,12 @@ extern "C" {
   typedef int(*cdio_data_close_t)(void *user_data);
   
   typedef void(*cdio_data_free_t)(void *user_data);
+
+  /* Rufus addition */
+  typedef const void*(*cdio_data_map_t)(void *user_data, off_t offset,
+                                        size_t count);
+
+  typedef void(*cdio_data_unmap_t)(void *user_data, const void *ptr);
   
   
   /* abstract data source */
@@ -53,6 +59,8 @@ extern "C" {
     cdio_data_read_t read;
     cdio_data_close_t close;
     cdio_data_free_t free;
+    cdio_data_map_t map;   /**< Optional - may be NULL (Rufus addition) */
+    cdio_data_unmap_t unmap; /**< Required if map is set (Rufus addition) */
   } cdio_stream_io_functions;
   
   /**
@@ -114,6 +122,26 @@ extern "C" {
     On error return -1;
   */
   off_t cdio_stream_stat(CdioDataSource_t *p_obj);
+
+  /**
+    Return a pointer to i_size bytes of the stream, starting at
+    i_offset, without copying them. The data is read-only and remains
+    valid until it is released with cdio_stream_unmap(), which must be
+    done before the stream is closed. The stream position is not
+    changed.
+
+    @return NULL if the stream does not support direct access, or if
+    the range cannot be accessed that way, in which case the caller
+    should use cdio_stream_read() instead. (Rufus addition)
+  */
+  const void *cdio_stream_map(CdioDataSource_t *p_obj, off_t i_offset,
+                              size_t i_size);
+
+  /**
+    Release a pointer that was returned by cdio_stream_map().
+    (Rufus addition)
+  */
+  void cdio_stream_unmap(CdioDataSource_t *p_obj, const void *ptr);
   
   /**
     Deallocate resources associated with p_obj. After this p_obj is unusable.
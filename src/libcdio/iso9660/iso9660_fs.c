@@ -94,8 +94,19 @@ struct _iso9660_s {
 			         different.
 			     */
   bool b_have_superblock;   /**< Superblock has been read in? */
+  iso9660_stat_t **dd_index; /**< Rufus addition: LSN -> directory hash
+			         table, used to resolve Rock Ridge deep
+			         directory child links without searching
+			         the whole file system for each of them. */
+  uint32_t dd_index_size;   /**< Number of slots in dd_index (power of 2) */
+  uint32_t dd_index_count;  /**< Number of directories in dd_index */
+  bool b_dd_index_failed;   /**< Don't try to build dd_index again */
 };
 
+#ifdef HAVE_ROCK
+static void dd_index_free(iso9660_t *p_iso);
+#endif
+
 static long int iso9660_seek_read_framesize (const iso9660_t *p_iso,
 					     void *ptr, lsn_t start,
 					     long int size,
@@ -288,6 +299,9 @@ iso9660_close (iso9660_t *p_iso)
   if (NULL != p_iso) {
     cdio_stdio_destroy(p_iso->stream);
     p_iso->stream = NULL;
+#ifdef HAVE_ROCK
+    dd_index_free(p_iso);
+#endif
     free(p_iso);
   }
   return true;
@@ -740,6 +754,78 @@ iso9660_iso_seek_read (const iso9660_t *p_iso, void *ptr, lsn_t start,
   return iso9660_seek_read_framesize(p_iso, ptr, start, size, ISO_BLOCKSIZE);
 }
 
+/*!
+  Return a read-only pointer to n blocks of the image, starting at
+  start, without copying them, or NULL if the data source can't do that.
+  The data remains valid until iso9660_iso_seek_unmap(). (Rufus addition)
+*/
+const void *
+iso9660_iso_seek_map (const iso9660_t *p_iso, lsn_t start, long int size)
+{
+  int64_t i_byte_offset;
+
+  if (!p_iso || size <= 0) return NULL;
+  /* Blocks are only contiguous if there are no raw frame headers */
+  if (p_iso->i_framesize != ISO_BLOCKSIZE) return NULL;
+  i_byte_offset = (start * (int64_t)ISO_BLOCKSIZE)
+    + p_iso->i_fuzzy_offset + p_iso->i_datastart;
+
+  return cdio_stream_map(p_iso->stream, i_byte_offset,
+			 (size_t)size * ISO_BLOCKSIZE);
+}
+
+/*!
+  Release a pointer returned by iso9660_iso_seek_map(). (Rufus addition)
+*/
+void
+iso9660_iso_seek_unmap (const iso9660_t *p_iso, const void *ptr)
+{
+  if (!p_iso) return;
+  cdio_stream_unmap(p_iso->stream, ptr);
+}
+
+/*
+  Rufus addition: Return the content of a directory extent, straight from
+  the mapping of the image if there is one, or else read into a buffer
+  that the caller must free, in which case *pb_alloc is set.
+*/
+static uint8_t *
+iso9660_dirbuf_get (const iso9660_t *p_iso, lsn_t lsn, uint32_t blocks,
+		    bool *pb_alloc)
+{
+  const size_t dirbuf_len = blocks * ISO_BLOCKSIZE;
+  uint8_t *_dirbuf;
+
+  /* Directory records are only ever read, so the const can go */
+  _dirbuf = (uint8_t *) iso9660_iso_seek_map (p_iso, lsn, blocks);
+  *pb_alloc = false;
+  if (_dirbuf)
+    return _dirbuf;
+
+  _dirbuf = calloc(1, dirbuf_len);
+  if (!_dirbuf)
+    {
+      cdio_warn("Couldn't calloc(1, %lu)", (unsigned long)dirbuf_len);
+      return NULL;
+    }
+  if (iso9660_iso_seek_read (p_iso, _dirbuf, lsn, blocks) != dirbuf_len)
+    {
+      free(_dirbuf);
+      return NULL;
+    }
+  *pb_alloc = true;
+  return _dirbuf;
+}
+
+static void
+iso9660_dirbuf_put (const iso9660_t *p_iso, uint8_t *_dirbuf, bool b_alloc)
+{
+  if (b_alloc)
+    free(_dirbuf);
+  else
+    iso9660_iso_seek_unmap (p_iso, _dirbuf);
+}
+
 
 
 /*!
@@ -815,6 +901,14 @@ _iso9660_dir_to_statbuf (iso9660_dir_t *p_iso9660_dir,
 
   i_fname = from_711(p_iso9660_dir->filename.len);
 
+  /* Rufus addition: Make sure that the name is within the record, since
+     a record that is parsed in place may end where the mapping does */
+  if (dir_len < sizeof(iso9660_dir_t) + i_fname) {
+    cdio_warn("Invalid directory record length %u", (unsigned)dir_len);
+    iso9660_stat_free(last_p_stat);
+    return NULL;
+  }
+
   /* .. string in statbuf is one longer than in p_iso9660_dir's listing '\1' */
   stat_len = sizeof(iso9660_stat_t) + i_fname + 2;
 
@@ -1188,8 +1282,9 @@ _fs_iso_stat_traverse (iso9660_t *p_iso, const iso9660_stat_t *_root,
 {
   unsigned offset = 0;
   uint8_t *_dirbuf = NULL;
+  bool b_dirbuf_alloc;
   uint32_t blocks; 
-  int ret, cmp;
+  int cmp;
   iso9660_stat_t *p_stat = NULL;
   iso9660_dir_t *p_iso9660_dir = NULL;
 
@@ -1212,18 +1307,9 @@ _fs_iso_stat_traverse (iso9660_t *p_iso, const iso9660_stat_t *_root,
   cdio_assert (_root->type == _STAT_DIR);
 
   blocks = CDIO_EXTENT_BLOCKS(_root->total_size);
-  _dirbuf = calloc(1, blocks * ISO_BLOCKSIZE);
+  _dirbuf = iso9660_dirbuf_get (p_iso, _root->lsn, blocks, &b_dirbuf_alloc);
   if (!_dirbuf)
-    {
-    cdio_warn("Couldn't calloc(1, %d)", blocks * ISO_BLOCKSIZE);
     return NULL;
-    }
-
-  ret = iso9660_iso_seek_read (p_iso, _dirbuf, _root->lsn, blocks);
-  if (ret != blocks * ISO_BLOCKSIZE) {
-    free(_dirbuf);
-    return NULL;
-  }
 
   for (offset = 0; offset < (blocks * ISO_BLOCKSIZE);
        offset += iso9660_get_dir_len(p_iso9660_dir))
@@ -1238,7 +1324,7 @@ _fs_iso_stat_traverse (iso9660_t *p_iso, const iso9660_stat_t *_root,
 
       if (!p_stat) {
 	cdio_warn("Bad directory information for %s", splitpath[0]);
-	free(_dirbuf);
+	iso9660_dirbuf_put (p_iso, _dirbuf, b_dirbuf_alloc);
 	return NULL;
       }
 
@@ -1259,6 +1345,7 @@ _fs_iso_stat_traverse (iso9660_t *p_iso, const iso9660_stat_t *_root,
 	    cdio_warn("can't allocate %lu bytes",
 		      (long unsigned int) strlen(p_stat->filename));
 	    iso9660_stat_free(p_stat);
+	    iso9660_dirbuf_put (p_iso, _dirbuf, b_dirbuf_alloc);
 	    return NULL;
 	  }
 	  iso9660_name_translate_ext(p_stat->filename, trans_fname,
@@ -1272,7 +1359,7 @@ _fs_iso_stat_traverse (iso9660_t *p_iso, const iso9660_stat_t *_root,
 	iso9660_stat_t *ret_stat
 	  = _fs_iso_stat_traverse (p_iso, p_stat, &splitpath[1]);
 	iso9660_stat_free(p_stat);
-	free (_dirbuf);
+	iso9660_dirbuf_put (p_iso, _dirbuf, b_dirbuf_alloc);
 	return ret_stat;
       }
       iso9660_stat_free(p_stat);
@@ -1282,7 +1369,7 @@ _fs_iso_stat_traverse (iso9660_t *p_iso, const iso9660_stat_t *_root,
   cdio_assert (offset == (blocks * ISO_BLOCKSIZE));
 
   /* not found */
-  free (_dirbuf);
+  iso9660_dirbuf_put (p_iso, _dirbuf, b_dirbuf_alloc);
   return NULL;
 }
 
@@ -1522,31 +1609,28 @@ iso9660_fs_readdir (CdIo_t *p_cdio, const char psz_path[])
 }
 
 /*!
-  Read psz_path (a directory) and return a list of iso9660_stat_t
-  of the files inside that. The caller must free the returned result.
+  Read the directory described by p_stat and return a list of
+  iso9660_stat_t of the files inside that. Unlike iso9660_ifs_readdir(),
+  this does not need to resolve the directory's path from the root, which
+  makes it much cheaper for callers that walk the whole tree.
+  The caller must free the returned result. (Rufus addition)
 */
 CdioISO9660FileList_t *
-iso9660_ifs_readdir (iso9660_t *p_iso, const char psz_path[])
+iso9660_ifs_readdir_stat (iso9660_t *p_iso, const iso9660_stat_t *p_stat)
 {
   iso9660_dir_t *p_iso9660_dir;
   iso9660_stat_t *p_iso9660_stat = NULL;
-  iso9660_stat_t *p_stat;
 
   if (!p_iso)    return NULL;
-  if (!psz_path) return NULL;
-
-  p_stat = iso9660_ifs_stat (p_iso, psz_path);
   if (!p_stat)   return NULL;
 
-  if (p_stat->type != _STAT_DIR) {
-    iso9660_stat_free(p_stat);
+  if (p_stat->type != _STAT_DIR)
     return NULL;
-  }
 
   {
-    long int ret;
     unsigned offset = 0;
     uint8_t *_dirbuf = NULL;
+    bool b_dirbuf_alloc;
     uint32_t blocks = CDIO_EXTENT_BLOCKS(p_stat->total_size);
     CdioList_t *retval = _cdio_list_new ();
     const size_t dirbuf_len = blocks * ISO_BLOCKSIZE;
@@ -1555,28 +1639,18 @@ iso9660_ifs_readdir (iso9660_t *p_iso, const char psz_path[])
     if (!dirbuf_len)
       {
         cdio_warn("Invalid directory buffer sector size %u", blocks);
-	iso9660_stat_free(p_stat);
 	_cdio_list_free (retval, true, NULL);
         return NULL;
       }
 
-    _dirbuf = calloc(1, dirbuf_len);
+    _dirbuf = iso9660_dirbuf_get (p_iso, p_stat->lsn, blocks,
+				  &b_dirbuf_alloc);
     if (!_dirbuf)
       {
-        cdio_warn("Couldn't calloc(1, %lu)", (unsigned long)dirbuf_len);
-	iso9660_stat_free(p_stat);
 	_cdio_list_free (retval, true, NULL);
         return NULL;
       }
 
-    ret = iso9660_iso_seek_read (p_iso, _dirbuf, p_stat->lsn, blocks);
-    if (ret != dirbuf_len) 	  {
-      _cdio_list_free (retval, true, NULL);
-      iso9660_stat_free(p_stat);
-      free (_dirbuf);
-      return NULL;
-    }
-
     while (offset < (dirbuf_len))
       {
 	p_iso9660_dir = (void *) &_dirbuf[offset];
@@ -1609,8 +1683,7 @@ iso9660_ifs_readdir (iso9660_t *p_iso, const char psz_path[])
 	offset += iso9660_get_dir_len(p_iso9660_dir);
       }
 
-    free (_dirbuf);
-    iso9660_stat_free(p_stat);
+    iso9660_dirbuf_put (p_iso, _dirbuf, b_dirbuf_alloc);
 
     if (offset != dirbuf_len) {
       _cdio_list_free (retval, true, (CdioDataFree_t) iso9660_stat_free);
@@ -1621,6 +1694,27 @@ iso9660_ifs_readdir (iso9660_t *p_iso, const char psz_path[])
   }
 }
 
+/*!
+  Read psz_path (a directory) and return a list of iso9660_stat_t
+  of the files inside that. The caller must free the returned result.
+*/
+CdioISO9660FileList_t *
+iso9660_ifs_readdir (iso9660_t *p_iso, const char psz_path[])
+{
+  iso9660_stat_t *p_stat;
+  CdioISO9660FileList_t *retval;
+
+  if (!p_iso)    return NULL;
+  if (!psz_path) return NULL;
+
+  p_stat = iso9660_ifs_stat (p_iso, psz_path);
+  if (!p_stat)   return NULL;
+
+  retval = iso9660_ifs_readdir_stat (p_iso, p_stat);
+  iso9660_stat_free(p_stat);
+  return retval;
+}
+
 typedef CdioISO9660FileList_t * (iso9660_readdir_t)
   (void *p_image,  const char * psz_path);
 
@@ -1780,6 +1874,138 @@ iso9660_ifs_find_lsn(iso9660_t *p_iso, lsn_t i_lsn)
 iso9660_stat_t *
 _iso9660_dd_find_lsn(void* p_image, lsn_t i_lsn);
 
+#define DD_INDEX_HASH(lsn, size) (((uint32_t)(lsn) * 2654435761U) & ((size) - 1))
+
+static void
+dd_index_free(iso9660_t *p_iso)
+{
+  uint32_t i;
+
+  if (p_iso->dd_index != NULL) {
+    for (i = 0; i < p_iso->dd_index_size; i++)
+      iso9660_stat_free(p_iso->dd_index[i]);
+    free(p_iso->dd_index);
+  }
+  p_iso->dd_index = NULL;
+  p_iso->dd_index_size = 0;
+  p_iso->dd_index_count = 0;
+}
+
+static iso9660_stat_t *
+dd_index_find(const iso9660_t *p_iso, lsn_t lsn)
+{
+  uint32_t i;
+
+  for (i = DD_INDEX_HASH(lsn, p_iso->dd_index_size); p_iso->dd_index[i] != NULL;
+       i = (i + 1) & (p_iso->dd_index_size - 1))
+    if (p_iso->dd_index[i]->lsn == lsn)
+      return p_iso->dd_index[i];
+  return NULL;
+}
+
+/*
+  Add a copy of a directory stat to the index, unless its LSN is already
+  there. Returns 1 if added, 0 if already indexed and -1 on error.
+*/
+static int
+dd_index_add(iso9660_t *p_iso, const iso9660_stat_t *p_stat)
+{
+  uint32_t i, new_size;
+  iso9660_stat_t **new_index, *p_copy;
+  size_t len;
+
+  if (dd_index_find(p_iso, p_stat->lsn) != NULL)
+    return 0;
+
+  /* Keep the table at most half full */
+  if (2 * (p_iso->dd_index_count + 1) > p_iso->dd_index_size) {
+    new_size = 2 * p_iso->dd_index_size;
+    new_index = calloc(new_size, sizeof(iso9660_stat_t *));
+    if (!new_index) {
+      cdio_warn("Couldn't calloc(%u, %u)", new_size,
+		(unsigned int)sizeof(iso9660_stat_t *));
+      return -1;
+    }
+    for (i = 0; i < p_iso->dd_index_size; i++) {
+      uint32_t j;
+      if (p_iso->dd_index[i] == NULL)
+	continue;
+      for (j = DD_INDEX_HASH(p_iso->dd_index[i]->lsn, new_size); new_index[j] != NULL;
+	   j = (j + 1) & (new_size - 1));
+      new_index[j] = p_iso->dd_index[i];
+    }
+    free(p_iso->dd_index);
+    p_iso->dd_index = new_index;
+    p_iso->dd_index_size = new_size;
+  }
+
+  len = sizeof(iso9660_stat_t) + strlen(p_stat->filename) + 1;
+  p_copy = calloc(1, len);
+  if (!p_copy) {
+    cdio_warn("Couldn't calloc(1, %u)", (unsigned int)len);
+    return -1;
+  }
+  memcpy(p_copy, p_stat, len);
+  p_copy->rr.psz_symlink = NULL;
+
+  for (i = DD_INDEX_HASH(p_copy->lsn, p_iso->dd_index_size); p_iso->dd_index[i] != NULL;
+       i = (i + 1) & (p_iso->dd_index_size - 1));
+  p_iso->dd_index[i] = p_copy;
+  p_iso->dd_index_count++;
+  return 1;
+}
+
+/*
+  Index all the subdirectories of p_dir (the root if NULL), using p_iso_dd,
+  a duplicate of p_iso with deep directory processing disabled. As with
+  find_lsn_recurse(), all the entries of a directory are indexed before
+  we descend, so that the first match is the one we would have found by
+  searching. Directories that were already indexed are not descended into,
+  which also protects us against loops in corrupted images.
+*/
+static bool
+dd_index_build(iso9660_t *p_iso, iso9660_t *p_iso_dd, const iso9660_stat_t *p_dir)
+{
+  CdioISO9660FileList_t *entlist;
+  CdioISO9660FileList_t *dirlist;
+  CdioListNode_t *entnode;
+  bool ret = false;
+
+  entlist = (p_dir == NULL) ? iso9660_ifs_readdir(p_iso_dd, "/")
+    : iso9660_ifs_readdir_stat(p_iso_dd, p_dir);
+  if (!entlist)
+    return false;
+  dirlist = _cdio_list_new();
+
+  _CDIO_LIST_FOREACH (entnode, entlist) {
+    iso9660_stat_t *statbuf = _cdio_list_node_data (entnode);
+    if (statbuf->type != _STAT_DIR || !strcmp(statbuf->filename, ".")
+	|| !strcmp(statbuf->filename, ".."))
+      continue;
+    switch (dd_index_add(p_iso, statbuf)) {
+    case 1:
+      _cdio_list_append(dirlist, statbuf);
+      break;
+    case 0:
+      break;
+    default:
+      goto out;
+    }
+  }
+
+  _CDIO_LIST_FOREACH (entnode, dirlist) {
+    if (!dd_index_build(p_iso, p_iso_dd, _cdio_list_node_data (entnode)))
+      goto out;
+  }
+  ret = true;
+
+out:
+  /* The entries of dirlist belong to entlist */
+  _cdio_list_free(dirlist, false, NULL);
+  iso9660_filelist_free(entlist);
+  return ret;
+}
+
 /* Same as above for Rock Ridge deep directory traversing. */
 iso9660_stat_t *
 _iso9660_dd_find_lsn(void* p_image, lsn_t i_lsn)
@@ -1816,6 +2042,37 @@ _iso9660_dd_find_lsn(void* p_image, lsn_t i_lsn)
   /* Disable the deep directory flag so we can process all entries */
   p_header = (cdio_header_t*)p_image_dd;
   p_header->u_flags |= CDIO_HEADER_FLAGS_DISABLE_RR_DD;
+
+  /*
+    Rufus addition: Searching the whole file system for every child link
+    makes images with lots of deep directories impossibly slow to process,
+    so, for ISO images, we index all the directories by LSN on first use.
+  */
+  if (p_header->u_type == CDIO_HEADER_TYPE_ISO) {
+    iso9660_t *p_iso = (iso9660_t *)p_image;
+    if (p_iso->dd_index == NULL && !p_iso->b_dd_index_failed) {
+      p_iso->dd_index_size = 1024;
+      p_iso->dd_index = calloc(p_iso->dd_index_size, sizeof(iso9660_stat_t *));
+      if (!p_iso->dd_index || !dd_index_build(p_iso, (iso9660_t *)p_image_dd, NULL)) {
+	cdio_warn("Could not index deep directories - falling back to search");
+	dd_index_free(p_iso);
+	p_iso->b_dd_index_failed = true;
+      }
+    }
+    if (p_iso->dd_index != NULL) {
+      iso9660_stat_t *p_stat = dd_index_find(p_iso, i_lsn);
+      ret = NULL;
+      if (p_stat != NULL) {
+	size = sizeof(iso9660_stat_t) + strlen(p_stat->filename) + 1;
+	ret = calloc(1, size);
+	if (ret)
+	  memcpy(ret, p_stat, size);
+      }
+      free(p_image_dd);
+      return ret;
+    }
+  }
+
   ret = find_lsn_recurse(p_image_dd, f_readdir, "/", i_lsn, &psz_full_filename);
   if (psz_full_filename != NULL)
     free(psz_full_filename);
@@ -106,10 +106,15 @@ udf_is_dir(const udf_dirent_t *p_udf_dirent)
 
 /*
  * Translate a file offset into a logical block and then into a physical
- * block.
+ * block. pi_max_size is set to the number of bytes left in the extent.
+ *
+ * Rufus addition: Rather than walk the allocation descriptors from the
+ * first one on every call, which is O(extents) per block read, we resume
+ * from the extent we last translated an offset for, as long as we are not
+ * seeking backwards. The dirent is not const, as it holds this cursor.
  */
 static lba_t
-offset_to_lba(const udf_dirent_t *p_udf_dirent, off_t i_offset, 
+offset_to_lba(udf_dirent_t *p_udf_dirent, off_t i_offset,
 	      /*out*/ lba_t *pi_lba, /*out*/ uint32_t *pi_max_size)
 {
   udf_t *p_udf = p_udf_dirent->p_udf;
@@ -134,6 +139,12 @@ offset_to_lba(const udf_dirent_t *p_udf_dirent, off_t i_offset,
       uint64_t lsector;
       int ad_offset, ad_num = 0;
       uint16_t addr_ilk = uint16_from_le(p_icb_tag->flags&ICBTAG_FLAG_AD_MASK);
+      const off_t i_start = i_offset;
+
+      if ((uint64_t)i_offset >= p_udf_dirent->i_ad_offset) {
+	ad_num = p_udf_dirent->i_ad;
+	i_offset -= p_udf_dirent->i_ad_offset;
+      }
       
       switch (addr_ilk) {
       case ICBTAG_FLAG_AD_SHORT: 
@@ -160,7 +171,7 @@ offset_to_lba(const udf_dirent_t *p_udf_dirent, off_t i_offset,
 	  
 	  lsector = (i_offset / UDF_BLOCKSIZE) + p_icb->pos;
 	  
-	  *pi_max_size = p_icb->len;
+	  *pi_max_size = p_icb->len - (uint32_t)i_offset;
 	}
 	break;
       case ICBTAG_FLAG_AD_LONG: 
@@ -188,7 +199,7 @@ offset_to_lba(const udf_dirent_t *p_udf_dirent, off_t i_offset,
 	  lsector = (i_offset / UDF_BLOCKSIZE) +
 	    uint32_from_le(((udf_long_ad_t *)(p_icb))->loc.lba);
 	  
-	  *pi_max_size = p_icb->len;
+	  *pi_max_size = p_icb->len - (uint32_t)i_offset;
 	}
 	break;
       case ICBTAG_FLAG_AD_IN_ICB:
@@ -207,6 +218,10 @@ offset_to_lba(const udf_dirent_t *p_udf_dirent, off_t i_offset,
 	return CDIO_INVALID_LBA;
       }
 
+      /* Remember the extent we are in for the next call */
+      p_udf_dirent->i_ad = ad_num - 1;
+      p_udf_dirent->i_ad_offset = (uint64_t)(i_start - i_offset);
+
       *pi_lba = (lba_t)lsector + p_udf->i_part_start;
       if (*pi_lba < 0) {
 	cdio_warn("Negative LBA value");
@@ -235,23 +250,26 @@ offset_to_lba(const udf_dirent_t *p_udf_dirent, off_t i_offset,
   If there is an error, cast the result to driver_return_code_t for 
   the specific error code.
 */
-ssize_t
-udf_read_block(const udf_dirent_t *p_udf_dirent, void * buf, size_t count)
+static ssize_t
+read_blocks(const udf_dirent_t *p_udf_dirent, void * buf, size_t count,
+	    bool b_warn_truncated)
 {
   if (count == 0) return 0;
   else {
     driver_return_code_t ret;
     uint32_t i_max_size=0;
     udf_t *p_udf = p_udf_dirent->p_udf;
-    lba_t i_lba = offset_to_lba(p_udf_dirent, p_udf->i_position, &i_lba, 
-				&i_max_size);
+    lba_t i_lba = offset_to_lba((udf_dirent_t *)p_udf_dirent, p_udf->i_position,
+				&i_lba, &i_max_size);
     if (i_lba != CDIO_INVALID_LBA) {
       uint32_t i_max_blocks = CEILING(i_max_size, UDF_BLOCKSIZE);
       if ( i_max_blocks < count ) {
+	if (b_warn_truncated) {
 	  cdio_warn("read count %u is larger than %u extent size.",
 		  (unsigned int)count, i_max_blocks);
 	  cdio_warn("read count truncated to %u", (unsigned int)count);
-	  count = i_max_blocks;
+	}
+	count = i_max_blocks;
       }
       ret = udf_read_sectors(p_udf, buf, i_lba, count);
       if (DRIVER_OP_SUCCESS == ret) {
@@ -265,3 +283,22 @@ udf_read_block(const udf_dirent_t *p_udf_dirent, void * buf, size_t count)
     }
   }
 }
+
+ssize_t
+udf_read_block(const udf_dirent_t *p_udf_dirent, void * buf, size_t count)
+{
+  return read_blocks(p_udf_dirent, buf, count, true);
+}
+
+/**
+  Rufus addition: Same as udf_read_block(), except that reads that span
+  past the end of the current extent are silently truncated to it. This
+  allows callers to read a whole file in as few calls as there are
+  extents, by asking for as many blocks as they have room for, and then
+  calling again for the next extent.
+*/
+ssize_t
+udf_read_blocks(const udf_dirent_t *p_udf_dirent, void * buf, size_t count)
+{
+  return read_blocks(p_udf_dirent, buf, count, false);
+}
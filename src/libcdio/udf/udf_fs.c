@@ -360,6 +360,28 @@ udf_read_sectors (const udf_t *p_udf, void *ptr, lsn_t i_start,
   }
 }
 
+/*!
+  Rufus addition: Return a read-only pointer to i_blocks sectors starting
+  at i_start, straight from the mapping of the image, or NULL if there
+  isn't one.
+*/
+const void *
+udf_map_sectors (const udf_t *p_udf, lsn_t i_start, long i_blocks)
+{
+  if (!p_udf || !p_udf->b_stream || i_blocks <= 0) return NULL;
+
+  return cdio_stream_map (p_udf->stream, ((off_t)i_start) * UDF_BLOCKSIZE,
+			  (size_t)i_blocks * UDF_BLOCKSIZE);
+}
+
+void
+udf_unmap_sectors (const udf_t *p_udf, const void *ptr)
+{
+  if (!p_udf || !p_udf->b_stream) return;
+
+  cdio_stream_unmap (p_udf->stream, ptr);
+}
+
 /*!
   Open an UDF for reading. Maybe in the future we will have
   a mode. NULL is returned on error.
@@ -696,6 +718,9 @@ udf_readdir(udf_dirent_t *p_udf_dirent)
   /* file position must be reset when accessing a new file */
   p_udf = p_udf_dirent->p_udf;
   p_udf->i_position = 0;
+  /* as must the extent cursor, since we reuse the dirent */
+  p_udf_dirent->i_ad = 0;
+  p_udf_dirent->i_ad_offset = 0;
 
   if (p_udf_dirent->fid) {
     /* advance to next File Identifier Descriptor */
@@ -706,6 +731,12 @@ udf_readdir(udf_dirent_t *p_udf_dirent)
 
     p_udf_dirent->fid =
       (udf_fileid_desc_t *)((uint8_t *)p_udf_dirent->fid + ofs);
+    /* Rufus addition: Don't go past the sectors we mapped or read */
+    if ((uint8_t *)p_udf_dirent->fid + sizeof(*(p_udf_dirent->fid))
+	> p_udf_dirent->p_fid_end) {
+      udf_dirent_free(p_udf_dirent);
+      return NULL;
+    }
   }
 
   if (!p_udf_dirent->fid) {
@@ -714,15 +745,22 @@ udf_readdir(udf_dirent_t *p_udf_dirent)
     uint32_t size = UDF_BLOCKSIZE * i_sectors;
     driver_return_code_t i_ret;
 
-    if (!p_udf_dirent->sector)
-      p_udf_dirent->sector = (uint8_t*) malloc(size);
-    i_ret = udf_read_sectors(p_udf, p_udf_dirent->sector,
-			     p_udf_dirent->i_part_start+p_udf_dirent->i_loc,
-			     i_sectors);
-    if (DRIVER_OP_SUCCESS == i_ret)
-      p_udf_dirent->fid = (udf_fileid_desc_t *) p_udf_dirent->sector;
-    else
-      p_udf_dirent->fid = NULL;
+    /* Rufus addition: Parse the File Identifiers in place if we can */
+    p_udf_dirent->p_map =
+      udf_map_sectors(p_udf, p_udf_dirent->i_part_start+p_udf_dirent->i_loc,
+		      i_sectors);
+    p_udf_dirent->fid = (udf_fileid_desc_t *) p_udf_dirent->p_map;
+    if (!p_udf_dirent->fid) {
+      if (!p_udf_dirent->sector)
+	p_udf_dirent->sector = (uint8_t*) malloc(size);
+      i_ret = udf_read_sectors(p_udf, p_udf_dirent->sector,
+			       p_udf_dirent->i_part_start+p_udf_dirent->i_loc,
+			       i_sectors);
+      if (DRIVER_OP_SUCCESS == i_ret)
+	p_udf_dirent->fid = (udf_fileid_desc_t *) p_udf_dirent->sector;
+    }
+    if (p_udf_dirent->fid)
+      p_udf_dirent->p_fid_end = (uint8_t *) p_udf_dirent->fid + size;
   }
 
   if (p_udf_dirent->fid && !udf_checktag(&(p_udf_dirent->fid->tag), TAGID_FID))
@@ -731,6 +769,14 @@ udf_readdir(udf_dirent_t *p_udf_dirent)
 	4 * ((sizeof(*p_udf_dirent->fid) + p_udf_dirent->fid->u.i_imp_use
 	      + p_udf_dirent->fid->i_file_id + 3) / 4);
 
+      /* Rufus addition: The name must also be within these sectors */
+      if ((uint8_t *)p_udf_dirent->fid + sizeof(*p_udf_dirent->fid)
+	  + p_udf_dirent->fid->u.i_imp_use + p_udf_dirent->fid->i_file_id
+	  > p_udf_dirent->p_fid_end) {
+	udf_dirent_free(p_udf_dirent);
+	return NULL;
+      }
+
       p_udf_dirent->dir_left -= ofs;
       p_udf_dirent->b_dir =
 	(p_udf_dirent->fid->file_characteristics & UDF_FILE_DIRECTORY) != 0;
@@ -764,6 +810,7 @@ udf_dirent_free(udf_dirent_t *p_udf_dirent)
 {
   if (p_udf_dirent) {
     p_udf_dirent->fid = NULL;
+    udf_unmap_sectors(p_udf_dirent->p_udf, p_udf_dirent->p_map);
     free_and_null(p_udf_dirent->psz_name);
     free_and_null(p_udf_dirent->sector);
     free_and_null(p_udf_dirent);
@@ -53,6 +53,21 @@
 #endif
 #endif
 
+/*
+ * x86 SIMD helpers: CPU_X86 is defined when building for an x86 or x64 target, and
+ * TARGET() enables an instruction set extension for the function it precedes, so that
+ * we can compile runtime-dispatched SIMD code without raising the baseline for the
+ * whole application (MSVC does not need this, as it always allows the intrinsics).
+ */
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define CPU_X86
+#endif
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET(t) __attribute__ ((__target__(t)))
+#else
+#define TARGET(t)
+#endif
+
 /* Read/write with endianness swap */
 #if defined (_MSC_VER) && (_MSC_VER >= 1300)
 #include <stdlib.h>
@@ -157,6 +157,8 @@
 #define IDC_SHA1                        1072
 #define IDC_SHA256                      1073
 #define IDC_SHA512                      1112
+#define IDC_TREE_HASH                   1113
+#define IDC_TREE_HASH_TXT               1114
 #define IDC_SELECTION_ICON              1074
 #define IDC_SELECTION_TEXT              1075
 #define IDC_SELECTION_LINE              1076
@@ -544,7 +546,7 @@
 #define _APS_NO_MFC                     1
 #define _APS_NEXT_RESOURCE_VALUE        505
 #define _APS_NEXT_COMMAND_VALUE         40001
-#define _APS_NEXT_CONTROL_VALUE         1112
+#define _APS_NEXT_CONTROL_VALUE         1115
 #define _APS_NEXT_SYMED_VALUE           4000
 #endif
 #endif
@@ -103,6 +103,15 @@
 #define MAX_FAT32_SIZE              2.0f		// Threshold above which we disable FAT32 formatting (in TB)
 #define FAT32_CLUSTER_THRESHOLD     1.011f		// For FAT32, cluster size changes don't occur at power of 2 boundaries but sligthly above
 #define DD_BUFFER_SIZE              65536		// Minimum size of the buffer we use for DD operations
+#define WRITE_BUFFERS               4			// Default number of buffers in the image write pipeline
+#define WRITE_BUFFER_SIZE           (1024*1024)	// Default size of the image write pipeline buffers
+#define MAX_WRITE_BUFFERS           64
+#define MAX_WRITE_BUFFER_SIZE       (64*1024*1024)
+#define ZERO_BATCH_SIZE             (4*1024*1024)	// Size of the writes we issue when zeroing, and of the fast-zeroing read-ahead
+#define MAX_FAST_ZEROING_BACKOFF    64		// Maximum number of batches we write without checking, when fast-zeroing
+#define SPARSE_BLOCK_SIZE           (64*1024)	// Granularity at which we detect zeroed blocks, for sparse writes
+#define VERIFY_BUFFER_SIZE          (1024*1024)	// Size of the reads we issue when verifying a written image
+#define VERIFY_LEAF_SIZE            (1024*1024)	// Granularity at which we locate verification errors
 #define UBUFFER_SIZE                4096
 #define RSA_SIGNATURE_SIZE          256
 #define CBN_SELCHANGE_INTERNAL      (CBN_SELCHANGE + 256)
@@ -294,6 +303,10 @@ enum checksum_type {
 	CHECKSUM_SHA512,
 	CHECKSUM_MAX
 };
+#define MAX_HASHSIZE        64
+
+/* Checksums computed by worker threads, on data that is being processed elsewhere */
+typedef struct hash_stream HASH_STREAM;
 
 /* Special handling for old .c32 files we need to replace */
 #define NB_OLD_C32          2
@@ -396,6 +409,18 @@ typedef struct {
 	char* Label;
 } IMG_SAVE;
 
+/* Tree hash (SHA-256 Merkle tree over fixed size leaves) and its sidecar file */
+#define TREE_HASH_VERSION 1
+#define TREE_HASH_EXT ".sha256tree"
+
+typedef struct {
+	uint64_t size;
+	uint32_t leaf_size;
+	uint32_t num_leaves;
+	uint8_t* leaf_sum;
+	uint8_t root[32];
+} TREE_HASH;
+
 /*
  * Structure and macros used for the extensions specification of FileDialog()
  * You can use:
@@ -466,6 +491,7 @@ extern WORD selected_langid;
 extern DWORD FormatStatus, DownloadStatus, MainThreadId, LastWriteError;
 extern BOOL use_own_c32[NB_OLD_C32], detect_fakes, op_in_progress, right_to_left_mode;
 extern BOOL allow_dual_uefi_bios, large_drive, usb_debug;
+extern BOOL cpu_has_sse2, cpu_has_ssse3, cpu_has_sse41, cpu_has_avx2, cpu_has_sha, cpu_has_pclmulqdq;
 extern int64_t iso_blocking_status;
 extern uint8_t image_options;
 extern uint16_t rufus_version[3], embedded_sl_version[2];
@@ -486,6 +512,8 @@ extern char *image_path, *fido_url;
 extern void GetWindowsVersion(void);
 extern BOOL is_x64(void);
 extern BOOL GetCpuArch(void);
+extern void DetectCpuFeatures(void);
+extern BOOL IsBufferUniform(const void* buf, size_t len, uint8_t val);
 extern const char *WindowsErrorString(void);
 extern void DumpBufferHex(void *buf, size_t size);
 extern void PrintStatusInfo(BOOL info, BOOL debug, unsigned int duration, int msg_id, ...);
@@ -495,6 +523,7 @@ extern void PrintStatusInfo(BOOL info, BOOL debug, unsigned int duration, int ms
 #define PrintInfoDebug(...) PrintStatusInfo(TRUE, TRUE, __VA_ARGS__)
 extern void UpdateProgress(int op, float percent);
 extern void UpdateProgressWithInfo(int op, int msg, uint64_t processed, uint64_t total);
+extern void SetProgressRates(uint64_t source_rate, uint64_t drive_rate);
 #define UpdateProgressWithInfoInit(hProgressDialog, bNoAltMode) UpdateProgressWithInfo(OP_INIT, (int)bNoAltMode, (uint64_t)(uintptr_t)hProgressDialog, 0);
 extern const char* StrError(DWORD error_code, BOOL use_default_locale);
 extern char* GuidToString(const GUID* guid);
@@ -523,6 +552,7 @@ extern SIZE GetTextSize(HWND hCtrl, char* txt);
 extern BOOL ExtractAppIcon(const char* filename, BOOL bSilent);
 extern BOOL ExtractDOS(const char* path);
 extern BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan);
+extern BOOL ExtractISOToExtFs(const char* src_iso, DWORD DriveIndex, uint64_t PartitionOffset);
 extern int64_t ExtractISOFile(const char* iso, const char* iso_file, const char* dest_file, DWORD attributes);
 extern BOOL HasEfiImgBootLoaders(void);
 extern BOOL DumpFatDir(const char* path, int32_t cluster);
@@ -579,6 +609,15 @@ extern BOOL WriteFileWithRetry(HANDLE hFile, LPCVOID lpBuffer, DWORD nNumberOfBy
 extern BOOL SetThreadAffinity(DWORD_PTR* thread_affinity, size_t num_threads);
 extern BOOL HashFile(const unsigned type, const char* path, uint8_t* sum);
 extern BOOL HashBuffer(const unsigned type, const unsigned char* buf, const size_t len, uint8_t* sum);
+extern void InitChecksumKernels(void);
+extern void ComputeTreeHashRoot(TREE_HASH* tree);
+extern void FreeTreeHash(TREE_HASH* tree);
+extern BOOL SaveTreeHash(const char* path, const TREE_HASH* tree);
+extern BOOL LoadTreeHash(const char* path, TREE_HASH* tree);
+extern uint32_t CompareTreeHash(const TREE_HASH* ref, const TREE_HASH* tree);
+extern HASH_STREAM* HashStreamOpen(uint32_t type_mask, uint32_t leaf_size);
+extern BOOL HashStreamWrite(HASH_STREAM* hs, const uint8_t* buf, size_t len);
+extern BOOL HashStreamClose(HASH_STREAM* hs, uint8_t sum[CHECKSUM_MAX][MAX_HASHSIZE], uint64_t* size, TREE_HASH* tree);
 extern BOOL IsFileInDB(const char* path);
 extern BOOL IsBufferInDB(const unsigned char* buf, const size_t len);
 #define printbits(x) _printbits(sizeof(x), &x, 0)
@@ -30,6 +30,8 @@ extern char* ini_file;
 #define SETTING_ADVANCED_MODE               "AdvancedMode"
 #define SETTING_ADVANCED_MODE_DEVICE        "ShowAdvancedDriveProperties"
 #define SETTING_ADVANCED_MODE_FORMAT        "ShowAdvancedFormatOptions"
+#define SETTING_CHECKSUM_BUFFER_COUNT       "ChecksumBufferCount"
+#define SETTING_CHECKSUM_BUFFER_SIZE        "ChecksumBufferSize"
 #define SETTING_COMM_CHECK                  "CommCheck64"
 #define SETTING_DEFAULT_THREAD_PRIORITY     "DefaultThreadPriority"
 #define SETTING_DISABLE_FAKE_DRIVES_CHECK   "DisableFakeDrivesCheck"
@@ -37,10 +39,13 @@ extern char* ini_file;
 #define SETTING_DISABLE_SECURE_BOOT_NOTICE  "DisableSecureBootNotice"
 #define SETTING_DISABLE_VHDS                "DisableVHDs"
 #define SETTING_ENABLE_EXTRA_HASHES         "EnableExtraHashes"
+#define SETTING_ENABLE_TREE_HASH            "EnableTreeHash"
 #define SETTING_ENABLE_FILE_INDEXING        "EnableFileIndexing"
 #define SETTING_ENABLE_USB_DEBUG            "EnableUsbDebug"
 #define SETTING_ENABLE_VMDK_DETECTION       "EnableVmdkDetection"
 #define SETTING_ENABLE_WIN_DUAL_EFI_BIOS    "EnableWindowsDualUefiBiosMode"
+#define SETTING_ENABLE_WRITE_HASH           "EnableWriteHash"
+#define SETTING_ENABLE_WRITE_VERIFY         "EnableWriteVerify"
 #define SETTING_FORCE_LARGE_FAT32_FORMAT    "ForceLargeFat32Formatting"
 #define SETTING_INCLUDE_BETAS               "CheckForBetas"
 #define SETTING_LAST_UPDATE                 "LastUpdateCheck"
@@ -51,7 +56,11 @@ extern char* ini_file;
 #define SETTING_USE_UDF_VERSION             "UseUdfVersion"
 #define SETTING_USE_VDS                     "UseVds"
 #define SETTING_PRESERVE_TIMESTAMPS         "PreserveTimestamps"
+#define SETTING_SPARSE_IMAGE_WRITE          "SparseImageWrite"
 #define SETTING_VERBOSE_UPDATES             "VerboseUpdateCheck"
+#define SETTING_WRITE_BENCHMARK             "WriteBenchmark"
+#define SETTING_WRITE_BUFFER_COUNT          "WriteBufferCount"
+#define SETTING_WRITE_BUFFER_SIZE           "WriteBufferSize"
 
 
 static __inline BOOL CheckIniKey(const char* key) {
@@ -27,12 +27,22 @@
 
 #include "rufus.h"
 #include "missing.h"
+#if defined(CPU_X86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include <immintrin.h>
+#endif
 #include "resource.h"
 #include "msapi_utf8.h"
 #include "localization.h"
 
 #include "settings.h"
 
+BOOL cpu_has_sse2 = FALSE, cpu_has_ssse3 = FALSE, cpu_has_sse41 = FALSE, cpu_has_avx2 = FALSE;
+BOOL cpu_has_sha = FALSE, cpu_has_pclmulqdq = FALSE;
 int  nWindowsVersion = WINDOWS_UNDEFINED;
 int  nWindowsBuildNumber = -1;
 char WindowsVersionStr[128] = "Windows ";
@@ -239,6 +249,120 @@ int GetCpuArch(void)
 	}
 }
 
+#if defined(CPU_X86)
+static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+{
+#if defined(_MSC_VER)
+	__cpuidex((int*)regs, (int)leaf, (int)subleaf);
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static uint64_t xgetbv(uint32_t index)
+{
+#if defined(_MSC_VER)
+	return _xgetbv(index);
+#else
+	uint32_t eax, edx;
+	__asm__ __volatile__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (index));
+	return ((uint64_t)edx << 32) | eax;
+#endif
+}
+#endif
+
+/*
+ * Detect the instruction set extensions we can use for our SIMD code paths.
+ * For AVX2, we must also check that the OS saves the YMM registers on context switch.
+ */
+void DetectCpuFeatures(void)
+{
+#if defined(CPU_X86)
+	uint32_t regs[4] = { 0 }, max_leaf;
+
+	cpuid(0, 0, regs);
+	max_leaf = regs[0];
+	if (max_leaf < 1)
+		return;
+	cpuid(1, 0, regs);
+	cpu_has_sse2 = (regs[3] & (1 << 26)) != 0;
+	cpu_has_ssse3 = (regs[2] & (1 << 9)) != 0;
+	cpu_has_sse41 = (regs[2] & (1 << 19)) != 0;
+	cpu_has_pclmulqdq = (regs[2] & (1 << 1)) != 0;
+	// OSXSAVE and AVX, and XMM + YMM state enabled in XCR0
+	cpu_has_avx2 = ((regs[2] & (1 << 27)) != 0) && ((regs[2] & (1 << 28)) != 0) && ((xgetbv(0) & 0x06) == 0x06);
+	if (max_leaf < 7) {
+		cpu_has_avx2 = FALSE;
+		return;
+	}
+	cpuid(7, 0, regs);
+	cpu_has_avx2 = cpu_has_avx2 && ((regs[1] & (1 << 5)) != 0);
+	cpu_has_sha = (regs[1] & (1 << 29)) != 0;
+#endif
+}
+
+#if defined(CPU_X86)
+// Return the size of the prefix of buf that is filled with val, in blocks of 128 bytes
+TARGET("avx2") static size_t uniform_prefix_avx2(const uint8_t* buf, size_t len, uint8_t val)
+{
+	const __m256i v = _mm256_set1_epi8((char)val);
+	__m256i acc;
+	size_t i;
+
+	for (i = 0; i + 128 <= len; i += 128) {
+		acc = _mm256_or_si256(
+			_mm256_or_si256(_mm256_xor_si256(_mm256_loadu_si256((const __m256i*)&buf[i]), v),
+				_mm256_xor_si256(_mm256_loadu_si256((const __m256i*)&buf[i + 32]), v)),
+			_mm256_or_si256(_mm256_xor_si256(_mm256_loadu_si256((const __m256i*)&buf[i + 64]), v),
+				_mm256_xor_si256(_mm256_loadu_si256((const __m256i*)&buf[i + 96]), v)));
+		if (!_mm256_testz_si256(acc, acc))
+			break;
+	}
+	return i;
+}
+
+// Same as above, in blocks of 64 bytes
+TARGET("sse2") static size_t uniform_prefix_sse2(const uint8_t* buf, size_t len, uint8_t val)
+{
+	const __m128i v = _mm_set1_epi8((char)val), zero = _mm_setzero_si128();
+	__m128i acc;
+	size_t i;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		acc = _mm_or_si128(
+			_mm_or_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i*)&buf[i]), v),
+				_mm_xor_si128(_mm_loadu_si128((const __m128i*)&buf[i + 16]), v)),
+			_mm_or_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i*)&buf[i + 32]), v),
+				_mm_xor_si128(_mm_loadu_si128((const __m128i*)&buf[i + 48]), v)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff)
+			break;
+	}
+	return i;
+}
+#endif
+
+/*
+ * Check whether a buffer only contains bytes of value val (e.g. to detect blocks of zeros).
+ */
+BOOL IsBufferUniform(const void* buf, size_t len, uint8_t val)
+{
+	const uint8_t* p = (const uint8_t*)buf;
+	size_t i = 0;
+
+#if defined(CPU_X86)
+	if (cpu_has_avx2)
+		i = uniform_prefix_avx2(p, len, val);
+	else if (cpu_has_sse2)
+		i = uniform_prefix_sse2(p, len, val);
+#endif
+	// The SIMD scans stop at the first block that differs, or before the trailing bytes
+	for (; i < len; i++) {
+		if (p[i] != val)
+			return FALSE;
+	}
+	return TRUE;
+}
+
 // From smartmontools os_win32.cpp
 void GetWindowsVersion(void)
 {
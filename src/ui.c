@@ -68,6 +68,8 @@ static IAccPropServices* pfaps = NULL;
 static int nb_slots[OP_MAX];
 static float slot_end[OP_MAX+1];	// shifted +1 so that we can subtract 1 to OP indexes
 static float previous_end;
+// Separate source and device throughput, for operations that run these on their own threads
+static uint64_t progress_rate[2];
 
 void SetAccessibleName(HWND hCtrl, const char* name)
 {
@@ -1385,6 +1387,15 @@ static void bar_update(struct bar_progress* bp, uint64_t howmuch, uint64_t dltim
 		hist->pos = 0;
 }
 
+// Set the decompression and drive throughput (in bytes per second), which the speed
+// display mode of UpdateProgressWithInfo() then shows instead of the overall speed.
+// Both are reset when progress is initialized.
+void SetProgressRates(uint64_t source_rate, uint64_t drive_rate)
+{
+	progress_rate[0] = source_rate;
+	progress_rate[1] = drive_rate;
+}
+
 // This updates the progress bar as well as the data displayed on it so that we can
 // display percentage completed, rate of transfer and estimated remaining duration.
 // During init (op = OP_INIT) an optional HWND can be passed on which to look for
@@ -1407,6 +1418,8 @@ void UpdateProgressWithInfo(int op, int msg, uint64_t processed, uint64_t total)
 		last_update_progress_type = UPT_PERCENT;
 		percent = 0.0f;
 		speed = 0;
+		progress_rate[0] = 0;
+		progress_rate[1] = 0;
 		memset(&bp, 0, sizeof(bp));
 		bp.total_length = total;
 		hProgressBar = NULL;
@@ -1448,7 +1461,12 @@ void UpdateProgressWithInfo(int op, int msg, uint64_t processed, uint64_t total)
 			update_progress_type = UPT_PERCENT;
 		switch (update_progress_type) {
 		case UPT_SPEED:
-			if (speed != 0)
+			if ((progress_rate[0] != 0) && (progress_rate[1] != 0)) {
+				char source_speed[32];
+				static_strcpy(source_speed, SizeToHumanReadable(progress_rate[0], FALSE, FALSE));
+				static_sprintf(msg_data, "%s", lmprintf(MSG_320, source_speed,
+					SizeToHumanReadable(progress_rate[1], FALSE, FALSE)));
+			} else if (speed != 0)
 				static_sprintf(msg_data, "%s/s", SizeToHumanReadable(speed, FALSE, FALSE));
 			else
 				static_sprintf(msg_data, "---");